@@ -309,7 +309,7 @@ fun ChatScreen(
                     )})
                 }
                 composable(route = ChatScreen.ParamsScreen.name){
-                    ParametersScreen(viewModel)
+                    ParametersScreen(viewModel, extFileDir)
                 }
                 composable(route = ChatScreen.AboutScreen.name){
                     AboutScreen()
@@ -3,6 +3,7 @@ package com.nervesparks.iris
 import android.content.Context
 import android.llama.cpp.LLamaAndroid
 import android.net.Uri
+import android.os.Build
 import android.speech.tts.TextToSpeech
 import android.speech.tts.UtteranceProgressListener
 import android.util.Log
@@ -16,6 +17,7 @@ import androidx.lifecycle.viewModelScope
 import com.nervesparks.iris.data.UserPreferencesRepository
 import com.nervesparks.iris.docs.DocumentUriPermission
 import com.nervesparks.iris.irisapp.ServiceLocator
+import com.nervesparks.iris.rag.RagBenchmark
 import com.nervesparks.iris.rag.RagRepository
 import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Dispatchers
@@ -37,6 +39,8 @@ class MainViewModel(
 
     companion object {
         private const val TAG = "MainViewModel"
+        // About the previous 18k-char limit; native trimming handles anything between this and n_ctx.
+        private const val PROMPT_SHRINK_TOKENS = 4_500
     }
 
     private val ragRepo: RagRepository = ServiceLocator.ragRepository
@@ -246,6 +250,22 @@ RULES:
     var topK by mutableStateOf(0)
     var temp by mutableStateOf(0f)
 
+    // Optional draft GGUF for speculative decoding (same tokenizer as the chat model); applied on next load().
+    var draftModelPath by mutableStateOf(userPreferencesRepository.getDraftModelPath())
+        private set
+
+    fun selectDraftModel(path: String?) {
+        draftModelPath = path
+        userPreferencesRepository.setDraftModelPath(path)
+    }
+
+    // Chat context shape; auto-tune sizes n_ctx from free RAM and n_ubatch from a prefill probe.
+    var contextConfig by mutableStateOf(LLamaAndroid.ContextConfig(autoTune = true))
+
+    // mmap / mlock / GPU layers for the chat model, and its load progress (0..1) for LoadingModal.
+    var loadOptions by mutableStateOf(LLamaAndroid.LoadOptions())
+    var loadProgress by mutableStateOf(0f)
+
     var allModels by mutableStateOf(
         listOf(
             mapOf(
@@ -471,7 +491,8 @@ RULES:
                 emptyList()
             }
 
-            val best = hits.firstOrNull()?.score ?: 0.0
+            // Hybrid hits come in fused order, so the best vector score isn't necessarily first.
+            val best = hits.maxOfOrNull { it.score } ?: 0.0
             val second = hits.getOrNull(1)?.score ?: 0.0
 
             // ✅ SMART ROUTING: Only use docs if query matches well OR user explicitly asks
@@ -542,24 +563,23 @@ RULES:
 
             // ✅ Build prompt with strict document-only mode
             var base = windowedMessages(messages, keepLast = 10)
-            val messagesForModel = injectDocContextTransient(base, docExcerpts, readyDocs.isNotEmpty())
-
-            var template = llamaAndroid.getTemplate(messagesForModel)
-            var promptLen = template.length
+            var messagesForModel = injectDocContextTransient(base, docExcerpts, readyDocs.isNotEmpty())
 
-            if (promptLen > 18_000) {
+            // Templated and tokenized natively; the count is reused by sendChat() below.
+            var promptTokens = llamaAndroid.chatTokens(messagesForModel).size
+            if (promptTokens > PROMPT_SHRINK_TOKENS) {
                 base = windowedMessages(messages, keepLast = 6)
-                val shrunken = injectDocContextTransient(base, docExcerpts, readyDocs.isNotEmpty())
-                template = llamaAndroid.getTemplate(shrunken)
-                promptLen = template.length
-                Log.w(TAG, "prompt too big; reduced keepLast=6 newPromptChars=$promptLen")
+                messagesForModel = injectDocContextTransient(base, docExcerpts, readyDocs.isNotEmpty())
+                promptTokens = llamaAndroid.chatTokens(messagesForModel).size
+                Log.w(TAG, "prompt too big; reduced keepLast=6 newPromptTokens=$promptTokens")
             }
 
             var firstTokenLogged = false
             val tSendStart = System.currentTimeMillis()
 
             try {
-                llamaAndroid.send(template)
+                // Native trimming and context shifts never drop the system turn.
+                llamaAndroid.sendChat(messagesForModel)
                     .catch {
                         Log.e(TAG, "send() failed", it)
                         addMessage("error", it.message ?: "")
@@ -617,10 +637,80 @@ RULES:
         }
     }
 
+    // Latest bench suite report (JSON from the native harness), null until one has run.
+    var benchReport: String? by mutableStateOf(null)
+        private set
+    var isBenchSuiteRunning by mutableStateOf(false)
+        private set
+
+    fun runBenchSuite(config: LLamaAndroid.BenchConfig = LLamaAndroid.BenchConfig()) {
+        if (isBenchSuiteRunning) return
+        viewModelScope.launch {
+            isBenchSuiteRunning = true
+            try {
+                benchReport = llamaAndroid.benchSuite(config)
+                Log.i(TAG, "bench suite: ${benchReport?.length ?: 0} chars")
+            } catch (exc: Exception) {
+                Log.e(TAG, "Bench suite failed", exc)
+            } finally {
+                isBenchSuiteRunning = false
+            }
+        }
+    }
+
+    fun cancelBenchSuite() = llamaAndroid.cancelBench()
+
+    // Latest RAG stage benchmark (embed / scan / retrieve / prefill), null until one has run.
+    var ragBenchReport: String? by mutableStateOf(null)
+        private set
+    var isRagBenchRunning by mutableStateOf(false)
+        private set
+
+    fun runRagBench(config: RagBenchmark.Config = RagBenchmark.Config()) {
+        if (isRagBenchRunning) return
+        viewModelScope.launch {
+            isRagBenchRunning = true
+            try {
+                ragBenchReport = ServiceLocator.ragBenchmark.run(config).toString()
+            } catch (exc: Exception) {
+                Log.e(TAG, "RAG bench failed", exc)
+            } finally {
+                isRagBenchRunning = false
+            }
+        }
+    }
+
+    /**
+     * Writes the last report ([rag] = the RAG stage report) to app-specific storage; returns
+     * the file, or null if none.
+     */
+    fun exportBenchReport(context: Context, rag: Boolean = false): File? {
+        val report = (if (rag) ragBenchReport else benchReport) ?: return null
+        val dir = File(context.getExternalFilesDir(null) ?: context.filesDir, "bench").apply { mkdirs() }
+        val prefix = if (rag) "rag_bench" else "bench"
+        return File(dir, "${prefix}_${Build.MODEL.replace(Regex("[^A-Za-z0-9_-]"), "_")}_${System.currentTimeMillis()}.json")
+            .also { it.writeText(report) }
+    }
+
     var loadedModelName = mutableStateOf("")
 
+    // Keys the saved KV cache of the current chat; a new chat gets a new id. Messages live only
+    // in memory, so a saved session is restored on a model switch within this process, and the
+    // files of earlier processes can never match again: drop them.
+    private var conversationId = UUID.randomUUID().toString().also { id ->
+        viewModelScope.launch(Dispatchers.IO) {
+            runCatching { llamaAndroid.pruneSessions(ServiceLocator.sessionDir, id) }
+                .onFailure { Log.w(TAG, "pruneSessions failed", it) }
+        }
+    }
+
     fun load(pathToModel: String, userThreads: Int) {
         viewModelScope.launch {
+            // Keep the current chat's KV cache so switching back doesn't re-evaluate the history.
+            if (messages.isNotEmpty()) {
+                runCatching { llamaAndroid.saveSession(ServiceLocator.sessionDir, conversationId) }
+                    .onFailure { Log.w(TAG, "saveSession failed", it) }
+            }
             try { llamaAndroid.unload() } catch (_: Exception) {}
 
             try {
@@ -628,13 +718,23 @@ RULES:
                 newShowModal = false
                 showModal = false
                 showAlert = true
+                loadProgress = 0f
                 llamaAndroid.load(
                     pathToModel,
                     userThreads = userThreads,
                     topK = topK,
                     topP = topP,
-                    temp = temp
+                    temp = temp,
+                    draftModelPath = draftModelPath?.takeIf { File(it).exists() && it != pathToModel },
+                    contextConfig = contextConfig,
+                    loadOptions = loadOptions,
+                    onProgress = { loadProgress = it }
                 )
+                Log.i(TAG, "load: ${llamaAndroid.getLoadTimings()}")
+                if (messages.isNotEmpty()) {
+                    val restored = llamaAndroid.restoreSession(ServiceLocator.sessionDir, conversationId)
+                    Log.i(TAG, "load: restored session tokens=$restored")
+                }
                 showAlert = false
             } catch (exc: IllegalStateException) {
                 Log.e(TAG, "load() failed", exc)
@@ -673,6 +773,8 @@ RULES:
     fun updateMessage(newMessage: String) { message = newMessage }
 
     fun clear() {
+        llamaAndroid.deleteSessions(ServiceLocator.sessionDir, conversationId)
+        conversationId = UUID.randomUUID().toString()
         messages = listOf()
         first = true
         lastRouteWasDocs = false
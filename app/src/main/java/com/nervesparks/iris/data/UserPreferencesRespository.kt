@@ -4,6 +4,7 @@ import android.content.Context
 
 private const val USER_PREFERENCES_NAME = "user_preferences"
 private const val KEY_DEFAULT_MODEL_NAME = "default_model_name"
+private const val KEY_DRAFT_MODEL_PATH = "draft_model_path"
 
 class UserPreferencesRepository private constructor(context: Context) {
 
@@ -20,6 +21,15 @@ class UserPreferencesRepository private constructor(context: Context) {
         sharedPreferences.edit().putString(KEY_DEFAULT_MODEL_NAME, modelName).apply()
     }
 
+    // Draft model for speculative decoding, null when off
+    fun getDraftModelPath(): String? {
+        return sharedPreferences.getString(KEY_DRAFT_MODEL_PATH, null)
+    }
+
+    fun setDraftModelPath(path: String?) {
+        sharedPreferences.edit().putString(KEY_DRAFT_MODEL_PATH, path).apply()
+    }
+
     companion object {
         @Volatile
         private var INSTANCE: UserPreferencesRepository? = null
@@ -1,10 +1,23 @@
 package com.nervesparks.iris.irisapp
 
 import android.app.Application
+import android.llama.cpp.LLamaAndroid
+import kotlinx.coroutines.CoroutineScope
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.SupervisorJob
+import kotlinx.coroutines.launch
 
 class IrisApp : Application() {
+    private val appScope = CoroutineScope(SupervisorJob() + Dispatchers.Default)
+
     override fun onCreate() {
         super.onCreate()
         ServiceLocator.init(this)
     }
+
+    // Lets the idle embedding model go before the low-memory killer picks the whole process.
+    override fun onTrimMemory(level: Int) {
+        super.onTrimMemory(level)
+        appScope.launch { LLamaAndroid.instance().trimMemory(level) }
+    }
 }
@@ -2,11 +2,14 @@ package com.nervesparks.iris.irisapp
 
 import android.content.Context
 import android.util.Log
+import com.nervesparks.iris.rag.RagBenchmark
 import com.nervesparks.iris.rag.RagRepository
 import com.nervesparks.iris.rag.embed.Embedder
 import com.nervesparks.iris.rag.embed.LlamaCppEmbedder
+import com.nervesparks.iris.rag.ingest.Chunker
 import com.nervesparks.iris.rag.storage.LocalRagStore
 import java.io.File
+import java.nio.ByteBuffer
 import kotlin.math.max
 import kotlin.math.min
 
@@ -30,6 +33,13 @@ object ServiceLocator {
     lateinit var ragRepository: RagRepository
         private set
 
+    lateinit var ragBenchmark: RagBenchmark
+        private set
+
+    // Saved chat KV caches (LLamaAndroid.saveSession / restoreSession).
+    lateinit var sessionDir: File
+        private set
+
     fun init(context: Context) {
         if (initialized) return
         synchronized(this) {
@@ -39,6 +49,8 @@ object ServiceLocator {
             localRagStore = LocalRagStore(appCtx)
             embedder = embedderProxy
             ragRepository = RagRepository(appCtx, localRagStore, embedder)
+            ragBenchmark = RagBenchmark(appCtx, localRagStore, embedder, ragRepository)
+            sessionDir = File(appCtx.filesDir, "sessions")
 
             // If already present, attach now (no crash if missing)
             ensureEmbeddingReady(appCtx)
@@ -133,11 +145,26 @@ object ServiceLocator {
         fun attach(real: Embedder) { delegate = real }
         fun isReady(): Boolean = delegate != null
 
-        override fun embed(text: String): FloatArray {
-            val d = delegate ?: throw IllegalStateException(
-                "Embedding model not downloaded. Go to Settings → Models and download it."
-            )
-            return d.embed(text)
-        }
+        override fun embed(text: String): FloatArray = requireDelegate().embed(text)
+
+        override fun embedBatch(texts: List<String>): List<FloatArray> = requireDelegate().embedBatch(texts)
+
+        override fun dimension(): Int = requireDelegate().dimension()
+
+        override fun tokenCounts(texts: List<String>): IntArray? = requireDelegate().tokenCounts(texts)
+
+        override fun maxInputTokens(): Int = requireDelegate().maxInputTokens()
+
+        override fun normalizes(): Boolean = requireDelegate().normalizes()
+
+        override fun embedBatchInto(texts: List<String>, out: ByteBuffer, offsetBytes: Int): Int =
+            requireDelegate().embedBatchInto(texts, out, offsetBytes)
+
+        override fun embedChunksInto(chunks: List<Chunker.Chunk>, out: ByteBuffer, offsetBytes: Int): Int =
+            requireDelegate().embedChunksInto(chunks, out, offsetBytes)
+
+        private fun requireDelegate(): Embedder = delegate ?: throw IllegalStateException(
+            "Embedding model not downloaded. Go to Settings → Models and download it."
+        )
     }
 }
@@ -0,0 +1,290 @@
+package com.nervesparks.iris.rag
+
+import android.content.Context
+import android.llama.cpp.LLamaAndroid
+import android.util.Log
+import com.nervesparks.iris.rag.embed.Embedder
+import com.nervesparks.iris.rag.storage.EmbeddingFormat
+import com.nervesparks.iris.rag.storage.LocalRagStore
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.withContext
+import org.json.JSONObject
+import java.io.File
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+import kotlin.math.sqrt
+import kotlin.random.Random
+
+/**
+ * Stage-by-stage timing of the document Q&A path: chunk embedding (one at a time and
+ * batched), vector scan per storage dtype, end-to-end [RagRepository.retrieve], and prefill
+ * of the [RagRepository.buildContextBlock] output on the chat model. Runs on the indexed
+ * corpus when there is one (or [Config.synthetic] is set, on generated text instead).
+ */
+class RagBenchmark(
+    private val context: Context,
+    private val store: LocalRagStore,
+    private val embedder: Embedder,
+    private val repository: RagRepository
+) {
+    companion object {
+        private const val TAG = "RagBenchmark"
+
+        // Same group size as IndexDocumentWorker, so batched numbers match indexing.
+        private const val EMBED_GROUP = 32
+
+        // Single-text embedding is slow; a handful of texts is enough for a stable rate.
+        private const val SINGLE_EMBED_MAX = 16
+
+        private val WORDS = (
+            "device memory model token battery thermal kernel vector index search document chapter " +
+            "section result table figure method sample value system network response request cache " +
+            "latency budget policy update report market energy signal process layer window"
+        ).split(' ')
+    }
+
+    data class Config(
+        val corpusChunks: Int = 64,
+        val queries: Int = 20,
+        val scanRows: Int = 16_384,
+        val scanReps: Int = 10,
+        val topK: Int = 8,
+        val prefillReps: Int = 3,
+        val synthetic: Boolean = false
+    )
+
+    /** Runs every stage and returns the report; a failing stage reports "error" and the rest still run. */
+    suspend fun run(config: Config = Config()): JSONObject = withContext(Dispatchers.Default) {
+        val report = JSONObject()
+        val (corpus, source) = corpus(config)
+        report.put("corpus", JSONObject().apply {
+            put("source", source)
+            put("chunks", corpus.size)
+            put("avg_chars", if (corpus.isEmpty()) 0 else corpus.sumOf { it.length } / corpus.size)
+        })
+
+        val t0 = System.nanoTime()
+        report.put("embed_single", stage { embedSingle(corpus) })
+        report.put("embed_batched", stage { embedBatched(corpus) })
+        val dim = runCatching { embedder.dimension() }.getOrDefault(0)
+        report.put("scan", stage { scan(dim, config) })
+        val hits = ArrayList<RetrievalHit>()
+        report.put("retrieve", stage { retrieve(corpus, config, source, hits) })
+        report.put("prefill", stage { prefill(corpus, hits, config) })
+        report.put("elapsed_ms", (System.nanoTime() - t0) / 1e6)
+
+        Log.i(TAG, "run: $report")
+        report
+    }
+
+    private inline fun stage(block: () -> JSONObject): JSONObject =
+        try {
+            block()
+        } catch (t: Throwable) {
+            Log.e(TAG, "stage failed", t)
+            JSONObject().put("error", t.message ?: t.javaClass.simpleName)
+        }
+
+    // Real chunks from READY docs, topped up with generated text when the corpus is small.
+    private fun corpus(config: Config): Pair<List<String>, String> {
+        val n = config.corpusChunks.coerceAtLeast(1)
+        val real = if (config.synthetic) emptyList() else store.readAllDocs()
+            .filter { it.status == "READY" }
+            .asSequence()
+            .flatMap { store.readDocChunks(it.docId, n).asSequence() }
+            .map { it.text.trim() }
+            .filter { it.isNotEmpty() }
+            .take(n)
+            .toList()
+        if (real.size == n) return real to "indexed"
+
+        val rnd = Random(42)
+        val generated = List(n - real.size) {
+            List(80 + rnd.nextInt(40)) { WORDS[rnd.nextInt(WORDS.size)] }.joinToString(" ")
+        }
+        return (real + generated) to if (real.isEmpty()) "synthetic" else "mixed"
+    }
+
+    private fun embedSingle(corpus: List<String>): JSONObject {
+        val texts = corpus.take(SINGLE_EMBED_MAX)
+        val ms = texts.map { t ->
+            val t0 = System.nanoTime()
+            embedder.embed(t)
+            (System.nanoTime() - t0) / 1e6
+        }
+        return JSONObject().apply {
+            put("chunks", texts.size)
+            put("chunks_per_s", rate(texts.size, ms.sum()))
+            put("ms_p50", percentile(ms, 0.50))
+            put("ms_p95", percentile(ms, 0.95))
+        }
+    }
+
+    private fun embedBatched(corpus: List<String>): JSONObject {
+        val t0 = System.nanoTime()
+        corpus.chunked(EMBED_GROUP).forEach { embedder.embedBatch(it) }
+        val ms = (System.nanoTime() - t0) / 1e6
+        return JSONObject().apply {
+            put("chunks", corpus.size)
+            put("group", EMBED_GROUP)
+            put("chunks_per_s", rate(corpus.size, ms))
+        }
+    }
+
+    /**
+     * Exact top-k over [Config.scanRows] random unit vectors: float32 from a direct buffer,
+     * then each stored dtype through a temporary mmapped file, as retrieval reads them.
+     */
+    private suspend fun scan(dim: Int, config: Config): JSONObject {
+        require(dim > 0) { "embedding dimension unknown" }
+        val llama = LLamaAndroid.instance()
+        val rows = config.scanRows.coerceAtLeast(1)
+        val rnd = Random(7)
+        val src = ByteBuffer.allocateDirect(rows * dim * 4).order(ByteOrder.LITTLE_ENDIAN)
+        val row = FloatArray(dim)
+        repeat(rows) {
+            unitVector(row, rnd)
+            for (f in row) src.putFloat(f)
+        }
+        src.clear()
+        val queries = List(config.scanReps.coerceAtLeast(1)) { unitVector(FloatArray(dim), rnd) }
+
+        val out = JSONObject().put("rows", rows).put("dim", dim)
+        out.put("F32_buffer", scanStats(rows, EmbeddingFormat.Dtype.F32.rowBytes(dim)) {
+            for (q in queries) llama.searchTopK(q, src, rows, config.topK)
+            queries.size
+        })
+
+        for (dtype in EmbeddingFormat.Dtype.values()) {
+            val rowBytes = dtype.rowBytes(dim)
+            val dst = ByteBuffer.allocateDirect(EmbeddingFormat.HEADER_BYTES + rows * rowBytes)
+            val written = llama.quantizeEmbeddings(src, rows, dim, dtype.code, true, dst)
+            val file = File.createTempFile("bench_", ".bin", context.cacheDir)
+            try {
+                file.outputStream().channel.use { ch ->
+                    dst.limit(written).position(0)
+                    while (dst.hasRemaining()) ch.write(dst)
+                }
+                val handle = llama.openEmbeddingStore(file.path, dim)
+                require(handle != 0L) { "openEmbeddingStore() failed for ${dtype.name}" }
+                try {
+                    llama.searchEmbeddingStore(handle, queries[0], config.topK) // page the file in
+                    out.put("${dtype.name}_store", scanStats(rows, rowBytes) {
+                        for (q in queries) llama.searchEmbeddingStore(handle, q, config.topK)
+                        queries.size
+                    })
+                } finally {
+                    llama.closeEmbeddingStore(handle)
+                }
+            } finally {
+                file.delete()
+            }
+        }
+        return out
+    }
+
+    private inline fun scanStats(rows: Int, rowBytes: Int, block: () -> Int): JSONObject {
+        val t0 = System.nanoTime()
+        val n = block()
+        val s = ((System.nanoTime() - t0) / 1e9).coerceAtLeast(1e-9)
+        return JSONObject().apply {
+            put("ms_per_query", s * 1e3 / n)
+            put("vectors_per_s", rows.toDouble() * n / s)
+            put("gb_per_s", rows.toDouble() * rowBytes * n / s / 1e9)
+        }
+    }
+
+    /**
+     * Full retrieve() per query, drawn from the corpus so each one misses the query cache.
+     * Fills [hitsOut] with the last non-empty result for the prefill stage.
+     */
+    private suspend fun retrieve(
+        corpus: List<String>,
+        config: Config,
+        source: String,
+        hitsOut: MutableList<RetrievalHit>
+    ): JSONObject {
+        if (source == "synthetic") return JSONObject().put("skipped", "no indexed documents")
+        val queries = corpus.take(config.queries.coerceAtLeast(1))
+            .mapIndexed { i, t -> t.split(' ').take(12).joinToString(" ") + " ($i)" }
+        val ms = ArrayList<Double>(queries.size)
+        var hitCount = 0
+        for (q in queries) {
+            val t0 = System.nanoTime()
+            val hits = repository.retrieve(q, topK = config.topK)
+            ms.add((System.nanoTime() - t0) / 1e6)
+            hitCount += hits.size
+            if (hits.isNotEmpty()) {
+                hitsOut.clear()
+                hitsOut.addAll(hits)
+            }
+        }
+        return JSONObject().apply {
+            put("queries", queries.size)
+            put("ms_p50", percentile(ms, 0.50))
+            put("ms_p95", percentile(ms, 0.95))
+            put("avg_hits", hitCount.toDouble() / queries.size)
+        }
+    }
+
+    // Context block of the last retrieval, or of the first corpus chunks when there was none.
+    private suspend fun prefill(corpus: List<String>, hits: List<RetrievalHit>, config: Config): JSONObject {
+        val useHits = hits.ifEmpty {
+            corpus.take(config.topK).mapIndexed { i, t -> RetrievalHit("bench", "bench", "c$i", i, t, 1.0) }
+        }
+        val block = repository.buildContextBlock(useHits)
+            ?: return JSONObject().put("skipped", "empty context block")
+        val cost = LLamaAndroid.instance().benchPrefill(block, config.prefillReps)
+            ?: return JSONObject().put("skipped", "no chat model loaded")
+        return JSONObject().apply {
+            put("chars", block.length)
+            put("tokens", cost.tokens)
+            put("tokenize_ms", cost.tokenizeMs)
+            put("prefill_ms", cost.prefillMs)
+            put("prefill_ms_best", cost.bestMs)
+            put("tokens_per_s", rate(cost.tokens, cost.prefillMs))
+        }
+    }
+
+    private fun unitVector(out: FloatArray, rnd: Random): FloatArray {
+        var sum = 0.0
+        for (i in out.indices) {
+            out[i] = rnd.nextFloat() * 2f - 1f
+            sum += out[i] * out[i]
+        }
+        val inv = (1.0 / sqrt(sum.coerceAtLeast(1e-12))).toFloat()
+        for (i in out.indices) out[i] *= inv
+        return out
+    }
+
+    private fun rate(count: Int, ms: Double): Double = if (ms > 0) count * 1000.0 / ms else 0.0
+
+    private fun percentile(values: List<Double>, p: Double): Double {
+        if (values.isEmpty()) return 0.0
+        val sorted = values.sorted()
+        return sorted[((sorted.size - 1) * p).toInt()]
+    }
+}
+
+/** Display lines for a [RagBenchmark.run] report: one per stage, one per dtype for the scan. */
+internal fun ragBenchRows(report: JSONObject): List<String> = buildList {
+    report.optJSONObject("corpus")?.let { add("corpus: ${it.optString("source")}, ${it.optInt("chunks")} chunks") }
+    for (key in listOf("embed_single", "embed_batched", "scan", "retrieve", "prefill")) {
+        val s = report.optJSONObject(key) ?: continue
+        add(when {
+            s.has("error") -> "$key: ${s.getString("error")}"
+            s.has("skipped") -> "$key: skipped (${s.getString("skipped")})"
+            key == "scan" -> s.keys().asSequence().mapNotNull { k -> s.optJSONObject(k)?.let { k to it } }
+                .joinToString("\n", prefix = "scan ${s.optInt("rows")}x${s.optInt("dim")}:\n") { (k, v) ->
+                    "  $k: %.2f ms, %.0f vec/s, %.2f GB/s".format(
+                        v.optDouble("ms_per_query"), v.optDouble("vectors_per_s"), v.optDouble("gb_per_s")
+                    )
+                }
+            key == "retrieve" -> "retrieve: p50 %.1f ms, p95 %.1f ms".format(s.optDouble("ms_p50"), s.optDouble("ms_p95"))
+            key == "prefill" -> "prefill: %d tokens, %.0f ms (%.1f t/s)".format(
+                s.optInt("tokens"), s.optDouble("prefill_ms"), s.optDouble("tokens_per_s")
+            )
+            else -> "$key: %.1f chunks/s".format(s.optDouble("chunks_per_s"))
+        })
+    }
+}
@@ -6,7 +6,9 @@ data class RetrievalHit(
     val chunkId: String,
     val chunkIndex: Int,
     val text: String,
-    val score: Double
+    val score: Double,
+    // BM25 score from hybrid retrieval; 0 when no query term occurs in the chunk.
+    val lexScore: Double = 0.0
 )
 
 enum class DocStatus { INDEXING, READY, FAILED }
@@ -2,6 +2,7 @@ package com.nervesparks.iris.rag
 
 import android.content.Context
 import android.database.Cursor
+import android.llama.cpp.LLamaAndroid
 import android.net.Uri
 import android.provider.OpenableColumns
 import android.util.Log
@@ -12,7 +13,7 @@ import androidx.work.WorkManager
 import androidx.work.workDataOf
 import com.nervesparks.iris.rag.embed.Embedder
 import com.nervesparks.iris.rag.retrieval.VectorSearch
-import com.nervesparks.iris.rag.storage.LocalChunk
+import com.nervesparks.iris.rag.storage.EmbeddingFormat
 import com.nervesparks.iris.rag.storage.LocalDoc
 import com.nervesparks.iris.rag.storage.LocalRagStore
 import com.nervesparks.iris.rag.worker.IndexDocumentWorker
@@ -20,10 +21,12 @@ import kotlinx.coroutines.delay
 import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.distinctUntilChanged
 import kotlinx.coroutines.flow.flow
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
 import java.io.File
-import java.util.PriorityQueue
+import java.util.concurrent.ConcurrentHashMap
 import java.util.concurrent.TimeUnit
-import kotlin.math.min
+import kotlin.math.sqrt
 
 class RagRepository(
     private val context: Context,
@@ -32,6 +35,37 @@ class RagRepository(
 ) {
     companion object {
         private const val TAG = "RagRepository"
+
+        // Cached docs hold an mmap each (address space, not heap); sized so a large corpus
+        // stays open and one ivf_search call covers all of it.
+        private const val MAX_CACHED_DOCS = 256
+
+        // ANN index: trained once the corpus has this many chunks (exact scan is sub-ms
+        // below it), retrained when it has grown by RETRAIN_GROWTH since the last training.
+        private const val ANN_MIN_ROWS = 4096
+        private const val ANN_RETRAIN_GROWTH = 2
+        private const val ANN_KMEANS_ITERS = 10
+
+        // Lists probed per query: higher = better recall, slower.
+        const val DEFAULT_ANN_PROBES = 16
+
+        private const val ANN_LISTS_FILE = "ivf.lists"
+
+        // BM25 score a hit needs to be kept on its term match alone, whatever its vector score:
+        // about one rare query term, so a word found in most chunks doesn't carry a hit.
+        private const val MIN_LEX_SCORE = 1.0
+
+        // Dropped from the BM25 query; they match nearly every chunk and carry no meaning.
+        private val STOPWORDS = setOf(
+            "a", "an", "and", "are", "as", "at", "be", "by", "can", "do", "does", "for", "from",
+            "how", "i", "in", "is", "it", "me", "my", "of", "on", "or", "that", "the", "this",
+            "to", "was", "what", "when", "where", "which", "who", "why", "with", "you"
+        )
+        // Same term split as the native lexical index: runs of ASCII letters/digits or non-ASCII.
+        private val LEX_TERM_SPLIT = Regex("[^0-9A-Za-z\\u0080-\\uFFFF]+")
+
+        private fun lexicalQuery(q: String): String =
+            q.split(LEX_TERM_SPLIT).filter { it.isNotEmpty() && it.lowercase() !in STOPWORDS }.joinToString(" ")
     }
 
     fun observeDocs(pollMs: Long = 1_000L): Flow<List<LocalDoc>> = flow {
@@ -123,26 +157,44 @@ class RagRepository(
         Log.i(TAG, "clearAllDocuments: Cleanup complete")
     }
 
+    /**
+     * A doc ready for scoring: embeddings.bin (any [EmbeddingFormat] dtype) stays mmap()ed
+     * natively behind [store], and chunk text is only read (via [chunkOffsets]) for rows
+     * that make the final top-k.
+     */
     private data class CachedDoc(
         val doc: LocalDoc,
-        val chunks: List<LocalChunk>,
-        val embeddings: ByteArray,
-        val bytesPerEmb: Int,
+        val store: Long, // native emb_store handle
+        val chunkOffsets: LongArray,
+        val count: Int,
+        val dim: Int,
         val chunksLastMod: Long,
-        val embLastMod: Long
+        val embLastMod: Long,
+        val lexLastMod: Long
     )
 
     private val cache = LinkedHashMap<String, CachedDoc>(16, 0.75f, true)
 
+    // docId -> chunks.jsonl mtime of a failed postings backfill, so it isn't retried per query.
+    private val lexBackfillFailed = ConcurrentHashMap<String, Long>()
+
     private fun invalidateCache(docId: String) {
-        synchronized(cache) { cache.remove(docId) }
+        synchronized(cache) { cache.remove(docId)?.let { closeStore(it) } }
+        lexBackfillFailed.remove(docId)
     }
 
     fun clearCache() {
-        synchronized(cache) { cache.clear() }
+        synchronized(cache) {
+            cache.values.forEach { closeStore(it) }
+            cache.clear()
+        }
+    }
+
+    private fun closeStore(cd: CachedDoc) {
+        runCatching { LLamaAndroid.instance().closeEmbeddingStore(cd.store) }
     }
 
-    private fun loadDocIntoCache(doc: LocalDoc, expectedDim: Int): CachedDoc? {
+    private suspend fun loadDocIntoCache(doc: LocalDoc, expectedDim: Int): CachedDoc? {
         val dir = store.docFolder(doc.docId)
         val chunksFile = File(dir, "chunks.jsonl")
         val embFile = File(dir, "embeddings.bin")
@@ -150,53 +202,80 @@ class RagRepository(
 
         val chunksLast = chunksFile.lastModified()
         val embLast = embFile.lastModified()
+        val lexFile = store.lexicalIndexFile(doc.docId)
+        var lexLast = lexFile.lastModified() // 0 when missing
 
         synchronized(cache) {
             val cached = cache[doc.docId]
-            if (cached != null && cached.chunksLastMod == chunksLast && cached.embLastMod == embLast) {
-                val dim = cached.bytesPerEmb / 4
-                if (dim == expectedDim) return cached
+            if (cached != null) {
+                if (cached.chunksLastMod == chunksLast && cached.embLastMod == embLast &&
+                    cached.lexLastMod == lexLast && cached.dim == expectedDim
+                ) {
+                    return cached
+                }
+                cache.remove(doc.docId)
+                closeStore(cached)
             }
         }
 
-        val chunks = ArrayList<LocalChunk>()
-        chunksFile.useLines { seq ->
-            seq.filter { it.isNotBlank() }.forEach { line ->
-                val jo = org.json.JSONObject(line)
-                chunks.add(
-                    LocalChunk(
-                        chunkId = jo.getString("chunkId"),
-                        chunkIndex = jo.getInt("chunkIndex"),
-                        text = jo.getString("text")
-                    )
-                )
+        // Docs indexed before hybrid retrieval get their postings when first loaded; a failed
+        // build is retried only once the doc's chunks change.
+        if (lexLast == 0L && lexBackfillFailed[doc.docId] != chunksLast) {
+            val built = runCatching {
+                val texts = store.readAllDocChunks(doc.docId).map { it.text }
+                texts.isNotEmpty() && LLamaAndroid.instance().buildLexicalIndex(texts, lexFile.absolutePath)
+            }.getOrDefault(false)
+            if (built) {
+                lexLast = lexFile.lastModified()
+            } else {
+                Log.w(TAG, "loadDocIntoCache: docId=${doc.docId} lexical backfill failed")
+                lexBackfillFailed[doc.docId] = chunksLast
             }
         }
 
-        val embBytes = embFile.readBytes()
-        if (chunks.isEmpty() || embBytes.isEmpty()) return null
+        val offsets = store.readChunkOffsets(doc.docId) ?: return null
+        val nChunks = offsets.size - 1
+        if (nChunks <= 0) return null
 
-        val bytesPer = embBytes.size / chunks.size
-        if (bytesPer * chunks.size != embBytes.size) return null
+        val llama = LLamaAndroid.instance()
+        val rescoreFile = File(dir, EmbeddingFormat.RESCORE_FILE)
+        val handle = llama.openEmbeddingStore(
+            path = embFile.absolutePath,
+            dim = expectedDim,
+            rescorePath = rescoreFile.takeIf { it.exists() }?.absolutePath
+        )
+        if (handle == 0L) return null
 
-        val dim = bytesPer / 4
-        if (dim != expectedDim) return null
+        val count = llama.embeddingStoreCount(handle)
+        if (count != nChunks) {
+            Log.w(TAG, "loadDocIntoCache: docId=${doc.docId} rows=$count chunks=$nChunks mismatch")
+            llama.closeEmbeddingStore(handle)
+            return null
+        }
+
+        val listsFile = File(dir, ANN_LISTS_FILE)
+        if (listsFile.exists()) llama.attachAnnLists(handle, listsFile.absolutePath)
+        if (lexLast != 0L && !llama.attachLexicalIndex(handle, lexFile.absolutePath)) {
+            Log.w(TAG, "loadDocIntoCache: docId=${doc.docId} lexical index unusable")
+        }
 
         val cd = CachedDoc(
             doc = doc,
-            chunks = chunks,
-            embeddings = embBytes,
-            bytesPerEmb = bytesPer,
+            store = handle,
+            chunkOffsets = offsets,
+            count = count,
+            dim = expectedDim,
             chunksLastMod = chunksLast,
-            embLastMod = embLast
+            embLastMod = embLast,
+            lexLastMod = lexLast
         )
 
         synchronized(cache) {
-            cache[doc.docId] = cd
-            while (cache.size > 16) {
+            cache.put(doc.docId, cd)?.let { if (it.store != handle) closeStore(it) }
+            while (cache.size > MAX_CACHED_DOCS) {
                 val it = cache.entries.iterator()
                 if (it.hasNext()) {
-                    it.next()
+                    closeStore(it.next().value)
                     it.remove()
                 } else break
             }
@@ -208,12 +287,18 @@ class RagRepository(
     /**
      * ✅ Retrieval can be restricted to ONE doc using docIdFilter.
      * ✅ IMPROVED: Lower threshold, dynamic cutoff, better logging
+     *
+     * With [hybrid], BM25 over the query terms is fused with the vector ranking (reciprocal
+     * rank) so exact names, identifiers and numbers are found; hits come back in fused order
+     * and chunks with a strong term match (stopwords aside) are kept whatever their vector score.
      */
     suspend fun retrieve(
         query: String,
         topK: Int = 8,
         scoreThreshold: Double = 0.05,
-        docIdFilter: String? = null
+        docIdFilter: String? = null,
+        annProbes: Int = DEFAULT_ANN_PROBES,
+        hybrid: Boolean = true
     ): List<RetrievalHit> {
         val q = query.trim()
         if (q.isEmpty()) return emptyList()
@@ -237,52 +322,112 @@ class RagRepository(
         }
 
         val k = topK.coerceAtLeast(1)
-        val heap = PriorityQueue<RetrievalHit>(k) { a, b -> a.score.compareTo(b.score) }
+
+        // Candidates only carry (doc, row, scores, rank); text is read for the winners at the end.
+        class Candidate(val cached: CachedDoc, val row: Int, val score: Double, val lexScore: Double, val rank: Int)
+        val candidates = ArrayList<Candidate>(k)
         var bestScoreFound = 0.0
 
-        for (doc in readyDocs) {
-            val cached = loadDocIntoCache(doc, expectedDim = qEmb.size) ?: continue
-            val bytesPer = cached.bytesPerEmb
-            val dim = qEmb.size
-
-            val nChunks = min(cached.chunks.size, cached.embeddings.size / bytesPer)
-            for (i in 0 until nChunks) {
-                val score = VectorSearch.dotPackedLE(qEmb, cached.embeddings, i * bytesPer, dim)
-                if (score > bestScoreFound) bestScoreFound = score
-                
-                // Use static threshold for initial filtering
-                if (score <= scoreThreshold) continue
-
-                val chunk = cached.chunks[i]
-                val hit = RetrievalHit(
-                    docId = cached.doc.docId,
-                    docName = cached.doc.name,
-                    chunkId = chunk.chunkId,
-                    chunkIndex = chunk.chunkIndex,
-                    text = chunk.text,
-                    score = score
-                )
+        ensureAnnLoaded()
+        val docs = readyDocs.mapNotNull { loadDocIntoCache(it, expectedDim = qEmb.size) }
+        val handles = LongArray(docs.size) { docs[it].store }
 
-                if (heap.size < k) heap.add(hit)
-                else if (heap.peek().score < hit.score) {
-                    heap.poll()
-                    heap.add(hit)
-                }
-            }
+        // One native call returns the global top-k over every doc: IVF-probed where lists
+        // exist, exact otherwise (fused with BM25 when hybrid).
+        val ranked = if (hybrid) {
+            VectorSearch.topKHybrid(handles, qEmb, lexicalQuery(q), k, annProbes)
+        } else {
+            VectorSearch.topKStores(handles, qEmb, k, annProbes).map { LLamaAndroid.HybridHit(it.store, it.index, it.score, 0f) }
+        }
+        ranked.forEachIndexed { rank, sh ->
+            val score = sh.score.toDouble()
+            if (score > bestScoreFound) bestScoreFound = score
+
+            // Use static threshold for initial filtering
+            if (score <= scoreThreshold && sh.lexScore < MIN_LEX_SCORE) return@forEachIndexed
+            candidates.add(Candidate(docs[sh.store], sh.index, score, sh.lexScore.toDouble(), rank))
         }
 
         // Apply dynamic threshold: if best score is high, filter out low relative scores
         val dynamicThreshold = if (bestScoreFound > 0.5) bestScoreFound * 0.25 else scoreThreshold
-        
-        val out = ArrayList<RetrievalHit>(heap.size)
-        while (heap.isNotEmpty()) {
-            val hit = heap.poll()
-            if (hit.score >= dynamicThreshold) out.add(hit)
+        val winners = candidates.filter { it.score >= dynamicThreshold || it.lexScore >= MIN_LEX_SCORE }
+
+        val out = ArrayList<Pair<Int, RetrievalHit>>(winners.size)
+        for ((_, group) in winners.groupBy { it.cached.doc.docId }) {
+            val cached = group.first().cached
+            val chunks = store.readChunksAt(cached.doc.docId, cached.chunkOffsets, group.map { it.row })
+            for (c in group) {
+                val chunk = chunks[c.row] ?: continue
+                out.add(
+                    c.rank to RetrievalHit(
+                        docId = cached.doc.docId,
+                        docName = cached.doc.name,
+                        chunkId = chunk.chunkId,
+                        chunkIndex = chunk.chunkIndex,
+                        text = chunk.text,
+                        score = c.score,
+                        lexScore = c.lexScore
+                    )
+                )
+            }
         }
-        out.sortByDescending { it.score }
+        out.sortBy { it.first }
         
-        Log.i(TAG, "retrieve: query='${q.take(50)}...' hits=${out.size} bestScore=${"%.3f".format(bestScoreFound)} threshold=${"%.3f".format(dynamicThreshold)}")
-        return out
+        Log.i(TAG, "retrieve: query='${q.take(50)}...' hits=${out.size} hybrid=$hybrid bestScore=${"%.3f".format(bestScoreFound)} threshold=${"%.3f".format(dynamicThreshold)}")
+        return out.map { it.second }
+    }
+
+    private val annMutex = Mutex()
+    @Volatile private var annLoaded = false
+
+    private suspend fun ensureAnnLoaded() {
+        if (annLoaded) return
+        annMutex.withLock {
+            if (annLoaded) return
+            val f = store.annIndexFile()
+            if (f.exists()) LLamaAndroid.instance().loadAnnIndex(f.absolutePath)
+            annLoaded = true
+        }
+    }
+
+    /**
+     * Brings the ANN index up to date after a doc is indexed: trains centroids once the corpus
+     * is large enough (or has grown enough), otherwise only buckets docs that have no current
+     * lists yet. Small corpora are left to the exact scan.
+     */
+    suspend fun updateAnnIndex() {
+        ensureAnnLoaded()
+        annMutex.withLock {
+            val dim = embedder.dimension()
+            val docs = store.readAllDocs()
+                .filter { it.status == "READY" }
+                .mapNotNull { loadDocIntoCache(it, expectedDim = dim) }
+            val total = docs.sumOf { it.count }
+            if (total < ANN_MIN_ROWS) return
+
+            val llama = LLamaAndroid.instance()
+            val trained = llama.annTrainedRows()
+            val retrain = trained == 0 || total >= trained.toLong() * ANN_RETRAIN_GROWTH
+
+            if (retrain) {
+                val nlist = sqrt(total.toDouble()).toInt().coerceIn(16, 1024)
+                val handles = LongArray(docs.size) { docs[it].store }
+                val gen = llama.trainAnnIndex(handles, nlist, ANN_KMEANS_ITERS, store.annIndexFile().absolutePath)
+                if (gen == 0) {
+                    Log.w(TAG, "updateAnnIndex: training failed rows=$total")
+                    return
+                }
+                Log.i(TAG, "updateAnnIndex: trained nlist=$nlist rows=$total docs=${docs.size}")
+            }
+
+            var assigned = 0
+            for (cd in docs) {
+                val lists = File(store.docFolder(cd.doc.docId), ANN_LISTS_FILE).absolutePath
+                if (!retrain && llama.attachAnnLists(cd.store, lists)) continue
+                if (llama.assignAnnLists(cd.store, lists)) assigned++
+            }
+            Log.d(TAG, "updateAnnIndex: assigned=$assigned docs")
+        }
     }
 
     /**
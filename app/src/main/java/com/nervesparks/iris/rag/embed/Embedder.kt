@@ -1,5 +1,49 @@
 package com.nervesparks.iris.rag.embed
 
+import com.nervesparks.iris.rag.ingest.Chunker
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
 interface Embedder {
     fun embed(text: String): FloatArray
+
+    /**
+     * Embeds [texts] in order. Implementations backed by llama.cpp pack them into shared batches.
+     * A blank text gets an all-zero vector, here and in [embedBatchInto], so row i is texts[i].
+     */
+    fun embedBatch(texts: List<String>): List<FloatArray> =
+        texts.map { if (it.isBlank()) FloatArray(dimension()) else embed(it) }
+
+    /**
+     * Tokens per text as the model sees it, or null if unknown. Native embedders cache the
+     * tokenization, so embedding the same texts afterwards is not tokenized twice.
+     */
+    fun tokenCounts(texts: List<String>): IntArray? = null
+
+    /** Longest input (tokens) embedded without truncation; 0 = unknown. */
+    fun maxInputTokens(): Int = 0
+
+    /** Floats per vector. */
+    fun dimension(): Int
+
+    /** True when every vector comes out L2-normalized (recorded in the stored file's header). */
+    fun normalizes(): Boolean = false
+
+    /**
+     * Writes one float32 little-endian row per text into [out] at [offsetBytes].
+     * Returns bytes written. Default goes through [embedBatch]; native embedders write in place.
+     */
+    fun embedBatchInto(texts: List<String>, out: ByteBuffer, offsetBytes: Int): Int {
+        val bb = out.duplicate().order(ByteOrder.LITTLE_ENDIAN)
+        bb.position(offsetBytes)
+        for (v in embedBatch(texts)) for (f in v) bb.putFloat(f)
+        return bb.position() - offsetBytes
+    }
+
+    /**
+     * [embedBatchInto] for consecutive chunks of one document, which lets an implementation
+     * embed them together (late chunking). Default embeds each chunk's text on its own.
+     */
+    fun embedChunksInto(chunks: List<Chunker.Chunk>, out: ByteBuffer, offsetBytes: Int): Int =
+        embedBatchInto(chunks.map { it.text }, out, offsetBytes)
 }
@@ -3,7 +3,9 @@ package com.nervesparks.iris.rag.embed
 import android.llama.cpp.LLamaAndroid
 import android.os.Looper
 import android.util.Log
+import com.nervesparks.iris.rag.ingest.Chunker
 import kotlinx.coroutines.runBlocking
+import java.nio.ByteBuffer
 import kotlin.math.sqrt
 
 class LlamaCppEmbedder(
@@ -11,7 +13,9 @@ class LlamaCppEmbedder(
     private val userThreads: Int = 4,
     private val nCtx: Int = 512,
     private val poolingType: Int = 1, // 1=MEAN, 2=CLS, 3=LAST (must be supported natively)
-    private val normalize: Boolean = true
+    private val normalize: Boolean = true,
+    // Index consecutive chunks from one decode of their window (MEAN pooling only).
+    private val lateChunking: Boolean = true
 ) : Embedder {
 
     private val llama = LLamaAndroid.instance()
@@ -19,6 +23,10 @@ class LlamaCppEmbedder(
     @Volatile
     private var loaded = false
 
+    // Floats per vector, read from the model once it is loaded.
+    @Volatile
+    private var dim = 0
+
     // ✅ LRU cache for query embeddings - major performance boost for repeated queries
     private val embeddingCache = object : LinkedHashMap<String, FloatArray>(32, 0.75f, true) {
         override fun removeEldestEntry(eldest: MutableMap.MutableEntry<String, FloatArray>?): Boolean {
@@ -103,6 +111,204 @@ class LlamaCppEmbedder(
         return result
     }
 
+    /**
+     * Batched path for indexing: no query cache, one native call per group of texts.
+     */
+    override fun embedBatch(texts: List<String>): List<FloatArray> {
+        check(Looper.myLooper() != Looper.getMainLooper()) {
+            "embedBatch() called on main thread. Call from a background dispatcher (Default/IO/Worker)."
+        }
+        if (texts.isEmpty()) return emptyList()
+
+        val trimmed = texts.map { it.trim() }
+        val nonBlank = trimmed.filter { it.isNotEmpty() }
+        if (nonBlank.isEmpty()) return trimmed.map { FloatArray(dimension()) }
+
+        ensureLoaded()
+
+        val startTime = System.currentTimeMillis()
+        val flat = runBlocking {
+            try {
+                llama.embedBatch(nonBlank)
+            } catch (t: Throwable) {
+                Log.e(TAG, "embedBatch() native call failed", t)
+                throw IllegalStateException("Embedding failed: ${t.message}", t)
+            }
+        }
+
+        val dim = flat.size / nonBlank.size
+        var row = 0
+        val out = trimmed.map { t ->
+            if (t.isEmpty()) FloatArray(dim)
+            else {
+                val v = flat.copyOfRange(row * dim, (row + 1) * dim)
+                row++
+                if (normalize) l2NormalizeInPlace(v) else v
+            }
+        }
+
+        Log.d(TAG, "embedBatch: ${nonBlank.size} texts in ${System.currentTimeMillis() - startTime}ms")
+        return out
+    }
+
+    override fun tokenCounts(texts: List<String>): IntArray? {
+        check(Looper.myLooper() != Looper.getMainLooper()) {
+            "tokenCounts() called on main thread. Call from a background dispatcher (Default/IO/Worker)."
+        }
+        if (texts.isEmpty()) return IntArray(0)
+        ensureLoaded()
+        return runBlocking { llama.embeddingTokenCounts(texts.map { it.trim() }) }
+    }
+
+    override fun maxInputTokens(): Int = nCtx
+
+    override fun normalizes(): Boolean = normalize
+
+    override fun dimension(): Int {
+        if (dim > 0) return dim
+        ensureLoaded()
+        return runBlocking { llama.embeddingDim() }.also { dim = it }
+    }
+
+    /**
+     * Zero-copy path: pooled (and normalized) vectors land directly in [out], no FloatArray per chunk.
+     */
+    override fun embedBatchInto(texts: List<String>, out: ByteBuffer, offsetBytes: Int): Int {
+        check(Looper.myLooper() != Looper.getMainLooper()) {
+            "embedBatchInto() called on main thread. Call from a background dispatcher (Default/IO/Worker)."
+        }
+        if (!out.isDirect) return super.embedBatchInto(texts, out, offsetBytes)
+        if (texts.isEmpty()) return 0
+
+        ensureLoaded()
+
+        val trimmed = texts.map { it.trim() }
+        val nonBlank = trimmed.filter { it.isNotEmpty() }
+        val written = if (nonBlank.isEmpty()) 0 else runBlocking {
+            try {
+                llama.embedBatchInto(nonBlank, out, offsetBytes, normalize)
+            } catch (t: Throwable) {
+                Log.e(TAG, "embedBatchInto() native call failed", t)
+                throw IllegalStateException("Embedding failed: ${t.message}", t)
+            }
+        }
+        if (nonBlank.size == trimmed.size) return written
+
+        // Spread the packed rows out to their texts' slots, back to front, zeroing blank rows.
+        val rowBytes = dimension() * 4
+        val bb = out.duplicate()
+        var src = nonBlank.size
+        for (i in trimmed.indices.reversed()) {
+            val dst = offsetBytes + i * rowBytes
+            if (trimmed[i].isEmpty()) {
+                for (b in 0 until rowBytes) bb.put(dst + b, 0)
+            } else {
+                src--
+                val from = offsetBytes + src * rowBytes
+                if (from != dst) for (b in rowBytes - 1 downTo 0) bb.put(dst + b, bb.get(from + b))
+            }
+        }
+        return trimmed.size * rowBytes
+    }
+
+    /**
+     * Late chunking: consecutive chunks are decoded together as one window of up to [nCtx]
+     * tokens with per-token embeddings, and each chunk's vector is the mean over its own tokens.
+     * Overlap text that neighbouring chunks share is decoded once, and every vector sees the
+     * chunks around it. A window the native side can't fit goes through [embedBatchInto].
+     */
+    override fun embedChunksInto(chunks: List<Chunker.Chunk>, out: ByteBuffer, offsetBytes: Int): Int {
+        check(Looper.myLooper() != Looper.getMainLooper()) {
+            "embedChunksInto() called on main thread. Call from a background dispatcher (Default/IO/Worker)."
+        }
+        if (!lateChunking || poolingType != POOLING_MEAN || !out.isDirect) {
+            return super.embedChunksInto(chunks, out, offsetBytes)
+        }
+        if (chunks.isEmpty()) return 0
+
+        ensureLoaded()
+        val rowBytes = dimension() * 4
+        val parts = chunks.map { LatePart.of(it) }
+        // [tail, core] per chunk; counts carry the special tokens too, so windows err short.
+        val counts = tokenCounts(parts.flatMap { listOf(it.tail, it.core) })
+            ?: return super.embedChunksInto(chunks, out, offsetBytes)
+        val budget = nCtx - LATE_WINDOW_MARGIN
+
+        val startTime = System.currentTimeMillis()
+        var written = 0
+        var windows = 0
+        var first = 0
+        while (first < chunks.size) {
+            var last = first + 1
+            var tokens = counts[2 * first] + counts[2 * first + 1]
+            while (last < chunks.size && chunks[last].index == chunks[last - 1].index + 1 &&
+                tokens + counts[2 * last + 1] <= budget
+            ) {
+                tokens += counts[2 * last + 1]
+                last++
+            }
+
+            val at = offsetBytes + first * rowBytes
+            val n = lateWindowInto(parts.subList(first, last), out, at)
+            written += if (n > 0) n else embedBatchInto(chunks.subList(first, last).map { it.text }, out, at)
+            windows++
+            first = last
+        }
+
+        Log.d(TAG, "embedChunksInto: ${chunks.size} chunks in $windows windows, ${System.currentTimeMillis() - startTime}ms")
+        return written
+    }
+
+    // A chunk split into the overlap it repeats from the previous chunk and its own text.
+    private class LatePart(val tail: String, val core: String) {
+        companion object {
+            fun of(c: Chunker.Chunk): LatePart {
+                val text = c.text.trim()
+                val prefix = c.overlapPrefix.coerceIn(0, text.length)
+                val tail = if (prefix > OVERLAP_MARK.length && text.startsWith(OVERLAP_MARK)) {
+                    text.substring(OVERLAP_MARK.length, prefix).trim()
+                } else ""
+                return LatePart(tail, text.substring(prefix).trim())
+            }
+        }
+    }
+
+    /**
+     * One window: each chunk's own text is a segment, and an overlap is split off the end of the
+     * chunk it came from so the next chunk's span starts there instead of repeating it.
+     */
+    private fun lateWindowInto(parts: List<LatePart>, out: ByteBuffer, offsetBytes: Int): Int {
+        val segments = ArrayList<String>(parts.size * 2 + 1)
+        val spans = IntArray(parts.size * 2)
+        var sharedTail = false
+        for (i in parts.indices) {
+            val p = parts[i]
+            var start = segments.size
+            if (p.tail.isNotEmpty()) {
+                if (sharedTail) start = segments.size - 1 else segments.add(p.tail)
+            }
+            val next = parts.getOrNull(i + 1)?.tail.orEmpty()
+            sharedTail = next.isNotEmpty() && next.length < p.core.length && p.core.endsWith(next)
+            if (sharedTail) {
+                segments.add(p.core.dropLast(next.length))
+                segments.add(next)
+            } else {
+                segments.add(p.core)
+            }
+            spans[2 * i] = start
+            spans[2 * i + 1] = segments.size
+        }
+
+        return runBlocking {
+            try {
+                llama.embedLateChunkedInto(segments, spans, out, offsetBytes, normalize)
+            } catch (t: Throwable) {
+                Log.e(TAG, "embedChunksInto() native call failed", t)
+                throw IllegalStateException("Embedding failed: ${t.message}", t)
+            }
+        }
+    }
+
     private fun l2NormalizeInPlace(x: FloatArray): FloatArray {
         var sum = 0.0
         for (v in x) sum += (v * v).toDouble()
@@ -117,5 +323,13 @@ class LlamaCppEmbedder(
 
     companion object {
         private const val TAG = "LlamaCppEmbedder"
+
+        private const val POOLING_MEAN = 1
+
+        // Headroom under nCtx for the window's special tokens and per-segment tokenization.
+        private const val LATE_WINDOW_MARGIN = 16
+
+        // Chunker marks a chunk's overlap with the previous one as "...tail ".
+        private const val OVERLAP_MARK = "..."
     }
 }
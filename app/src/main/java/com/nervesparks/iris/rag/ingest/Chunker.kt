@@ -16,7 +16,9 @@ object Chunker {
         val index: Int,
         val text: String,
         val startOffset: Int = 0,  // ✅ NEW: Track position in original document
-        val endOffset: Int = 0
+        val endOffset: Int = 0,
+        // Leading chars of text repeated from the previous chunk ("...tail "), 0 without overlap.
+        val overlapPrefix: Int = 0
     )
 
     /**
@@ -254,7 +256,8 @@ object Chunker {
                 index = i,
                 text = merged,
                 startOffset = runningOffset,
-                endOffset = runningOffset + curr.length
+                endOffset = runningOffset + curr.length,
+                overlapPrefix = merged.length - curr.length
             ))
 
             runningOffset += curr.length
@@ -1,5 +1,7 @@
 package com.nervesparks.iris.rag.retrieval
 
+import android.llama.cpp.LLamaAndroid
+import java.nio.ByteBuffer
 import kotlin.math.min
 
 /**
@@ -7,6 +9,25 @@ import kotlin.math.min
  */
 object VectorSearch {
 
+    /**
+     * Native top-k over packed float32 rows in a direct buffer (NEON kernel + bounded heap).
+     * Best-first; used by retrieval instead of calling [dotPackedLE] per chunk.
+     */
+    suspend fun topKPacked(query: FloatArray, vectors: ByteBuffer, count: Int, k: Int): List<LLamaAndroid.VectorHit> =
+        LLamaAndroid.instance().searchTopK(query, vectors, count, k)
+
+    /** Same, over an embeddings.bin mapped with [LLamaAndroid.openEmbeddingStore]. */
+    suspend fun topKStore(store: Long, query: FloatArray, k: Int): List<LLamaAndroid.VectorHit> =
+        LLamaAndroid.instance().searchEmbeddingStore(store, query, k)
+
+    /** Global top-k over several mapped stores in one call, using the IVF index when present. */
+    suspend fun topKStores(stores: LongArray, query: FloatArray, k: Int, nprobe: Int): List<LLamaAndroid.StoreHit> =
+        LLamaAndroid.instance().searchStores(stores, query, k, nprobe)
+
+    /** [topKStores] fused with BM25 over [text] (stores with a lexical index), in one call. */
+    suspend fun topKHybrid(stores: LongArray, query: FloatArray, text: String, k: Int, nprobe: Int): List<LLamaAndroid.HybridHit> =
+        LLamaAndroid.instance().searchHybrid(stores, query, text, k, nprobe)
+
     fun dot(a: FloatArray, b: FloatArray): Double {
         val n = min(a.size, b.size)
         var s = 0.0
@@ -0,0 +1,101 @@
+package com.nervesparks.iris.rag.storage
+
+import java.io.File
+import java.io.RandomAccessFile
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+/**
+ * On-disk layout of embeddings.bin. Encoding and scoring happen natively
+ * (llama-android.cpp, emb_quantize / emb_store_*); this mirrors the header for Kotlin-side
+ * readers and sizing.
+ *
+ *   16-byte LE header: u32 magic "IEMB", u16 version, u8 dtype, u8 flags, u32 dim, u32 reserved
+ *   rows: F32 = dim floats, F16 = dim halves, I8 = f32 scale + dim int8
+ *
+ * Files without the magic are legacy headerless float32 rows.
+ */
+object EmbeddingFormat {
+    const val MAGIC = 0x424D4549 // "IEMB"
+    const val VERSION = 1
+    const val HEADER_BYTES = 16
+    const val FLAG_NORMALIZED = 1
+
+    /** Float32 copy kept next to a quantized embeddings.bin for optional exact rescoring. */
+    const val RESCORE_FILE = "embeddings.f32"
+
+    enum class Dtype(val code: Int) {
+        F32(0),
+        F16(1),
+        I8(2);
+
+        fun rowBytes(dim: Int): Int = when (this) {
+            F32 -> dim * 4
+            F16 -> dim * 2
+            I8 -> 4 + dim
+        }
+
+        companion object {
+            fun fromCode(code: Int): Dtype? = values().firstOrNull { it.code == code }
+        }
+    }
+
+    data class Header(val dim: Int, val dtype: Dtype, val normalized: Boolean)
+
+    fun fileBytes(count: Int, dim: Int, dtype: Dtype): Int = HEADER_BYTES + count * dtype.rowBytes(dim)
+
+    /** Null for legacy (headerless float32) or unreadable files. */
+    fun readHeader(file: File): Header? {
+        if (!file.exists() || file.length() < HEADER_BYTES) return null
+        val bytes = ByteArray(HEADER_BYTES)
+        runCatching { RandomAccessFile(file, "r").use { it.readFully(bytes) } }.getOrElse { return null }
+        return parseHeader(ByteBuffer.wrap(bytes))
+    }
+
+    fun parseHeader(buf: ByteBuffer): Header? {
+        if (buf.remaining() < HEADER_BYTES) return null
+        val bb = buf.duplicate().order(ByteOrder.LITTLE_ENDIAN)
+        val start = bb.position()
+        if (bb.getInt(start) != MAGIC) return null
+        if ((bb.getShort(start + 4).toInt() and 0xFFFF) != VERSION) return null
+        val dtype = Dtype.fromCode(bb.get(start + 6).toInt() and 0xFF) ?: return null
+        val flags = bb.get(start + 7).toInt() and 0xFF
+        val dim = bb.getInt(start + 8)
+        return Header(dim = dim, dtype = dtype, normalized = (flags and FLAG_NORMALIZED) != 0)
+    }
+
+    /** Decodes row [row] of a whole-file buffer to floats (diagnostics; retrieval scores natively). */
+    fun decodeRow(file: ByteBuffer, header: Header?, dim: Int, row: Int): FloatArray {
+        val bb = file.duplicate().order(ByteOrder.LITTLE_ENDIAN)
+        val dtype = header?.dtype ?: Dtype.F32
+        val base = (if (header != null) HEADER_BYTES else 0) + row * dtype.rowBytes(dim)
+        return when (dtype) {
+            Dtype.F32 -> FloatArray(dim) { bb.getFloat(base + it * 4) }
+            Dtype.F16 -> FloatArray(dim) { halfToFloat(bb.getShort(base + it * 2).toInt() and 0xFFFF) }
+            Dtype.I8 -> {
+                val scale = bb.getFloat(base)
+                FloatArray(dim) { bb.get(base + 4 + it) * scale }
+            }
+        }
+    }
+
+    private fun halfToFloat(h: Int): Float {
+        val sign = (h and 0x8000) shl 16
+        var exp = (h shr 10) and 0x1F
+        var mant = h and 0x3FF
+        val bits = when {
+            exp == 0 && mant == 0 -> sign
+            exp == 0 -> {
+                exp = 127 - 15 + 1
+                while (mant and 0x400 == 0) {
+                    mant = mant shl 1
+                    exp--
+                }
+                sign or (exp shl 23) or ((mant and 0x3FF) shl 13)
+            }
+            exp == 31 -> sign or 0x7F800000 or (mant shl 13)
+            else -> sign or ((exp + 127 - 15) shl 23) or (mant shl 13)
+        }
+        return Float.fromBits(bits)
+    }
+}
@@ -2,9 +2,14 @@ package com.nervesparks.iris.rag.storage
 
 import android.content.Context
 import android.util.Log
+import com.nervesparks.iris.rag.util.FloatPacking
 import org.json.JSONObject
+import java.io.ByteArrayOutputStream
 import java.io.File
 import java.io.FileOutputStream
+import java.io.RandomAccessFile
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
 import java.util.UUID
 
 data class LocalDoc(
@@ -41,6 +46,12 @@ class LocalRagStore(private val context: Context) {
 
     fun docFolder(docId: String): File = File(docsDir, docId)
 
+    /** Corpus-wide IVF centroids; each doc folder holds its own "ivf.lists". */
+    fun annIndexFile(): File = File(root, "ivf.bin")
+
+    /** Per-doc BM25 postings, row-aligned with embeddings.bin. */
+    fun lexicalIndexFile(docId: String): File = File(docFolder(docId), "lexical.bin")
+
     fun writeDocMeta(doc: LocalDoc) {
         val dir = docFolder(doc.docId).apply { mkdirs() }
         val metaFile = File(dir, "meta.json")
@@ -103,31 +114,206 @@ class LocalRagStore(private val context: Context) {
         docId: String,
         chunks: List<LocalChunk>,
         embeddingsBytes: ByteArray // float32 little-endian, concatenated
+    ) = writeChunksAndEmbeddings(docId, chunks, ByteBuffer.wrap(embeddingsBytes))
+
+    /**
+     * Same as above, but takes the embeddings file image as a (typically direct) buffer;
+     * bytes [0, limit) are written through a FileChannel without another heap copy.
+     * [embeddings] is either raw float32 rows or an [EmbeddingFormat] file; [fullPrecision]
+     * (raw float32 rows) is stored alongside a quantized file for rescoring.
+     */
+    fun writeChunksAndEmbeddings(
+        docId: String,
+        chunks: List<LocalChunk>,
+        embeddings: ByteBuffer,
+        fullPrecision: ByteBuffer? = null
     ) {
         val dir = docFolder(docId).apply { mkdirs() }
         val chunksFile = File(dir, "chunks.jsonl")
+        val idxFile = File(dir, "chunks.idx")
         val embFile = File(dir, "embeddings.bin")
+        val rescoreFile = File(dir, EmbeddingFormat.RESCORE_FILE)
 
-        // chunks.jsonl
-        val sb = StringBuilder()
-        for (c in chunks) {
+        // chunks.jsonl + chunks.idx (byte offset of every line, plus end offset)
+        val out = ByteArrayOutputStream()
+        val offsets = LongArray(chunks.size + 1)
+        for ((i, c) in chunks.withIndex()) {
             val jo = JSONObject()
             jo.put("chunkId", c.chunkId)
             jo.put("chunkIndex", c.chunkIndex)
             jo.put("text", c.text)
-            sb.append(jo.toString()).append('\n')
+            offsets[i] = out.size().toLong()
+            out.write((jo.toString() + "\n").toByteArray(Charsets.UTF_8))
+        }
+        offsets[chunks.size] = out.size().toLong()
+        atomicWriteBuffer(chunksFile, ByteBuffer.wrap(out.toByteArray()))
+        atomicWriteBuffer(idxFile, offsetsToBuffer(offsets))
+
+        // embeddings.bin (+ optional float32 copy)
+        atomicWriteBuffer(embFile, embeddings)
+        if (fullPrecision != null) atomicWriteBuffer(rescoreFile, fullPrecision)
+        else if (rescoreFile.exists()) rescoreFile.delete()
+
+        Log.d(TAG, "writeChunksAndEmbeddings: docId=$docId chunks=${chunks.size} embBytes=${embeddings.limit()}")
+    }
+
+    /**
+     * Streaming counterpart of [writeChunksAndEmbeddings] for ingestion: rows are appended to
+     * temp files as each batch is embedded, so no document ever has all its chunks or vectors
+     * in memory. [ChunkWriter.commit] swaps the finished files in; until then readers keep
+     * seeing the previous files (or none). [fullPrecision] also writes the float32 rescoring copy.
+     */
+    fun openChunkWriter(docId: String, fullPrecision: Boolean = false): ChunkWriter =
+        ChunkWriter(docFolder(docId).apply { mkdirs() }, docId, fullPrecision)
+
+    inner class ChunkWriter internal constructor(
+        private val dir: File,
+        private val docId: String,
+        fullPrecision: Boolean
+    ) : java.io.Closeable {
+        private val chunksTmp = File(dir, "chunks.jsonl.tmp")
+        private val embTmp = File(dir, "embeddings.bin.tmp")
+        private val rescoreTmp = File(dir, EmbeddingFormat.RESCORE_FILE + ".tmp")
+
+        private val chunksOut = FileOutputStream(chunksTmp).buffered()
+        private val embOut = FileOutputStream(embTmp).channel
+        private val rescoreOut = if (fullPrecision) FileOutputStream(rescoreTmp).channel else null
+
+        private val offsets = ArrayList<Long>()
+        private var chunkBytes = 0L
+        private var headerWritten = false
+        private var done = false
+
+        var count: Int = 0
+            private set
+
+        /**
+         * Appends [chunks] and their vectors. [embeddings] is an [EmbeddingFormat] image of
+         * exactly these rows (header included, as emb_quantize writes it); the header is only
+         * kept from the first call. [rows] are the matching raw float32 rows, if kept.
+         */
+        fun append(chunks: List<LocalChunk>, embeddings: ByteBuffer, rows: ByteBuffer? = null) {
+            check(!done) { "ChunkWriter already closed" }
+            for (c in chunks) {
+                val jo = JSONObject()
+                jo.put("chunkId", c.chunkId)
+                jo.put("chunkIndex", c.chunkIndex)
+                jo.put("text", c.text)
+                val line = (jo.toString() + "\n").toByteArray(Charsets.UTF_8)
+                offsets.add(chunkBytes)
+                chunksOut.write(line)
+                chunkBytes += line.size
+            }
+
+            val src = embeddings.duplicate().apply { position(if (headerWritten) EmbeddingFormat.HEADER_BYTES else 0) }
+            while (src.hasRemaining()) embOut.write(src)
+            headerWritten = true
+
+            if (rescoreOut != null && rows != null) {
+                val r = rows.duplicate().apply { position(0) }
+                while (r.hasRemaining()) rescoreOut.write(r)
+            }
+            count += chunks.size
+        }
+
+        /** Makes the appended rows the doc's chunks.jsonl / chunks.idx / embeddings.bin. */
+        fun commit() {
+            check(!done) { "ChunkWriter already closed" }
+            closeStreams()
+            done = true
+
+            offsets.add(chunkBytes)
+            replaceFile(chunksTmp, File(dir, "chunks.jsonl"))
+            atomicWriteBuffer(File(dir, "chunks.idx"), offsetsToBuffer(offsets.toLongArray()))
+            replaceFile(embTmp, File(dir, "embeddings.bin"))
+            val rescoreFile = File(dir, EmbeddingFormat.RESCORE_FILE)
+            if (rescoreOut != null) replaceFile(rescoreTmp, rescoreFile)
+            else if (rescoreFile.exists()) rescoreFile.delete()
+
+            Log.d(TAG, "ChunkWriter.commit: docId=$docId chunks=$count embBytes=${File(dir, "embeddings.bin").length()}")
         }
-        atomicWriteText(chunksFile, sb.toString())
 
-        // embeddings.bin
-        atomicWriteBytes(embFile, embeddingsBytes)
+        /** Without [commit]: drops the temp files. */
+        override fun close() {
+            if (done) return
+            done = true
+            closeStreams()
+            chunksTmp.delete()
+            embTmp.delete()
+            rescoreTmp.delete()
+        }
 
-        Log.d(TAG, "writeChunksAndEmbeddings: docId=$docId chunks=${chunks.size} embBytes=${embeddingsBytes.size}")
+        private fun closeStreams() {
+            runCatching { chunksOut.close() }
+            runCatching { embOut.close() }
+            runCatching { rescoreOut?.close() }
+        }
+    }
+
+    /**
+     * Line offsets into chunks.jsonl: entry i is where chunk row i starts, the last entry is
+     * where the final row ends. Docs indexed before chunks.idx existed (or with a stale idx)
+     * get one built by scanning for newlines, so no JSON is parsed here.
+     */
+    fun readChunkOffsets(docId: String): LongArray? {
+        val dir = docFolder(docId)
+        val chunksFile = File(dir, "chunks.jsonl")
+        val idxFile = File(dir, "chunks.idx")
+        if (!chunksFile.exists()) return null
+
+        if (idxFile.exists() && idxFile.length() >= 8 && idxFile.length() % 8 == 0L) {
+            val bb = ByteBuffer.wrap(idxFile.readBytes()).order(ByteOrder.LITTLE_ENDIAN)
+            val offsets = LongArray(bb.capacity() / 8) { bb.getLong() }
+            if (offsets.last() == chunksFile.length()) return offsets
+            Log.w(TAG, "readChunkOffsets: stale chunks.idx for docId=$docId, rebuilding")
+        }
+
+        val offsets = scanLineOffsets(chunksFile)
+        runCatching { atomicWriteBuffer(idxFile, offsetsToBuffer(offsets)) }
+            .onFailure { Log.w(TAG, "readChunkOffsets: could not persist chunks.idx docId=$docId", it) }
+        return offsets
+    }
+
+    /**
+     * Reads chunk rows by position using [offsets] from [readChunkOffsets]; only the
+     * requested lines are read and parsed. Rows that fail to parse are skipped.
+     */
+    fun readChunksAt(docId: String, offsets: LongArray, rows: List<Int>): Map<Int, LocalChunk> {
+        if (rows.isEmpty()) return emptyMap()
+        val chunksFile = File(docFolder(docId), "chunks.jsonl")
+        if (!chunksFile.exists()) return emptyMap()
+
+        val out = HashMap<Int, LocalChunk>(rows.size)
+        RandomAccessFile(chunksFile, "r").use { raf ->
+            for (row in rows.distinct().sorted()) {
+                if (row < 0 || row + 1 >= offsets.size) continue
+                val start = offsets[row]
+                val len = (offsets[row + 1] - start).toInt()
+                if (len <= 0) continue
+
+                val bytes = ByteArray(len)
+                raf.seek(start)
+                raf.readFully(bytes)
+
+                runCatching {
+                    val jo = JSONObject(String(bytes, Charsets.UTF_8).trim())
+                    out[row] = LocalChunk(
+                        chunkId = jo.getString("chunkId"),
+                        chunkIndex = jo.getInt("chunkIndex"),
+                        text = jo.getString("text")
+                    )
+                }.onFailure {
+                    Log.w(TAG, "readChunksAt: bad row=$row docId=$docId", it)
+                }
+            }
+        }
+        return out
     }
 
     /**
      * Returns triples (doc, chunk, embeddingBytesForChunk)
-     * embeddingBytesForChunk is one chunk vector (dim * 4 bytes)
+     * embeddingBytesForChunk is one chunk vector (dim * 4 bytes), decoded to float32 LE
+     * whatever the on-disk format.
      */
     fun readAllChunksAndEmbeddings(): List<Triple<LocalDoc, LocalChunk, ByteArray>> {
         val docs = readAllDocs().filter { it.status == "READY" }
@@ -140,12 +326,12 @@ class LocalRagStore(private val context: Context) {
             if (!chunksFile.exists() || !embFile.exists()) continue
 
             val lines = chunksFile.readLines().filter { it.isNotBlank() }
-            val allEmb = embFile.readBytes()
+            val allEmb = ByteBuffer.wrap(embFile.readBytes())
+            val header = EmbeddingFormat.parseHeader(allEmb)
 
             val n = lines.size
             if (n == 0) continue
-            val bytesPerEmb = allEmb.size / n
-            if (bytesPerEmb * n != allEmb.size) continue
+            val dim = embeddingDim(header, allEmb.capacity().toLong(), n) ?: continue
 
             for ((i, line) in lines.withIndex()) {
                 val jo = JSONObject(line)
@@ -154,8 +340,7 @@ class LocalRagStore(private val context: Context) {
                     chunkIndex = jo.getInt("chunkIndex"),
                     text = jo.getString("text")
                 )
-                val start = i * bytesPerEmb
-                val emb = allEmb.copyOfRange(start, start + bytesPerEmb)
+                val emb = FloatPacking.floatsToBytes(EmbeddingFormat.decodeRow(allEmb, header, dim, i))
                 out.add(Triple(doc, chunk, emb))
             }
         }
@@ -210,7 +395,7 @@ class LocalRagStore(private val context: Context) {
     }
 
     /**
-     * ✅ NEW: Read embeddings.bin bytes for a doc (raw concatenated float32 LE).
+     * ✅ NEW: Read embeddings.bin bytes for a doc as stored (see [EmbeddingFormat]).
      * Helpful for diagnostics or future pre-warm.
      */
     fun readDocEmbeddingsBytes(docId: String): ByteArray? {
@@ -221,7 +406,8 @@ class LocalRagStore(private val context: Context) {
     }
 
     /**
-     * ✅ NEW: infer embedding dimension (float count) from embeddings.bin and chunk count.
+     * ✅ NEW: embedding dimension from the embeddings.bin header, or inferred from size and
+     * chunk count for legacy float32 files.
      */
     fun readDocEmbeddingsDim(docId: String): Int? {
         val dir = docFolder(docId)
@@ -232,10 +418,17 @@ class LocalRagStore(private val context: Context) {
         val chunkCount = chunksFile.useLines { it.count { line -> line.isNotBlank() } }
         if (chunkCount <= 0) return null
 
-        val bytes = embFile.length()
-        val bytesPer = bytes / chunkCount
-        if (bytesPer * chunkCount != bytes) return null
-        return (bytesPer / 4L).toInt() // float32
+        return embeddingDim(EmbeddingFormat.readHeader(embFile), embFile.length(), chunkCount)
+    }
+
+    private fun embeddingDim(header: EmbeddingFormat.Header?, fileBytes: Long, count: Int): Int? {
+        if (header != null) {
+            val expected = EmbeddingFormat.fileBytes(count, header.dim, header.dtype).toLong()
+            return if (expected == fileBytes) header.dim else null
+        }
+        val bytesPer = fileBytes / count
+        if (bytesPer * count != fileBytes || bytesPer % 4L != 0L) return null
+        return (bytesPer / 4L).toInt() // legacy float32
     }
 
     fun getDocStats(docId: String): DocStats? {
@@ -307,11 +500,43 @@ class LocalRagStore(private val context: Context) {
         replaceFile(tmp, file)
     }
 
-    private fun atomicWriteBytes(file: File, bytes: ByteArray) {
+    private fun offsetsToBuffer(offsets: LongArray): ByteBuffer {
+        val bb = ByteBuffer.allocate(offsets.size * 8).order(ByteOrder.LITTLE_ENDIAN)
+        for (o in offsets) bb.putLong(o)
+        bb.flip()
+        return bb
+    }
+
+    /**
+     * Offsets of non-blank lines (the rows readAllDocChunks / readDocChunks see) plus the file
+     * length. A row may run over trailing blank lines; readers trim before parsing.
+     */
+    private fun scanLineOffsets(file: File): LongArray {
+        val bytes = file.readBytes()
+        val offsets = ArrayList<Long>()
+        var lineStart = 0
+        var blank = true
+        for (i in 0..bytes.size) {
+            if (i == bytes.size || bytes[i] == '\n'.code.toByte()) {
+                if (!blank) offsets.add(lineStart.toLong())
+                lineStart = i + 1
+                blank = true
+            } else if (bytes[i] < 0 || bytes[i] > ' '.code.toByte()) {
+                blank = false
+            }
+        }
+        offsets.add(bytes.size.toLong())
+        return offsets.toLongArray()
+    }
+
+    private fun atomicWriteBuffer(file: File, buffer: ByteBuffer) {
         val dir = file.parentFile ?: return
         dir.mkdirs()
         val tmp = File(dir, file.name + ".tmp")
-        FileOutputStream(tmp).use { it.write(bytes) }
+        val src = buffer.duplicate().apply { position(0) }
+        FileOutputStream(tmp).channel.use { ch ->
+            while (src.hasRemaining()) ch.write(src)
+        }
         replaceFile(tmp, file)
     }
 
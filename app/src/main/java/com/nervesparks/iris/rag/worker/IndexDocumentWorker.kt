@@ -3,17 +3,27 @@ package com.nervesparks.iris.rag.worker
 import android.content.Context
 import android.net.Uri
 import android.util.Log
+import android.llama.cpp.LLamaAndroid
 import androidx.work.CoroutineWorker
 import androidx.work.WorkerParameters
 import androidx.work.workDataOf
 import com.nervesparks.iris.docs.DocumentTextExtractor
 import com.nervesparks.iris.irisapp.ServiceLocator
+import com.nervesparks.iris.rag.embed.Embedder
 import com.nervesparks.iris.rag.ingest.Chunker
 import com.nervesparks.iris.rag.ingest.TextNormalize
+import com.nervesparks.iris.rag.storage.EmbeddingFormat
 import com.nervesparks.iris.rag.storage.LocalChunk
 import com.nervesparks.iris.rag.storage.LocalDoc
-import com.nervesparks.iris.rag.util.FloatPacking
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.channels.Channel
+import kotlinx.coroutines.coroutineScope
+import kotlinx.coroutines.launch
+import kotlinx.coroutines.sync.Semaphore
+import kotlinx.coroutines.sync.withPermit
 import java.io.File
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
 import java.util.UUID
 import kotlin.math.max
 
@@ -60,69 +70,40 @@ class IndexDocumentWorker(
         return try {
             val uri = Uri.parse(uriStr)
 
-            // ✅ extractor now throws if empty/low-quality
-            val extracted = DocumentTextExtractor.extractTextFromUri(
-                context = applicationContext,
-                uri = uri
-            )
-
-            var normalized = TextNormalize.normalize(extracted).trim()
-            if (normalized.isBlank()) {
-                return failDoc(
+            // Extraction is the memory-heavy CPU stage; bounding it lets a multi-file upload
+            // extract the next document while this one's batches are on the native embedder.
+            val allChunks = extractPermits.withPermit { extractAndChunk(uri) }
+                ?: return failDoc(
                     docId, uriStr, name, mime, sizeBytes, createdAt,
                     "No text extracted (empty after normalize)."
                 )
-            }
-
-            // ✅ second safety dedupe (removes repeated headers that survive normalize)
-            normalized = removeRepeatingLines(normalized)
-
-            // ✅ If still too small, fail fast to avoid garbage indexing
-            if (normalized.length < 350) {
+            if (allChunks.isEmpty()) {
                 return failDoc(
                     docId, uriStr, name, mime, sizeBytes, createdAt,
                     "Extracted text too small after cleanup. PDF may be scanned or layout is unsupported."
                 )
             }
 
-            val chunks = Chunker.chunkText(
-                normalized,
-                targetChars = 700,   // ✅ Reduced from 900 for finer-grained retrieval
-                overlapChars = 300   // ✅ Increased from 250 for better context continuity
-            )
+            Log.i(TAG, "Created ${allChunks.size} chunks for docId=$docId name=$name")
 
+            val chunks = embedAndAppend(docId, allChunks, embedder)
+            if (chunks.size < allChunks.size) {
+                Log.w(TAG, "Skipped ${allChunks.size - chunks.size} chunks over ${embedder.maxInputTokens()} tokens docId=$docId")
+            }
             if (chunks.isEmpty()) {
                 return failDoc(
                     docId, uriStr, name, mime, sizeBytes, createdAt,
                     "Chunker produced 0 chunks."
                 )
             }
+            val written = chunks.size
+            Log.d(TAG, "Streamed $written chunks to disk docId=$docId")
 
-            Log.i(TAG, "Created ${chunks.size} chunks for docId=$docId name=$name")
-
-            val localChunks = ArrayList<LocalChunk>(chunks.size)
-            val allEmbBytes = ByteArrayOutput()
-
-            for (c in chunks) {
-                val emb = embedder.embed(c.text)
-                val chunkId = UUID.randomUUID().toString()
-
-                localChunks.add(
-                    LocalChunk(
-                        chunkId = chunkId,
-                        chunkIndex = c.index,
-                        text = c.text
-                    )
-                )
-
-                allEmbBytes.write(FloatPacking.floatsToBytes(emb))
-            }
-
-            store.writeChunksAndEmbeddings(
-                docId = docId,
-                chunks = localChunks,
-                embeddingsBytes = allEmbBytes.toByteArray()
-            )
+            // BM25 postings for exact terms; without them the doc is still found by vector search.
+            val lexical = runCatching {
+                LLamaAndroid.instance().buildLexicalIndex(chunks.map { it.text }, store.lexicalIndexFile(docId).absolutePath)
+            }.getOrDefault(false)
+            if (!lexical) Log.w(TAG, "Lexical index not built docId=$docId")
 
             store.writeDocMeta(
                 LocalDoc(
@@ -139,7 +120,11 @@ class IndexDocumentWorker(
 
             runCatching { deleteLocalFileIfPossible(uri) }
 
-            Log.i(TAG, "Indexed docId=$docId name=$name chunks=${chunks.size}")
+            // Doc is already searchable by exact scan; the ANN index is a best-effort speedup.
+            runCatching { ServiceLocator.ragRepository.updateAnnIndex() }
+                .onFailure { Log.w(TAG, "ANN index update failed docId=$docId", it) }
+
+            Log.i(TAG, "Indexed docId=$docId name=$name chunks=$written")
             Result.success()
         } catch (e: Exception) {
             Log.e(TAG, "IndexDocumentWorker FAILED docId=$docId uri=$uriStr name=$name", e)
@@ -150,6 +135,109 @@ class IndexDocumentWorker(
         }
     }
 
+    // Null when nothing survives normalization; empty when the text is too small to index.
+    private fun extractAndChunk(uri: Uri): List<Chunker.Chunk>? {
+        // ✅ extractor now throws if empty/low-quality
+        val extracted = DocumentTextExtractor.extractTextFromUri(
+            context = applicationContext,
+            uri = uri
+        )
+
+        var normalized = TextNormalize.normalize(extracted).trim()
+        if (normalized.isBlank()) return null
+
+        // ✅ second safety dedupe (removes repeated headers that survive normalize)
+        normalized = removeRepeatingLines(normalized)
+
+        // ✅ If still too small, fail fast to avoid garbage indexing
+        if (normalized.length < 350) return emptyList()
+
+        return Chunker.chunkText(
+            normalized,
+            targetChars = 700,   // ✅ Reduced from 900 for finer-grained retrieval
+            overlapChars = 300   // ✅ Increased from 250 for better context continuity
+        )
+    }
+
+    /**
+     * Embed → quantize → append pipeline. Groups of chunks go through a bounded channel into the
+     * native embedder (one batched call per group) while the previous group is encoded and
+     * appended to the doc's files, so memory stays at a few groups whatever the document size.
+     * A chunk over the embedder's input limit would be embedded from its head only, so it is
+     * left out. Returns the chunks written, in row order.
+     */
+    private suspend fun embedAndAppend(docId: String, chunks: List<Chunker.Chunk>, embedder: Embedder): List<Chunker.Chunk> = coroutineScope {
+        val dim = embedder.dimension()
+        val bytesPerEmb = dim * 4
+        val format = EMBED_STORAGE_FORMAT
+        val keepF32 = KEEP_F32_FOR_RESCORE && format != EmbeddingFormat.Dtype.F32
+        val normalized = embedder.normalizes()
+
+        class Embedded(val group: List<Chunker.Chunk>, val rows: ByteBuffer)
+
+        val embedded = Channel<Embedded>(capacity = PIPELINE_DEPTH)
+        // The embedder blocks its caller until the native batch is done.
+        val producer = launch(Dispatchers.IO) {
+            var failure: Throwable? = null
+            try {
+                val maxTokens = embedder.maxInputTokens()
+                for (all in chunks.chunked(EMBED_GROUP_SIZE)) {
+                    // Counted per group, right before embedding it: the native tokenizer cache
+                    // holds a group's tokens, so the embed call doesn't tokenize them again.
+                    val counts = if (maxTokens > 0) embedder.tokenCounts(all.map { it.text }) else null
+                    val group = if (counts == null) all else all.filterIndexed { i, _ -> counts[i] <= maxTokens }
+                    if (group.isEmpty()) continue
+                    // float32 LE rows filled in place, no per-chunk arrays.
+                    val rows = ByteBuffer.allocateDirect(group.size * bytesPerEmb).order(ByteOrder.LITTLE_ENDIAN)
+                    embedder.embedChunksInto(group, rows, 0)
+                    embedded.send(Embedded(group, rows))
+                }
+            } catch (t: Throwable) {
+                failure = t
+                throw t
+            } finally {
+                // A failed stage fails the consumer too, so a partial doc is never committed.
+                embedded.close(failure)
+            }
+        }
+
+        // Encode buffer reused across groups (the last group may use less of it).
+        val packed = ByteBuffer.allocateDirect(EmbeddingFormat.fileBytes(EMBED_GROUP_SIZE, dim, format))
+            .order(ByteOrder.LITTLE_ENDIAN)
+
+        val written = ArrayList<Chunker.Chunk>(chunks.size)
+        ServiceLocator.localRagStore.openChunkWriter(docId, fullPrecision = keepF32).use { writer ->
+            for (e in embedded) {
+                packed.clear()
+                LLamaAndroid.instance().quantizeEmbeddings(
+                    src = e.rows,
+                    count = e.group.size,
+                    dim = dim,
+                    dtype = format.code,
+                    normalized = normalized,
+                    dst = packed
+                )
+                packed.limit(EmbeddingFormat.fileBytes(e.group.size, dim, format))
+
+                writer.append(
+                    chunks = e.group.map { c ->
+                        LocalChunk(
+                            chunkId = UUID.randomUUID().toString(),
+                            chunkIndex = c.index,
+                            text = c.text
+                        )
+                    },
+                    embeddings = packed,
+                    rows = e.rows.takeIf { keepF32 }
+                )
+                written.addAll(e.group)
+            }
+            producer.join()
+            if (written.isNotEmpty()) writer.commit()
+            written
+        }
+    }
+
     private fun failDoc(
         docId: String,
         uriStr: String,
@@ -210,29 +298,22 @@ class IndexDocumentWorker(
         return if (out.length >= max(120, text.length / 4)) out else text
     }
 
-    // Helper: build big ByteArray without reallocating too much
-    private class ByteArrayOutput {
-        private var buf = ByteArray(1024 * 16)
-        private var size = 0
-
-        fun write(bytes: ByteArray) {
-            ensureCapacity(size + bytes.size)
-            System.arraycopy(bytes, 0, buf, size, bytes.size)
-            size += bytes.size
-        }
+    companion object {
+        private const val TAG = "IndexDocumentWorker"
 
-        fun toByteArray(): ByteArray = buf.copyOf(size)
+        // Chunks handed to the embedder per call.
+        private const val EMBED_GROUP_SIZE = 32
+        // Embedded groups waiting to be encoded and written.
+        private const val PIPELINE_DEPTH = 2
 
-        private fun ensureCapacity(needed: Int) {
-            if (needed <= buf.size) return
-            var n = buf.size
-            while (n < needed) n *= 2
-            buf = buf.copyOf(n)
-        }
-    }
+        // Documents extracted at the same time across workers (embedding is serialized natively).
+        private val extractPermits = Semaphore(2)
 
-    companion object {
-        private const val TAG = "IndexDocumentWorker"
+        // fp16 halves index size and scan bandwidth with no measurable ranking change for
+        // unit-norm vectors; I8 quarters it. Keeping a float32 copy restores exact top-k
+        // ordering at the cost of the savings on disk.
+        private val EMBED_STORAGE_FORMAT = EmbeddingFormat.Dtype.F16
+        private const val KEEP_F32_FOR_RESCORE = false
 
         const val KEY_DOC_ID = "doc_id"
         const val KEY_URI = "uri"
@@ -1,5 +1,6 @@
 package com.nervesparks.iris.ui
 
+import android.content.Intent
 import android.os.Build
 import android.widget.Toast
 import androidx.compose.foundation.layout.*
@@ -16,7 +17,9 @@ import androidx.compose.ui.platform.LocalContext
 import androidx.compose.ui.text.font.FontWeight
 import androidx.compose.ui.unit.dp
 import com.nervesparks.iris.MainViewModel
+import com.nervesparks.iris.rag.ragBenchRows
 import kotlinx.coroutines.launch
+import org.json.JSONObject
 
 data class BenchmarkState(
     val isRunning: Boolean = false,
@@ -142,6 +145,113 @@ fun BenchMarkScreen(viewModel: MainViewModel) {
             modifier = Modifier.padding(16.dp)
         )
 
+        // Parameter sweep from the native harness (pp/tg/TTFT/latency, memory, thermals)
+        androidx.compose.material3.Button(
+            modifier = Modifier.padding(vertical = 8.dp),
+            colors = ButtonDefaults.buttonColors(
+                containerColor = Color(0xFF2563EB).copy(alpha = 1.0f),
+                contentColor = Color.White
+            ),
+            shape = RoundedCornerShape(8.dp),
+            onClick = {
+                when {
+                    viewModel.isBenchSuiteRunning -> viewModel.cancelBenchSuite()
+                    viewModel.loadedModelName.value == "" ->
+                        Toast.makeText(context, "Load A Model First", Toast.LENGTH_SHORT).show()
+                    else -> viewModel.runBenchSuite()
+                }
+            },
+            enabled = !state.isRunning
+        ) {
+            Text(if (viewModel.isBenchSuiteRunning) "Stop Suite" else "Run Benchmark Suite", color = Color.White)
+        }
+
+        viewModel.benchReport?.let { report ->
+            val rows = remember(report) { parseBenchRows(report) }
+            Card(
+                modifier = Modifier
+                    .fillMaxWidth()
+                    .padding(vertical = 16.dp),
+                elevation = 4.dp
+            ) {
+                Column(modifier = Modifier.padding(16.dp)) {
+                    Text(
+                        "Benchmark Suite",
+                        style = MaterialTheme.typography.h6,
+                        modifier = Modifier.padding(bottom = 8.dp)
+                    )
+                    rows.forEach { row ->
+                        Text(row, style = MaterialTheme.typography.body2, modifier = Modifier.padding(vertical = 2.dp))
+                    }
+                    TextButton(onClick = {
+                        val file = viewModel.exportBenchReport(context)
+                        if (file != null) {
+                            Toast.makeText(context, "Saved ${file.name}", Toast.LENGTH_SHORT).show()
+                            val send = Intent(Intent.ACTION_SEND).apply {
+                                type = "application/json"
+                                putExtra(Intent.EXTRA_SUBJECT, file.name)
+                                putExtra(Intent.EXTRA_TEXT, report)
+                            }
+                            context.startActivity(Intent.createChooser(send, "Export benchmark"))
+                        }
+                    }) {
+                        Text("Export JSON")
+                    }
+                }
+            }
+        }
+
+        // RAG path broken down by stage: embedding, vector scan, retrieve, context prefill
+        androidx.compose.material3.Button(
+            modifier = Modifier.padding(vertical = 8.dp),
+            colors = ButtonDefaults.buttonColors(
+                containerColor = Color(0xFF2563EB).copy(alpha = 1.0f),
+                contentColor = Color.White
+            ),
+            shape = RoundedCornerShape(8.dp),
+            onClick = { viewModel.runRagBench() },
+            enabled = !state.isRunning && !viewModel.isRagBenchRunning && !viewModel.isBenchSuiteRunning
+        ) {
+            Text(if (viewModel.isRagBenchRunning) "Benchmarking RAG..." else "Run RAG Benchmark", color = Color.White)
+        }
+
+        viewModel.ragBenchReport?.let { report ->
+            val rows = remember(report) {
+                runCatching { ragBenchRows(JSONObject(report)) }.getOrElse { listOf("Unreadable report: ${it.message}") }
+            }
+            Card(
+                modifier = Modifier
+                    .fillMaxWidth()
+                    .padding(vertical = 16.dp),
+                elevation = 4.dp
+            ) {
+                Column(modifier = Modifier.padding(16.dp)) {
+                    Text(
+                        "RAG Benchmark",
+                        style = MaterialTheme.typography.h6,
+                        modifier = Modifier.padding(bottom = 8.dp)
+                    )
+                    rows.forEach { row ->
+                        Text(row, style = MaterialTheme.typography.body2, modifier = Modifier.padding(vertical = 2.dp))
+                    }
+                    TextButton(onClick = {
+                        val file = viewModel.exportBenchReport(context, rag = true)
+                        if (file != null) {
+                            Toast.makeText(context, "Saved ${file.name}", Toast.LENGTH_SHORT).show()
+                            val send = Intent(Intent.ACTION_SEND).apply {
+                                type = "application/json"
+                                putExtra(Intent.EXTRA_SUBJECT, file.name)
+                                putExtra(Intent.EXTRA_TEXT, report)
+                            }
+                            context.startActivity(Intent.createChooser(send, "Export benchmark"))
+                        }
+                    }) {
+                        Text("Export JSON")
+                    }
+                }
+            }
+        }
+
         // Error Display
         state.error?.let { error ->
             Text(
@@ -205,6 +315,25 @@ fun BenchMarkScreen(viewModel: MainViewModel) {
 
 
 
+// One line per test point: shape, then throughput, TTFT, step latency and the end temperature.
+private fun parseBenchRows(report: String): List<String> = runCatching {
+    val results = JSONObject(report).getJSONArray("results")
+    (0 until results.length()).map { i ->
+        val r = results.getJSONObject(i)
+        val shape = "pp${r.optInt("pp")} @${r.optInt("depth")} b${r.optInt("n_batch")} " +
+                "t${r.optInt("decode_threads")}/${r.optInt("prefill_threads")} kv${r.optInt("kv")} pl${r.optInt("pl")}"
+        if (r.has("error")) {
+            "$shape: ${r.getString("error")}"
+        } else {
+            val temp = r.optJSONObject("after")?.optDouble("temp_c") ?: 0.0
+            "$shape: pp %.1f t/s, tg %.1f t/s, ttft %.0f ms, p50/p99 %.1f/%.1f ms, %.0f°C".format(
+                r.optDouble("pp_tps"), r.optDouble("tg_tps"), r.optDouble("ttft_ms"),
+                r.optDouble("tg_step_ms_p50"), r.optDouble("tg_step_ms_p99"), temp
+            )
+        }
+    }
+}.getOrElse { listOf("Unreadable report: ${it.message}") }
+
 private fun buildDeviceInfo(viewModel: MainViewModel): String {
     return buildString {
         append("Device: ${Build.MODEL}\n")
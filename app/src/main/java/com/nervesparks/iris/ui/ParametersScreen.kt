@@ -1,6 +1,7 @@
 package com.nervesparks.iris.ui
 
 import android.widget.Toast
+import androidx.compose.foundation.clickable
 import androidx.compose.foundation.layout.Arrangement
 import androidx.compose.foundation.layout.Column
 import androidx.compose.foundation.layout.Row
@@ -30,12 +31,20 @@ import androidx.compose.ui.text.font.FontWeight
 import androidx.compose.ui.unit.dp
 import com.nervesparks.iris.MainViewModel
 import com.nervesparks.iris.ui.components.LoadingModal
+import java.io.File
 
 
 @Composable
-fun ParametersScreen(viewModel: MainViewModel) {
+fun ParametersScreen(viewModel: MainViewModel, extFileDir: File?) {
     val context = LocalContext.current
 
+    // Downloaded chat models other than the loaded one can serve as the draft model.
+    val embeddingNames = viewModel.embeddingModels.mapNotNull { it["name"]?.toString() }.toSet()
+    val draftCandidates = extFileDir?.listFiles()
+        ?.filter { it.isFile && it.name.endsWith(".gguf") && it.name !in embeddingNames && it.name != viewModel.loadedModelName.value }
+        ?.sortedBy { it.name }
+        .orEmpty()
+
     // Main container with fillMaxSize
     Column(
         modifier = Modifier
@@ -172,6 +181,22 @@ fun ParametersScreen(viewModel: MainViewModel) {
                     }
                 }
 
+                item { SectionDivider() }
+
+                item {
+                    SettingSection(
+                        title = "Draft Model",
+                        description = "Small model with the same tokenizer for speculative decoding"
+                    ) {
+                        DraftOption("None", viewModel.draftModelPath == null) { viewModel.selectDraftModel(null) }
+                        draftCandidates.forEach { f ->
+                            DraftOption(f.name, viewModel.draftModelPath == f.absolutePath) {
+                                viewModel.selectDraftModel(f.absolutePath)
+                            }
+                        }
+                    }
+                }
+
 
             }
         }
@@ -266,6 +291,18 @@ private fun SettingSection(
     Spacer(modifier = Modifier.height(16.dp))
 }
 
+@Composable
+private fun DraftOption(label: String, selected: Boolean, onClick: () -> Unit) {
+    Text(
+        text = if (selected) "● $label" else "○ $label",
+        color = if (selected) Color(0xFF2563EB) else Color.White,
+        modifier = Modifier
+            .fillMaxWidth()
+            .clickable(onClick = onClick)
+            .padding(vertical = 6.dp)
+    )
+}
+
 @Composable
 private fun SectionDivider() {
     Divider(
@@ -57,12 +57,22 @@ fun LoadingModal(viewModel: MainViewModel){
                     fontWeight = FontWeight.Bold,
                     color = Color.White
                 )
-                LinearProgressIndicator(
-                    modifier = Modifier
-                        .fillMaxWidth()
-                        .padding(top = 10.dp),
-                    color = Color(0xFF17246a)
-                )
+                if (viewModel.loadProgress > 0f) {
+                    LinearProgressIndicator(
+                        progress = { viewModel.loadProgress },
+                        modifier = Modifier
+                            .fillMaxWidth()
+                            .padding(top = 10.dp),
+                        color = Color(0xFF17246a)
+                    )
+                } else {
+                    LinearProgressIndicator(
+                        modifier = Modifier
+                            .fillMaxWidth()
+                            .padding(top = 10.dp),
+                        color = Color(0xFF17246a)
+                    )
+                }
             }
         }
     }
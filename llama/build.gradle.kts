@@ -20,6 +20,8 @@ android {
             cmake {
                 arguments += "-DLLAMA_BUILD_COMMON=ON"
                 arguments += "-DCMAKE_BUILD_TYPE=Release"
+                // GPU variant for layer offload: ./gradlew assembleRelease -PllamaGpu=vulkan (or opencl)
+                arguments += "-DLLAMA_ANDROID_GPU=${project.findProperty("llamaGpu") ?: "none"}"
                 cppFlags += listOf()
                 arguments += listOf()
 
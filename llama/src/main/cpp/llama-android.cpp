@@ -13,20 +13,44 @@
 // but it removes the common ones you were hitting (n_batch/prompt overflow).
 
 #include <android/log.h>
+#include <android/trace.h>
 #include <jni.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
 #include <iomanip>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <random>
+#include <sched.h>
 #include <sstream>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <type_traits>
 #include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
 #include "llama.h"
 #include "common.h"
+#include "json-schema-to-grammar.h"
+#include "ggml-cpu.h"
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #define JSON_ASSERT GGML_ASSERT
 #include "json.hpp"
@@ -50,99 +74,279 @@ static T json_value(const json & body, const std::string & key, const T & defaul
 #define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
 
 /**
- * SPEED DEFAULTS (Chat)
+ * SPEED DEFAULTS (Chat), used when new_context() gets 0 for a parameter.
  * Keep n_ctx modest for mobile. n_batch modest too.
  * IMPORTANT: We chunk decode, so prompts > n_batch do NOT crash.
  */
 static const int CHAT_N_CTX_DEFAULT   = 1024;
 static const int CHAT_N_BATCH_DEFAULT = 512;
 
-static std::string cached_token_chars;
+// KV cache element types accepted by new_context() (Kotlin ContextConfig.KV_*).
+enum kv_cache_type : jint { KV_F16 = 0, KV_Q8_0 = 1, KV_Q4_0 = 2 };
 
-// Track heap allocations for llama_batch so free_batch() can reliably free all buffers.
-static std::mutex g_batch_mu;
-static std::unordered_map<llama_batch *, int> g_batch_n_tokens;
-static std::unordered_map<llama_batch *, int> g_batch_n_seq_max;
+static ggml_type kv_ggml_type(jint kv_type) {
+    switch (kv_type) {
+        case KV_Q8_0: return GGML_TYPE_Q8_0;
+        case KV_Q4_0: return GGML_TYPE_Q4_0;
+        default:      return GGML_TYPE_F16;
+    }
+}
 
-// Track context limits so we can safely chunk decode.
-static std::mutex g_ctx_mu;
-static std::unordered_map<llama_context *, int> g_ctx_n_batch;
-static std::unordered_map<llama_context *, int> g_ctx_n_ctx;
+// Bytes per cached element (quantized types: block bytes / 32 elements).
+static double kv_type_bytes(ggml_type t) {
+    switch (t) {
+        case GGML_TYPE_Q8_0: return 34.0 / 32.0;
+        case GGML_TYPE_Q4_0: return 18.0 / 32.0;
+        default:             return 2.0;
+    }
+}
+
+/**
+ * Embedding contexts can pack several texts into one llama_batch (one seq_id each).
+ * Kotlin allocates the embedding batch with the same n_seq_max.
+ */
+static const int EMB_N_SEQ_MAX = 16;
+
+/**
+ * What new_batch() allocates: the llama_batch plus the sizes free_batch() and the chunked
+ * decoders need. The batch is the first member, so the llama_batch * handed to Kotlin is
+ * also the holder and its capacity is read without a lock or map lookup.
+ *
+ * Every array the batch points at lives in one aligned arena: token (or embd), pos,
+ * n_seq_id, the seq_id pointer table, the seq_id storage it points into (n_seq_max ids
+ * per token, back to back), then logits.
+ */
+struct batch_holder {
+    llama_batch batch{0, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr};
+    int n_tokens  = 0;
+    int n_seq_max = 0;
+    int embd      = 0;
+    void * arena  = nullptr;
+    size_t arena_bytes = 0;
+};
+static_assert(std::is_standard_layout<batch_holder>::value, "batch_holder must be standard-layout");
+
+static batch_holder * holder_of(llama_batch * batch) {
+    return reinterpret_cast<batch_holder *>(batch);
+}
 
-static bool is_valid_utf8(const char * string) {
-    if (!string) return true;
+// Each array starts on a cache line.
+static constexpr size_t BATCH_ARENA_ALIGN = 64;
 
-    const unsigned char * bytes = (const unsigned char *) string;
-    int num = 0;
+// Batches kept by free_batch() for the next new_batch() of the same shape; the large
+// embd batches are not worth holding on to.
+static constexpr size_t BATCH_POOL_MAX       = 4;
+static constexpr size_t BATCH_POOL_MAX_BYTES = 4u << 20;
 
-    while (*bytes != 0x00) {
-        if      ((*bytes & 0x80) == 0x00) num = 1;
-        else if ((*bytes & 0xE0) == 0xC0) num = 2;
-        else if ((*bytes & 0xF0) == 0xE0) num = 3;
-        else if ((*bytes & 0xF8) == 0xF0) num = 4;
-        else return false;
+static std::mutex g_batch_pool_mu;
+static std::vector<batch_holder *> g_batch_pool;
 
-        bytes += 1;
-        for (int i = 1; i < num; ++i) {
-            if ((*bytes & 0xC0) != 0x80) return false;
-            bytes += 1;
-        }
-    }
-    return true;
+static size_t arena_round(size_t bytes) {
+    return (bytes + BATCH_ARENA_ALIGN - 1) & ~(BATCH_ARENA_ALIGN - 1);
 }
 
-static std::string mapListToJSONString(JNIEnv *env, jobjectArray allMessages) {
-    json jsonArray = json::array();
+// One posix_memalign for all of the batch arrays. nullptr when out of memory.
+static batch_holder * batch_alloc(int n_tokens, int embd, int n_seq_max) {
+    const size_t n = (size_t) n_tokens;
 
-    jclass mapClass = env->FindClass("java/util/Map");
-    if (!mapClass) return jsonArray.dump();
+    const size_t off_input  = 0;
+    const size_t off_pos    = off_input  + arena_round(embd ? sizeof(float) * n * (size_t) embd : sizeof(llama_token) * n);
+    const size_t off_nseq   = off_pos    + arena_round(sizeof(llama_pos) * n);
+    const size_t off_seqtab = off_nseq   + arena_round(sizeof(int32_t) * n);
+    const size_t off_seqids = off_seqtab + arena_round(sizeof(llama_seq_id *) * n);
+    const size_t off_logits = off_seqids + arena_round(sizeof(llama_seq_id) * n * (size_t) n_seq_max);
+    const size_t total      = off_logits + arena_round(sizeof(int8_t) * n);
 
-    jmethodID getMethod = env->GetMethodID(mapClass, "get", "(Ljava/lang/Object;)Ljava/lang/Object;");
-    if (!getMethod) {
-        env->DeleteLocalRef(mapClass);
-        return jsonArray.dump();
+    void * arena = nullptr;
+    if (posix_memalign(&arena, BATCH_ARENA_ALIGN, total) != 0) return nullptr;
+
+    auto * holder = new (std::nothrow) batch_holder();
+    if (!holder) {
+        free(arena);
+        return nullptr;
     }
 
-    jstring roleKey = env->NewStringUTF("role");
-    jstring contentKey = env->NewStringUTF("content");
+    auto * base = static_cast<char *>(arena);
+    llama_batch & b = holder->batch;
+    if (embd) {
+        b.embd  = reinterpret_cast<float *>(base + off_input);
+    } else {
+        b.token = reinterpret_cast<llama_token *>(base + off_input);
+    }
+    b.pos      = reinterpret_cast<llama_pos *>(base + off_pos);
+    b.n_seq_id = reinterpret_cast<int32_t *>(base + off_nseq);
+    b.seq_id   = reinterpret_cast<llama_seq_id **>(base + off_seqtab);
+    b.logits   = reinterpret_cast<int8_t *>(base + off_logits);
+
+    auto * ids = reinterpret_cast<llama_seq_id *>(base + off_seqids);
+    for (size_t i = 0; i < n; ++i) b.seq_id[i] = ids + i * (size_t) n_seq_max;
+
+    holder->n_tokens    = n_tokens;
+    holder->n_seq_max   = n_seq_max;
+    holder->embd        = embd;
+    holder->arena       = arena;
+    holder->arena_bytes = total;
+    return holder;
+}
 
-    jsize arrayLength = env->GetArrayLength(allMessages);
-    for (jsize i = 0; i < arrayLength; ++i) {
-        jobject messageObj = env->GetObjectArrayElement(allMessages, i);
-        if (!messageObj) continue;
+static void batch_destroy(batch_holder * holder) {
+    free(holder->arena);
+    delete holder;
+}
 
-        if (!env->IsInstanceOf(messageObj, mapClass)) {
-            env->DeleteLocalRef(messageObj);
-            continue;
+// A pooled batch of exactly this shape, else a fresh one.
+static batch_holder * batch_acquire(int n_tokens, int embd, int n_seq_max) {
+    {
+        std::lock_guard<std::mutex> lk(g_batch_pool_mu);
+        for (auto it = g_batch_pool.begin(); it != g_batch_pool.end(); ++it) {
+            batch_holder * h = *it;
+            if (h->n_tokens == n_tokens && h->embd == embd && h->n_seq_max == n_seq_max) {
+                g_batch_pool.erase(it);
+                h->batch.n_tokens = 0;
+                return h;
+            }
         }
+    }
+    return batch_alloc(n_tokens, embd, n_seq_max);
+}
 
-        json jsonMsg;
-
-        jobject roleObj = env->CallObjectMethod(messageObj, getMethod, roleKey);
-        if (roleObj) {
-            const char* roleStr = env->GetStringUTFChars((jstring) roleObj, nullptr);
-            jsonMsg["role"] = roleStr ? roleStr : "";
-            if (roleStr) env->ReleaseStringUTFChars((jstring) roleObj, roleStr);
-            env->DeleteLocalRef(roleObj);
+// Back to the pool while it has room (oldest entry evicted otherwise).
+static void batch_release(batch_holder * holder) {
+    if (holder->arena_bytes > BATCH_POOL_MAX_BYTES) {
+        batch_destroy(holder);
+        return;
+    }
+    batch_holder * evicted = nullptr;
+    {
+        std::lock_guard<std::mutex> lk(g_batch_pool_mu);
+        if (g_batch_pool.size() >= BATCH_POOL_MAX) {
+            evicted = g_batch_pool.front();
+            g_batch_pool.erase(g_batch_pool.begin());
         }
+        g_batch_pool.push_back(holder);
+    }
+    if (evicted) batch_destroy(evicted);
+}
+
+// Guards the per-context state map (g_ctx_state) and the shared thread pools.
+static std::mutex g_ctx_mu;
+
+/**
+ * Prompt-prefix reuse (per context).
+ * `tokens` mirrors what is currently in the KV cache for seq 0 (prompt + generated),
+ * so the next completion_init() only has to decode the part that changed.
+ */
+struct prompt_cache_state {
+    bool enabled  = false;
+    int  n_reused = 0;
+    int  n_pinned = 0; // leading prompt tokens (system/template) kept by trimming and context shifts
+    std::vector<llama_token> tokens;
+
+    // Last prompt text and its (untrimmed) tokenization, so a grown chat history only
+    // tokenizes what was appended.
+    std::string              prompt_text;
+    std::vector<llama_token> prompt_text_tokens;
+};
 
-        jobject contentObj = env->CallObjectMethod(messageObj, getMethod, contentKey);
-        if (contentObj) {
-            const char* contentStr = env->GetStringUTFChars((jstring) contentObj, nullptr);
-            jsonMsg["content"] = contentStr ? contentStr : "";
-            if (contentStr) env->ReleaseStringUTFChars((jstring) contentObj, contentStr);
-            env->DeleteLocalRef(contentObj);
+/**
+ * Incremental UTF-8 splitter for per-token text. append() adds a piece and only looks at
+ * the new bytes; take() hands out the complete characters so far and keeps just the
+ * incomplete tail (at most 3 bytes). A stray continuation or invalid lead byte counts as
+ * a character of its own, so malformed output is passed on rather than held forever.
+ */
+struct utf8_stream {
+    std::string pending;
+    size_t      complete = 0; // bytes of pending that end on a character boundary
+    int         need     = 0; // continuation bytes still expected after the last lead byte
+
+    void append(const std::string & piece) {
+        for (unsigned char c : piece) {
+            pending.push_back((char) c);
+            if (need > 0 && (c & 0xC0) == 0x80) {
+                if (--need == 0) complete = pending.size();
+                continue;
+            }
+            // A lead byte (or a broken sequence restarting here): the broken bytes before it
+            // are passed on as they are, so a run of lead bytes can't stall the stream.
+            if (need > 0) complete = pending.size() - 1;
+            if      ((c & 0xE0) == 0xC0) need = 1;
+            else if ((c & 0xF0) == 0xE0) need = 2;
+            else if ((c & 0xF8) == 0xF0) need = 3;
+            else                         need = 0;
+            if (need == 0) complete = pending.size();
         }
+    }
+
+    bool ready() const { return complete > 0; }
+
+    std::string take() {
+        std::string out = pending.substr(0, complete);
+        pending.erase(0, complete);
+        complete = 0;
+        return out;
+    }
 
-        if (!jsonMsg.empty()) jsonArray.push_back(jsonMsg);
-        env->DeleteLocalRef(messageObj);
+    void clear() {
+        pending.clear();
+        complete = 0;
+        need = 0;
+    }
+};
+
+// NewStringUTF() expects modified UTF-8 and rejects 4-byte sequences (emoji); go through UTF-16.
+static jstring utf8_to_jstring(JNIEnv * env, const std::string & s) {
+    std::vector<jchar> u16;
+    u16.reserve(s.size());
+    for (size_t i = 0; i < s.size();) {
+        const unsigned char c = (unsigned char) s[i];
+        uint32_t cp = 0xFFFD;
+        size_t len = 1;
+        if      (c < 0x80)           { cp = c; }
+        else if ((c & 0xE0) == 0xC0) { len = 2; cp = c & 0x1F; }
+        else if ((c & 0xF0) == 0xE0) { len = 3; cp = c & 0x0F; }
+        else if ((c & 0xF8) == 0xF0) { len = 4; cp = c & 0x07; }
+        if (len > 1) {
+            if (i + len > s.size()) { cp = 0xFFFD; len = s.size() - i; }
+            for (size_t k = 1; k < len && cp != 0xFFFD; ++k) {
+                const unsigned char cc = (unsigned char) s[i + k];
+                if ((cc & 0xC0) != 0x80) { cp = 0xFFFD; len = k; break; }
+                cp = (cp << 6) | (cc & 0x3F);
+            }
+        }
+        if (cp >= 0x10000 && cp != 0xFFFD) {
+            cp -= 0x10000;
+            u16.push_back((jchar) (0xD800 + (cp >> 10)));
+            u16.push_back((jchar) (0xDC00 + (cp & 0x3FF)));
+        } else {
+            u16.push_back((jchar) cp);
+        }
+        i += len;
     }
+    return env->NewString(u16.data(), (jsize) u16.size());
+}
 
-    env->DeleteLocalRef(roleKey);
-    env->DeleteLocalRef(contentKey);
-    env->DeleteLocalRef(mapClass);
+static std::string jstring_to_string(JNIEnv * env, jstring js) {
+    if (!js) return {};
+    const char * c = env->GetStringUTFChars(js, 0);
+    std::string out = c ? c : "";
+    if (c) env->ReleaseStringUTFChars(js, c);
+    return out;
+}
 
-    return jsonArray.dump();
+static std::vector<std::string> string_array_to_vector(JNIEnv * env, jobjectArray arr) {
+    std::vector<std::string> out;
+    if (!arr) return out;
+
+    const jsize n = env->GetArrayLength(arr);
+    out.reserve(n);
+    for (jsize i = 0; i < n; ++i) {
+        auto jstr = (jstring) env->GetObjectArrayElement(arr, i);
+        const char * str = jstr ? env->GetStringUTFChars(jstr, 0) : nullptr;
+        out.emplace_back(str ? str : "");
+        if (str) env->ReleaseStringUTFChars(jstr, str);
+        if (jstr) env->DeleteLocalRef(jstr);
+    }
+    return out;
 }
 
 /**
@@ -159,41 +363,125 @@ static void log_callback(ggml_log_level level, const char * text, void * data) {
     else                                    __android_log_print(ANDROID_LOG_DEFAULT, TAG, "%s", text);
 }
 
+// Batches always come from new_batch().
 static int get_batch_capacity(llama_batch * batch) {
-    if (!batch) return 0;
-    std::lock_guard<std::mutex> lk(g_batch_mu);
-    auto it = g_batch_n_tokens.find(batch);
-    return it != g_batch_n_tokens.end() ? it->second : 0;
+    return batch ? holder_of(batch)->n_tokens : 0;
 }
 
-static void get_ctx_limits(llama_context * ctx, int & out_n_ctx, int & out_n_batch) {
-    out_n_ctx = ctx ? llama_n_ctx(ctx) : 0;
-    out_n_batch = 0;
+static int get_batch_seq_capacity(llama_batch * batch) {
+    return batch ? holder_of(batch)->n_seq_max : 0;
+}
 
-    if (ctx) {
-        std::lock_guard<std::mutex> lk(g_ctx_mu);
-        auto itB = g_ctx_n_batch.find(ctx);
-        auto itC = g_ctx_n_ctx.find(ctx);
-        if (itC != g_ctx_n_ctx.end()) out_n_ctx = itC->second;
-        if (itB != g_ctx_n_batch.end()) out_n_batch = itB->second;
-    }
+static void get_ctx_limits(llama_context * ctx, int & out_n_ctx, int & out_n_batch) {
+    out_n_ctx   = ctx ? (int) llama_n_ctx(ctx)   : 0;
+    out_n_batch = ctx ? (int) llama_n_batch(ctx) : 0;
 
     if (out_n_batch <= 0) out_n_batch = CHAT_N_BATCH_DEFAULT;
     if (out_n_ctx   <= 0) out_n_ctx   = CHAT_N_CTX_DEFAULT;
 }
 
+// ---------------- Hot-path metrics ----------------
+
+/**
+ * Per-context counters and latency histograms for completion_init / generation, readable
+ * from any thread via get_metrics() while a completion runs. Recording is a few relaxed
+ * atomic adds: no locks and no allocation per sample. Buckets are log2 microseconds
+ * (bucket i holds [2^(i-1), 2^i) us; the last one everything above ~4 s).
+ */
+static constexpr int METRIC_BUCKETS = 24;
+
+struct metric_hist {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum_us{0};
+    std::atomic<uint64_t> max_us{0};
+    std::atomic<uint32_t> buckets[METRIC_BUCKETS] = {};
+
+    void add(int64_t us) {
+        const uint64_t v = (uint64_t) std::max<int64_t>(0, us);
+        const int b = std::min(METRIC_BUCKETS - 1, v == 0 ? 0 : 64 - __builtin_clzll(v));
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add(v, std::memory_order_relaxed);
+        buckets[b].fetch_add(1, std::memory_order_relaxed);
+        uint64_t m = max_us.load(std::memory_order_relaxed);
+        while (v > m && !max_us.compare_exchange_weak(m, v, std::memory_order_relaxed)) {}
+    }
+
+    void reset() {
+        count.store(0, std::memory_order_relaxed);
+        sum_us.store(0, std::memory_order_relaxed);
+        max_us.store(0, std::memory_order_relaxed);
+        for (auto & b : buckets) b.store(0, std::memory_order_relaxed);
+    }
+};
+
+// Spans, in get_metrics() order. SAMPLE includes draft + verify when speculative.
+enum metric_span { MS_TOKENIZE, MS_PREFILL_CHUNK, MS_SAMPLE, MS_DECODE, MS_COUNT };
+static const char * const METRIC_SPAN_NAMES[MS_COUNT] = { "tokenize", "prefill_chunk", "sample", "decode" };
+
+struct ctx_metrics {
+    metric_hist span[MS_COUNT];
+    std::atomic<uint64_t> prompts{0};
+    std::atomic<uint64_t> tokens_reused{0};    // prompt tokens kept from the KV cache
+    std::atomic<uint64_t> tokens_prefilled{0}; // prompt tokens decoded
+    std::atomic<uint64_t> tokens_generated{0};
+    std::atomic<uint64_t> utf8_stalls{0};      // tokens whose text was held back as an incomplete character
+    std::atomic<uint64_t> context_shifts{0};
+    std::atomic<int32_t>  kv_used{0};
+    std::atomic<int32_t>  kv_peak{0};
+
+    void set_kv(llama_context * ctx) {
+        const int32_t used = llama_get_kv_cache_used_cells(ctx);
+        kv_used.store(used, std::memory_order_relaxed);
+        int32_t p = kv_peak.load(std::memory_order_relaxed);
+        while (used > p && !kv_peak.compare_exchange_weak(p, used, std::memory_order_relaxed)) {}
+    }
+
+    // Zeroed in place: the generation loop may hold a pointer to it.
+    void reset() {
+        for (auto & h : span) h.reset();
+        for (auto * c : { &prompts, &tokens_reused, &tokens_prefilled, &tokens_generated, &utf8_stalls, &context_shifts }) {
+            c->store(0, std::memory_order_relaxed);
+        }
+        kv_peak.store(kv_used.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+};
+
+/**
+ * Times one span into `m` (if any) and, while a system trace is being captured, brackets it
+ * with an ATrace section of the same name so it lines up with Perfetto captures.
+ */
+struct metric_timer {
+    ctx_metrics * m;
+    metric_span   span;
+    int64_t       t0;
+    bool          traced;
+
+    metric_timer(ctx_metrics * m, metric_span span)
+            : m(m), span(span), t0(ggml_time_us()), traced(m && ATrace_isEnabled()) {
+        if (traced) ATrace_beginSection(METRIC_SPAN_NAMES[span]);
+    }
+    ~metric_timer() {
+        if (traced) ATrace_endSection();
+        if (m) m->span[span].add(ggml_time_us() - t0);
+    }
+};
+
 /**
  * Chunked prompt evaluation to avoid n_batch asserts.
  * - Adds tokens with positions [pos0..pos0+len-1]
  * - Calls llama_decode per chunk
  * - logits only on final token of final chunk when want_logits=true
+ * - each chunk is timed into `m` when given (chat prefill)
+ * - tokens go to sequence `seq_id` (0 unless generating several sequences, see seq_start)
  */
 static bool decode_tokens_chunked(
         llama_context * ctx,
         llama_batch   * batch,
         const std::vector<llama_token> & tokens,
         int pos0,
-        bool want_logits_last_token
+        bool want_logits_last_token,
+        ctx_metrics * m = nullptr,
+        llama_seq_id seq_id = 0
 ) {
     if (!ctx || !batch) return false;
     if (tokens.empty()) return true;
@@ -210,7 +498,7 @@ static bool decode_tokens_chunked(
 
         common_batch_clear(*batch);
         for (int i = 0; i < take; ++i) {
-            common_batch_add(*batch, tokens[done + i], pos0 + done + i, {0}, false);
+            common_batch_add(*batch, tokens[done + i], pos0 + done + i, {seq_id}, false);
         }
 
         // logits only on very last token of very last chunk (needed for sampling)
@@ -218,7 +506,11 @@ static bool decode_tokens_chunked(
             if (batch->n_tokens > 0) batch->logits[batch->n_tokens - 1] = true;
         }
 
-        const int rc = llama_decode(ctx, *batch);
+        int rc;
+        {
+            metric_timer timer(m, MS_PREFILL_CHUNK);
+            rc = llama_decode(ctx, *batch);
+        }
         if (rc != 0) {
             LOGe("llama_decode() failed rc=%d (chunk done=%d take=%d)", rc, done, take);
             return false;
@@ -230,506 +522,4145 @@ static bool decode_tokens_chunked(
     return true;
 }
 
-// ---------------- JNI exports ----------------
+// ---------------- Tokenizer cache ----------------
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_log_1to_1android(JNIEnv *, jobject) {
-    llama_log_set(log_callback, NULL);
+/**
+ * Tokenizations keyed by content (per model), so repeated segments — the system prompt, the
+ * pinned prefix, RAG chunks embedded again or counted first — skip common_tokenize().
+ * LRU, bounded by the number of cached tokens.
+ */
+struct token_cache {
+    struct entry {
+        std::string              text;
+        bool                     add_special;
+        std::vector<llama_token> tokens;
+        std::list<uint64_t>::iterator lru;
+    };
+    std::unordered_map<uint64_t, entry> entries;
+    std::list<uint64_t> lru; // most recent first
+    size_t n_tokens = 0;
+    uint64_t hits = 0, misses = 0, incremental = 0;
+};
+
+static constexpr size_t TOK_CACHE_MAX_TOKENS = 1 << 16;
+// Texts shorter than this are cheaper to tokenize again than to hash and store.
+static constexpr size_t TOK_CACHE_MIN_CHARS = 32;
+// Tokens of the previous prompt re-tokenized with the appended text (merges across the seam).
+static constexpr int TOK_INCREMENTAL_BACKOFF = 4;
+
+static std::mutex g_tok_mu;
+static std::unordered_map<const llama_model *, token_cache> g_tok_cache;
+
+static uint64_t tok_cache_key(const std::string & text, bool add_special) {
+    return std::hash<std::string>{}(text) * 2 + (add_special ? 1 : 0);
 }
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_backend_1init(JNIEnv *, jobject) {
-    llama_backend_init();
-}
+static std::vector<llama_token> tokenize_cached(llama_context * ctx, const std::string & text, bool add_special) {
+    const llama_model * model = llama_get_model(ctx);
+    if (text.size() < TOK_CACHE_MIN_CHARS) return common_tokenize(ctx, text, add_special);
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_backend_1free(JNIEnv *, jobject) {
-    llama_backend_free();
-}
+    const uint64_t key = tok_cache_key(text, add_special);
+    {
+        std::lock_guard<std::mutex> lk(g_tok_mu);
+        token_cache & tc = g_tok_cache[model];
+        auto it = tc.entries.find(key);
+        if (it != tc.entries.end() && it->second.add_special == add_special && it->second.text == text) {
+            tc.lru.splice(tc.lru.begin(), tc.lru, it->second.lru);
+            ++tc.hits;
+            return it->second.tokens;
+        }
+        ++tc.misses;
+    }
 
-extern "C"
-JNIEXPORT jstring JNICALL
-Java_android_llama_cpp_LLamaAndroid_system_1info(JNIEnv *env, jobject) {
-    return env->NewStringUTF(llama_print_system_info());
+    std::vector<llama_token> tokens = common_tokenize(ctx, text, add_special);
+    if (tokens.size() > TOK_CACHE_MAX_TOKENS / 4) return tokens;
+
+    std::lock_guard<std::mutex> lk(g_tok_mu);
+    token_cache & tc = g_tok_cache[model];
+    if (tc.entries.count(key)) return tokens; // hash collision or raced insert: keep the older one
+    tc.lru.push_front(key);
+    tc.entries.emplace(key, token_cache::entry{text, add_special, tokens, tc.lru.begin()});
+    tc.n_tokens += tokens.size();
+    while (tc.n_tokens > TOK_CACHE_MAX_TOKENS && !tc.lru.empty()) {
+        auto old = tc.entries.find(tc.lru.back());
+        tc.n_tokens -= old->second.tokens.size();
+        tc.entries.erase(old);
+        tc.lru.pop_back();
+    }
+    return tokens;
 }
 
-extern "C"
-JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_load_1model(JNIEnv *env, jobject, jstring filename) {
-    llama_model_params model_params = llama_model_default_params();
+/**
+ * Tokenizes `text` reusing the tokens of `prev_text` when `text` extends it (a chat history
+ * that grew by a turn). At least the last TOK_INCREMENTAL_BACKOFF tokens of the previous
+ * prompt are re-tokenized together with the new text, and further back until the seam falls
+ * just before an ASCII space that follows a non-space. A byte-level BPE pretokenizer never
+ * merges across such a point, and it is always a codepoint boundary, so the tail comes out as
+ * a full tokenization would produce it. BPE vocabularies only: SentencePiece pieces do not map
+ * back onto the input bytes (space prefix), so those take the full path.
+ */
+static std::vector<llama_token> tokenize_incremental(
+        llama_context * ctx, const std::string & text, bool add_special,
+        const std::string & prev_text, const std::vector<llama_token> & prev_tokens
+) {
+    const llama_model * model = llama_get_model(ctx);
+    const bool extends = !prev_tokens.empty() && prev_text.size() < text.size() &&
+                         text.compare(0, prev_text.size(), prev_text) == 0;
+    if (!extends || llama_vocab_type(model) != LLAMA_VOCAB_TYPE_BPE) return tokenize_cached(ctx, text, add_special);
+
+    // Byte offset where each kept token ends; every kept piece must match the text exactly.
+    int n_head = (int) prev_tokens.size() - TOK_INCREMENTAL_BACKOFF;
+    if (n_head <= 0) return tokenize_cached(ctx, text, add_special);
+    std::vector<size_t> ends((size_t) n_head);
+    size_t off = 0;
+    for (int i = 0; i < n_head; ++i) {
+        const std::string piece = common_token_to_piece(ctx, prev_tokens[i], false);
+        if (text.compare(off, piece.size(), piece) != 0) return tokenize_cached(ctx, text, add_special);
+        off += piece.size();
+        ends[i] = off;
+    }
 
-    const char * path_to_model = env->GetStringUTFChars(filename, 0);
-    LOGi("Loading model from %s", path_to_model ? path_to_model : "(null)");
+    // Back off to a word boundary (ends[] < prev_text.size() < text.size(), so text[e] exists).
+    auto is_seam = [&](size_t e) { return e > 0 && text[e] == ' ' && text[e - 1] != ' ' && text[e - 1] != '\n'; };
+    while (n_head > 0 && !is_seam(ends[n_head - 1])) --n_head;
+    if (n_head == 0) return tokenize_cached(ctx, text, add_special);
+    off = ends[n_head - 1];
 
-    llama_model * model = llama_load_model_from_file(path_to_model, model_params);
+    std::vector<llama_token> tokens(prev_tokens.begin(), prev_tokens.begin() + n_head);
+    const std::vector<llama_token> tail = common_tokenize(ctx, text.substr(off), false);
+    tokens.insert(tokens.end(), tail.begin(), tail.end());
+    {
+        std::lock_guard<std::mutex> lk(g_tok_mu);
+        ++g_tok_cache[model].incremental;
+    }
+    return tokens;
+}
 
-    if (path_to_model) env->ReleaseStringUTFChars(filename, path_to_model);
+/**
+ * Batched embedding: packs as many texts as fit into one llama_batch, one seq_id per text,
+ * and reads each pooled vector back with llama_get_embeddings_seq().
+ * - each text is truncated to the per-decode token budget (n_batch / batch capacity)
+ * - out must hold texts.size() * n_embd floats
+ */
+static bool embed_texts_batched(
+        llama_context * ctx,
+        llama_batch   * batch,
+        const std::vector<std::string> & texts,
+        float * out
+) {
+    if (!ctx || !batch || !out) return false;
+    if (texts.empty()) return true;
 
-    if (!model) {
-        LOGe("load_model() failed");
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "load_model() failed");
-        return 0;
-    }
+    const int n_embd = llama_n_embd(llama_get_model(ctx));
 
-    return reinterpret_cast<jlong>(model);
-}
+    int n_ctx = 0, n_batch_ctx = 0;
+    get_ctx_limits(ctx, n_ctx, n_batch_ctx);
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_free_1model(JNIEnv *, jobject, jlong model) {
-    llama_free_model(reinterpret_cast<llama_model *>(model));
-}
+    const int batch_cap = get_batch_capacity(batch);
+    const int tok_cap   = std::max(1, std::min({n_batch_ctx, n_ctx, batch_cap > 0 ? batch_cap : n_batch_ctx}));
+    const int seq_cap   = std::max(1, std::min(get_batch_seq_capacity(batch), (int)llama_n_seq_max(ctx)));
 
-extern "C"
-JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_new_1context(JNIEnv *env, jobject, jlong jmodel, jint userThreads) {
-    auto model = reinterpret_cast<llama_model *>(jmodel);
-    if (!model) {
-        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "Model cannot be null");
-        return 0;
+    std::vector<std::vector<llama_token>> toks(texts.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        toks[i] = tokenize_cached(ctx, texts[i], true);
+        if ((int)toks[i].size() > tok_cap) toks[i].resize(tok_cap);
     }
 
-    const int cores = std::max(2, (int)sysconf(_SC_NPROCESSORS_ONLN));
-    const int max_threads = std::min(8, cores);
-    const int threads = (userThreads > 0)
-                        ? std::max(2, std::min(max_threads, (int)userThreads))
-                        : std::max(2, max_threads);
+    size_t first = 0;
+    while (first < texts.size()) {
+        // pick [first, last) so the pack fits token + sequence budgets
+        size_t last = first;
+        int n_tok = 0;
+        while (last < texts.size() && (int)(last - first) < seq_cap &&
+               n_tok + (int)toks[last].size() <= tok_cap) {
+            n_tok += (int)toks[last].size();
+            ++last;
+        }
+        if (last == first) last = first + 1; // tokens already truncated to tok_cap
 
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx   = CHAT_N_CTX_DEFAULT;
-    ctx_params.n_batch = (uint32_t) std::min((int)CHAT_N_BATCH_DEFAULT, (int)ctx_params.n_ctx);
-    ctx_params.n_threads       = threads;
-    ctx_params.n_threads_batch = threads;
+        llama_kv_cache_clear(ctx);
+        common_batch_clear(*batch);
+        for (size_t t = first; t < last; ++t) {
+            const llama_seq_id sid = (llama_seq_id)(t - first);
+            const auto & tt = toks[t];
+            for (size_t j = 0; j < tt.size(); ++j) {
+                common_batch_add(*batch, tt[j], (llama_pos) j, {sid}, j + 1 == tt.size());
+            }
+        }
 
-    LOGi("new_context(): cores=%d threads=%d n_ctx=%d n_batch=%d",
-         cores, threads, (int)ctx_params.n_ctx, (int)ctx_params.n_batch);
+        if (batch->n_tokens > 0) {
+            const int rc = llama_decode(ctx, *batch);
+            if (rc != 0) {
+                LOGe("embed_texts_batched: llama_decode() failed rc=%d (texts %zu..%zu)", rc, first, last);
+                return false;
+            }
+        }
 
-    llama_context * ctx = llama_new_context_with_model(model, ctx_params);
-    if (!ctx) {
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"),
-                      "llama_new_context_with_model() returned null");
-        return 0;
-    }
+        for (size_t t = first; t < last; ++t) {
+            float * dst = out + t * (size_t)n_embd;
+            const float * emb = toks[t].empty() ? nullptr : llama_get_embeddings_seq(ctx, (llama_seq_id)(t - first));
+            if (emb) std::copy(emb, emb + n_embd, dst);
+            else     std::fill(dst, dst + n_embd, 0.0f);
+        }
 
-    {
-        std::lock_guard<std::mutex> lk(g_ctx_mu);
-        g_ctx_n_ctx[ctx]   = (int)ctx_params.n_ctx;
-        g_ctx_n_batch[ctx] = (int)ctx_params.n_batch;
+        first = last;
     }
 
-    return reinterpret_cast<jlong>(ctx);
+    llama_kv_cache_clear(ctx);
+    return true;
 }
 
-extern "C"
-JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_new_1embedding_1context(JNIEnv *env, jobject, jlong jmodel, jint userThreads, jint nCtx, jint poolingType) {
-    auto model = reinterpret_cast<llama_model *>(jmodel);
-    if (!model) {
-        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "Model cannot be null");
-        return 0;
+/**
+ * Late chunking: decodes a window of consecutive text segments as one sequence on a
+ * LLAMA_POOLING_TYPE_NONE context, then mean-pools the per-token embeddings of chunk i's
+ * segments [spans[2i], spans[2i+1]) into row i of out. Each chunk vector sees the whole window
+ * as context, and text that overlapping chunks share is decoded once instead of per chunk.
+ * - segments are tokenized one by one so every chunk maps onto an exact token range; the
+ *   model's BOS/CLS and EOS/SEP wrap the window, not each chunk
+ * Returns the number of rows written, 0 when the window does not fit one decode (or a chunk
+ * has no tokens) so the caller embeds those texts one by one, -1 when decode fails.
+ */
+static int embed_late_chunked(
+        llama_context * ctx,
+        llama_batch   * batch,
+        const std::vector<std::string> & segments,
+        const std::vector<int> & spans,
+        float * out
+) {
+    const llama_model * model = llama_get_model(ctx);
+    const int n_embd = llama_n_embd(model);
+    const size_t n_chunks = spans.size() / 2;
+
+    // The special tokens an empty text gets, split into the leading (BOS/CLS) and trailing part.
+    const std::vector<llama_token> wrap = common_tokenize(ctx, "", true);
+    const size_t n_lead = std::min(wrap.size(), (size_t) (llama_add_bos_token(model) ? 1 : 0));
+
+    std::vector<llama_token> tokens(wrap.begin(), wrap.begin() + n_lead);
+    std::vector<int> seg_first(segments.size() + 1);
+    for (size_t s = 0; s < segments.size(); ++s) {
+        seg_first[s] = (int) tokens.size();
+        const std::vector<llama_token> t = tokenize_cached(ctx, segments[s], false);
+        tokens.insert(tokens.end(), t.begin(), t.end());
     }
+    seg_first[segments.size()] = (int) tokens.size();
+    tokens.insert(tokens.end(), wrap.begin() + n_lead, wrap.end());
 
-    const int cores = std::max(2, (int)sysconf(_SC_NPROCESSORS_ONLN));
-    const int max_threads = std::min(8, cores);
-    const int threads = (userThreads > 0)
-                        ? std::max(2, std::min(max_threads, (int)userThreads))
-                        : std::max(2, max_threads);
-
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx           = (int)nCtx;
-    ctx_params.n_threads       = threads;
-    ctx_params.n_threads_batch = threads;
-
-    ctx_params.embeddings      = true;
-    ctx_params.pooling_type    = (enum llama_pooling_type)poolingType;
-
-    // Keep embedding batch reasonable; we chunk anyway.
-    ctx_params.n_batch = (uint32_t) std::min((int)nCtx, 512);
+    int n_ctx = 0, n_batch_ctx = 0;
+    get_ctx_limits(ctx, n_ctx, n_batch_ctx);
+    const int batch_cap = get_batch_capacity(batch);
+    const int tok_cap   = std::min({n_batch_ctx, n_ctx, batch_cap > 0 ? batch_cap : n_batch_ctx});
+    if ((int) tokens.size() > tok_cap) return 0;
+    for (size_t c = 0; c < n_chunks; ++c) {
+        if (seg_first[spans[2 * c + 1]] <= seg_first[spans[2 * c]]) return 0;
+    }
 
-    LOGi("new_embedding_context(): cores=%d threads=%d n_ctx=%d n_batch=%d pooling=%d",
-         cores, threads, (int)ctx_params.n_ctx, (int)ctx_params.n_batch, poolingType);
+    // Non-causal models attend over the whole window, so it has to go in as one ubatch.
+    llama_kv_cache_clear(ctx);
+    common_batch_clear(*batch);
+    for (size_t j = 0; j < tokens.size(); ++j) common_batch_add(*batch, tokens[j], (llama_pos) j, {0}, true);
 
-    llama_context * ctx = llama_new_context_with_model(model, ctx_params);
-    if (!ctx) {
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"),
-                      "new_embedding_context(): llama_new_context_with_model() returned null");
-        return 0;
+    const int rc = llama_decode(ctx, *batch);
+    if (rc != 0) {
+        LOGe("embed_late_chunked: llama_decode() failed rc=%d (%zu tokens)", rc, tokens.size());
+        llama_kv_cache_clear(ctx);
+        return -1;
     }
 
-    {
-        std::lock_guard<std::mutex> lk(g_ctx_mu);
-        g_ctx_n_ctx[ctx]   = (int)ctx_params.n_ctx;
-        g_ctx_n_batch[ctx] = (int)ctx_params.n_batch;
+    for (size_t c = 0; c < n_chunks; ++c) {
+        const int t0 = seg_first[spans[2 * c]];
+        const int t1 = seg_first[spans[2 * c + 1]];
+        float * dst = out + c * (size_t) n_embd;
+        std::fill(dst, dst + n_embd, 0.0f);
+        for (int t = t0; t < t1; ++t) {
+            const float * emb = llama_get_embeddings_ith(ctx, t);
+            if (!emb) continue;
+            for (int j = 0; j < n_embd; ++j) dst[j] += emb[j];
+        }
+        const float inv = 1.0f / (float) (t1 - t0);
+        for (int j = 0; j < n_embd; ++j) dst[j] *= inv;
     }
 
-    return reinterpret_cast<jlong>(ctx);
+    llama_kv_cache_clear(ctx);
+    return (int) n_chunks;
 }
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_free_1context(JNIEnv *, jobject, jlong context) {
-    auto ctx = reinterpret_cast<llama_context *>(context);
-    if (ctx) {
-        std::lock_guard<std::mutex> lk(g_ctx_mu);
-        g_ctx_n_ctx.erase(ctx);
-        g_ctx_n_batch.erase(ctx);
+static void l2_normalize_rows(float * rows, size_t n, int n_embd) {
+    for (size_t i = 0; i < n; ++i) {
+        float * row = rows + i * n_embd;
+        double sum = 0.0;
+        for (int j = 0; j < n_embd; ++j) sum += (double) row[j] * row[j];
+        const float denom = std::max((float) std::sqrt(sum), 1e-12f);
+        for (int j = 0; j < n_embd; ++j) row[j] /= denom;
     }
-    llama_free(ctx);
 }
 
-extern "C"
-JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_new_1batch(JNIEnv *env, jobject, jint n_tokens, jint embd, jint n_seq_max) {
-    if (n_tokens <= 0 || n_seq_max <= 0) {
-        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "new_batch(): invalid sizes");
-        return 0;
-    }
+static size_t common_prefix_len(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
+    const size_t n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i < n && a[i] == b[i]) ++i;
+    return i;
+}
 
-    llama_batch *batch = new llama_batch{0, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr};
+/**
+ * Speculative decoding: a small draft model proposes tokens that the main model then
+ * verifies in one batched decode. Each verified position is sampled with the main sampler
+ * chain, so the output is exactly what plain decoding would give; the draft only changes
+ * how many tokens one llama_decode yields.
+ *
+ * The last sampled token (`id_last`) is kept undecoded and becomes the head of the next
+ * verify batch. completion_loop still hands Kotlin one piece per call from `queue`.
+ */
+struct spec_state {
+    llama_context * draft_ctx     = nullptr; // owned by Kotlin
+    llama_batch   * draft_batch   = nullptr; // owned by Kotlin
+    llama_sampler * draft_sampler = nullptr; // greedy, owned here
+    int             n_draft       = 0;
+
+    std::vector<llama_token> draft_tokens;   // mirror of the draft KV cache (seq 0)
+    std::deque<llama_token>  queue;          // decoded on the main context, not yet returned
+    bool                     has_last = false;
+    llama_token              id_last  = -1;
+
+    int64_t n_rounds   = 0;
+    int64_t n_drafted  = 0;
+    int64_t n_accepted = 0;
+
+    ~spec_state() {
+        if (draft_sampler) llama_sampler_free(draft_sampler);
+    }
+};
 
-    auto malloc_or_throw = [&](size_t bytes) -> void * {
-        void * p = malloc(bytes);
-        if (!p) {
-            env->ThrowNew(env->FindClass("java/lang/OutOfMemoryError"), "new_batch(): malloc failed");
-        }
-        return p;
-    };
+// Below this draft-model probability a round stops drafting; unlikely tokens rarely verify.
+static const float SPEC_P_MIN = 0.35f;
+// Same tolerance llama.cpp's speculative example uses for draft/target vocab sizes.
+static const int SPEC_VOCAB_MAX_SIZE_DIFF = 128;
 
-    if (embd) {
-        batch->embd = (float *) malloc_or_throw(sizeof(float) * (size_t)n_tokens * (size_t)embd);
-        if (env->ExceptionCheck()) { delete batch; return 0; }
-    } else {
-        batch->token = (llama_token *) malloc_or_throw(sizeof(llama_token) * (size_t)n_tokens);
-        if (env->ExceptionCheck()) { delete batch; return 0; }
-    }
+// ---------------- Per-context state ----------------
 
-    batch->pos      = (llama_pos *)     malloc_or_throw(sizeof(llama_pos)      * (size_t)n_tokens);
-    if (env->ExceptionCheck()) { delete batch; return 0; }
+struct ctx_threadpools;
 
-    batch->n_seq_id = (int32_t *)       malloc_or_throw(sizeof(int32_t)        * (size_t)n_tokens);
-    if (env->ExceptionCheck()) { delete batch; return 0; }
+/**
+ * Everything kept per llama_context, in one object. A JNI entry point looks it up once
+ * (get_ctx_state, one g_ctx_mu lock per call) and passes the pieces down, so the decode /
+ * sample loops take no locks; the object stays put until free_context(). It makes contexts
+ * independent of each other, not concurrent: compute still runs on the Kotlin runLoop only,
+ * which the shared worker pools (ctx_threadpools) rely on.
+ */
+struct ctx_state {
+    prompt_cache_state          prompt;
+    std::unique_ptr<spec_state> spec;        // speculative decoding, null when off
+    std::atomic<bool>           cancel{false}; // set from any thread by completion_cancel()
+    ctx_metrics                 metrics;
+    utf8_stream                 utf8;         // completion_loop(): piece bytes short of a full character
+    std::shared_ptr<ctx_threadpools> pools;   // released after llama_free()
+    bool                        pools_batch_only = false; // embedding: prefill pool for both
+};
+
+// Guarded by g_ctx_mu for lookup; created on first use, dropped by free_context().
+static std::unordered_map<llama_context *, std::unique_ptr<ctx_state>> g_ctx_state;
+
+static ctx_state * get_ctx_state(llama_context * ctx) {
+    if (!ctx) return nullptr;
+    std::lock_guard<std::mutex> lk(g_ctx_mu);
+    auto & st = g_ctx_state[ctx];
+    if (!st) st = std::make_unique<ctx_state>();
+    return st.get();
+}
 
-    batch->seq_id   = (llama_seq_id **) malloc_or_throw(sizeof(llama_seq_id *) * (size_t)n_tokens);
-    if (env->ExceptionCheck()) { delete batch; return 0; }
+// Single-field shorthands for entry points that need only one piece.
+static prompt_cache_state * get_prompt_cache(llama_context * ctx) {
+    ctx_state * st = get_ctx_state(ctx);
+    return st ? &st->prompt : nullptr;
+}
 
-    for (int i = 0; i < n_tokens; ++i) {
-        batch->seq_id[i] = (llama_seq_id *) malloc_or_throw(sizeof(llama_seq_id) * (size_t)n_seq_max);
-        if (env->ExceptionCheck()) { delete batch; return 0; }
-    }
+static spec_state * get_spec(llama_context * ctx) {
+    ctx_state * st = get_ctx_state(ctx);
+    return st ? st->spec.get() : nullptr;
+}
 
-    batch->logits   = (int8_t *)        malloc_or_throw(sizeof(int8_t)         * (size_t)n_tokens);
-    if (env->ExceptionCheck()) { delete batch; return 0; }
+static float token_prob(const float * logits, int n_vocab, llama_token t) {
+    float max_l = logits[0];
+    for (int i = 1; i < n_vocab; ++i) max_l = std::max(max_l, logits[i]);
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; ++i) sum += std::exp((double) (logits[i] - max_l));
+    return (float) (std::exp((double) (logits[t] - max_l)) / sum);
+}
 
-    {
-        std::lock_guard<std::mutex> lk(g_batch_mu);
-        g_batch_n_tokens[batch] = (int)n_tokens;
-        g_batch_n_seq_max[batch] = (int)n_seq_max;
+/**
+ * Brings the draft KV cache to `target` (main tokens + id_last) and greedily drafts up to
+ * `n_max` tokens. Drafting stops at EOG or when the draft gets unsure.
+ */
+static std::vector<llama_token> spec_draft(spec_state * sp, const std::vector<llama_token> & target, int n_max) {
+    std::vector<llama_token> drafts;
+    if (n_max <= 0 || target.empty()) return drafts;
+
+    llama_context * dctx = sp->draft_ctx;
+    const llama_model * dmodel = llama_get_model(dctx);
+
+    int n_keep = (int) std::min(common_prefix_len(sp->draft_tokens, target), target.size() - 1);
+    if (n_keep > 0 && !llama_kv_cache_seq_rm(dctx, 0, n_keep, -1)) n_keep = 0;
+    if (n_keep == 0) llama_kv_cache_clear(dctx);
+    sp->draft_tokens.assign(target.begin(), target.begin() + n_keep);
+
+    const std::vector<llama_token> missing(target.begin() + n_keep, target.end());
+    if (!decode_tokens_chunked(dctx, sp->draft_batch, missing, n_keep, true)) {
+        llama_kv_cache_clear(dctx);
+        sp->draft_tokens.clear();
+        return drafts;
     }
-
-    return reinterpret_cast<jlong>(batch);
+    sp->draft_tokens = target;
+
+    const int n_vocab = llama_n_vocab(dmodel);
+    for (int j = 0; j < n_max; ++j) {
+        const llama_token d = llama_sampler_sample(sp->draft_sampler, dctx, -1);
+        if (llama_token_is_eog(dmodel, d)) break;
+        if (token_prob(llama_get_logits_ith(dctx, -1), n_vocab, d) < SPEC_P_MIN) break;
+        drafts.push_back(d);
+        if (j + 1 == n_max) break;
+
+        common_batch_clear(*sp->draft_batch);
+        common_batch_add(*sp->draft_batch, d, (llama_pos) sp->draft_tokens.size(), {0}, true);
+        if (llama_decode(dctx, *sp->draft_batch) != 0) break;
+        sp->draft_tokens.push_back(d);
+    }
+    return drafts;
 }
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_free_1batch(JNIEnv *, jobject, jlong batch_pointer) {
-    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
-    if (!batch) return;
+/**
+ * Next token for completion_loop in speculative mode; it is already in the main KV cache
+ * unless it is EOG. Returns -1 if a decode failed.
+ */
+static llama_token spec_next_token(
+        llama_context * ctx, llama_batch * batch, llama_sampler * sampler,
+        spec_state * sp, prompt_cache_state * pc, int n_past
+) {
+    if (!sp->queue.empty()) {
+        const llama_token t = sp->queue.front();
+        sp->queue.pop_front();
+        return t;
+    }
 
-    int n_tokens = 0;
-    {
-        std::lock_guard<std::mutex> lk(g_batch_mu);
-        auto itN = g_batch_n_tokens.find(batch);
-        if (itN != g_batch_n_tokens.end()) n_tokens = itN->second;
-        g_batch_n_tokens.erase(batch);
-        g_batch_n_seq_max.erase(batch);
+    const llama_model * model = llama_get_model(ctx);
+    if (!sp->has_last) {
+        sp->id_last  = llama_sampler_sample(sampler, ctx, -1);
+        sp->has_last = true;
     }
+    if (llama_token_is_eog(model, sp->id_last)) return sp->id_last;
 
-    common_batch_clear(*batch);
+    std::vector<llama_token> target = pc ? pc->tokens : std::vector<llama_token>();
+    target.push_back(sp->id_last);
 
-    if (batch->token) free(batch->token);
-    if (batch->embd)  free(batch->embd);
-    if (batch->pos)   free(batch->pos);
+    const int n_ctx = llama_n_ctx(ctx);
+    const int room  = std::min(get_batch_capacity(batch) - 1, n_ctx - n_past - 2);
+    const std::vector<llama_token> drafts = spec_draft(sp, target, std::min(sp->n_draft, room));
 
-    if (batch->seq_id) {
-        for (int i = 0; i < n_tokens; ++i) free(batch->seq_id[i]);
-        free(batch->seq_id);
+    // Verify: [id_last, d0 .. d(m-1)] with logits everywhere.
+    common_batch_clear(*batch);
+    common_batch_add(*batch, sp->id_last, n_past, {0}, true);
+    for (size_t i = 0; i < drafts.size(); ++i) {
+        common_batch_add(*batch, drafts[i], n_past + 1 + (int) i, {0}, true);
+    }
+    if (llama_decode(ctx, *batch) != 0) {
+        LOGe("spec_next_token: verify decode failed");
+        return -1;
+    }
+
+    // Sample each position with the real chain; stop at the first disagreement. The
+    // sampled token at that position (or after the last draft) becomes the next id_last.
+    std::vector<llama_token> committed = {sp->id_last};
+    size_t n_acc = 0;
+    for (size_t i = 0; i <= drafts.size(); ++i) {
+        const llama_token id = llama_sampler_sample(sampler, ctx, (int32_t) i);
+        if (i < drafts.size() && id == drafts[i]) {
+            committed.push_back(id);
+            ++n_acc;
+            continue;
+        }
+        sp->id_last = id;
+        break;
+    }
+
+    // Drop rejected drafts from the main KV cache.
+    const int n_past_new = n_past + (int) committed.size();
+    if (n_acc < drafts.size()) llama_kv_cache_seq_rm(ctx, 0, n_past_new, -1);
+
+    sp->n_rounds++;
+    sp->n_drafted  += (int64_t) drafts.size();
+    sp->n_accepted += (int64_t) n_acc;
+
+    if (pc) pc->tokens.insert(pc->tokens.end(), committed.begin(), committed.end());
+    sp->queue.insert(sp->queue.end(), committed.begin() + 1, committed.end());
+    return committed.front();
+}
+
+// ---------------- Generation steps (shared by completion_loop / completion_run) ----------------
+
+// Shift once fewer than this many KV cells are left, so a speculative round still has room.
+static constexpr int CTX_SHIFT_MARGIN = 8;
+
+/**
+ * Frees room when the context is full: drops the oldest half of the unpinned tokens and
+ * slides the rest back in place (llama.cpp re-applies RoPE for the new positions), so
+ * generation continues without re-decoding. The token mirrors and the draft cache follow.
+ */
+static bool context_shift(llama_context * ctx, prompt_cache_state * pc, spec_state * sp, int & n_cur) {
+    if (!llama_kv_cache_can_shift(ctx)) return false;
+
+    const int n_keep    = pc ? std::min(pc->n_pinned, n_cur) : 0;
+    const int n_discard = (n_cur - n_keep) / 2;
+    if (n_discard <= 0) return false;
+
+    if (!llama_kv_cache_seq_rm(ctx, 0, n_keep, n_keep + n_discard)) return false;
+    llama_kv_cache_seq_add(ctx, 0, n_keep + n_discard, -1, -n_discard);
+
+    auto drop = [&](std::vector<llama_token> & toks) {
+        if ((int) toks.size() < n_keep + n_discard) return false;
+        toks.erase(toks.begin() + n_keep, toks.begin() + n_keep + n_discard);
+        return true;
+    };
+    if (pc && !drop(pc->tokens)) pc->tokens.clear();
+
+    if (sp) {
+        llama_context * dctx = sp->draft_ctx;
+        if (llama_kv_cache_can_shift(dctx) && drop(sp->draft_tokens) &&
+            llama_kv_cache_seq_rm(dctx, 0, n_keep, n_keep + n_discard)) {
+            llama_kv_cache_seq_add(dctx, 0, n_keep + n_discard, -1, -n_discard);
+        } else {
+            // Re-synced from the target mirror on the next draft.
+            llama_kv_cache_clear(dctx);
+            sp->draft_tokens.clear();
+        }
+    }
+
+    n_cur -= n_discard;
+    LOGi("context_shift: kept=%d discarded=%d n_cur=%d", n_keep, n_discard, n_cur);
+    return true;
+}
+
+// Next token. In speculative mode it is already decoded (see spec_next_token); -1 on failure.
+static llama_token gen_sample(llama_context * ctx, llama_batch * batch, llama_sampler * sampler,
+                              spec_state * sp, prompt_cache_state * pc, int n_cur) {
+    return sp ? spec_next_token(ctx, batch, sampler, sp, pc, n_cur)
+              : llama_sampler_sample(sampler, ctx, -1);
+}
+
+// Appends `token` to the KV cache at n_cur and the prompt-cache mirror (no-op when speculative).
+static bool gen_commit(llama_context * ctx, llama_batch * batch, spec_state * sp, prompt_cache_state * pc,
+                       llama_token token, int n_cur) {
+    if (sp) return true;
+
+    common_batch_clear(*batch);
+    common_batch_add(*batch, token, n_cur, {0}, true);
+
+    const int rc = llama_decode(ctx, *batch);
+    if (rc != 0) {
+        LOGe("llama_decode() failed rc=%d at n_cur=%d", rc, n_cur);
+        if (pc) pc->tokens.clear();
+        return false;
+    }
+
+    // Keep the mirror in sync so the next turn can reuse the generated reply too.
+    if (pc) pc->tokens.push_back(token);
+    return true;
+}
+
+static std::atomic<bool> * get_cancel_flag(llama_context * ctx) {
+    ctx_state * st = get_ctx_state(ctx);
+    return st ? &st->cancel : nullptr;
+}
+
+// Parallel sequences (the seq_* entry points below completion_cancel()).
+
+/**
+ * One independent generation in a context created with n_seq_max > 1: its own seq_id
+ * (1..n_seq_max-1; seq 0 is never handed out), sampler, stop strings and UTF-8 buffer.
+ * generateParallel() runs them in a context of its own, not the chat one. seq_step()
+ * advances every running sequence of a context by one token with a single llama_decode,
+ * so N background replies cost about one batched decode per token.
+ */
+struct gen_seq {
+    llama_context * ctx   = nullptr;
+    llama_seq_id    seq   = 0;
+    llama_sampler * smpl  = nullptr; // owned
+    int             n_len = 0;
+    std::vector<std::string> stops;
+
+    int         n_past   = 0;  // tokens of this sequence in the KV cache
+    int         produced = 0;
+    llama_token next     = -1; // decoded on the next tick: the prompt's last token, then each sample
+    jint        reason   = -2; // SEQ_RUNNING or a gen_stop_reason once finished
+    int         i_batch  = -1;
+    std::string pending;       // generated text held back (partial character / possible stop string)
+    std::string ready;         // complete text waiting for seq_read()
+
+    ~gen_seq() { if (smpl) llama_sampler_free(smpl); }
+};
+
+static constexpr jint SEQ_RUNNING = -2;
+
+// runLoop only, like the contexts they decode into; the mutex covers handle lookups.
+static std::mutex g_seq_mu;
+static std::unordered_map<jlong, std::shared_ptr<gen_seq>> g_seqs;
+static jlong g_next_seq_handle = 1;
+
+static std::shared_ptr<gen_seq> get_seq(jlong handle) {
+    std::lock_guard<std::mutex> lk(g_seq_mu);
+    auto it = g_seqs.find(handle);
+    return it != g_seqs.end() ? it->second : nullptr;
+}
+
+static std::vector<std::shared_ptr<gen_seq>> running_seqs(llama_context * ctx) {
+    std::vector<std::shared_ptr<gen_seq>> out;
+    std::lock_guard<std::mutex> lk(g_seq_mu);
+    for (auto & kv : g_seqs) {
+        if (kv.second->ctx == ctx && kv.second->reason == SEQ_RUNNING) out.push_back(kv.second);
+    }
+    return out;
+}
+
+// Drops every sequence of `ctx` (free_context()).
+static void release_seqs(llama_context * ctx) {
+    std::lock_guard<std::mutex> lk(g_seq_mu);
+    for (auto it = g_seqs.begin(); it != g_seqs.end(); ) {
+        it = it->second->ctx == ctx ? g_seqs.erase(it) : std::next(it);
+    }
+}
+
+// Length of the longest suffix of `text` that is a proper prefix of some stop string.
+static size_t stop_partial_len(const std::string & text, const std::vector<std::string> & stops) {
+    size_t best = 0;
+    for (const auto & stop : stops) {
+        const size_t max_len = std::min(stop.size() - 1, text.size());
+        for (size_t len = max_len; len > best; --len) {
+            if (text.compare(text.size() - len, len, stop, 0, len) == 0) {
+                best = len;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+// Bytes of `s` up to the end of its last complete UTF-8 sequence; an incomplete tail is held back.
+static size_t utf8_complete_prefix(const std::string & s) {
+    // Walk back over (at most 3) continuation bytes to the lead byte of the last sequence.
+    size_t i = s.size();
+    int cont = 0;
+    while (i > 0 && cont < 3 && (((unsigned char) s[i - 1]) & 0xC0) == 0x80) { --i; ++cont; }
+    if (i == 0) return s.size(); // malformed: don't hold it back forever
+
+    const unsigned char lead = (unsigned char) s[i - 1];
+    int len = 1;
+    if      ((lead & 0xE0) == 0xC0) len = 2;
+    else if ((lead & 0xF0) == 0xE0) len = 3;
+    else if ((lead & 0xF8) == 0xF0) len = 4;
+    return (cont + 1 >= len) ? s.size() : i - 1;
+}
+
+// ---------------- CPU topology (big.LITTLE) ----------------
+
+/**
+ * Per-core compute capacity from sysfs: cpu_capacity (EAS scale, 0..1024) where the kernel
+ * exposes it, else cpuinfo_max_freq. Cores within PERF_CORE_RATIO of the fastest core we may
+ * run on are performance cores. A matmul finishes at the pace of its slowest worker, so
+ * llama.cpp threads only go there.
+ * - capacities are fixed and read once; the affinity mask is read on every call, because
+ *   Android moves the app between cpusets (little cores only while in the background)
+ */
+struct cpu_topology {
+    int               n_cpus = 0;
+    std::vector<long> capacity; // per cpu id, 0 = unknown
+    std::vector<int>  perf;     // performance cores we may run on
+};
+
+static constexpr double PERF_CORE_RATIO = 0.6;
+
+// Decode is memory-bound: past this, extra threads mostly fight over bandwidth.
+static constexpr int DECODE_THREADS_MAX = 4;
+
+static long read_sysfs_long(const std::string & path) {
+    FILE * f = fopen(path.c_str(), "r");
+    if (!f) return 0;
+    long v = 0;
+    if (fscanf(f, "%ld", &v) != 1) v = 0;
+    fclose(f);
+    return v;
+}
+
+static cpu_topology get_cpu_topology() {
+    static const cpu_topology fixed = [] {
+        cpu_topology t;
+        t.n_cpus = std::max(1, (int) sysconf(_SC_NPROCESSORS_CONF));
+        t.capacity.assign(t.n_cpus, 0);
+
+        const std::string base = "/sys/devices/system/cpu/cpu";
+        bool have_capacity = false;
+        for (int i = 0; i < t.n_cpus; ++i) {
+            t.capacity[i] = read_sysfs_long(base + std::to_string(i) + "/cpu_capacity");
+            have_capacity = have_capacity || t.capacity[i] > 0;
+        }
+        if (!have_capacity) {
+            for (int i = 0; i < t.n_cpus; ++i) {
+                t.capacity[i] = read_sysfs_long(base + std::to_string(i) + "/cpufreq/cpuinfo_max_freq");
+            }
+        }
+        return t;
+    }();
+
+    cpu_topology t = fixed;
+
+    // Android may confine the app to a cpuset (e.g. little cores in the background).
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool have_allowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    auto usable = [&](int i) { return !have_allowed || CPU_ISSET(i, &allowed); };
+
+    long best = 0;
+    for (int i = 0; i < t.n_cpus; ++i) if (usable(i)) best = std::max(best, t.capacity[i]);
+    for (int i = 0; i < t.n_cpus; ++i) {
+        if (!usable(i)) continue;
+        if (best <= 0 || t.capacity[i] >= (long) (best * PERF_CORE_RATIO)) t.perf.push_back(i);
+    }
+    return t;
+}
+
+struct thread_layout {
+    int  decode  = 2;
+    int  prefill = 2;
+    bool pinned  = false; // workers restricted to the performance cores
+    std::vector<int> cores; // those cores, as the affinity mask allowed when picked
+};
+
+// user_threads > 0 caps both counts (previously it was the thread count itself).
+static thread_layout pick_thread_layout(jint user_threads) {
+    const cpu_topology topo = get_cpu_topology();
+    const int n_perf = std::max(1, (int) topo.perf.size());
+    const int cap    = user_threads > 0 ? std::max(1, (int) user_threads) : 8;
+
+    thread_layout lay;
+    lay.prefill = std::max(1, std::min({n_perf, cap, 8}));
+    lay.decode  = std::max(1, std::min({n_perf, cap, DECODE_THREADS_MAX}));
+    lay.pinned  = !topo.perf.empty() && (int) topo.perf.size() < topo.n_cpus;
+    if (lay.pinned) lay.cores = topo.perf;
+    return lay;
+}
+
+static std::string describe_thread_layout(const thread_layout & lay) {
+    const cpu_topology topo = get_cpu_topology();
+    std::ostringstream ss;
+    ss << "cpus=" << topo.n_cpus << " capacity=[";
+    for (int i = 0; i < topo.n_cpus; ++i) ss << (i ? "," : "") << topo.capacity[i];
+    ss << "] perf=[";
+    for (size_t i = 0; i < topo.perf.size(); ++i) ss << (i ? "," : "") << topo.perf[i];
+    ss << "] decode_threads=" << lay.decode << " prefill_threads=" << lay.prefill
+       << " pinned=" << (lay.pinned ? "yes" : "no");
+    return ss.str();
+}
+
+/**
+ * Decode / prefill worker pools, shared by every context created while they are alive (chat,
+ * draft and embedding), so the app never has two sets of llama.cpp workers competing for
+ * the same cores. Sharing is safe because all compute runs on the Kotlin runLoop thread,
+ * one context at a time. Freed after the last context using them; embedding contexts move
+ * to new pools when a chat context replaces them (see acquire_threadpools).
+ */
+struct ctx_threadpools {
+    ggml_threadpool * decode = nullptr;
+    ggml_threadpool * batch  = nullptr;
+    int n_decode = 0;
+    int n_batch  = 0;
+    std::vector<int> cores; // pinned cores, empty when unpinned
+
+    ~ctx_threadpools() {
+        if (decode) ggml_threadpool_free(decode);
+        if (batch)  ggml_threadpool_free(batch);
+    }
+};
+static std::weak_ptr<ctx_threadpools> g_shared_threadpools;
+
+// Layout of the most recent chat context, for system_info(). Guarded by g_ctx_mu.
+static std::string g_thread_layout_desc;
+
+static ggml_threadpool * new_pinned_threadpool(int n_threads, const thread_layout & lay) {
+    ggml_threadpool_params p = ggml_threadpool_params_default(n_threads);
+    if (lay.pinned) {
+        for (int c : lay.cores) if (c < GGML_MAX_N_THREADS) p.cpumask[c] = true;
+    }
+    return ggml_threadpool_new(&p);
+}
+
+// Pools for `lay`, not shared with anything (benchmarks). Null if pool creation failed.
+static std::shared_ptr<ctx_threadpools> new_threadpools(const thread_layout & lay) {
+    auto pools = std::make_shared<ctx_threadpools>();
+    pools->decode   = new_pinned_threadpool(lay.decode, lay);
+    pools->batch    = new_pinned_threadpool(lay.prefill, lay);
+    pools->n_decode = lay.decode;
+    pools->n_batch  = lay.prefill;
+    pools->cores    = lay.cores;
+    if (!pools->decode || !pools->batch) return nullptr;
+    return pools;
+}
+
+// Points `ctx` at `pools`, with thread counts matching the pool sizes. Caller holds g_ctx_mu.
+static void attach_threadpools_locked(llama_context * ctx, ctx_state & st, const std::shared_ptr<ctx_threadpools> & pools, bool batch_only) {
+    llama_attach_threadpool(ctx, batch_only ? pools->batch : pools->decode, pools->batch);
+    llama_set_n_threads(ctx, batch_only ? pools->n_batch : pools->n_decode, pools->n_batch);
+    st.pools = pools;
+    st.pools_batch_only = batch_only;
+}
+
+/**
+ * The live shared pools, or new ones for `lay`. A chat context asking for different thread
+ * counts replaces them: live embedding contexts move over to the new pools, so only one set
+ * of workers stays up (a chat or draft context still running on the old ones keeps them until
+ * it is freed). `any_layout` (embedding) takes whatever is alive. Null if pool creation failed.
+ */
+static std::shared_ptr<ctx_threadpools> acquire_threadpools(const thread_layout & lay, bool any_layout) {
+    std::lock_guard<std::mutex> lk(g_ctx_mu);
+    auto live = g_shared_threadpools.lock();
+    if (live && (any_layout || (live->n_decode == lay.decode && live->n_batch == lay.prefill && live->cores == lay.cores))) return live;
+
+    auto pools = new_threadpools(lay);
+    if (!pools) return nullptr;
+    g_shared_threadpools = pools;
+    if (live) {
+        for (auto & kv : g_ctx_state) {
+            ctx_state & st = *kv.second;
+            if (st.pools == live && st.pools_batch_only) attach_threadpools_locked(kv.first, st, pools, true);
+        }
+    }
+    return pools;
+}
+
+static void attach_threadpools(llama_context * ctx, const std::shared_ptr<ctx_threadpools> & pools, bool batch_only) {
+    ctx_state * st = get_ctx_state(ctx);
+    std::lock_guard<std::mutex> lk(g_ctx_mu);
+    attach_threadpools_locked(ctx, *st, pools, batch_only);
+}
+
+// ---------------- JNI exports ----------------
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_log_1to_1android(JNIEnv *, jobject) {
+    llama_log_set(log_callback, NULL);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_backend_1init(JNIEnv *, jobject) {
+    llama_backend_init();
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_backend_1free(JNIEnv *, jobject) {
+    llama_backend_free();
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_system_1info(JNIEnv *env, jobject) {
+    std::string info = llama_print_system_info();
+
+    std::string layout;
+    {
+        std::lock_guard<std::mutex> lk(g_ctx_mu);
+        layout = g_thread_layout_desc;
+    }
+    if (layout.empty()) layout = describe_thread_layout(pick_thread_layout(0));
+    info += " | THREADS: " + layout;
+
+    return env->NewStringUTF(info.c_str());
+}
+
+// progress_callback bridge; runs on the loading (JNI) thread, so `env` stays valid.
+struct load_progress_ctx {
+    JNIEnv *  env;
+    jobject   callback;
+    jmethodID on_progress;
+    float     last      = -1.0f;
+    bool      cancelled = false;
+};
+
+static bool load_progress_bridge(float progress, void * user_data) {
+    auto * lp = static_cast<load_progress_ctx *>(user_data);
+    // llama.cpp reports per tensor; forward whole percents only.
+    if (progress < 1.0f && progress - lp->last < 0.01f) return true;
+    lp->last = progress;
+
+    const bool keep_going = lp->env->CallBooleanMethod(lp->callback, lp->on_progress, (jfloat) progress);
+    if (lp->env->ExceptionCheck() || !keep_going) lp->cancelled = true;
+    return !lp->cancelled;
+}
+
+/**
+ * - use_mmap: map weights instead of reading them (fast warm reloads from page cache)
+ * - use_mlock: pin mapped weights in RAM so they are never paged out
+ * - n_gpu_layers: layers offloaded when built with a GPU backend (LLAMA_ANDROID_GPU); 0 = CPU
+ * - callback: optional onProgress(float 0..1): Boolean; returning false cancels the load
+ */
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_load_1model(JNIEnv *env, jobject, jstring filename, jboolean useMmap,
+                                                jboolean useMlock, jint nGpuLayers, jobject callback) {
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap     = useMmap;
+    model_params.use_mlock    = useMlock;
+    model_params.n_gpu_layers = std::max(0, (int) nGpuLayers);
+
+    load_progress_ctx progress{env, callback, nullptr};
+    if (callback) {
+        jclass cls = env->GetObjectClass(callback);
+        progress.on_progress = env->GetMethodID(cls, "onProgress", "(F)Z");
+        env->DeleteLocalRef(cls);
+        if (!progress.on_progress) return 0;
+
+        model_params.progress_callback           = load_progress_bridge;
+        model_params.progress_callback_user_data = &progress;
+    }
+
+    const char * path_to_model = env->GetStringUTFChars(filename, 0);
+    LOGi("Loading model from %s (mmap=%d mlock=%d gpu_layers=%d)", path_to_model ? path_to_model : "(null)",
+         (int) model_params.use_mmap, (int) model_params.use_mlock, (int) model_params.n_gpu_layers);
+
+    const int64_t t0 = ggml_time_us();
+    llama_model * model = llama_load_model_from_file(path_to_model, model_params);
+
+    if (path_to_model) env->ReleaseStringUTFChars(filename, path_to_model);
+
+    // Cancelled from Kotlin, or its callback threw: not a load error.
+    if (progress.cancelled) {
+        LOGi("load_model(): cancelled");
+        if (model) llama_free_model(model);
+        return 0;
+    }
+
+    if (!model) {
+        LOGe("load_model() failed");
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "load_model() failed");
+        return 0;
+    }
+
+    LOGi("load_model(): loaded in %.1f ms", (ggml_time_us() - t0) / 1000.0);
+    return reinterpret_cast<jlong>(model);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_free_1model(JNIEnv *, jobject, jlong model) {
+    {
+        std::lock_guard<std::mutex> lk(g_tok_mu);
+        g_tok_cache.erase(reinterpret_cast<llama_model *>(model));
+    }
+    llama_free_model(reinterpret_cast<llama_model *>(model));
+}
+
+/**
+ * Chat context parameters; any value <= 0 falls back to the defaults above.
+ * - n_ctx is capped at the model's training context
+ * - n_ubatch <= n_batch <= n_ctx
+ * - a quantized V cache needs flash attention, so without it only K is quantized
+ */
+static llama_context_params chat_ctx_params(const llama_model * model, const thread_layout & lay, jint n_ctx, jint n_batch,
+                                            jint n_ubatch, jboolean flash_attn, jint kv_type) {
+    llama_context_params p = llama_context_default_params();
+
+    int ctx_len = n_ctx > 0 ? (int) n_ctx : CHAT_N_CTX_DEFAULT;
+    const int n_ctx_train = llama_n_ctx_train(model);
+    if (n_ctx_train > 0) ctx_len = std::min(ctx_len, n_ctx_train);
+
+    p.n_ctx    = (uint32_t) ctx_len;
+    p.n_batch  = (uint32_t) std::min(n_batch > 0 ? (int) n_batch : CHAT_N_BATCH_DEFAULT, ctx_len);
+    p.n_ubatch = (uint32_t) std::min(n_ubatch > 0 ? (int) n_ubatch : (int) p.n_batch, (int) p.n_batch);
+    p.n_threads       = lay.decode;
+    p.n_threads_batch = lay.prefill;
+
+    p.flash_attn = flash_attn;
+    p.type_k     = kv_ggml_type(kv_type);
+    p.type_v     = flash_attn ? p.type_k : GGML_TYPE_F16;
+    return p;
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_new_1context(JNIEnv *env, jobject, jlong jmodel, jint userThreads,
+                                                 jint nCtx, jint nBatch, jint nUbatch, jboolean flashAttn, jint kvType,
+                                                 jint nSeqMax) {
+    auto model = reinterpret_cast<llama_model *>(jmodel);
+    if (!model) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "Model cannot be null");
+        return 0;
+    }
+
+    const thread_layout lay = pick_thread_layout(userThreads);
+    llama_context_params ctx_params = chat_ctx_params(model, lay, nCtx, nBatch, nUbatch, flashAttn, kvType);
+    ctx_params.n_seq_max = (uint32_t) std::max<jint>(1, nSeqMax);
+
+    LOGi("new_context(): threads=%d/%d n_ctx=%d n_batch=%d n_ubatch=%d flash_attn=%d kv_type=%d n_seq_max=%d",
+         lay.decode, lay.prefill, (int)ctx_params.n_ctx, (int)ctx_params.n_batch, (int)ctx_params.n_ubatch,
+         (int)ctx_params.flash_attn, (int)kvType, (int)ctx_params.n_seq_max);
+
+    llama_context * ctx = llama_new_context_with_model(model, ctx_params);
+    if (!ctx) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"),
+                      "llama_new_context_with_model() returned null");
+        return 0;
+    }
+
+    // Shared pinned pools keep workers on the performance cores; without them llama.cpp
+    // falls back to its default unpinned pool.
+    if (auto pools = acquire_threadpools(lay, false)) {
+        attach_threadpools(ctx, pools, false);
+    } else {
+        LOGe("new_context(): threadpool creation failed, using default threads");
+    }
+
+    const std::string desc = describe_thread_layout(lay);
+    LOGi("new_context(): %s", desc.c_str());
+    {
+        std::lock_guard<std::mutex> lk(g_ctx_mu);
+        g_thread_layout_desc = desc;
+    }
+
+    return reinterpret_cast<jlong>(ctx);
+}
+
+// Actual [n_ctx, n_batch, n_ubatch] of a context (after new_context() clamping).
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_context_1limits(JNIEnv * env, jobject, jlong context_pointer) {
+    auto ctx = reinterpret_cast<llama_context *>(context_pointer);
+    if (!ctx) return nullptr;
+
+    const jint limits[3] = { (jint) llama_n_ctx(ctx), (jint) llama_n_batch(ctx), (jint) llama_n_ubatch(ctx) };
+    jintArray out = env->NewIntArray(3);
+    env->SetIntArrayRegion(out, 0, 3, limits);
+    return out;
+}
+
+/**
+ * Inputs for sizing a context: [KV-cache bytes per token for kv_type, training context].
+ * Per token the cache holds n_layer * n_head_kv * head_dim elements for K and for V.
+ */
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_context_1sizing(JNIEnv * env, jobject, jlong jmodel, jboolean flashAttn, jint kvType) {
+    auto model = reinterpret_cast<llama_model *>(jmodel);
+    if (!model) return nullptr;
+
+    const int n_layer = llama_n_layer(model);
+    const int n_head  = std::max(1, (int) llama_n_head(model));
+    const int n_embd  = llama_n_embd(model);
+
+    // GQA models cache fewer heads than they attend with.
+    int n_head_kv = n_head;
+    char arch[64] = {0};
+    if (llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch)) > 0) {
+        char buf[32] = {0};
+        const std::string key = std::string(arch) + ".attention.head_count_kv";
+        if (llama_model_meta_val_str(model, key.c_str(), buf, sizeof(buf)) > 0) {
+            n_head_kv = std::max(1, atoi(buf));
+        }
+    }
+
+    const ggml_type tk = kv_ggml_type(kvType);
+    const ggml_type tv = flashAttn ? tk : GGML_TYPE_F16;
+    const double per_layer = (double) n_head_kv * (n_embd / n_head) * (kv_type_bytes(tk) + kv_type_bytes(tv));
+
+    const jlong sizing[2] = { (jlong) std::ceil(per_layer * n_layer), (jlong) llama_n_ctx_train(model) };
+    jlongArray out = env->NewLongArray(2);
+    env->SetLongArrayRegion(out, 0, 2, sizing);
+    return out;
+}
+
+/**
+ * Prefill throughput (tokens/s) of a throwaway context with the given n_ubatch: decodes
+ * n_tokens filler tokens through `batch` and frees the context again. Used to pick n_ubatch
+ * per device; 0 on failure. One untimed ubatch goes first, so graph and buffer setup of the
+ * fresh context doesn't count against whichever candidate is probed first.
+ */
+extern "C"
+JNIEXPORT jdouble JNICALL
+Java_android_llama_cpp_LLamaAndroid_prefill_1probe(JNIEnv *, jobject, jlong jmodel, jlong batch_pointer, jint userThreads,
+                                                   jint nUbatch, jint nTokens, jboolean flashAttn, jint kvType) {
+    auto model = reinterpret_cast<llama_model *>(jmodel);
+    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+    if (!model || !batch || nUbatch <= 0 || nTokens <= 0) return 0.0;
+
+    const int n_tokens = std::min((int) nTokens, get_batch_capacity(batch));
+    // Room for the full ubatch too, or chat_ctx_params() would clamp it to n_ctx.
+    const int n_ctx = std::max(n_tokens, (int) nUbatch) + 8;
+    llama_context_params p = chat_ctx_params(model, pick_thread_layout(userThreads), n_ctx, nUbatch, nUbatch, flashAttn, kvType);
+    llama_context * ctx = llama_new_context_with_model(model, p);
+    if (!ctx) return 0.0;
+
+    // Content doesn't matter for timing; BOS keeps it a valid sequence for any vocab.
+    const std::vector<llama_token> tokens(n_tokens, llama_token_bos(model));
+
+    const std::vector<llama_token> warm(tokens.begin(), tokens.begin() + std::min(n_tokens, (int) nUbatch));
+    if (!decode_tokens_chunked(ctx, batch, warm, 0, true)) {
+        llama_free(ctx);
+        return 0.0;
+    }
+    llama_kv_cache_clear(ctx);
+
+    const int64_t t0 = ggml_time_us();
+    const bool ok = decode_tokens_chunked(ctx, batch, tokens, 0, true);
+    const int64_t t1 = ggml_time_us();
+    llama_free(ctx);
+
+    if (!ok || t1 <= t0) return 0.0;
+    const double tps = n_tokens * 1e6 / (double) (t1 - t0);
+    LOGi("prefill_probe: n_ubatch=%d tokens=%d -> %.1f t/s", (int) nUbatch, n_tokens, tps);
+    return tps;
+}
+
+/**
+ * Warm-up decode of [BOS, EOS] so the first real prompt doesn't pay for weight page faults
+ * and backend buffer setup. Leaves the KV cache, prompt-cache mirror and perf counters
+ * empty. Returns the elapsed microseconds, -1 if the decode failed.
+ */
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_warmup(JNIEnv *, jobject, jlong context_pointer, jlong batch_pointer) {
+    auto ctx   = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+    if (!ctx || !batch) return -1;
+
+    const llama_model * model = llama_get_model(ctx);
+    std::vector<llama_token> tokens;
+    if (llama_token_bos(model) != LLAMA_TOKEN_NULL) tokens.push_back(llama_token_bos(model));
+    if (llama_token_eos(model) != LLAMA_TOKEN_NULL) tokens.push_back(llama_token_eos(model));
+    if (tokens.empty()) tokens.push_back(0);
+
+    const int64_t t0 = ggml_time_us();
+    const bool ok = decode_tokens_chunked(ctx, batch, tokens, 0, true);
+    llama_synchronize(ctx);
+    const int64_t t1 = ggml_time_us();
+
+    llama_kv_cache_clear(ctx);
+    if (prompt_cache_state * pc = get_prompt_cache(ctx)) {
+        pc->tokens.clear();
+        pc->n_reused = 0;
+    }
+    llama_perf_context_reset(ctx);
+
+    LOGi("warmup: %s in %.1f ms", ok ? "ok" : "decode failed", (t1 - t0) / 1000.0);
+    return ok ? (jlong) (t1 - t0) : -1;
+}
+
+/**
+ * Pulls a model file into the page cache so llama.cpp's own mapping of it stops faulting:
+ * MADV_WILLNEED starts readahead, then one byte per page is touched so the call returns
+ * once the file is resident. Blocking, thread-safe, no llama state; meant for a background
+ * thread. Returns the elapsed microseconds, -1 on error.
+ */
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_prefetch_1file(JNIEnv * env, jobject, jstring jpath) {
+    const std::string path = jstring_to_string(env, jpath);
+
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return -1;
+    }
+
+    const size_t size = (size_t) st.st_size;
+    void * base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+
+    const int64_t t0 = ggml_time_us();
+    madvise(base, size, MADV_WILLNEED);
+
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const volatile uint8_t * bytes = static_cast<const uint8_t *>(base);
+    uint8_t sink = 0;
+    for (size_t off = 0; off < size; off += page) sink ^= bytes[off];
+    (void) sink;
+
+    const int64_t t1 = ggml_time_us();
+    munmap(base, size);
+
+    LOGi("prefetch_file: %s %.1f MiB in %.1f ms", path.c_str(), size / (1024.0 * 1024.0), (t1 - t0) / 1000.0);
+    return (jlong) (t1 - t0);
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_new_1embedding_1context(JNIEnv *env, jobject, jlong jmodel, jint userThreads, jint nCtx, jint nBatch, jint poolingType) {
+    auto model = reinterpret_cast<llama_model *>(jmodel);
+    if (!model) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "Model cannot be null");
+        return 0;
+    }
+
+    // Embedding is all prefill: it runs on the chat context's batch pool rather than a second
+    // set of workers, with as many threads as that pool has.
+    auto pools = acquire_threadpools(pick_thread_layout(userThreads), true);
+    const int threads = pools ? pools->n_batch : pick_thread_layout(userThreads).prefill;
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx           = (int)nCtx;
+    ctx_params.n_threads       = threads;
+    ctx_params.n_threads_batch = threads;
+
+    ctx_params.embeddings      = true;
+    ctx_params.pooling_type    = (enum llama_pooling_type)poolingType;
+
+    // A bigger batch packs more texts per decode; <= 0 keeps the old 512 cap.
+    ctx_params.n_batch = (uint32_t) std::max(1, nBatch > 0 ? (int)nBatch : std::min((int)nCtx, 512));
+    // Pooled (non-causal) embeddings need each sequence inside one ubatch.
+    ctx_params.n_ubatch  = ctx_params.n_batch;
+    ctx_params.n_seq_max = EMB_N_SEQ_MAX;
+
+    LOGi("new_embedding_context(): threads=%d n_ctx=%d n_batch=%d pooling=%d",
+         threads, (int)ctx_params.n_ctx, (int)ctx_params.n_batch, poolingType);
+
+    llama_context * ctx = llama_new_context_with_model(model, ctx_params);
+    if (!ctx) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"),
+                      "new_embedding_context(): llama_new_context_with_model() returned null");
+        return 0;
+    }
+
+    if (pools) attach_threadpools(ctx, pools, true);
+
+    return reinterpret_cast<jlong>(ctx);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_free_1context(JNIEnv *, jobject, jlong context) {
+    auto ctx = reinterpret_cast<llama_context *>(context);
+    std::unique_ptr<ctx_state> st;
+    if (ctx) {
+        std::lock_guard<std::mutex> lk(g_ctx_mu);
+        auto it = g_ctx_state.find(ctx);
+        if (it != g_ctx_state.end()) {
+            st = std::move(it->second);
+            g_ctx_state.erase(it);
+        }
+    }
+    release_seqs(ctx);
+
+    llama_free(ctx);
+
+    // Pools go only after the context using them (and only if it was the last one).
+    st.reset();
+}
+
+// Bytes of weights of a loaded model (for the Kotlin memory budget).
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_model_1size(JNIEnv *, jobject, jlong model) {
+    auto m = reinterpret_cast<llama_model *>(model);
+    return m ? (jlong) llama_model_size(m) : 0;
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_new_1batch(JNIEnv *env, jobject, jint n_tokens, jint embd, jint n_seq_max) {
+    if (n_tokens <= 0 || n_seq_max <= 0) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "new_batch(): invalid sizes");
+        return 0;
+    }
+
+    batch_holder * holder = batch_acquire(n_tokens, embd, n_seq_max);
+    if (!holder) {
+        env->ThrowNew(env->FindClass("java/lang/OutOfMemoryError"), "new_batch(): allocation failed");
+        return 0;
+    }
+    return reinterpret_cast<jlong>(&holder->batch);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_free_1batch(JNIEnv *, jobject, jlong batch_pointer) {
+    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+    if (!batch) return;
+
+    common_batch_clear(*batch);
+    batch_release(holder_of(batch));
+}
+
+// ---------------- Sampler chain ----------------
+
+/** What new_sampler() / new_sampler_config() build a chain from. */
+struct sampler_config {
+    float top_p = 0.9f;
+    int   top_k = 40;
+    float temp  = 0.4f;  // <= 0: greedy, top_k/top_p/min_p are then skipped
+    float min_p = 0.0f;  // 0: off
+
+    // Over the last penalty_last_n sampled tokens; 0 (or all neutral) turns penalties off.
+    int   penalty_last_n  = 0;
+    float penalty_repeat  = 1.0f;
+    float penalty_freq    = 0.0f;
+    float penalty_present = 0.0f;
+
+    uint32_t seed = 1234;  // fixed default; new_sampler_config maps seed < 0 to LLAMA_DEFAULT_SEED (random)
+
+    std::string grammar;  // GBNF with a "root" rule; empty: unconstrained
+};
+
+/**
+ * Grammar-gated sampling: the unconstrained chain picks a token and only that token is
+ * checked against the grammar. When the grammar rejects it, the full candidate set is
+ * constrained and the chain samples again. Most steps then cost one grammar check instead
+ * of matching the whole vocabulary.
+ */
+struct gated_grammar {
+    llama_sampler * chain   = nullptr;  // owned
+    llama_sampler * grammar = nullptr;  // owned
+    std::vector<llama_token_data> saved;
+};
+
+static llama_sampler * gated_grammar_new(llama_sampler * chain, llama_sampler * grammar);
+
+static const char * gated_grammar_name(const llama_sampler *) {
+    return "gated-grammar";
+}
+
+static void gated_grammar_accept(llama_sampler * smpl, llama_token token) {
+    auto * g = static_cast<gated_grammar *>(smpl->ctx);
+    llama_sampler_accept(g->grammar, token);
+    llama_sampler_accept(g->chain, token);
+}
+
+static void gated_grammar_apply(llama_sampler * smpl, llama_token_data_array * cur_p) {
+    auto * g = static_cast<gated_grammar *>(smpl->ctx);
+    g->saved.assign(cur_p->data, cur_p->data + cur_p->size);
+    const bool sorted = cur_p->sorted;
+
+    llama_sampler_apply(g->chain, cur_p);
+    if (cur_p->selected >= 0 && (size_t) cur_p->selected < cur_p->size) {
+        llama_token_data one = cur_p->data[cur_p->selected];
+        llama_token_data_array single = { &one, 1, -1, false };
+        llama_sampler_apply(g->grammar, &single);
+        if (!std::isinf(one.logit)) return;
+    }
+
+    // Rejected: the chain may have truncated the candidates, so start over from the copy.
+    std::copy(g->saved.begin(), g->saved.end(), cur_p->data);
+    cur_p->size     = g->saved.size();
+    cur_p->selected = -1;
+    cur_p->sorted   = sorted;
+    llama_sampler_apply(g->grammar, cur_p);
+    llama_sampler_apply(g->chain, cur_p);
+}
+
+static void gated_grammar_reset(llama_sampler * smpl) {
+    auto * g = static_cast<gated_grammar *>(smpl->ctx);
+    llama_sampler_reset(g->grammar);
+    llama_sampler_reset(g->chain);
+}
+
+static llama_sampler * gated_grammar_clone(const llama_sampler * smpl) {
+    auto * g = static_cast<const gated_grammar *>(smpl->ctx);
+    return gated_grammar_new(llama_sampler_clone(g->chain), llama_sampler_clone(g->grammar));
+}
+
+static void gated_grammar_free(llama_sampler * smpl) {
+    auto * g = static_cast<gated_grammar *>(smpl->ctx);
+    llama_sampler_free(g->grammar);
+    llama_sampler_free(g->chain);
+    delete g;
+}
+
+static llama_sampler_i gated_grammar_iface = {
+    /* .name   = */ gated_grammar_name,
+    /* .accept = */ gated_grammar_accept,
+    /* .apply  = */ gated_grammar_apply,
+    /* .reset  = */ gated_grammar_reset,
+    /* .clone  = */ gated_grammar_clone,
+    /* .free   = */ gated_grammar_free,
+};
+
+// Takes ownership of both samplers.
+static llama_sampler * gated_grammar_new(llama_sampler * chain, llama_sampler * grammar) {
+    auto * g = new gated_grammar();
+    g->chain   = chain;
+    g->grammar = grammar;
+    return new llama_sampler{ &gated_grammar_iface, g };
+}
+
+/**
+ * Penalties, then top-k / top-p / min-p and temperature, then the seeded draw (or greedy).
+ * With a grammar the chain is wrapped in gated_grammar. nullptr with *err set when the
+ * grammar does not parse, or when penalties or a grammar are asked for without a model.
+ */
+static llama_sampler * build_sampler(const llama_model * model, const sampler_config & cfg, std::string * err) {
+    const bool penalize = cfg.penalty_last_n != 0 &&
+            (cfg.penalty_repeat != 1.0f || cfg.penalty_freq != 0.0f || cfg.penalty_present != 0.0f);
+    // Both read the vocabulary.
+    if (!model && (penalize || !cfg.grammar.empty())) {
+        if (err) *err = "penalties and grammar need the model";
+        return nullptr;
+    }
+
+    auto sparams = llama_sampler_chain_default_params();
+    sparams.no_perf = true;
+
+    llama_sampler * smpl = llama_sampler_chain_init(sparams);
+
+    if (penalize) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_penalties(
+                llama_n_vocab(model), llama_token_eos(model), llama_token_nl(model),
+                cfg.penalty_last_n, cfg.penalty_repeat, cfg.penalty_freq, cfg.penalty_present,
+                /* penalize_nl = */ false, /* ignore_eos = */ false));
+    }
+
+    if (cfg.temp <= 0.0f) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+    } else {
+        if (cfg.top_k > 0)    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(cfg.top_k));
+        if (cfg.top_p < 1.0f) llama_sampler_chain_add(smpl, llama_sampler_init_top_p(cfg.top_p, 1));
+        if (cfg.min_p > 0.0f) llama_sampler_chain_add(smpl, llama_sampler_init_min_p(cfg.min_p, 1));
+        llama_sampler_chain_add(smpl, llama_sampler_init_temp(cfg.temp));
+        llama_sampler_chain_add(smpl, llama_sampler_init_dist(cfg.seed));
+    }
+
+    if (cfg.grammar.empty()) return smpl;
+
+    llama_sampler * grammar = llama_sampler_init_grammar(model, cfg.grammar.c_str(), "root");
+    if (!grammar) {
+        if (err) *err = "grammar does not parse";
+        llama_sampler_free(smpl);
+        return nullptr;
+    }
+    return gated_grammar_new(smpl, grammar);
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_new_1sampler(JNIEnv *, jobject, jfloat top_p, jint top_k, jfloat temp) {
+    // 0 means "default"; user values are rounded to one decimal as before.
+    sampler_config cfg;
+    if (top_k != 0)    cfg.top_k = top_k;
+    if (top_p != 0.0f) cfg.top_p = roundf(top_p * 10.0f) / 10.0f;
+    if (temp != 0.0f)  cfg.temp  = roundf(temp * 10.0f) / 10.0f;
+    // The default config has penalties and grammar off, so no model is needed.
+    return reinterpret_cast<jlong>(build_sampler(nullptr, cfg, nullptr));
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_new_1sampler_1config(
+        JNIEnv *env, jobject, jlong model_pointer,
+        jfloat top_p, jint top_k, jfloat temp, jfloat min_p,
+        jint penalty_last_n, jfloat penalty_repeat, jfloat penalty_freq, jfloat penalty_present,
+        jint seed, jstring jgrammar, jstring jschema
+) {
+    auto model = reinterpret_cast<llama_model *>(model_pointer);
+    if (!model) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "new_sampler_config(): no model");
+        return 0;
+    }
+
+    sampler_config cfg;
+    cfg.top_p           = top_p;
+    cfg.top_k           = top_k;
+    cfg.temp            = temp;
+    cfg.min_p           = min_p;
+    cfg.penalty_last_n  = penalty_last_n;
+    cfg.penalty_repeat  = penalty_repeat;
+    cfg.penalty_freq    = penalty_freq;
+    cfg.penalty_present = penalty_present;
+    cfg.seed            = seed < 0 ? LLAMA_DEFAULT_SEED : (uint32_t) seed;
+
+    if (jgrammar) {
+        const char * g = env->GetStringUTFChars(jgrammar, nullptr);
+        cfg.grammar = g;
+        env->ReleaseStringUTFChars(jgrammar, g);
+    } else if (jschema) {
+        const char * sc = env->GetStringUTFChars(jschema, nullptr);
+        const std::string schema = sc;
+        env->ReleaseStringUTFChars(jschema, sc);
+        try {
+            cfg.grammar = json_schema_to_grammar(json::parse(schema));
+        } catch (const std::exception & e) {
+            LOGe("new_sampler_config(): schema: %s", e.what());
+            env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "new_sampler_config(): unsupported JSON schema");
+            return 0;
+        }
+    }
+
+    std::string err;
+    llama_sampler * smpl = build_sampler(model, cfg, &err);
+    if (!smpl) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), ("new_sampler_config(): " + err).c_str());
+        return 0;
+    }
+    return reinterpret_cast<jlong>(smpl);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_free_1sampler(JNIEnv *, jobject, jlong sampler_pointer) {
+    llama_sampler_free(reinterpret_cast<llama_sampler *>(sampler_pointer));
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_kv_1cache_1clear(JNIEnv *, jobject, jlong context) {
+    auto ctx = reinterpret_cast<llama_context *>(context);
+    llama_kv_cache_clear(ctx);
+    if (auto pc = get_prompt_cache(ctx)) pc->tokens.clear();
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1prompt_1cache(JNIEnv *, jobject, jlong context, jboolean enabled) {
+    auto pc = get_prompt_cache(reinterpret_cast<llama_context *>(context));
+    if (!pc) return;
+    pc->enabled = enabled;
+    pc->n_reused = 0;
+}
+
+// Number of prompt tokens served from the KV cache by the last completion_init().
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_prompt_1cache_1reused(JNIEnv *, jobject, jlong context) {
+    auto pc = get_prompt_cache(reinterpret_cast<llama_context *>(context));
+    return pc ? pc->n_reused : 0;
+}
+
+/**
+ * Enables speculative decoding on `context` with an already loaded draft context/batch.
+ * Returns false (and leaves plain decoding on) if the two vocabularies don't match.
+ */
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_spec_1attach(
+        JNIEnv * env, jobject,
+        jlong context, jlong draft_context, jlong draft_batch, jint n_draft
+) {
+    auto ctx   = reinterpret_cast<llama_context *>(context);
+    auto dctx  = reinterpret_cast<llama_context *>(draft_context);
+    auto batch = reinterpret_cast<llama_batch *>(draft_batch);
+    if (!ctx || !dctx || !batch || n_draft <= 0) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "spec_attach(): bad arguments");
+        return JNI_FALSE;
+    }
+
+    const llama_model * tgt = llama_get_model(ctx);
+    const llama_model * dft = llama_get_model(dctx);
+    if (llama_vocab_type(tgt) != llama_vocab_type(dft) ||
+        std::abs(llama_n_vocab(tgt) - llama_n_vocab(dft)) > SPEC_VOCAB_MAX_SIZE_DIFF ||
+        llama_token_bos(tgt) != llama_token_bos(dft) || llama_token_eos(tgt) != llama_token_eos(dft)) {
+        LOGe("spec_attach: draft vocab does not match the main model");
+        return JNI_FALSE;
+    }
+
+    auto sp = std::make_unique<spec_state>();
+    sp->draft_ctx     = dctx;
+    sp->draft_batch   = batch;
+    sp->draft_sampler = llama_sampler_init_greedy();
+    sp->n_draft       = n_draft;
+
+    get_ctx_state(ctx)->spec = std::move(sp);
+    return JNI_TRUE;
+}
+
+// Back to plain decoding; call before freeing the draft context.
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_spec_1detach(JNIEnv *, jobject, jlong context) {
+    if (ctx_state * st = get_ctx_state(reinterpret_cast<llama_context *>(context))) st->spec.reset();
+}
+
+// [rounds, drafted, accepted] since spec_attach(); null when speculation is off.
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_spec_1stats(JNIEnv * env, jobject, jlong context) {
+    spec_state * sp = get_spec(reinterpret_cast<llama_context *>(context));
+    if (!sp) return nullptr;
+
+    const jlong vals[3] = { sp->n_rounds, sp->n_drafted, sp->n_accepted };
+    jlongArray out = env->NewLongArray(3);
+    env->SetLongArrayRegion(out, 0, 3, vals);
+    return out;
+}
+
+// Parallel role / content arrays straight into common_chat_msg (no Map / JSON round trip).
+static std::vector<common_chat_msg> chat_from_arrays(JNIEnv * env, jobjectArray jroles, jobjectArray jcontents) {
+    const std::vector<std::string> roles    = string_array_to_vector(env, jroles);
+    const std::vector<std::string> contents = string_array_to_vector(env, jcontents);
+
+    std::vector<common_chat_msg> chat;
+    chat.reserve(std::min(roles.size(), contents.size()));
+    for (size_t i = 0; i < roles.size() && i < contents.size(); ++i) chat.push_back({roles[i], contents[i]});
+    return chat;
+}
+
+/**
+ * Tokenizes a full chat prompt for `ctx`: the same text as last time comes back as is, a grown
+ * history is tokenized incrementally (see tokenize_incremental). Remembers the result in the
+ * context's prompt cache.
+ */
+static std::vector<llama_token> tokenize_prompt(llama_context * ctx, std::string text) {
+    ctx_state * st = get_ctx_state(ctx);
+    metric_timer timer(&st->metrics, MS_TOKENIZE);
+    prompt_cache_state * pc = &st->prompt;
+    if (!pc->prompt_text_tokens.empty() && text == pc->prompt_text) return pc->prompt_text_tokens;
+
+    std::vector<llama_token> tokens = tokenize_incremental(ctx, text, true, pc->prompt_text, pc->prompt_text_tokens);
+    pc->prompt_text        = std::move(text);
+    pc->prompt_text_tokens = tokens;
+    return tokens;
+}
+
+/**
+ * Shared prompt setup behind the completion_init* entry points: trims `tokens` to fit,
+ * reuses the cached KV prefix and decodes the rest. `n_pinned` leading tokens survive
+ * trimming and context shifts. Returns the prompt length (0 on failure).
+ */
+static int completion_prefill(llama_context * ctx, llama_batch * batch, std::vector<llama_token> tokens, int n_pinned, int n_len) {
+    ctx_state * st = get_ctx_state(ctx);
+    st->utf8.clear();
+
+    const int n_ctx = llama_n_ctx(ctx);
+    prompt_cache_state * pc = &st->prompt;
+
+    // ---- SAFETY: trim prompt to fit KV cache (n_ctx) ----
+    // With context shifting the reply only needs some room up front; it shifts once full.
+    const int reserve = llama_kv_cache_can_shift(ctx) ? std::min(n_len, n_ctx / 4) : n_len;
+    int max_prompt = n_ctx - reserve - CTX_SHIFT_MARGIN;
+    if (max_prompt < 64) max_prompt = std::max(64, n_ctx - 64);
+    n_pinned = std::max(0, std::min(n_pinned, max_prompt / 2));
+
+    if ((int)tokens.size() > max_prompt) {
+        // keep the pinned head and the most recent tokens, drop the oldest turns in between
+        tokens.erase(tokens.begin() + n_pinned, tokens.end() - (max_prompt - n_pinned));
+        LOGi("completion_init: trimmed prompt to max_prompt=%d pinned=%d (n_ctx=%d n_len=%d)", max_prompt, n_pinned, n_ctx, n_len);
+    }
+
+    const int prompt_tokens = (int)tokens.size();
+
+    // ---- PREFIX REUSE: keep the matching head of the KV cache, drop the rest ----
+    // At least one token is always re-decoded so sampling has fresh logits.
+    int n_keep = 0;
+    if (pc && pc->enabled && !pc->tokens.empty() && prompt_tokens > 0) {
+        n_keep = (int) std::min(common_prefix_len(pc->tokens, tokens), (size_t)(prompt_tokens - 1));
+        if (n_keep > 0 && !llama_kv_cache_seq_rm(ctx, 0, n_keep, -1)) {
+            LOGi("completion_init: partial KV removal unsupported, full re-eval");
+            n_keep = 0;
+        }
+    }
+    if (n_keep == 0) llama_kv_cache_clear(ctx);
+
+    if (pc) {
+        pc->n_reused = n_keep;
+        pc->n_pinned = n_pinned;
+        pc->tokens.clear();
+    }
+
+    if (spec_state * sp = st->spec.get()) {
+        sp->queue.clear();
+        sp->has_last = false;
+    }
+    st->cancel.store(false);
+
+    LOGi("completion_init: prompt_tokens=%d reused=%d pinned=%d n_len=%d n_ctx=%d", prompt_tokens, n_keep, n_pinned, n_len, n_ctx);
+
+    // ---- CRASH-PROOF: chunked prompt eval (avoids n_batch asserts) ----
+    ctx_metrics * m = &st->metrics;
+    const std::vector<llama_token> suffix(tokens.begin() + n_keep, tokens.end());
+    const bool ok = decode_tokens_chunked(ctx, batch, suffix, /*pos0=*/n_keep, /*want_logits_last_token=*/true, m);
+    m->prompts.fetch_add(1, std::memory_order_relaxed);
+    m->tokens_reused.fetch_add(n_keep, std::memory_order_relaxed);
+    m->tokens_prefilled.fetch_add(ok ? suffix.size() : 0, std::memory_order_relaxed);
+    if (!ok) {
+        // Do not abort process; return 0 so Kotlin can handle gracefully.
+        LOGe("completion_init: decode_tokens_chunked failed");
+        llama_kv_cache_clear(ctx);
+        m->set_kv(ctx);
+        return 0;
+    }
+
+    if (pc) pc->tokens = std::move(tokens);
+    m->set_kv(ctx);
+
+    // Return prompt length so Kotlin starts generation at correct position.
+    return prompt_tokens;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_completion_1init(
+        JNIEnv *env,
+        jobject,
+        jlong context_pointer,
+        jlong batch_pointer,
+        jstring jtext,
+        jstring jpinned,
+        jint n_len
+) {
+    auto ctx   = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+
+    if (!ctx || !batch) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "completion_init(): context/batch is null");
+        return 0;
+    }
+
+    std::vector<llama_token> tokens = tokenize_prompt(ctx, jstring_to_string(env, jtext));
+
+    // Pinned head: as much of `pinned` (the templated system turn) as the prompt starts with.
+    int n_pinned = 0;
+    if (jpinned) {
+        const std::vector<llama_token> pinned = tokenize_cached(ctx, jstring_to_string(env, jpinned), true);
+        n_pinned = (int) common_prefix_len(pinned, tokens);
+    }
+
+    return completion_prefill(ctx, batch, std::move(tokens), n_pinned, n_len);
+}
+
+/**
+ * completion_init() from the conversation itself: templates roles[i] / contents[i] with the
+ * model's chat template (plus the assistant prefix) and tokenizes it natively, incrementally
+ * against the previous turn. The first nPinnedMsgs messages (usually the system turn) are
+ * pinned. Returns the prompt length; throws IllegalStateException if the template fails.
+ */
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_completion_1init_1chat(
+        JNIEnv * env, jobject,
+        jlong context_pointer, jlong batch_pointer,
+        jobjectArray jroles, jobjectArray jcontents, jint n_pinned_msgs, jint n_len
+) {
+    auto ctx   = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+
+    if (!ctx || !batch || !jroles || !jcontents) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "completion_init_chat(): context/batch/messages is null");
+        return 0;
+    }
+
+    const llama_model * model = llama_get_model(ctx);
+    const std::vector<common_chat_msg> chat = chat_from_arrays(env, jroles, jcontents);
+
+    std::vector<llama_token> tokens;
+    int n_pinned = 0;
+    try {
+        tokens = tokenize_prompt(ctx, common_chat_apply_template(model, "", chat, true));
+
+        const size_t n_pin = std::min((size_t) std::max<jint>(n_pinned_msgs, 0), chat.size());
+        if (n_pin > 0) {
+            const std::vector<common_chat_msg> head(chat.begin(), chat.begin() + n_pin);
+            const std::vector<llama_token> pinned = tokenize_cached(ctx, common_chat_apply_template(model, "", head, false), true);
+            n_pinned = (int) common_prefix_len(pinned, tokens);
+        }
+    } catch (const std::exception & e) {
+        LOGe("completion_init_chat(): template error: %s", e.what());
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), ("completion_init_chat(): template error: " + std::string(e.what())).c_str());
+        return 0;
+    }
+
+    return completion_prefill(ctx, batch, std::move(tokens), n_pinned, n_len);
+}
+
+/**
+ * completion_init() from token IDs the caller already has (e.g. from chat_tokenize()); the
+ * first nPinned tokens are pinned.
+ */
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_completion_1init_1tokens(
+        JNIEnv * env, jobject,
+        jlong context_pointer, jlong batch_pointer, jintArray jtokens, jint n_pinned, jint n_len
+) {
+    auto ctx   = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+
+    if (!ctx || !batch || !jtokens) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "completion_init_tokens(): context/batch/tokens is null");
+        return 0;
+    }
+
+    const jsize n = env->GetArrayLength(jtokens);
+    std::vector<llama_token> tokens(n);
+    static_assert(sizeof(llama_token) == sizeof(jint), "llama_token must be 32-bit");
+    env->GetIntArrayRegion(jtokens, 0, n, reinterpret_cast<jint *>(tokens.data()));
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+    for (llama_token t : tokens) {
+        if (t < 0 || t >= n_vocab) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "completion_init_tokens(): token id out of range");
+            return 0;
+        }
+    }
+
+    return completion_prefill(ctx, batch, std::move(tokens), n_pinned, n_len);
+}
+
+/**
+ * Token-at-a-time generation: the next run of complete UTF-8 characters (one or more
+ * tokens, ncur advanced once per token), or null at EOG, n_len or on a decode error. A full
+ * context is shifted as in run_generation(), and ncur moved back by the discarded tokens.
+ */
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_completion_1loop(
+        JNIEnv * env,
+        jobject,
+        jlong context_pointer,
+        jlong batch_pointer,
+        jlong sampler_pointer,
+        jint n_len,
+        jobject intvar_ncur
+) {
+    auto ctx     = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch   = reinterpret_cast<llama_batch   *>(batch_pointer);
+    auto sampler = reinterpret_cast<llama_sampler *>(sampler_pointer);
+
+    if (!ctx || !batch || !sampler || !intvar_ncur) return nullptr;
+
+    const int n_ctx = llama_n_ctx(ctx);
+    const auto model = llama_get_model(ctx);
+
+    jclass cls = env->GetObjectClass(intvar_ncur);
+    if (!cls) return nullptr;
+
+    jmethodID midGetValue = env->GetMethodID(cls, "getValue", "()I");
+    jmethodID midInc      = env->GetMethodID(cls, "inc", "()V");
+    jmethodID midShift    = env->GetMethodID(cls, "shift", "(I)V");
+    if (!midGetValue || !midInc || !midShift) {
+        env->DeleteLocalRef(cls);
+        return nullptr;
+    }
+
+    jint n_cur = env->CallIntMethod(intvar_ncur, midGetValue);
+
+    ctx_state * st = get_ctx_state(ctx);
+    prompt_cache_state * pc = &st->prompt;
+    spec_state * sp = st->spec.get();
+    ctx_metrics * m = &st->metrics;
+
+    // Tokens that only add part of a character are decoded within this call, so Kotlin
+    // gets one string per complete character run instead of an empty one per byte token.
+    while (true) {
+        // Queued speculative tokens are already in the cache; shift only between rounds.
+        const int n_before = n_cur;
+        if (n_cur + CTX_SHIFT_MARGIN >= n_ctx && (!sp || sp->queue.empty()) && context_shift(ctx, pc, sp, n_cur)) {
+            m->context_shifts.fetch_add(1, std::memory_order_relaxed);
+            env->CallVoidMethod(intvar_ncur, midShift, (jint) (n_before - n_cur));
+        }
+        // Safety guard (avoid invalid positions)
+        if (n_cur < 0 || n_cur >= n_ctx) break;
+
+        // sample next token (speculative mode: drafted + verified, already decoded)
+        llama_token new_token_id;
+        {
+            metric_timer timer(m, MS_SAMPLE);
+            new_token_id = gen_sample(ctx, batch, sampler, sp, pc, n_cur);
+        }
+
+        if (new_token_id < 0 ||
+            llama_token_is_eog(model, new_token_id) ||
+            n_cur == n_len ||
+            new_token_id == llama_token_eot(model)) {
+            if (new_token_id < 0 && pc) pc->tokens.clear();
+            break;
+        }
+
+        // Convert token piece (may be partial UTF-8)
+        st->utf8.append(common_token_to_piece(ctx, new_token_id));
+
+        env->CallVoidMethod(intvar_ncur, midInc);
+
+        {
+            metric_timer timer(m, MS_DECODE);
+            if (!gen_commit(ctx, batch, sp, pc, new_token_id, n_cur)) break;
+        }
+        m->tokens_generated.fetch_add(1, std::memory_order_relaxed);
+        m->set_kv(ctx);
+        ++n_cur;
+
+        if (st->utf8.ready()) {
+            env->DeleteLocalRef(cls);
+            return utf8_to_jstring(env, st->utf8.take());
+        }
+        m->utf8_stalls.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    env->DeleteLocalRef(cls);
+    return nullptr;
+}
+
+// Why completion_run() returned; mirrored in LLamaAndroid.send().
+enum gen_stop_reason : jint {
+    GEN_ERROR       = -1,
+    GEN_EOG         = 0,
+    GEN_STOP_STRING = 1,
+    GEN_LENGTH      = 2,
+    GEN_CONTEXT     = 3,
+    GEN_CANCELLED   = 4,
+};
+
+// Hands generated UTF-8 to the consumer; false means stop generating.
+using gen_emit_fn = std::function<bool(const char * text, size_t n)>;
+
+/**
+ * Sample/decode loop shared by completion_run() and completion_run_ring().
+ * - stop strings are matched here and never emitted; text that could still become a
+ *   stop string is held back until it can't
+ * - emitted text always ends on a complete UTF-8 character
+ * - a full context is shifted (context_shift()); GEN_CONTEXT only if that isn't possible
+ * - stops on EOG, n_len new tokens, completion_cancel(), or emit() == false
+ */
+static gen_stop_reason run_generation(
+        llama_context * ctx, llama_batch * batch, llama_sampler * sampler,
+        int n_past, int n_len, const std::vector<std::string> & stops,
+        const gen_emit_fn & emit, int & out_produced, int & out_n_cur
+) {
+    const llama_model * model = llama_get_model(ctx);
+    const int n_ctx = llama_n_ctx(ctx);
+    ctx_state * st = get_ctx_state(ctx);
+    std::atomic<bool> * cancel = &st->cancel;
+    prompt_cache_state * pc = &st->prompt;
+    spec_state * sp = st->spec.get();
+    ctx_metrics * m = &st->metrics;
+
+    std::string pending; // generated text not handed out yet
+
+    auto flush = [&](size_t n) -> bool {
+        if (n == 0) return true;
+        const bool more = emit(pending.data(), n);
+        pending.erase(0, n);
+        return more;
+    };
+
+    int n_cur = n_past;
+    int produced = 0;
+    gen_stop_reason reason;
+
+    for (;;) {
+        if (cancel->load(std::memory_order_relaxed)) { reason = GEN_CANCELLED; break; }
+        if (produced >= n_len)                       { reason = GEN_LENGTH;    break; }
+
+        // Queued speculative tokens are already in the cache; shift only between rounds.
+        if (n_cur + CTX_SHIFT_MARGIN >= n_ctx && (!sp || sp->queue.empty()) && context_shift(ctx, pc, sp, n_cur)) {
+            m->context_shifts.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (n_cur < 0 || n_cur >= n_ctx)             { reason = GEN_CONTEXT;   break; }
+
+        llama_token token;
+        {
+            metric_timer timer(m, MS_SAMPLE);
+            token = gen_sample(ctx, batch, sampler, sp, pc, n_cur);
+        }
+        if (token < 0) { reason = GEN_ERROR; break; }
+        if (llama_token_is_eog(model, token) || token == llama_token_eot(model)) { reason = GEN_EOG; break; }
+
+        pending += common_token_to_piece(ctx, token);
+        bool committed;
+        {
+            metric_timer timer(m, MS_DECODE);
+            committed = gen_commit(ctx, batch, sp, pc, token, n_cur);
+        }
+        if (!committed) { reason = GEN_ERROR; break; }
+        ++n_cur;
+        ++produced;
+        m->tokens_generated.fetch_add(1, std::memory_order_relaxed);
+        m->set_kv(ctx);
+
+        size_t stop_at = std::string::npos;
+        for (const auto & st : stops) stop_at = std::min(stop_at, pending.find(st));
+        if (stop_at != std::string::npos) {
+            pending.resize(stop_at);
+            flush(pending.size());
+            reason = GEN_STOP_STRING;
+            break;
+        }
+
+        const size_t utf8_hold = pending.size() - utf8_complete_prefix(pending);
+        if (utf8_hold > 0) m->utf8_stalls.fetch_add(1, std::memory_order_relaxed);
+        const size_t hold = std::max(utf8_hold, stop_partial_len(pending, stops));
+        if (pending.size() > hold && !flush(pending.size() - hold)) { reason = GEN_CANCELLED; break; }
+    }
+
+    // Held-back text that never became a stop string is real output.
+    if (reason != GEN_STOP_STRING && reason != GEN_CANCELLED) flush(pending.size());
+
+    out_produced = produced;
+    out_n_cur    = n_cur;
+    return reason;
+}
+
+static jintArray gen_result(JNIEnv * env, gen_stop_reason reason, int produced, int n_cur) {
+    const jint result[3] = { (jint) reason, produced, n_cur };
+    jintArray out = env->NewIntArray(3);
+    env->SetIntArrayRegion(out, 0, 3, result);
+    return out;
+}
+
+/**
+ * Whole generation in one JNI call (after completion_init()). Text goes out as UTF-8
+ * through the direct `piece_buf`: callback.onPiece(int length) gets the byte count, and
+ * pieces never split a character. onPiece returning false stops generation.
+ * Returns [reason, tokens generated, final n_cur].
+ */
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_completion_1run(
+        JNIEnv * env,
+        jobject,
+        jlong context_pointer,
+        jlong batch_pointer,
+        jlong sampler_pointer,
+        jint n_past,
+        jint n_len,
+        jobjectArray jstops,
+        jobject piece_buf,
+        jobject callback
+) {
+    auto ctx     = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch   = reinterpret_cast<llama_batch   *>(batch_pointer);
+    auto sampler = reinterpret_cast<llama_sampler *>(sampler_pointer);
+
+    if (!ctx || !batch || !sampler || !piece_buf || !callback) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "completion_run(): context/batch/sampler/buffer/callback is null");
+        return nullptr;
+    }
+
+    auto * buf = (char *) env->GetDirectBufferAddress(piece_buf);
+    const jlong cap = env->GetDirectBufferCapacity(piece_buf);
+    if (!buf || cap < 4) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "completion_run(): piece buffer must be direct");
+        return nullptr;
+    }
+
+    // Looked up once per run, not per token.
+    jclass cls = env->GetObjectClass(callback);
+    jmethodID mid_on_piece = env->GetMethodID(cls, "onPiece", "(I)Z");
+    env->DeleteLocalRef(cls);
+    if (!mid_on_piece) return nullptr;
+
+    std::vector<std::string> stops;
+    for (auto & st : string_array_to_vector(env, jstops)) if (!st.empty()) stops.push_back(std::move(st));
+
+    // Buffer-sized slices, cut on character boundaries.
+    const gen_emit_fn emit = [&](const char * text, size_t n) -> bool {
+        size_t off = 0;
+        while (off < n) {
+            size_t take = std::min(n - off, (size_t) cap);
+            if (take < n - off) {
+                while (take > 1 && (((unsigned char) text[off + take]) & 0xC0) == 0x80) --take;
+            }
+            memcpy(buf, text + off, take);
+            const bool more = env->CallBooleanMethod(callback, mid_on_piece, (jint) take);
+            if (env->ExceptionCheck() || !more) return false;
+            off += take;
+        }
+        return true;
+    };
+
+    int produced = 0, n_cur = n_past;
+    const gen_stop_reason reason = run_generation(ctx, batch, sampler, n_past, n_len, stops, emit, produced, n_cur);
+    return gen_result(env, reason, produced, n_cur);
+}
+
+// ---------------- Piece ring buffer (decode thread -> Kotlin consumer) ----------------
+
+/**
+ * Single-producer / single-consumer byte ring. The decode thread appends whole UTF-8
+ * pieces and publishes them by advancing `head` (release); the consumer reads
+ * [tail, head) through a direct ByteBuffer over `data` and hands back `tail`.
+ * Both counters only grow; position = counter & (capacity - 1).
+ */
+struct piece_ring {
+    explicit piece_ring(size_t cap) : capacity(cap), data(cap) {}
+
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    const size_t          capacity; // power of two
+    std::vector<uint8_t>  data;
+
+    // Blocks only while the ring is full; false if cancelled meanwhile.
+    bool write(const char * p, size_t n, const std::atomic<bool> * cancel) {
+        if (n > capacity) {
+            // Never seen in practice (pieces are a few bytes); split on a character boundary.
+            size_t cut = capacity;
+            while (cut > 1 && (((unsigned char) p[cut]) & 0xC0) == 0x80) --cut;
+            return write(p, cut, cancel) && write(p + cut, n - cut, cancel);
+        }
+
+        const uint64_t h = head.load(std::memory_order_relaxed);
+        while (capacity - (size_t) (h - tail.load(std::memory_order_acquire)) < n) {
+            if (cancel && cancel->load(std::memory_order_relaxed)) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        const size_t at    = (size_t) (h & (capacity - 1));
+        const size_t first = std::min(n, capacity - at);
+        memcpy(data.data() + at, p, first);
+        memcpy(data.data(), p + first, n - first);
+        head.store(h + n, std::memory_order_release);
+        return true;
+    }
+};
+
+static std::mutex g_ring_mu;
+static std::unordered_map<jlong, std::shared_ptr<piece_ring>> g_rings;
+
+static std::shared_ptr<piece_ring> get_ring(jlong handle) {
+    std::lock_guard<std::mutex> lk(g_ring_mu);
+    auto it = g_rings.find(handle);
+    return it != g_rings.end() ? it->second : nullptr;
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_ring_1new(JNIEnv *, jobject, jint capacity_bytes) {
+    size_t cap = 4096;
+    while (cap < (size_t) std::max(0, (int) capacity_bytes)) cap <<= 1;
+
+    auto ring = std::make_shared<piece_ring>(cap);
+    const jlong handle = reinterpret_cast<jlong>(ring.get());
+    std::lock_guard<std::mutex> lk(g_ring_mu);
+    g_rings[handle] = std::move(ring);
+    return handle;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_ring_1free(JNIEnv *, jobject, jlong handle) {
+    std::lock_guard<std::mutex> lk(g_ring_mu);
+    g_rings.erase(handle);
+}
+
+// Direct view of the ring's data; valid until ring_free().
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_android_llama_cpp_LLamaAndroid_ring_1view(JNIEnv * env, jobject, jlong handle) {
+    auto ring = get_ring(handle);
+    if (!ring) return nullptr;
+    return env->NewDirectByteBuffer(ring->data.data(), (jlong) ring->capacity);
+}
+
+// Only while neither side is active (start of a send).
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_ring_1reset(JNIEnv *, jobject, jlong handle) {
+    if (auto ring = get_ring(handle)) {
+        ring->tail.store(0, std::memory_order_relaxed);
+        ring->head.store(0, std::memory_order_release);
+    }
+}
+
+// Consumer side: frees everything before `consumed` and returns the current head.
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_ring_1sync(JNIEnv *, jobject, jlong handle, jlong consumed) {
+    auto ring = get_ring(handle);
+    if (!ring) return consumed;
+    ring->tail.store((uint64_t) consumed, std::memory_order_release);
+    return (jlong) ring->head.load(std::memory_order_acquire);
+}
+
+/**
+ * completion_run() with output going into a piece ring instead of a JNI callback, so the
+ * decode thread never waits on the consumer unless the ring is full.
+ * Returns [reason, tokens generated, final n_cur].
+ */
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_completion_1run_1ring(
+        JNIEnv * env,
+        jobject,
+        jlong context_pointer,
+        jlong batch_pointer,
+        jlong sampler_pointer,
+        jint n_past,
+        jint n_len,
+        jobjectArray jstops,
+        jlong ring_handle
+) {
+    auto ctx     = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch   = reinterpret_cast<llama_batch   *>(batch_pointer);
+    auto sampler = reinterpret_cast<llama_sampler *>(sampler_pointer);
+    auto ring    = get_ring(ring_handle);
+
+    if (!ctx || !batch || !sampler || !ring) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "completion_run_ring(): context/batch/sampler/ring is null");
+        return nullptr;
+    }
+
+    std::vector<std::string> stops;
+    for (auto & st : string_array_to_vector(env, jstops)) if (!st.empty()) stops.push_back(std::move(st));
+
+    const std::atomic<bool> * cancel = get_cancel_flag(ctx);
+    const gen_emit_fn emit = [&](const char * text, size_t n) -> bool {
+        return ring->write(text, n, cancel);
+    };
+
+    int produced = 0, n_cur = n_past;
+    const gen_stop_reason reason = run_generation(ctx, batch, sampler, n_past, n_len, stops, emit, produced, n_cur);
+    return gen_result(env, reason, produced, n_cur);
+}
+
+// Any thread: makes the running completion_run() return GEN_CANCELLED after the current token.
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_completion_1cancel(JNIEnv *, jobject, jlong context) {
+    auto ctx = reinterpret_cast<llama_context *>(context);
+    if (!ctx) return;
+    // Lookup only: a cancel racing free_context() must not recreate the state.
+    std::lock_guard<std::mutex> lk(g_ctx_mu);
+    auto it = g_ctx_state.find(ctx);
+    if (it != g_ctx_state.end()) it->second->cancel.store(true);
+}
+
+// ---------------- Parallel sequences ----------------
+
+static void seq_finish(gen_seq & s, gen_stop_reason reason) {
+    if (reason != GEN_STOP_STRING && reason != GEN_CANCELLED) s.ready += s.pending;
+    s.pending.clear();
+    s.reason = reason;
+}
+
+/**
+ * Starts a sequence: tokenizes `text`, decodes all but its last token into a free seq_id
+ * and returns a handle for seq_step / seq_read / seq_state / seq_release. Takes ownership
+ * of `sampler`. Returns 0 when every seq_id is taken or the prefill fails.
+ */
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_seq_1start(
+        JNIEnv * env, jobject,
+        jlong context_pointer, jlong batch_pointer, jlong sampler_pointer,
+        jstring jtext, jint n_len, jobjectArray jstops
+) {
+    auto ctx     = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch   = reinterpret_cast<llama_batch   *>(batch_pointer);
+    auto sampler = reinterpret_cast<llama_sampler *>(sampler_pointer);
+
+    if (!ctx || !batch || !sampler) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "seq_start(): context/batch/sampler is null");
+        return 0;
+    }
+
+    auto s = std::make_shared<gen_seq>();
+    s->ctx   = ctx;
+    s->smpl  = sampler;
+    s->n_len = std::max<jint>(1, n_len);
+    for (auto & st : string_array_to_vector(env, jstops)) if (!st.empty()) s->stops.push_back(std::move(st));
+
+    std::vector<llama_token> tokens = tokenize_cached(ctx, jstring_to_string(env, jtext), true);
+    if (tokens.empty() || (int) tokens.size() + CTX_SHIFT_MARGIN >= (int) llama_n_ctx(ctx)) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "seq_start(): prompt is empty or doesn't fit the context");
+        return 0; // sampler is freed with `s`
+    }
+
+    jlong handle;
+    {
+        std::lock_guard<std::mutex> lk(g_seq_mu);
+        const int n_seq_max = (int) llama_n_seq_max(ctx);
+        std::vector<bool> taken(n_seq_max, false);
+        for (auto & kv : g_seqs) if (kv.second->ctx == ctx && kv.second->seq < n_seq_max) taken[kv.second->seq] = true;
+        for (int id = 1; id < n_seq_max && s->seq == 0; ++id) if (!taken[id]) s->seq = id;
+        if (s->seq == 0) {
+            LOGe("seq_start(): all %d sequences of the context are in use", n_seq_max - 1);
+            return 0;
+        }
+        handle = g_next_seq_handle++;
+        g_seqs[handle] = s;
+    }
+
+    llama_kv_cache_seq_rm(ctx, s->seq, -1, -1);
+    s->next = tokens.back();
+    tokens.pop_back();
+    if (!decode_tokens_chunked(ctx, batch, tokens, 0, false, &get_ctx_state(ctx)->metrics, s->seq)) {
+        LOGe("seq_start(): prefill failed");
+        llama_kv_cache_seq_rm(ctx, s->seq, -1, -1);
+        std::lock_guard<std::mutex> lk(g_seq_mu);
+        g_seqs.erase(handle);
+        return 0;
+    }
+    s->n_past = (int) tokens.size();
+    LOGi("seq_start(): handle=%lld seq=%d prompt_tokens=%d n_len=%d", (long long) handle, (int) s->seq, s->n_past + 1, s->n_len);
+    return handle;
+}
+
+/**
+ * One tick: every running sequence of the context decodes its pending token in a single
+ * llama_decode (up to the batch capacity per tick, the rest wait), then samples its next
+ * one. Returns how many sequences are still running, -1 if the decode failed.
+ */
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_seq_1step(JNIEnv * env, jobject, jlong context_pointer, jlong batch_pointer) {
+    auto ctx   = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch = reinterpret_cast<llama_batch   *>(batch_pointer);
+    if (!ctx || !batch) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "seq_step(): context/batch is null");
+        return -1;
+    }
+
+    std::vector<std::shared_ptr<gen_seq>> seqs = running_seqs(ctx);
+    if (seqs.empty()) return 0;
+
+    const llama_model * model = llama_get_model(ctx);
+    const int n_ctx = (int) llama_n_ctx(ctx);
+    ctx_metrics * m = &get_ctx_state(ctx)->metrics;
+
+    // Fewest tokens first, so when they don't all fit one batch none of them starves.
+    std::sort(seqs.begin(), seqs.end(), [](const auto & a, const auto & b) { return a->produced < b->produced; });
+    if ((int) seqs.size() > get_batch_capacity(batch)) seqs.resize(get_batch_capacity(batch));
+
+    common_batch_clear(*batch);
+    for (auto & s : seqs) {
+        s->i_batch = batch->n_tokens;
+        common_batch_add(*batch, s->next, s->n_past, {s->seq}, true);
+    }
+
+    int rc;
+    {
+        metric_timer timer(m, MS_DECODE);
+        rc = llama_decode(ctx, *batch);
+    }
+    if (rc != 0) {
+        // 1 = no KV slot: the shared cache is full, so these sequences are done.
+        LOGe("seq_step(): llama_decode() failed rc=%d with %zu sequences", rc, seqs.size());
+        for (auto & s : seqs) seq_finish(*s, rc == 1 ? GEN_CONTEXT : GEN_ERROR);
+        return rc == 1 ? (jint) (running_seqs(ctx).size()) : -1;
+    }
+
+    for (auto & s : seqs) {
+        s->n_past++;
+
+        llama_token token;
+        {
+            metric_timer timer(m, MS_SAMPLE);
+            token = llama_sampler_sample(s->smpl, ctx, s->i_batch);
+        }
+        if (llama_token_is_eog(model, token) || token == llama_token_eot(model)) { seq_finish(*s, GEN_EOG); continue; }
+
+        s->pending += common_token_to_piece(ctx, token);
+        s->next = token;
+        s->produced++;
+        m->tokens_generated.fetch_add(1, std::memory_order_relaxed);
+
+        size_t stop_at = std::string::npos;
+        for (const auto & st : s->stops) stop_at = std::min(stop_at, s->pending.find(st));
+        if (stop_at != std::string::npos) {
+            s->pending.resize(stop_at);
+            s->ready += s->pending;
+            seq_finish(*s, GEN_STOP_STRING);
+            continue;
+        }
+        if (s->produced >= s->n_len)           { seq_finish(*s, GEN_LENGTH);  continue; }
+        if (s->n_past + CTX_SHIFT_MARGIN >= n_ctx) { seq_finish(*s, GEN_CONTEXT); continue; }
+
+        const size_t utf8_hold = s->pending.size() - utf8_complete_prefix(s->pending);
+        if (utf8_hold > 0) m->utf8_stalls.fetch_add(1, std::memory_order_relaxed);
+        const size_t hold = std::max(utf8_hold, stop_partial_len(s->pending, s->stops));
+        if (s->pending.size() > hold) {
+            s->ready.append(s->pending, 0, s->pending.size() - hold);
+            s->pending.erase(0, s->pending.size() - hold);
+        }
+    }
+    m->set_kv(ctx);
+
+    return (jint) running_seqs(ctx).size();
+}
+
+// Text produced since the last call (complete UTF-8 only); null for an unknown handle.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_seq_1read(JNIEnv * env, jobject, jlong handle) {
+    auto s = get_seq(handle);
+    if (!s) return nullptr;
+    jstring out = utf8_to_jstring(env, s->ready);
+    s->ready.clear();
+    return out;
+}
+
+// [reason (SEQ_RUNNING = -2 while running, else gen_stop_reason), tokens generated, n_past]; null if unknown.
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_seq_1state(JNIEnv * env, jobject, jlong handle) {
+    auto s = get_seq(handle);
+    if (!s) return nullptr;
+    const jint st[3] = { s->reason, s->produced, s->n_past };
+    jintArray out = env->NewIntArray(3);
+    env->SetIntArrayRegion(out, 0, 3, st);
+    return out;
+}
+
+// Stops the sequence (if running), drops its KV cells and frees its sampler.
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_seq_1release(JNIEnv *, jobject, jlong handle) {
+    std::shared_ptr<gen_seq> s;
+    {
+        std::lock_guard<std::mutex> lk(g_seq_mu);
+        auto it = g_seqs.find(handle);
+        if (it == g_seqs.end()) return;
+        s = std::move(it->second);
+        g_seqs.erase(it);
+    }
+    llama_kv_cache_seq_rm(s->ctx, s->seq, -1, -1);
+}
+
+// Upper bound (us) of the bucket holding quantile q, 0 when empty.
+static uint64_t metric_hist_quantile(const uint32_t * buckets, uint64_t count, double q) {
+    if (count == 0) return 0;
+    const uint64_t rank = (uint64_t) std::ceil(q * (double) count);
+    uint64_t seen = 0;
+    for (int i = 0; i < METRIC_BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) return 1ull << i;
+    }
+    return 1ull << (METRIC_BUCKETS - 1);
+}
+
+static json metric_hist_json(const metric_hist & h) {
+    uint32_t buckets[METRIC_BUCKETS];
+    for (int i = 0; i < METRIC_BUCKETS; ++i) buckets[i] = h.buckets[i].load(std::memory_order_relaxed);
+    const uint64_t count = h.count.load(std::memory_order_relaxed);
+    const uint64_t sum   = h.sum_us.load(std::memory_order_relaxed);
+    return {
+            {"count", count},
+            {"total_ms", sum / 1000.0},
+            {"mean_us", count ? (double) sum / (double) count : 0.0},
+            {"max_us", h.max_us.load(std::memory_order_relaxed)},
+            {"p50_us", metric_hist_quantile(buckets, count, 0.50)},
+            {"p90_us", metric_hist_quantile(buckets, count, 0.90)},
+            {"p99_us", metric_hist_quantile(buckets, count, 0.99)},
+            {"buckets_log2_us", std::vector<uint32_t>(buckets, buckets + METRIC_BUCKETS)},
+    };
+}
+
+/**
+ * Snapshot of the context's hot-path metrics as JSON: one histogram per span (tokenize,
+ * prefill_chunk, sample, decode; percentiles are log2 bucket upper bounds), token counters,
+ * UTF-8 stalls, context shifts and KV occupancy. Any thread, also mid-generation; null for
+ * an unknown or freed context.
+ */
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1metrics(JNIEnv * env, jobject, jlong context) {
+    auto ctx = reinterpret_cast<llama_context *>(context);
+    if (!ctx) return nullptr;
+
+    json out;
+    {
+        // Held while reading so free_context() can't drop the counters underneath us.
+        std::lock_guard<std::mutex> lk(g_ctx_mu);
+        auto it = g_ctx_state.find(ctx);
+        if (it == g_ctx_state.end()) return nullptr;
+        const ctx_metrics & m = it->second->metrics;
+
+        for (int i = 0; i < MS_COUNT; ++i) out[METRIC_SPAN_NAMES[i]] = metric_hist_json(m.span[i]);
+        out["prompts"]          = m.prompts.load(std::memory_order_relaxed);
+        out["tokens_reused"]    = m.tokens_reused.load(std::memory_order_relaxed);
+        out["tokens_prefilled"] = m.tokens_prefilled.load(std::memory_order_relaxed);
+        out["tokens_generated"] = m.tokens_generated.load(std::memory_order_relaxed);
+        out["utf8_stalls"]      = m.utf8_stalls.load(std::memory_order_relaxed);
+        out["context_shifts"]   = m.context_shifts.load(std::memory_order_relaxed);
+        out["kv"] = {
+                {"used", m.kv_used.load(std::memory_order_relaxed)},
+                {"peak", m.kv_peak.load(std::memory_order_relaxed)},
+                {"n_ctx", (int) llama_n_ctx(ctx)},
+        };
+    }
+    return env->NewStringUTF(out.dump().c_str());
+}
+
+// Zeroes the context's metrics (KV occupancy stays current). Any thread.
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_reset_1metrics(JNIEnv *, jobject, jlong context) {
+    auto ctx = reinterpret_cast<llama_context *>(context);
+    if (!ctx) return;
+    std::lock_guard<std::mutex> lk(g_ctx_mu);
+    auto it = g_ctx_state.find(ctx);
+    if (it != g_ctx_state.end()) it->second->metrics.reset();
+}
+
+/**
+ * Embedding API (matches Kotlin JNI signature)
+ * CRASH-PROOF: chunked decode for long inputs.
+ */
+extern "C"
+JNIEXPORT jfloatArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_embedding_1for_1text(
+        JNIEnv * env, jobject,
+        jlong context_pointer, jlong batch_pointer, jstring jtext
+) {
+    auto ctx   = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+
+    if (!ctx || !batch) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "embedding_for_text(): context/batch is null");
+        return env->NewFloatArray(0);
+    }
+
+    std::vector<llama_token> tokens = tokenize_cached(ctx, jstring_to_string(env, jtext), true);
+
+    llama_kv_cache_clear(ctx);
+
+    const int n_ctx = llama_n_ctx(ctx);
+    if ((int)tokens.size() > n_ctx) tokens.resize(n_ctx);
+
+    // chunked eval (logits true on last token for safety)
+    const bool ok = decode_tokens_chunked(ctx, batch, tokens, /*pos0=*/0, /*want_logits_last_token=*/true);
+    if (!ok) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "embedding_for_text(): decode failed");
+        return env->NewFloatArray(0);
+    }
+
+    const llama_model * model = llama_get_model(ctx);
+
+    const float * emb = llama_get_embeddings_seq(ctx, 0);
+    if (!emb) emb = llama_get_embeddings(ctx);
+
+    if (!emb) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "Could not read embeddings from llama context");
+        return env->NewFloatArray(0);
+    }
+
+    const int n_embd = llama_n_embd(model);
+    jfloatArray out = env->NewFloatArray(n_embd);
+    env->SetFloatArrayRegion(out, 0, n_embd, emb);
+    return out;
+}
+
+/**
+ * Batched embedding API: one flat float array of texts.length * n_embd (row per text).
+ */
+extern "C"
+JNIEXPORT jfloatArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_embeddings_1for_1texts(
+        JNIEnv * env, jobject,
+        jlong context_pointer, jlong batch_pointer, jobjectArray jtexts
+) {
+    auto ctx   = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+
+    if (!ctx || !batch || !jtexts) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "embeddings_for_texts(): context/batch/texts is null");
+        return env->NewFloatArray(0);
+    }
+
+    const jsize n = env->GetArrayLength(jtexts);
+    const std::vector<std::string> texts = string_array_to_vector(env, jtexts);
+
+    const int n_embd = llama_n_embd(llama_get_model(ctx));
+    std::vector<float> flat((size_t)n * (size_t)n_embd);
+
+    if (!embed_texts_batched(ctx, batch, texts, flat.data())) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "embeddings_for_texts(): decode failed");
+        return env->NewFloatArray(0);
+    }
+
+    jfloatArray out = env->NewFloatArray((jsize) flat.size());
+    if (!out) return nullptr; // OutOfMemoryError pending
+    env->SetFloatArrayRegion(out, 0, (jsize) flat.size(), flat.data());
+    return out;
+}
+
+/**
+ * Zero-copy batched embedding: writes texts.length rows of n_embd floats (native LE order)
+ * straight into a direct ByteBuffer at offsetBytes. Optional L2 normalization in place.
+ * Returns the number of bytes written.
+ */
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_embeddings_1into_1buffer(
+        JNIEnv * env, jobject,
+        jlong context_pointer, jlong batch_pointer, jobjectArray jtexts,
+        jobject jbuffer, jint offset_bytes, jboolean normalize
+) {
+    auto ctx   = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+
+    if (!ctx || !batch || !jtexts || !jbuffer) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "embeddings_into_buffer(): context/batch/texts/buffer is null");
+        return 0;
+    }
+
+    auto * base = (uint8_t *) env->GetDirectBufferAddress(jbuffer);
+    const jlong capacity = env->GetDirectBufferCapacity(jbuffer);
+    if (!base || capacity < 0) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "embeddings_into_buffer(): buffer is not direct");
+        return 0;
+    }
+
+    const jsize n = env->GetArrayLength(jtexts);
+    const int n_embd = llama_n_embd(llama_get_model(ctx));
+    const jlong needed = (jlong) n * n_embd * (jlong) sizeof(float);
+
+    if (offset_bytes < 0 || (offset_bytes % sizeof(float)) != 0 || offset_bytes + needed > capacity) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "embeddings_into_buffer(): bad offset or buffer too small");
+        return 0;
+    }
+
+    const std::vector<std::string> texts = string_array_to_vector(env, jtexts);
+
+    auto * out = reinterpret_cast<float *>(base + offset_bytes);
+    if (!embed_texts_batched(ctx, batch, texts, out)) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "embeddings_into_buffer(): decode failed");
+        return 0;
+    }
+
+    if (normalize) l2_normalize_rows(out, (size_t) n, n_embd);
+
+    return (jint) needed;
+}
+
+/**
+ * Late-chunked embedding into a direct ByteBuffer (see embed_late_chunked): the context must
+ * have been created with LLAMA_POOLING_TYPE_NONE. spans holds [first, end) segment indices per
+ * chunk; one row of n_embd floats per chunk goes to offsetBytes, optionally L2-normalized.
+ * Returns the bytes written, or 0 when the window is too long for one decode.
+ */
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_embeddings_1late_1chunked(
+        JNIEnv * env, jobject,
+        jlong context_pointer, jlong batch_pointer, jobjectArray jsegments, jintArray jspans,
+        jobject jbuffer, jint offset_bytes, jboolean normalize
+) {
+    auto ctx   = reinterpret_cast<llama_context *>(context_pointer);
+    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+
+    if (!ctx || !batch || !jsegments || !jspans || !jbuffer) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "embeddings_late_chunked(): context/batch/segments/spans/buffer is null");
+        return 0;
+    }
+    if (llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "embeddings_late_chunked(): context must use pooling type NONE");
+        return 0;
+    }
+
+    auto * base = (uint8_t *) env->GetDirectBufferAddress(jbuffer);
+    const jlong capacity = env->GetDirectBufferCapacity(jbuffer);
+    if (!base || capacity < 0) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "embeddings_late_chunked(): buffer is not direct");
+        return 0;
+    }
+
+    const jsize n_segments = env->GetArrayLength(jsegments);
+    const jsize n_spans    = env->GetArrayLength(jspans);
+    std::vector<int> spans((size_t) n_spans);
+    if (n_spans > 0) env->GetIntArrayRegion(jspans, 0, n_spans, reinterpret_cast<jint *>(spans.data()));
+
+    bool spans_ok = (n_spans % 2) == 0;
+    for (jsize i = 0; spans_ok && i < n_spans; i += 2) {
+        spans_ok = spans[i] >= 0 && spans[i] < spans[i + 1] && spans[i + 1] <= n_segments;
+    }
+    if (!spans_ok) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "embeddings_late_chunked(): bad spans");
+        return 0;
+    }
+
+    const size_t n_chunks = (size_t) n_spans / 2;
+    const int n_embd = llama_n_embd(llama_get_model(ctx));
+    const jlong needed = (jlong) n_chunks * n_embd * (jlong) sizeof(float);
+
+    if (offset_bytes < 0 || (offset_bytes % sizeof(float)) != 0 || offset_bytes + needed > capacity) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "embeddings_late_chunked(): bad offset or buffer too small");
+        return 0;
+    }
+    if (n_chunks == 0) return 0;
+
+    const std::vector<std::string> segments = string_array_to_vector(env, jsegments);
+
+    auto * out = reinterpret_cast<float *>(base + offset_bytes);
+    const int rows = embed_late_chunked(ctx, batch, segments, spans, out);
+    if (rows < 0) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "embeddings_late_chunked(): decode failed");
+        return 0;
+    }
+    if (rows == 0) return 0;
+
+    if (normalize) l2_normalize_rows(out, n_chunks, n_embd);
+
+    return (jint) needed;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_embedding_1dim(JNIEnv *, jobject, jlong context_pointer) {
+    auto ctx = reinterpret_cast<llama_context *>(context_pointer);
+    return ctx ? llama_n_embd(llama_get_model(ctx)) : 0;
+}
+
+/**
+ * Token count of each text (with BOS, as the embedding path tokenizes it). The tokens stay in
+ * the tokenizer cache, so embedding the texts that fit afterwards does not tokenize again.
+ */
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_token_1counts(JNIEnv * env, jobject, jlong context_pointer, jobjectArray jtexts) {
+    auto ctx = reinterpret_cast<llama_context *>(context_pointer);
+    if (!ctx || !jtexts) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "token_counts(): context/texts is null");
+        return nullptr;
+    }
+
+    const std::vector<std::string> texts = string_array_to_vector(env, jtexts);
+    std::vector<jint> counts(texts.size());
+    for (size_t i = 0; i < texts.size(); ++i) counts[i] = (jint) tokenize_cached(ctx, texts[i], true).size();
+
+    jintArray out = env->NewIntArray((jsize) counts.size());
+    if (out) env->SetIntArrayRegion(out, 0, (jsize) counts.size(), counts.data());
+    return out;
+}
+
+// [cached entries, cached tokens, hits, misses, incremental prompt tokenizations] for a model.
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_token_1cache_1stats(JNIEnv * env, jobject, jlong model) {
+    jlong v[5] = {0, 0, 0, 0, 0};
+    {
+        std::lock_guard<std::mutex> lk(g_tok_mu);
+        auto it = g_tok_cache.find(reinterpret_cast<llama_model *>(model));
+        if (it != g_tok_cache.end()) {
+            const token_cache & tc = it->second;
+            v[0] = (jlong) tc.entries.size();
+            v[1] = (jlong) tc.n_tokens;
+            v[2] = (jlong) tc.hits;
+            v[3] = (jlong) tc.misses;
+            v[4] = (jlong) tc.incremental;
+        }
+    }
+    jlongArray out = env->NewLongArray(5);
+    if (out) env->SetLongArrayRegion(out, 0, 5, v);
+    return out;
+}
+
+// ---------------- Vector search (RAG) ----------------
+
+/**
+ * fp32 dot product. AArch64: 4 independent NEON FMA accumulators (16 floats / iter).
+ * Elsewhere: scalar with 4 accumulators (the compiler vectorizes it at -O3).
+ */
+static float dot_f32(const float * a, const float * b, int n) {
+    int i = 0;
+    float s = 0.0f;
+#if defined(__aarch64__)
+    float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+    float32x4_t acc2 = vdupq_n_f32(0.0f), acc3 = vdupq_n_f32(0.0f);
+    for (; i + 16 <= n; i += 16) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i),      vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4),  vld1q_f32(b + i + 4));
+        acc2 = vfmaq_f32(acc2, vld1q_f32(a + i + 8),  vld1q_f32(b + i + 8));
+        acc3 = vfmaq_f32(acc3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    s = vaddvq_f32(vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3)));
+#else
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    s = (s0 + s1) + (s2 + s3);
+#endif
+    for (; i < n; ++i) s += a[i] * b[i];
+    return s;
+}
+
+/**
+ * Bounded min-heap keeping the k best (score, index) pairs seen so far.
+ */
+struct topk_heap {
+    using entry = std::pair<float, int>;
+
+    explicit topk_heap(size_t k) : k(std::max<size_t>(1, k)) { items.reserve(this->k); }
+
+    void push(float score, int index) {
+        if (items.size() < k) {
+            items.emplace_back(score, index);
+            std::push_heap(items.begin(), items.end(), std::greater<entry>());
+        } else if (score > items.front().first) {
+            std::pop_heap(items.begin(), items.end(), std::greater<entry>());
+            items.back() = entry(score, index);
+            std::push_heap(items.begin(), items.end(), std::greater<entry>());
+        }
+    }
+
+    // Best first.
+    std::vector<entry> sorted() {
+        std::vector<entry> out = items;
+        std::sort(out.begin(), out.end(), std::greater<entry>());
+        return out;
     }
 
-    if (batch->n_seq_id) free(batch->n_seq_id);
-    if (batch->logits)   free(batch->logits);
+    size_t k;
+    std::vector<entry> items;
+};
+
+static bool vector_search_check_dims(JNIEnv * env, jfloatArray jquery, jintArray out_index, jfloatArray out_score,
+                                     int dim, int k, const char * fn) {
+    if (!jquery || !out_index || !out_score || dim <= 0 || k <= 0 ||
+        env->GetArrayLength(jquery) < dim ||
+        env->GetArrayLength(out_index) < k || env->GetArrayLength(out_score) < k) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), fn);
+        return false;
+    }
+    return true;
+}
 
-    delete batch;
+static jint vector_search_write_hits(JNIEnv * env, const std::vector<topk_heap::entry> & hits,
+                                     jintArray out_index, jfloatArray out_score) {
+    std::vector<jint>   idx(hits.size());
+    std::vector<jfloat> score(hits.size());
+    for (size_t i = 0; i < hits.size(); ++i) {
+        idx[i]   = hits[i].second;
+        score[i] = hits[i].first;
+    }
+    env->SetIntArrayRegion(out_index, 0, (jsize) idx.size(), idx.data());
+    env->SetFloatArrayRegion(out_score, 0, (jsize) score.size(), score.data());
+    return (jint) hits.size();
 }
 
+/**
+ * Top-k dot-product search over `count` packed float32 rows of `dim` in a direct ByteBuffer.
+ * Writes best-first (index, score) pairs into outIndex/outScore and returns how many were written.
+ */
 extern "C"
-JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_new_1sampler(JNIEnv *, jobject, jfloat top_p, jint top_k, jfloat temp) {
-    auto sparams = llama_sampler_chain_default_params();
-    sparams.no_perf = true;
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_vector_1search_1topk(
+        JNIEnv * env, jobject,
+        jfloatArray jquery, jobject jvectors, jint count, jint dim, jint k,
+        jintArray out_index, jfloatArray out_score
+) {
+    if (!vector_search_check_dims(env, jquery, out_index, out_score, dim, k, "vector_search_topk(): bad arguments")) return 0;
+    if (count <= 0) return 0;
 
-    llama_sampler * smpl = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+    auto * base = (const uint8_t *) (jvectors ? env->GetDirectBufferAddress(jvectors) : nullptr);
+    const jlong capacity = jvectors ? env->GetDirectBufferCapacity(jvectors) : -1;
+    if (!base || capacity < (jlong) count * dim * (jlong) sizeof(float) || ((uintptr_t) base % alignof(float)) != 0) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "vector_search_topk(): vectors must be an aligned direct buffer of count*dim floats");
+        return 0;
+    }
 
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(top_k == 0 ? 40 : top_k));
+    std::vector<float> query(dim);
+    env->GetFloatArrayRegion(jquery, 0, dim, query.data());
 
-    if (top_p == 0.0f) {
-        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.9f, 1));
-    } else {
-        float adjusted_top_p = roundf(top_p * 10.0f) / 10.0f;
-        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(adjusted_top_p, 1));
+    const auto * rows = reinterpret_cast<const float *>(base);
+    topk_heap heap((size_t) k);
+    for (int i = 0; i < count; ++i) {
+        heap.push(dot_f32(query.data(), rows + (size_t) i * dim, dim), i);
+    }
+
+    return vector_search_write_hits(env, heap.sorted(), out_index, out_score);
+}
+
+// ---------------- Memory-mapped embeddings store ----------------
+
+/**
+ * embeddings.bin layout (little-endian):
+ *   16-byte header: u32 magic "IEMB", u16 version, u8 dtype, u8 flags, u32 dim, u32 reserved
+ *   then `count` rows of emb_row_bytes(dim, dtype):
+ *     F32: dim floats
+ *     F16: dim IEEE halves
+ *     I8 : f32 scale, then dim int8 (value = q * scale)
+ * Files without the magic are the original headerless float32 rows. The magic read as a
+ * float is ~51.3, which a unit-norm embedding component can't be, so the two never collide.
+ * Must match rag/storage/EmbeddingFormat.kt.
+ */
+enum emb_dtype : uint8_t {
+    EMB_F32 = 0,
+    EMB_F16 = 1,
+    EMB_I8  = 2,
+};
+
+static constexpr uint32_t EMB_MAGIC        = 0x424D4549; // "IEMB"
+static constexpr uint16_t EMB_VERSION      = 1;
+static constexpr size_t   EMB_HEADER_BYTES = 16;
+static constexpr uint8_t  EMB_FLAG_NORMALIZED = 1;
+
+// Candidates scored from quantized rows per requested hit before exact rescoring.
+static constexpr int EMB_RESCORE_FACTOR = 4;
+
+static size_t emb_row_bytes(int dim, uint8_t dtype) {
+    switch (dtype) {
+        case EMB_F16: return (size_t) dim * sizeof(uint16_t);
+        case EMB_I8:  return sizeof(float) + (size_t) dim;
+        default:      return (size_t) dim * sizeof(float);
     }
+}
 
-    if (temp == 0.0f) {
-        llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.4f));
+static inline float half_to_float(uint16_t h) {
+    const uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp  = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0) {
+        if (mant == 0) {
+            bits = sign;
+        } else { // subnormal: renormalize
+            exp = 127 - 15 + 1;
+            while ((mant & 0x400) == 0) { mant <<= 1; --exp; }
+            bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else if (exp == 31) {
+        bits = sign | 0x7f800000 | (mant << 13);
     } else {
-        float adjusted_temp = roundf(temp * 10.0f) / 10.0f;
-        llama_sampler_chain_add(smpl, llama_sampler_init_temp(adjusted_temp));
+        bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Round-to-nearest-even; only used when writing an index.
+static inline uint16_t float_to_half(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    const uint16_t sign = (x >> 16) & 0x8000;
+    const uint32_t absx = x & 0x7fffffff;
+
+    if (absx >= 0x7f800000) return sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 : 0); // inf / nan
+    if (absx >= 0x477ff000) return sign | 0x7c00;                                      // >= 65520 -> inf
+    if (absx < 0x38800000) {                                                           // below 2^-14
+        if (absx < 0x33000000) return sign;                                            // rounds to 0
+        const uint32_t e     = absx >> 23;
+        const uint32_t m     = (absx & 0x7fffff) | 0x800000;
+        const uint32_t shift = 126 - e;
+        uint32_t       r     = m >> shift;
+        const uint32_t rem   = m & ((1u << shift) - 1);
+        const uint32_t half  = 1u << (shift - 1);
+        if (rem > half || (rem == half && (r & 1))) ++r;
+        return sign | (uint16_t) r;
     }
+    uint32_t v = (absx - 0x38000000) >> 13;
+    const uint32_t rem = absx & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (v & 1))) ++v;
+    return sign | (uint16_t) v;
+}
 
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(1234));
-    return reinterpret_cast<jlong>(smpl);
+/** fp32 query x fp16 row. AArch64 widens with vcvt (base ARMv8, no FP16 arithmetic needed). */
+static float dot_f16(const float * a, const uint16_t * b, int n) {
+    int i = 0;
+    float s = 0.0f;
+#if defined(__aarch64__)
+    float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+    float32x4_t acc2 = vdupq_n_f32(0.0f), acc3 = vdupq_n_f32(0.0f);
+    for (; i + 16 <= n; i += 16) {
+        const float16x8_t h0 = vreinterpretq_f16_u16(vld1q_u16(b + i));
+        const float16x8_t h1 = vreinterpretq_f16_u16(vld1q_u16(b + i + 8));
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i),      vcvt_f32_f16(vget_low_f16(h0)));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4),  vcvt_high_f32_f16(h0));
+        acc2 = vfmaq_f32(acc2, vld1q_f32(a + i + 8),  vcvt_f32_f16(vget_low_f16(h1)));
+        acc3 = vfmaq_f32(acc3, vld1q_f32(a + i + 12), vcvt_high_f32_f16(h1));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(b + i))));
+    }
+    s = vaddvq_f32(vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3)));
+#endif
+    for (; i < n; ++i) s += a[i] * half_to_float(b[i]);
+    return s;
+}
+
+/** fp32 query x int8 row (unscaled); the caller applies the row scale. */
+static float dot_i8(const float * a, const int8_t * b, int n) {
+    int i = 0;
+    float s = 0.0f;
+#if defined(__aarch64__)
+    float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+    float32x4_t acc2 = vdupq_n_f32(0.0f), acc3 = vdupq_n_f32(0.0f);
+    for (; i + 16 <= n; i += 16) {
+        const int8x16_t v  = vld1q_s8(b + i);
+        const int16x8_t lo = vmovl_s8(vget_low_s8(v));
+        const int16x8_t hi = vmovl_high_s8(v);
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i),      vcvtq_f32_s32(vmovl_s16(vget_low_s16(lo))));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4),  vcvtq_f32_s32(vmovl_high_s16(lo)));
+        acc2 = vfmaq_f32(acc2, vld1q_f32(a + i + 8),  vcvtq_f32_s32(vmovl_s16(vget_low_s16(hi))));
+        acc3 = vfmaq_f32(acc3, vld1q_f32(a + i + 12), vcvtq_f32_s32(vmovl_high_s16(hi)));
+    }
+    s = vaddvq_f32(vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3)));
+#else
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i]     * (float) b[i];
+        s1 += a[i + 1] * (float) b[i + 1];
+        s2 += a[i + 2] * (float) b[i + 2];
+        s3 += a[i + 3] * (float) b[i + 3];
+    }
+    s = (s0 + s1) + (s2 + s3);
+#endif
+    for (; i < n; ++i) s += a[i] * (float) b[i];
+    return s;
+}
+
+/**
+ * One doc's rows grouped by IVF list: rows[offsets[c] .. offsets[c + 1]) belong to centroid c
+ * of the corpus index with the same generation.
+ */
+struct ivf_lists {
+    uint32_t              generation = 0;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> rows;
+};
+
+struct lex_index; // BM25 postings, see "Lexical index" below
+
+/**
+ * Read-only mmap of a per-doc embeddings file. Pages are faulted in by the scan itself;
+ * nothing is copied onto the Java heap.
+ */
+struct emb_store {
+    void   * base       = MAP_FAILED;
+    size_t   size       = 0;
+    size_t   data_off   = 0;
+    size_t   stride     = 0;
+    int      count      = 0;
+    int      dim        = 0;
+    uint8_t  dtype      = EMB_F32;
+    bool     normalized = false;
+
+    // Optional float32 copy of the same rows, used to rescore quantized candidates.
+    std::shared_ptr<emb_store> full;
+
+    // Set after open by ivf_assign / ivf_attach; read with std::atomic_load.
+    std::shared_ptr<const ivf_lists> lists;
+
+    // Set by lex_attach; read with std::atomic_load.
+    std::shared_ptr<const lex_index> lex;
+
+    const uint8_t * row(int i) const {
+        return reinterpret_cast<const uint8_t *>(base) + data_off + (size_t) i * stride;
+    }
+
+    float score(const float * q, int i) const {
+        const uint8_t * r = row(i);
+        switch (dtype) {
+            case EMB_F16:
+                return dot_f16(q, reinterpret_cast<const uint16_t *>(r), dim);
+            case EMB_I8: {
+                float scale;
+                memcpy(&scale, r, sizeof(scale)); // rows are not 4-aligned when dim % 4 != 0
+                return scale * dot_i8(q, reinterpret_cast<const int8_t *>(r + sizeof(float)), dim);
+            }
+            default:
+                return dot_f32(q, reinterpret_cast<const float *>(r), dim);
+        }
+    }
+
+    void decode(int i, float * out) const {
+        const uint8_t * r = row(i);
+        switch (dtype) {
+            case EMB_F16: {
+                const auto * h = reinterpret_cast<const uint16_t *>(r);
+                for (int j = 0; j < dim; ++j) out[j] = half_to_float(h[j]);
+                break;
+            }
+            case EMB_I8: {
+                float scale;
+                memcpy(&scale, r, sizeof(scale));
+                const auto * q = reinterpret_cast<const int8_t *>(r + sizeof(float));
+                for (int j = 0; j < dim; ++j) out[j] = scale * (float) q[j];
+                break;
+            }
+            default:
+                memcpy(out, r, (size_t) dim * sizeof(float));
+                break;
+        }
+    }
+
+    ~emb_store() {
+        if (base != MAP_FAILED) munmap(base, size);
+    }
+};
+
+static std::shared_ptr<emb_store> emb_store_map(const char * path, int dim) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGe("emb_store_open: cannot open %s", path);
+        return nullptr;
+    }
+
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    auto store = std::make_shared<emb_store>();
+    store->size = (size_t) st.st_size;
+    store->base = mmap(nullptr, store->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file referenced
+
+    if (store->base == MAP_FAILED) {
+        LOGe("emb_store_open: mmap failed for %s", path);
+        return nullptr;
+    }
+
+    const auto * bytes = reinterpret_cast<const uint8_t *>(store->base);
+    uint32_t magic = 0;
+    if (store->size >= EMB_HEADER_BYTES) memcpy(&magic, bytes, sizeof(magic));
+
+    if (magic == EMB_MAGIC) {
+        uint16_t version;
+        uint32_t file_dim;
+        memcpy(&version, bytes + 4, sizeof(version));
+        memcpy(&file_dim, bytes + 8, sizeof(file_dim));
+        store->dtype      = bytes[6];
+        store->normalized = (bytes[7] & EMB_FLAG_NORMALIZED) != 0;
+        store->data_off   = EMB_HEADER_BYTES;
+
+        if (version != EMB_VERSION || store->dtype > EMB_I8 || (int) file_dim != dim) {
+            LOGe("emb_store_open: %s has version=%u dtype=%u dim=%u, expected dim=%d",
+                 path, version, store->dtype, file_dim, dim);
+            return nullptr;
+        }
+    }
+
+    store->dim    = dim;
+    store->stride = emb_row_bytes(dim, store->dtype);
+    const size_t payload = store->size - store->data_off;
+    if (payload == 0 || payload % store->stride != 0) {
+        LOGe("emb_store_open: %s payload %zu is not a multiple of %zu-byte rows", path, payload, store->stride);
+        return nullptr;
+    }
+    store->count = (int) (payload / store->stride);
+
+    // Retrieval always scans the whole file; let the kernel read ahead.
+    madvise(store->base, store->size, MADV_WILLNEED);
+    return store;
+}
+
+// Handles are validated here so a stale handle from Kotlin can never touch unmapped memory.
+// A search holds its own shared_ptr, so close() while scanning only unmaps once the scan ends.
+// Handles come from a counter, never reused, so a stale one can't resolve to a newer store
+// mapped at the same address.
+static std::mutex g_store_mu;
+static std::unordered_map<jlong, std::shared_ptr<emb_store>> g_stores;
+static jlong g_next_store_handle = 1;
+
+static std::shared_ptr<emb_store> get_store(jlong handle) {
+    std::lock_guard<std::mutex> lk(g_store_mu);
+    auto it = g_stores.find(handle);
+    return it != g_stores.end() ? it->second : nullptr;
 }
 
 extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_free_1sampler(JNIEnv *, jobject, jlong sampler_pointer) {
-    llama_sampler_free(reinterpret_cast<llama_sampler *>(sampler_pointer));
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_emb_1store_1open(JNIEnv * env, jobject, jstring jpath, jint dim, jstring jrescore_path) {
+    if (!jpath || dim <= 0) return 0;
+
+    const char * path = env->GetStringUTFChars(jpath, 0);
+    auto store = path ? emb_store_map(path, dim) : nullptr;
+    if (path) env->ReleaseStringUTFChars(jpath, path);
+    if (!store) return 0;
+
+    if (jrescore_path && store->dtype != EMB_F32) {
+        const char * rpath = env->GetStringUTFChars(jrescore_path, 0);
+        auto full = rpath ? emb_store_map(rpath, dim) : nullptr;
+        if (rpath) env->ReleaseStringUTFChars(jrescore_path, rpath);
+
+        if (full && full->dtype == EMB_F32 && full->count == store->count) {
+            store->full = std::move(full);
+        } else {
+            LOGi("emb_store_open: rescore file unusable, scoring quantized rows only");
+        }
+    }
+
+    std::lock_guard<std::mutex> lk(g_store_mu);
+    const jlong handle = g_next_store_handle++;
+    g_stores[handle] = std::move(store);
+    return handle;
 }
 
 extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_kv_1cache_1clear(JNIEnv *, jobject, jlong context) {
-    llama_kv_cache_clear(reinterpret_cast<llama_context *>(context));
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_emb_1store_1count(JNIEnv *, jobject, jlong handle) {
+    auto store = get_store(handle);
+    return store ? store->count : 0;
 }
 
 extern "C"
 JNIEXPORT jint JNICALL
-Java_android_llama_cpp_LLamaAndroid_completion_1init(
-        JNIEnv *env,
-        jobject,
-        jlong context_pointer,
-        jlong batch_pointer,
-        jstring jtext,
-        jint n_len
+Java_android_llama_cpp_LLamaAndroid_emb_1store_1search(
+        JNIEnv * env, jobject,
+        jlong handle, jfloatArray jquery, jint k,
+        jintArray out_index, jfloatArray out_score
 ) {
-    cached_token_chars.clear();
+    auto store = get_store(handle);
+    if (!store) return -1;
+    if (!vector_search_check_dims(env, jquery, out_index, out_score, store->dim, k, "emb_store_search(): bad arguments")) return 0;
 
-    auto ctx   = reinterpret_cast<llama_context *>(context_pointer);
-    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+    std::vector<float> query(store->dim);
+    env->GetFloatArrayRegion(jquery, 0, store->dim, query.data());
 
-    if (!ctx || !batch) {
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "completion_init(): context/batch is null");
+    // Quantized scan first; with a float32 copy available, take a wider candidate set
+    // and re-rank it exactly.
+    const bool rescore = store->full != nullptr;
+    const size_t n_cand = rescore ? std::min<size_t>((size_t) store->count, (size_t) k * EMB_RESCORE_FACTOR) : (size_t) k;
+
+    topk_heap heap(n_cand);
+    for (int i = 0; i < store->count; ++i) {
+        heap.push(store->score(query.data(), i), i);
+    }
+
+    if (!rescore) {
+        return vector_search_write_hits(env, heap.sorted(), out_index, out_score);
+    }
+
+    topk_heap exact((size_t) k);
+    for (const auto & e : heap.items) {
+        exact.push(store->full->score(query.data(), e.second), e.second);
+    }
+    return vector_search_write_hits(env, exact.sorted(), out_index, out_score);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_emb_1store_1close(JNIEnv *, jobject, jlong handle) {
+    std::lock_guard<std::mutex> lk(g_store_mu);
+    g_stores.erase(handle);
+}
+
+/**
+ * Encodes `count` float32 rows from `src` into a complete embeddings file image (header +
+ * rows) in `dst`. Returns the bytes written. Int8 uses one symmetric scale per row.
+ */
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_emb_1quantize(
+        JNIEnv * env, jobject,
+        jobject jsrc, jint count, jint dim, jint dtype, jboolean normalized, jobject jdst
+) {
+    const auto * src = jsrc ? (const float *) env->GetDirectBufferAddress(jsrc) : nullptr;
+    auto       * dst = jdst ? (uint8_t *) env->GetDirectBufferAddress(jdst) : nullptr;
+    if (!src || !dst) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "emb_quantize(): buffers must be direct");
+        return 0;
+    }
+    if (count < 0 || dim <= 0 || dtype < EMB_F32 || dtype > EMB_I8) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "emb_quantize(): bad count/dim/dtype");
         return 0;
     }
 
-    const int n_ctx = llama_n_ctx(ctx);
+    const size_t stride = emb_row_bytes(dim, (uint8_t) dtype);
+    const size_t needed = EMB_HEADER_BYTES + (size_t) count * stride;
+    if (env->GetDirectBufferCapacity(jsrc) < (jlong) count * dim * (jlong) sizeof(float) ||
+        env->GetDirectBufferCapacity(jdst) < (jlong) needed) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "emb_quantize(): buffer too small");
+        return 0;
+    }
 
-    const char * text = env->GetStringUTFChars(jtext, 0);
-    llama_kv_cache_clear(ctx);
+    const uint32_t magic    = EMB_MAGIC;
+    const uint16_t version  = EMB_VERSION;
+    const uint32_t udim     = (uint32_t) dim;
+    const uint32_t reserved = 0;
+    memcpy(dst,      &magic,    sizeof(magic));
+    memcpy(dst + 4,  &version,  sizeof(version));
+    dst[6] = (uint8_t) dtype;
+    dst[7] = normalized ? EMB_FLAG_NORMALIZED : 0;
+    memcpy(dst + 8,  &udim,     sizeof(udim));
+    memcpy(dst + 12, &reserved, sizeof(reserved));
+
+    for (int i = 0; i < count; ++i) {
+        const float * v   = src + (size_t) i * dim;
+        uint8_t     * out = dst + EMB_HEADER_BYTES + (size_t) i * stride;
+
+        switch (dtype) {
+            case EMB_F16: {
+                auto * h = reinterpret_cast<uint16_t *>(out);
+                for (int j = 0; j < dim; ++j) h[j] = float_to_half(v[j]);
+                break;
+            }
+            case EMB_I8: {
+                float amax = 0.0f;
+                for (int j = 0; j < dim; ++j) amax = std::max(amax, std::fabs(v[j]));
+                const float scale = amax / 127.0f;
+                const float inv   = scale > 0.0f ? 1.0f / scale : 0.0f;
+                memcpy(out, &scale, sizeof(scale));
+                auto * q = reinterpret_cast<int8_t *>(out + sizeof(float));
+                for (int j = 0; j < dim; ++j) {
+                    q[j] = (int8_t) std::max(-127.0f, std::min(127.0f, std::round(v[j] * inv)));
+                }
+                break;
+            }
+            default:
+                memcpy(out, v, (size_t) dim * sizeof(float));
+                break;
+        }
+    }
 
-    std::vector<llama_token> tokens = common_tokenize(ctx, text ? text : "", 1);
-    if (text) env->ReleaseStringUTFChars(jtext, text);
+    return (jint) needed;
+}
 
-    // ---- SAFETY: trim prompt to fit KV cache (n_ctx) ----
-    // Ensure prompt + n_len fits n_ctx.
-    int max_prompt = n_ctx - (int)n_len - 8;
-    if (max_prompt < 64) max_prompt = std::max(64, n_ctx - 64);
+// ---------------- IVF index (approximate search across stores) ----------------
 
-    if ((int)tokens.size() > max_prompt) {
-        tokens.erase(tokens.begin(), tokens.end() - max_prompt); // keep last tokens
-        LOGi("completion_init: trimmed prompt to max_prompt=%d (n_ctx=%d n_len=%d)", max_prompt, n_ctx, n_len);
+/**
+ * Corpus-wide inverted-file index. rag/ivf.bin holds spherical k-means centroids trained on
+ * a sample of every doc's rows; each doc keeps its own ivf.lists (rows bucketed by centroid),
+ * so adding a doc only assigns its rows. A query scores the nprobe nearest centroids and
+ * then only rows in those lists. Lists from an older generation are scanned exactly.
+ *
+ * ivf.bin   : u32 magic "IIVF", u16 version, u16 0, u32 dim, u32 nlist, u32 generation,
+ *             u32 trained_rows, 8 bytes 0, then nlist * dim floats
+ * ivf.lists : u32 magic "IIVL", u16 version, u16 0, u32 generation, u32 nlist, u32 count,
+ *             then (nlist + 1) u32 offsets, then count u32 row ids
+ */
+static constexpr uint32_t IVF_MAGIC        = 0x46564949; // "IIVF"
+static constexpr uint32_t IVF_LISTS_MAGIC  = 0x4C564949; // "IIVL"
+static constexpr uint16_t IVF_VERSION      = 1;
+static constexpr size_t   IVF_HEADER_BYTES = 32;
+
+// Below this many rows an exact scan is already well under a millisecond.
+static constexpr size_t IVF_EXACT_BELOW = 4096;
+// k-means trains on at most this many sampled rows per list.
+static constexpr size_t IVF_SAMPLES_PER_LIST = 64;
+
+struct ivf_index {
+    int                dim          = 0;
+    int                nlist        = 0;
+    uint32_t           generation   = 0;
+    uint32_t           trained_rows = 0;
+    std::vector<float> centroids;
+
+    const float * centroid(int c) const { return centroids.data() + (size_t) c * dim; }
+
+    int nearest(const float * v) const {
+        int   best       = 0;
+        float best_score = -INFINITY;
+        for (int c = 0; c < nlist; ++c) {
+            const float s = dot_f32(v, centroid(c), dim);
+            if (s > best_score) { best_score = s; best = c; }
+        }
+        return best;
     }
+};
 
-    const int prompt_tokens = (int)tokens.size();
-    LOGi("completion_init: prompt_tokens=%d n_len=%d n_ctx=%d", prompt_tokens, n_len, n_ctx);
+static std::mutex g_ivf_mu;
+static std::shared_ptr<const ivf_index> g_ivf;
 
-    // ---- CRASH-PROOF: chunked prompt eval (avoids n_batch asserts) ----
-    const bool ok = decode_tokens_chunked(ctx, batch, tokens, /*pos0=*/0, /*want_logits_last_token=*/true);
-    if (!ok) {
-        // Do not abort process; return 0 so Kotlin can handle gracefully.
-        LOGe("completion_init: decode_tokens_chunked failed");
+static std::shared_ptr<const ivf_index> get_ivf() {
+    std::lock_guard<std::mutex> lk(g_ivf_mu);
+    return g_ivf;
+}
+
+// Writes to path.tmp then renames, so readers never see a half-written file.
+static bool write_file_atomic(const std::string & path, const std::vector<uint8_t> & header,
+                              const void * body, size_t body_bytes) {
+    const std::string tmp = path + ".tmp";
+    FILE * f = fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+    bool ok = fwrite(header.data(), 1, header.size(), f) == header.size();
+    ok = ok && (body_bytes == 0 || fwrite(body, 1, body_bytes, f) == body_bytes);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+static std::vector<uint8_t> read_file(const std::string & path) {
+    std::vector<uint8_t> out;
+    FILE * f = fopen(path.c_str(), "rb");
+    if (!f) return out;
+    uint8_t buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) out.insert(out.end(), buf, buf + n);
+    fclose(f);
+    return out;
+}
+
+template <typename T>
+static void put_le(std::vector<uint8_t> & out, size_t at, T v) {
+    memcpy(out.data() + at, &v, sizeof(T));
+}
+
+template <typename T>
+static T get_le(const std::vector<uint8_t> & in, size_t at) {
+    T v;
+    memcpy(&v, in.data() + at, sizeof(T));
+    return v;
+}
+
+// Resolves Kotlin store handles; unknown handles come back as nullptr, in place.
+static std::vector<std::shared_ptr<emb_store>> get_stores(JNIEnv * env, jlongArray jhandles) {
+    std::vector<std::shared_ptr<emb_store>> out;
+    if (!jhandles) return out;
+    const jsize n = env->GetArrayLength(jhandles);
+    std::vector<jlong> handles(n);
+    env->GetLongArrayRegion(jhandles, 0, n, handles.data());
+
+    std::lock_guard<std::mutex> lk(g_store_mu);
+    out.reserve(n);
+    for (jlong h : handles) {
+        auto it = g_stores.find(h);
+        out.push_back(it != g_stores.end() ? it->second : nullptr);
+    }
+    return out;
+}
+
+static std::shared_ptr<const ivf_index> ivf_read(const std::string & path) {
+    const std::vector<uint8_t> bytes = read_file(path);
+    if (bytes.size() < IVF_HEADER_BYTES ||
+        get_le<uint32_t>(bytes, 0) != IVF_MAGIC || get_le<uint16_t>(bytes, 4) != IVF_VERSION) {
+        return nullptr;
+    }
+
+    auto ivf = std::make_shared<ivf_index>();
+    ivf->dim          = (int) get_le<uint32_t>(bytes, 8);
+    ivf->nlist        = (int) get_le<uint32_t>(bytes, 12);
+    ivf->generation   = get_le<uint32_t>(bytes, 16);
+    ivf->trained_rows = get_le<uint32_t>(bytes, 20);
+
+    const size_t n_floats = (size_t) ivf->dim * ivf->nlist;
+    if (ivf->dim <= 0 || ivf->nlist <= 0 || bytes.size() != IVF_HEADER_BYTES + n_floats * sizeof(float)) {
+        LOGe("ivf_load: %s is corrupt", path.c_str());
+        return nullptr;
+    }
+    ivf->centroids.resize(n_floats);
+    memcpy(ivf->centroids.data(), bytes.data() + IVF_HEADER_BYTES, n_floats * sizeof(float));
+    return ivf;
+}
+
+static bool ivf_write(const std::string & path, const ivf_index & ivf) {
+    std::vector<uint8_t> header(IVF_HEADER_BYTES, 0);
+    put_le<uint32_t>(header, 0,  IVF_MAGIC);
+    put_le<uint16_t>(header, 4,  IVF_VERSION);
+    put_le<uint32_t>(header, 8,  (uint32_t) ivf.dim);
+    put_le<uint32_t>(header, 12, (uint32_t) ivf.nlist);
+    put_le<uint32_t>(header, 16, ivf.generation);
+    put_le<uint32_t>(header, 20, ivf.trained_rows);
+    return write_file_atomic(path, header, ivf.centroids.data(), ivf.centroids.size() * sizeof(float));
+}
+
+static std::shared_ptr<const ivf_lists> ivf_lists_read(const std::string & path, int count) {
+    const std::vector<uint8_t> bytes = read_file(path);
+    if (bytes.size() < 20 ||
+        get_le<uint32_t>(bytes, 0) != IVF_LISTS_MAGIC || get_le<uint16_t>(bytes, 4) != IVF_VERSION) {
+        return nullptr;
+    }
+    auto lists = std::make_shared<ivf_lists>();
+    lists->generation = get_le<uint32_t>(bytes, 8);
+    const uint32_t nlist = get_le<uint32_t>(bytes, 12);
+    const uint32_t n     = get_le<uint32_t>(bytes, 16);
+    if ((int) n != count || bytes.size() != 20 + ((size_t) nlist + 1 + n) * sizeof(uint32_t)) return nullptr;
+
+    lists->offsets.resize(nlist + 1);
+    lists->rows.resize(n);
+    memcpy(lists->offsets.data(), bytes.data() + 20, lists->offsets.size() * sizeof(uint32_t));
+    memcpy(lists->rows.data(), bytes.data() + 20 + lists->offsets.size() * sizeof(uint32_t), n * sizeof(uint32_t));
+
+    if (lists->offsets.back() != n) return nullptr;
+    for (uint32_t r : lists->rows) if ((int) r >= count) return nullptr;
+    return lists;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_ivf_1load(JNIEnv * env, jobject, jstring jpath) {
+    auto ivf = ivf_read(jstring_to_string(env, jpath));
+    std::lock_guard<std::mutex> lk(g_ivf_mu);
+    g_ivf = ivf;
+    return ivf ? (jint) ivf->generation : 0;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_ivf_1trained_1rows(JNIEnv *, jobject) {
+    auto ivf = get_ivf();
+    return ivf ? (jint) ivf->trained_rows : 0;
+}
+
+/**
+ * Trains nlist centroids over every row of the given stores (sampled), writes them to `path`
+ * and makes them current. Returns the new generation, or 0 on failure. Existing ivf.lists
+ * files become stale and must be reassigned.
+ */
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_ivf_1train(
+        JNIEnv * env, jobject, jlongArray jstores, jint nlist, jint iters, jstring jpath
+) {
+    std::vector<std::shared_ptr<emb_store>> stores;
+    for (auto & st : get_stores(env, jstores)) if (st) stores.push_back(std::move(st));
+    if (stores.empty() || nlist <= 0) return 0;
+
+    const int dim = stores.front()->dim;
+    size_t total = 0;
+    for (const auto & st : stores) {
+        if (st->dim != dim) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "ivf_train(): stores have different dims");
+            return 0;
+        }
+        total += (size_t) st->count;
+    }
+
+    // Evenly strided sample over the concatenated rows.
+    const size_t n_sample = std::min(total, (size_t) nlist * IVF_SAMPLES_PER_LIST);
+    std::vector<float> sample(n_sample * dim);
+    {
+        size_t s = 0, base = 0;
+        for (const auto & st : stores) {
+            for (; s < n_sample; ++s) {
+                const size_t g = (size_t) ((double) s * total / n_sample);
+                if (g >= base + st->count) break;
+                st->decode((int) (g - base), sample.data() + s * dim);
+            }
+            base += st->count;
+        }
+    }
+
+    const int k = (int) std::min<size_t>((size_t) nlist, n_sample);
+    std::mt19937 rng(0x1B5EEDu);
+
+    auto ivf = std::make_shared<ivf_index>();
+    ivf->dim = dim;
+    ivf->nlist = k;
+    ivf->trained_rows = (uint32_t) total;
+    ivf->centroids.resize((size_t) k * dim);
+
+    std::vector<size_t> perm(n_sample);
+    for (size_t i = 0; i < n_sample; ++i) perm[i] = i;
+    std::shuffle(perm.begin(), perm.end(), rng);
+    for (int c = 0; c < k; ++c) {
+        memcpy(ivf->centroids.data() + (size_t) c * dim, sample.data() + perm[c] * dim, dim * sizeof(float));
+    }
+
+    std::vector<int>    assign(n_sample, -1);
+    std::vector<double> sums((size_t) k * dim);
+    std::vector<size_t> counts(k);
+
+    for (int it = 0; it < std::max(1, (int) iters); ++it) {
+        size_t changed = 0;
+        for (size_t i = 0; i < n_sample; ++i) {
+            const int c = ivf->nearest(sample.data() + i * dim);
+            if (c != assign[i]) { assign[i] = c; ++changed; }
+        }
+        if (it > 0 && changed == 0) break;
+
+        std::fill(sums.begin(), sums.end(), 0.0);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < n_sample; ++i) {
+            double * acc = sums.data() + (size_t) assign[i] * dim;
+            const float * v = sample.data() + i * dim;
+            for (int j = 0; j < dim; ++j) acc[j] += v[j];
+            counts[assign[i]]++;
+        }
+
+        std::uniform_int_distribution<size_t> pick(0, n_sample - 1);
+        for (int c = 0; c < k; ++c) {
+            float * cen = ivf->centroids.data() + (size_t) c * dim;
+            if (counts[c] == 0) { // re-seed empty lists from a random sample
+                memcpy(cen, sample.data() + pick(rng) * dim, dim * sizeof(float));
+                continue;
+            }
+            // Spherical k-means: rows are unit-norm, so the centroid is the normalized mean.
+            const double * acc = sums.data() + (size_t) c * dim;
+            double norm = 0.0;
+            for (int j = 0; j < dim; ++j) norm += acc[j] * acc[j];
+            const double inv = norm > 0.0 ? 1.0 / std::sqrt(norm) : 0.0;
+            for (int j = 0; j < dim; ++j) cen[j] = (float) (acc[j] * inv);
+        }
+    }
+
+    {
+        auto prev = get_ivf();
+        const uint32_t now = (uint32_t) time(nullptr);
+        ivf->generation = std::max(now, prev ? prev->generation + 1 : 1u);
+    }
+
+    const std::string path = jstring_to_string(env, jpath);
+    if (!ivf_write(path, *ivf)) {
+        LOGe("ivf_train: cannot write %s", path.c_str());
         return 0;
     }
 
-    // Return prompt length so Kotlin starts generation at correct position.
-    return prompt_tokens;
+    LOGi("ivf_train: rows=%zu sample=%zu nlist=%d gen=%u", total, n_sample, k, ivf->generation);
+    std::lock_guard<std::mutex> lk(g_ivf_mu);
+    g_ivf = ivf;
+    return (jint) ivf->generation;
+}
+
+/** Buckets one store's rows against the current centroids, writes ivf.lists and attaches it. */
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_ivf_1assign(JNIEnv * env, jobject, jlong handle, jstring jpath) {
+    auto store = get_store(handle);
+    auto ivf   = get_ivf();
+    if (!store || !ivf || ivf->dim != store->dim) return JNI_FALSE;
+
+    std::vector<uint32_t> list_of(store->count);
+    std::vector<float>    row(store->dim);
+    auto lists = std::make_shared<ivf_lists>();
+    lists->generation = ivf->generation;
+    lists->offsets.assign(ivf->nlist + 1, 0);
+
+    for (int i = 0; i < store->count; ++i) {
+        store->decode(i, row.data());
+        list_of[i] = (uint32_t) ivf->nearest(row.data());
+        lists->offsets[list_of[i] + 1]++;
+    }
+    for (int c = 0; c < ivf->nlist; ++c) lists->offsets[c + 1] += lists->offsets[c];
+
+    lists->rows.resize(store->count);
+    std::vector<uint32_t> fill(lists->offsets.begin(), lists->offsets.end() - 1);
+    for (int i = 0; i < store->count; ++i) lists->rows[fill[list_of[i]]++] = (uint32_t) i;
+
+    std::vector<uint8_t> header(20 + lists->offsets.size() * sizeof(uint32_t), 0);
+    put_le<uint32_t>(header, 0,  IVF_LISTS_MAGIC);
+    put_le<uint16_t>(header, 4,  IVF_VERSION);
+    put_le<uint32_t>(header, 8,  lists->generation);
+    put_le<uint32_t>(header, 12, (uint32_t) ivf->nlist);
+    put_le<uint32_t>(header, 16, (uint32_t) store->count);
+    memcpy(header.data() + 20, lists->offsets.data(), lists->offsets.size() * sizeof(uint32_t));
+
+    const std::string path = jstring_to_string(env, jpath);
+    if (!write_file_atomic(path, header, lists->rows.data(), lists->rows.size() * sizeof(uint32_t))) {
+        LOGe("ivf_assign: cannot write %s", path.c_str());
+        return JNI_FALSE;
+    }
+
+    std::atomic_store(&store->lists, std::shared_ptr<const ivf_lists>(lists));
+    return JNI_TRUE;
+}
+
+/**
+ * Loads an existing ivf.lists into a store. False if missing, corrupt or not from the
+ * current centroid generation (the doc is then scanned exactly until reassigned).
+ */
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_ivf_1attach(JNIEnv * env, jobject, jlong handle, jstring jpath) {
+    auto store = get_store(handle);
+    if (!store) return JNI_FALSE;
+
+    auto lists = ivf_lists_read(jstring_to_string(env, jpath), store->count);
+    if (!lists) return JNI_FALSE;
+    std::atomic_store(&store->lists, lists);
+
+    auto ivf = get_ivf();
+    return (ivf && lists->generation == ivf->generation &&
+            lists->offsets.size() == (size_t) ivf->nlist + 1) ? JNI_TRUE : JNI_FALSE;
+}
+
+// Start of each store's rows in one global row space (base[s] .. base[s + 1]); stores that
+// are unknown or of another dim get no rows.
+static std::vector<size_t> store_bases(const std::vector<std::shared_ptr<emb_store>> & stores, int dim) {
+    std::vector<size_t> base(stores.size() + 1, 0);
+    for (size_t s = 0; s < stores.size(); ++s) {
+        const bool ok = stores[s] && stores[s]->dim == dim;
+        base[s + 1] = base[s] + (ok ? (size_t) stores[s]->count : 0);
+    }
+    return base;
+}
+
+static size_t store_of(const std::vector<size_t> & base, int global) {
+    return (size_t) (std::upper_bound(base.begin(), base.end(), (size_t) global) - base.begin()) - 1;
+}
+
+/**
+ * Best-first (score, global row) over every store: IVF-probed where lists are current,
+ * exact otherwise, with quantized candidates re-ranked from float32 copies where present.
+ */
+static std::vector<topk_heap::entry> vector_topk_stores(
+        const std::vector<std::shared_ptr<emb_store>> & stores, const std::vector<size_t> & base,
+        const float * query, int dim, int k, int nprobe
+) {
+    bool any_full = false;
+    for (size_t s = 0; s < stores.size(); ++s) any_full = any_full || (base[s + 1] > base[s] && stores[s]->full);
+    const size_t total = base.back();
+
+    auto ivf = get_ivf();
+    const bool use_ivf = ivf && ivf->dim == dim && total >= IVF_EXACT_BELOW && nprobe > 0 && nprobe < ivf->nlist;
+
+    std::vector<int> probe;
+    if (use_ivf) {
+        topk_heap near((size_t) nprobe);
+        for (int c = 0; c < ivf->nlist; ++c) near.push(dot_f32(query, ivf->centroid(c), dim), c);
+        for (const auto & e : near.items) probe.push_back(e.second);
+    }
+
+    const size_t n_cand = any_full ? (size_t) k * EMB_RESCORE_FACTOR : (size_t) k;
+    topk_heap heap(n_cand);
+
+    for (size_t s = 0; s < stores.size(); ++s) {
+        const auto & st = stores[s];
+        if (base[s + 1] == base[s]) continue;
+
+        auto lists = use_ivf ? std::atomic_load(&st->lists) : nullptr;
+        if (lists && lists->generation == ivf->generation && lists->offsets.size() == (size_t) ivf->nlist + 1) {
+            for (int c : probe) {
+                for (uint32_t p = lists->offsets[c]; p < lists->offsets[c + 1]; ++p) {
+                    const int row = (int) lists->rows[p];
+                    heap.push(st->score(query, row), (int) (base[s] + row));
+                }
+            }
+        } else {
+            for (int row = 0; row < st->count; ++row) {
+                heap.push(st->score(query, row), (int) (base[s] + row));
+            }
+        }
+    }
+
+    if (!any_full) return heap.sorted();
+
+    topk_heap exact((size_t) k);
+    for (const auto & e : heap.items) {
+        const size_t s = store_of(base, e.second);
+        const auto & st = stores[s];
+        const int row = (int) (e.second - base[s]);
+        exact.push(st->full ? st->full->score(query, row) : e.first, e.second);
+    }
+    return exact.sorted();
 }
 
+/**
+ * Global top-k across stores in one call. nprobe is the recall/latency knob: the number of
+ * nearest lists scanned per query (<= 0 or >= nlist means exact). Outputs are (store
+ * position in `stores`, row, score), best-first; returns the count written.
+ */
 extern "C"
-JNIEXPORT jstring JNICALL
-Java_android_llama_cpp_LLamaAndroid_completion_1loop(
-        JNIEnv * env,
-        jobject,
-        jlong context_pointer,
-        jlong batch_pointer,
-        jlong sampler_pointer,
-        jint n_len,
-        jobject intvar_ncur
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_ivf_1search(
+        JNIEnv * env, jobject,
+        jlongArray jstores, jfloatArray jquery, jint k, jint nprobe,
+        jintArray out_store, jintArray out_index, jfloatArray out_score
 ) {
-    auto ctx     = reinterpret_cast<llama_context *>(context_pointer);
-    auto batch   = reinterpret_cast<llama_batch   *>(batch_pointer);
-    auto sampler = reinterpret_cast<llama_sampler *>(sampler_pointer);
-
-    if (!ctx || !batch || !sampler || !intvar_ncur) return nullptr;
-
-    const int n_ctx = llama_n_ctx(ctx);
-    const auto model = llama_get_model(ctx);
-
-    jclass cls = env->GetObjectClass(intvar_ncur);
-    if (!cls) return nullptr;
+    const auto stores = get_stores(env, jstores);
+    if (stores.empty()) return 0;
+
+    int dim = 0;
+    for (const auto & st : stores) if (st) { dim = st->dim; break; }
+    if (dim == 0) return 0;
+    if (!vector_search_check_dims(env, jquery, out_index, out_score, dim, k, "ivf_search(): bad arguments")) return 0;
+    if (!out_store || env->GetArrayLength(out_store) < k) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "ivf_search(): outStore too small");
+        return 0;
+    }
 
-    jmethodID midGetValue = env->GetMethodID(cls, "getValue", "()I");
-    jmethodID midInc      = env->GetMethodID(cls, "inc", "()V");
-    if (!midGetValue || !midInc) {
-        env->DeleteLocalRef(cls);
-        return nullptr;
+    std::vector<float> query(dim);
+    env->GetFloatArrayRegion(jquery, 0, dim, query.data());
+
+    // Global row id = base[s] + row, so one heap ranks every store.
+    const std::vector<size_t> base = store_bases(stores, dim);
+    const std::vector<topk_heap::entry> hits = vector_topk_stores(stores, base, query.data(), dim, k, nprobe);
+
+    const jsize n = (jsize) std::min<size_t>(hits.size(), (size_t) k);
+    std::vector<jint> st_idx(n), row_idx(n);
+    std::vector<jfloat> scores(n);
+    for (jsize i = 0; i < n; ++i) {
+        const size_t s = store_of(base, hits[i].second);
+        st_idx[i]  = (jint) s;
+        row_idx[i] = (jint) (hits[i].second - base[s]);
+        scores[i]  = hits[i].first;
     }
+    env->SetIntArrayRegion(out_store, 0, n, st_idx.data());
+    env->SetIntArrayRegion(out_index, 0, n, row_idx.data());
+    env->SetFloatArrayRegion(out_score, 0, n, scores.data());
+    return n;
+}
 
-    const jint n_cur = env->CallIntMethod(intvar_ncur, midGetValue);
+// ---------------- Lexical index (BM25) ----------------
 
-    // Safety guard (avoid invalid positions)
-    if (n_cur < 0 || n_cur >= n_ctx) {
-        env->DeleteLocalRef(cls);
-        return nullptr;
+/**
+ * Per-doc inverted index over chunk text, built next to embeddings.bin at indexing time
+ * and mmap()ed at retrieval. Terms are lower-cased ASCII letter/digit runs (bytes >= 0x80
+ * are kept as word characters, so non-Latin words stay whole) stored as 64-bit FNV-1a
+ * hashes; exact identifiers, names and numbers match even when their embedding doesn't.
+ *
+ * lexical.bin : u32 magic "ILEX", u16 version, u16 0, u32 count, u32 n_terms, u32 n_postings,
+ *               u32 0, u64 total_len, then count u32 row lengths (padded to 8 bytes), then
+ *               n_terms * {u64 hash, u32 first posting, u32 df} sorted by hash, then
+ *               n_postings * {u32 row, u32 tf}
+ */
+static constexpr uint32_t LEX_MAGIC        = 0x58454C49; // "ILEX"
+static constexpr uint16_t LEX_VERSION      = 1;
+static constexpr size_t   LEX_HEADER_BYTES = 32;
+static constexpr size_t   LEX_TERM_BYTES   = 16;
+static constexpr size_t   LEX_POSTING_BYTES = 8;
+
+// Longer runs are base64 / hex blobs, not words.
+static constexpr size_t LEX_MAX_TERM_BYTES = 48;
+
+static constexpr float BM25_K1 = 1.2f;
+static constexpr float BM25_B  = 0.75f;
+
+// Reciprocal-rank fusion: fused = sum over lists of 1 / (RRF_K + rank).
+static constexpr float RRF_K = 60.0f;
+// Candidates taken from each list per requested hit.
+static constexpr int HYBRID_CANDIDATE_FACTOR = 4;
+
+static uint64_t lex_hash(const char * s, size_t n) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (unsigned char) s[i];
+        h *= 1099511628211ULL;
     }
+    return h;
+}
 
-    // sample next token
-    const auto new_token_id = llama_sampler_sample(sampler, ctx, -1);
+template <typename F>
+static void lex_terms(const std::string & text, F && emit) {
+    char   term[LEX_MAX_TERM_BYTES];
+    size_t n = 0;
+    bool   too_long = false;
+    auto flush = [&]() {
+        if (n > 0 && !too_long) emit(lex_hash(term, n));
+        n = 0;
+        too_long = false;
+    };
+    for (unsigned char c : text) {
+        const bool word = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+        if (!word) { flush(); continue; }
+        if (n == LEX_MAX_TERM_BYTES) { too_long = true; continue; }
+        term[n++] = (char) ((c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c);
+    }
+    flush();
+}
 
-    if (llama_token_is_eog(model, new_token_id) ||
-        n_cur == n_len ||
-        new_token_id == llama_token_eot(model)) {
-        env->DeleteLocalRef(cls);
-        return nullptr;
+/** Read-only mmap of a lexical.bin; lookups read the mapped tables in place. */
+struct lex_index {
+    void   * base       = MAP_FAILED;
+    size_t   size       = 0;
+    int      count      = 0;
+    uint32_t n_terms    = 0;
+    uint32_t n_postings = 0;
+    uint64_t total_len  = 0;
+    size_t   terms_off    = 0;
+    size_t   postings_off = 0;
+
+    const uint8_t * bytes() const { return reinterpret_cast<const uint8_t *>(base); }
+
+    uint32_t row_len(int row) const {
+        uint32_t v;
+        memcpy(&v, bytes() + LEX_HEADER_BYTES + (size_t) row * sizeof(uint32_t), sizeof(v));
+        return v;
     }
 
-    // Convert token piece (may be partial UTF-8)
-    cached_token_chars += common_token_to_piece(ctx, new_token_id);
+    // Binary search over the sorted term table; false when the term is absent.
+    bool find(uint64_t hash, uint32_t & first, uint32_t & df) const {
+        uint32_t lo = 0, hi = n_terms;
+        while (lo < hi) {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            const uint8_t * t = bytes() + terms_off + (size_t) mid * LEX_TERM_BYTES;
+            uint64_t h;
+            memcpy(&h, t, sizeof(h));
+            if (h < hash) {
+                lo = mid + 1;
+            } else if (h > hash) {
+                hi = mid;
+            } else {
+                memcpy(&first, t + 8, sizeof(first));
+                memcpy(&df, t + 12, sizeof(df));
+                return true;
+            }
+        }
+        return false;
+    }
 
-    jstring out = nullptr;
-    if (is_valid_utf8(cached_token_chars.c_str())) {
-        out = env->NewStringUTF(cached_token_chars.c_str());
-        cached_token_chars.clear();
-    } else {
-        out = env->NewStringUTF("");
+    void posting(uint32_t p, uint32_t & row, uint32_t & tf) const {
+        const uint8_t * e = bytes() + postings_off + (size_t) p * LEX_POSTING_BYTES;
+        memcpy(&row, e, sizeof(row));
+        memcpy(&tf, e + 4, sizeof(tf));
     }
 
-    // Decode this token
-    common_batch_clear(*batch);
-    common_batch_add(*batch, new_token_id, n_cur, {0}, true);
+    ~lex_index() {
+        if (base != MAP_FAILED) munmap(base, size);
+    }
+};
 
-    env->CallVoidMethod(intvar_ncur, midInc);
-    env->DeleteLocalRef(cls);
+static std::shared_ptr<const lex_index> lex_map(const std::string & path) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
 
-    const int rc = llama_decode(ctx, *batch);
-    if (rc != 0) {
-        LOGe("llama_decode() failed in completion_loop rc=%d", rc);
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < LEX_HEADER_BYTES) {
+        close(fd);
         return nullptr;
     }
 
-    return out;
+    auto idx = std::make_shared<lex_index>();
+    idx->size = (size_t) st.st_size;
+    idx->base = mmap(nullptr, idx->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (idx->base == MAP_FAILED) return nullptr;
+
+    const uint8_t * b = idx->bytes();
+    uint32_t magic, count;
+    uint16_t version;
+    memcpy(&magic, b, sizeof(magic));
+    memcpy(&version, b + 4, sizeof(version));
+    memcpy(&count, b + 8, sizeof(count));
+    memcpy(&idx->n_terms, b + 12, sizeof(idx->n_terms));
+    memcpy(&idx->n_postings, b + 16, sizeof(idx->n_postings));
+    memcpy(&idx->total_len, b + 24, sizeof(idx->total_len));
+    if (magic != LEX_MAGIC || version != LEX_VERSION) return nullptr;
+
+    idx->count        = (int) count;
+    idx->terms_off    = (LEX_HEADER_BYTES + (size_t) count * sizeof(uint32_t) + 7) & ~(size_t) 7;
+    idx->postings_off = idx->terms_off + (size_t) idx->n_terms * LEX_TERM_BYTES;
+    if (idx->postings_off + (size_t) idx->n_postings * LEX_POSTING_BYTES != idx->size) {
+        LOGe("lex_map: %s is truncated", path.c_str());
+        return nullptr;
+    }
+    return idx;
 }
 
 /**
- * Embedding API (matches Kotlin JNI signature)
- * CRASH-PROOF: chunked decode for long inputs.
+ * Builds lexical.bin for one doc's chunk texts (row i = chunk i, as in embeddings.bin).
+ * Written to path.tmp and renamed.
  */
 extern "C"
-JNIEXPORT jfloatArray JNICALL
-Java_android_llama_cpp_LLamaAndroid_embedding_1for_1text(
-        JNIEnv * env, jobject,
-        jlong context_pointer, jlong batch_pointer, jstring jtext
-) {
-    auto ctx   = reinterpret_cast<llama_context *>(context_pointer);
-    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
-
-    if (!ctx || !batch) {
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "embedding_for_text(): context/batch is null");
-        return env->NewFloatArray(0);
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_lex_1build(JNIEnv * env, jobject, jobjectArray jtexts, jstring jpath) {
+    const std::vector<std::string> texts = string_array_to_vector(env, jtexts);
+    const std::string path = jstring_to_string(env, jpath);
+    if (path.empty()) return JNI_FALSE;
+
+    struct occurrence { uint64_t hash; uint32_t row; uint32_t tf; };
+    std::vector<occurrence> occ;
+    std::vector<uint32_t>   lens(texts.size(), 0);
+    uint64_t total_len = 0;
+
+    std::unordered_map<uint64_t, uint32_t> tf;
+    for (size_t row = 0; row < texts.size(); ++row) {
+        tf.clear();
+        lex_terms(texts[row], [&](uint64_t h) { ++tf[h]; ++lens[row]; });
+        total_len += lens[row];
+        for (const auto & e : tf) occ.push_back({ e.first, (uint32_t) row, e.second });
+    }
+    std::sort(occ.begin(), occ.end(), [](const occurrence & a, const occurrence & b) {
+        return a.hash != b.hash ? a.hash < b.hash : a.row < b.row;
+    });
+
+    const size_t terms_off = (LEX_HEADER_BYTES + lens.size() * sizeof(uint32_t) + 7) & ~(size_t) 7;
+    std::vector<uint8_t> head(terms_off, 0);
+    std::vector<uint8_t> postings(occ.size() * LEX_POSTING_BYTES);
+
+    uint32_t n_terms = 0;
+    for (size_t i = 0; i < occ.size(); ++i) {
+        if (i == 0 || occ[i].hash != occ[i - 1].hash) {
+            size_t j = i;
+            while (j < occ.size() && occ[j].hash == occ[i].hash) ++j;
+            const size_t at = head.size();
+            head.resize(at + LEX_TERM_BYTES);
+            put_le<uint64_t>(head, at, occ[i].hash);
+            put_le<uint32_t>(head, at + 8, (uint32_t) i);
+            put_le<uint32_t>(head, at + 12, (uint32_t) (j - i));
+            ++n_terms;
+        }
+        memcpy(postings.data() + i * LEX_POSTING_BYTES, &occ[i].row, sizeof(uint32_t));
+        memcpy(postings.data() + i * LEX_POSTING_BYTES + 4, &occ[i].tf, sizeof(uint32_t));
     }
 
-    const char * text = env->GetStringUTFChars(jtext, 0);
-    std::vector<llama_token> tokens = common_tokenize(ctx, text ? text : "", 1);
-    if (text) env->ReleaseStringUTFChars(jtext, text);
-
-    llama_kv_cache_clear(ctx);
+    put_le<uint32_t>(head, 0, LEX_MAGIC);
+    put_le<uint16_t>(head, 4, LEX_VERSION);
+    put_le<uint32_t>(head, 8, (uint32_t) lens.size());
+    put_le<uint32_t>(head, 12, n_terms);
+    put_le<uint32_t>(head, 16, (uint32_t) occ.size());
+    put_le<uint64_t>(head, 24, total_len);
+    if (!lens.empty()) memcpy(head.data() + LEX_HEADER_BYTES, lens.data(), lens.size() * sizeof(uint32_t));
+
+    const bool ok = write_file_atomic(path, head, postings.data(), postings.size());
+    if (!ok) LOGe("lex_build(): cannot write %s", path.c_str());
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
 
-    const int n_ctx = llama_n_ctx(ctx);
-    if ((int)tokens.size() > n_ctx) tokens.resize(n_ctx);
+// Attaches a doc's lexical.bin to its open store; false when missing or for another row count.
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_lex_1attach(JNIEnv * env, jobject, jlong handle, jstring jpath) {
+    auto store = get_store(handle);
+    if (!store) return JNI_FALSE;
+
+    auto idx = lex_map(jstring_to_string(env, jpath));
+    if (!idx || idx->count != store->count) return JNI_FALSE;
+    std::atomic_store(&store->lex, idx);
+    return JNI_TRUE;
+}
 
-    // chunked eval (logits true on last token for safety)
-    const bool ok = decode_tokens_chunked(ctx, batch, tokens, /*pos0=*/0, /*want_logits_last_token=*/true);
-    if (!ok) {
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "embedding_for_text(): decode failed");
-        return env->NewFloatArray(0);
+/**
+ * Hybrid retrieval across stores in one call: BM25 over the attached lexical indexes (idf
+ * and average length from the whole set) and the vector top-k as in ivf_search(), fused
+ * by reciprocal rank. With `prefilter`, and at least k lexical matches, only those are
+ * scored against the query vector instead of scanning every row. Outputs, in fused
+ * order: store position, row, vector score and BM25 score (0: no term matched).
+ */
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_hybrid_1search(
+        JNIEnv * env, jobject,
+        jlongArray jstores, jfloatArray jquery, jstring jtext, jint k, jint nprobe, jboolean prefilter,
+        jintArray out_store, jintArray out_index, jfloatArray out_score, jfloatArray out_lex
+) {
+    const auto stores = get_stores(env, jstores);
+    if (stores.empty()) return 0;
+
+    int dim = 0;
+    for (const auto & st : stores) if (st) { dim = st->dim; break; }
+    if (dim == 0) return 0;
+    if (!vector_search_check_dims(env, jquery, out_index, out_score, dim, k, "hybrid_search(): bad arguments")) return 0;
+    if (!out_store || env->GetArrayLength(out_store) < k || !out_lex || env->GetArrayLength(out_lex) < k) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "hybrid_search(): output arrays too small");
+        return 0;
     }
 
-    const llama_model * model = llama_get_model(ctx);
+    std::vector<float> query(dim);
+    env->GetFloatArrayRegion(jquery, 0, dim, query.data());
 
-    const float * emb = llama_get_embeddings_seq(ctx, 0);
-    if (!emb) emb = llama_get_embeddings(ctx);
+    const std::vector<size_t> base = store_bases(stores, dim);
+    const size_t n_cand = (size_t) k * HYBRID_CANDIDATE_FACTOR;
 
-    if (!emb) {
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "Could not read embeddings from llama context");
-        return env->NewFloatArray(0);
+    // Lexical side; collection statistics span every store that has an index.
+    std::vector<std::shared_ptr<const lex_index>> lex(stores.size());
+    uint64_t n_rows = 0, total_len = 0;
+    for (size_t s = 0; s < stores.size(); ++s) {
+        if (base[s + 1] == base[s]) continue;
+        lex[s] = std::atomic_load(&stores[s]->lex);
+        if (lex[s]) { n_rows += (uint64_t) lex[s]->count; total_len += lex[s]->total_len; }
     }
 
-    const int n_embd = llama_n_embd(model);
-    jfloatArray out = env->NewFloatArray(n_embd);
-    env->SetFloatArrayRegion(out, 0, n_embd, emb);
-    return out;
-}
-
-// Format chat for template parsing
-static std::string format_chat(const llama_model *model, const std::string &tmpl, const std::vector<json> &messages) {
-    std::vector<common_chat_msg> chat;
-    chat.reserve(messages.size());
-
-    for (const auto & curr_msg : messages) {
-        std::string role = json_value(curr_msg, "role", std::string(""));
-        std::string content;
-
-        if (curr_msg.contains("content")) {
-            if (curr_msg["content"].is_string()) {
-                content = curr_msg["content"].get<std::string>();
-            } else if (curr_msg["content"].is_array()) {
-                for (const auto &part : curr_msg["content"]) {
-                    if (part.contains("text")) content += "\n" + part["text"].get<std::string>();
+    std::vector<uint64_t> terms;
+    lex_terms(jstring_to_string(env, jtext), [&](uint64_t h) { terms.push_back(h); });
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+    std::unordered_map<int, float> bm25;
+    if (n_rows > 0 && !terms.empty()) {
+        const float avg_len = std::max(1.0f, (float) ((double) total_len / (double) n_rows));
+        for (uint64_t h : terms) {
+            uint64_t df = 0;
+            for (const auto & li : lex) {
+                uint32_t first, n;
+                if (li && li->find(h, first, n)) df += n;
+            }
+            if (df == 0) continue;
+            const float idf = std::log(1.0f + ((float) (n_rows - df) + 0.5f) / ((float) df + 0.5f));
+
+            for (size_t s = 0; s < lex.size(); ++s) {
+                uint32_t first, n;
+                if (!lex[s] || !lex[s]->find(h, first, n)) continue;
+                for (uint32_t p = first; p < first + n; ++p) {
+                    uint32_t row, tf;
+                    lex[s]->posting(p, row, tf);
+                    if ((int) row >= stores[s]->count) continue;
+                    const float norm = BM25_K1 * (1.0f - BM25_B + BM25_B * (float) lex[s]->row_len((int) row) / avg_len);
+                    bm25[(int) (base[s] + row)] += idf * (float) tf * (BM25_K1 + 1.0f) / ((float) tf + norm);
                 }
-            } else {
-                throw std::runtime_error("Invalid 'content' type.");
             }
-        } else {
-            throw std::runtime_error("Missing 'content'.");
         }
+    }
+
+    topk_heap lex_heap(n_cand);
+    for (const auto & e : bm25) lex_heap.push(e.second, e.first);
+    const std::vector<topk_heap::entry> lex_hits = lex_heap.sorted();
 
-        chat.push_back({role, content});
+    // Vector side: a full (or IVF) scan, or only the lexical candidates.
+    auto vector_score = [&](int global) {
+        const size_t s = store_of(base, global);
+        const auto & st = stores[s];
+        const int row = (int) (global - base[s]);
+        return st->full ? st->full->score(query.data(), row) : st->score(query.data(), row);
+    };
+    std::vector<topk_heap::entry> vec_hits;
+    if (prefilter && lex_hits.size() >= (size_t) k) {
+        topk_heap heap(n_cand);
+        for (const auto & e : lex_hits) heap.push(vector_score(e.second), e.second);
+        vec_hits = heap.sorted();
+    } else {
+        vec_hits = vector_topk_stores(stores, base, query.data(), dim, (int) n_cand, nprobe);
+    }
+
+    struct fused { float rrf = 0.0f; float vec = NAN; float lex = 0.0f; };
+    std::unordered_map<int, fused> merged;
+    for (size_t r = 0; r < vec_hits.size(); ++r) {
+        auto & f = merged[vec_hits[r].second];
+        f.rrf += 1.0f / (RRF_K + (float) (r + 1));
+        f.vec  = vec_hits[r].first;
+    }
+    for (size_t r = 0; r < lex_hits.size(); ++r) {
+        auto & f = merged[lex_hits[r].second];
+        f.rrf += 1.0f / (RRF_K + (float) (r + 1));
+        f.lex  = lex_hits[r].first;
     }
 
-    const auto formatted = common_chat_apply_template(model, tmpl, chat, true);
-    LOGi("formatted_chat length=%d", (int)formatted.size());
-    return formatted;
+    topk_heap best((size_t) k);
+    for (const auto & e : merged) best.push(e.second.rrf, e.first);
+    const std::vector<topk_heap::entry> hits = best.sorted();
+
+    const jsize n = (jsize) std::min<size_t>(hits.size(), (size_t) k);
+    std::vector<jint> st_idx(n), row_idx(n);
+    std::vector<jfloat> scores(n), lex_scores(n);
+    for (jsize i = 0; i < n; ++i) {
+        const int global = hits[i].second;
+        const fused & f  = merged[global];
+        const size_t s   = store_of(base, global);
+        st_idx[i]     = (jint) s;
+        row_idx[i]    = (jint) (global - base[s]);
+        scores[i]     = std::isnan(f.vec) ? vector_score(global) : f.vec;
+        lex_scores[i] = f.lex;
+    }
+    env->SetIntArrayRegion(out_store, 0, n, st_idx.data());
+    env->SetIntArrayRegion(out_index, 0, n, row_idx.data());
+    env->SetFloatArrayRegion(out_score, 0, n, scores.data());
+    env->SetFloatArrayRegion(out_lex, 0, n, lex_scores.data());
+    return n;
 }
 
+// Templated prompt (with the assistant prefix) for parallel role / content arrays.
 extern "C"
 JNIEXPORT jstring JNICALL
-Java_android_llama_cpp_LLamaAndroid_oaicompat_1completion_1param_1parse(
-        JNIEnv *env, jobject, jobjectArray allMessages, jlong model
+Java_android_llama_cpp_LLamaAndroid_chat_1apply_1template(
+        JNIEnv * env, jobject, jlong model, jobjectArray jroles, jobjectArray jcontents, jboolean add_ass
 ) {
+    if (!model || !jroles || !jcontents) return env->NewStringUTF("");
     try {
-        std::string parsedData = mapListToJSONString(env, allMessages);
-        std::vector<json> jsonMessages = json::parse(parsedData);
-        const auto formatted = format_chat(reinterpret_cast<const llama_model *>(model), "", jsonMessages);
+        const auto formatted = common_chat_apply_template(
+                reinterpret_cast<const llama_model *>(model), "", chat_from_arrays(env, jroles, jcontents), add_ass);
         return env->NewStringUTF(formatted.c_str());
-    } catch (const std::exception &e) {
-        LOGe("oaicompat parse error: %s", e.what());
+    } catch (const std::exception & e) {
+        LOGe("chat_apply_template(): %s", e.what());
         return env->NewStringUTF("");
     }
 }
 
+/**
+ * Token IDs of the templated conversation, as completion_init_chat() would decode them (before
+ * trimming). Tokenized incrementally against the context's previous prompt, so counting a turn
+ * and then sending it costs one tokenization.
+ */
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_chat_1tokenize(
+        JNIEnv * env, jobject, jlong context_pointer, jobjectArray jroles, jobjectArray jcontents
+) {
+    auto ctx = reinterpret_cast<llama_context *>(context_pointer);
+    if (!ctx || !jroles || !jcontents) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "chat_tokenize(): context/messages is null");
+        return nullptr;
+    }
+
+    std::vector<llama_token> tokens;
+    try {
+        const std::string text = common_chat_apply_template(llama_get_model(ctx), "", chat_from_arrays(env, jroles, jcontents), true);
+        tokens = tokenize_prompt(ctx, text);
+    } catch (const std::exception & e) {
+        LOGe("chat_tokenize(): template error: %s", e.what());
+        return env->NewIntArray(0);
+    }
+
+    jintArray out = env->NewIntArray((jsize) tokens.size());
+    if (out) env->SetIntArrayRegion(out, 0, (jsize) tokens.size(), reinterpret_cast<const jint *>(tokens.data()));
+    return out;
+}
+
 extern "C"
 JNIEXPORT jstring JNICALL
 Java_android_llama_cpp_LLamaAndroid_get_1eot_1str(JNIEnv *env, jobject, jlong jmodel) {
@@ -792,17 +4723,19 @@ Java_android_llama_cpp_LLamaAndroid_bench_1model(
         (void) llama_decode(ctx, *batch);
         const auto t_pp_end = ggml_time_us();
 
-        // text generation
-        llama_kv_cache_clear(ctx);
+        // text generation on top of the prompt (every sequence shares it), so each step
+        // attends over a real context instead of an empty cache
+        for (int j = 1; j < pl; ++j) llama_kv_cache_seq_cp(ctx, 0, j, -1, -1);
         const auto t_tg_start = ggml_time_us();
         for (int i = 0; i < tg; ++i) {
             common_batch_clear(*batch);
             for (int j = 0; j < pl; ++j) {
-                common_batch_add(*batch, 0, i, {j}, true);
+                common_batch_add(*batch, 0, pp + i, {j}, true);
             }
             (void) llama_decode(ctx, *batch);
         }
         const auto t_tg_end = ggml_time_us();
+        llama_kv_cache_clear(ctx);
 
         const double t_pp = double(t_pp_end - t_pp_start) / 1e6;
         const double t_tg = double(t_tg_end - t_tg_start) / 1e6;
@@ -840,3 +4773,456 @@ Java_android_llama_cpp_LLamaAndroid_bench_1model(
 
     return env->NewStringUTF(ss.str().c_str());
 }
+
+// ---------------- Benchmark suite ----------------
+
+/**
+ * llama-bench style sweep on throwaway contexts of the loaded model. Every combination of
+ * pp x depth x n_batch x threads x kv x pl is measured `reps` times:
+ * - pp: prompt of `pp` tokens decoded on top of `depth` tokens already in the cache
+ * - ttft: that prompt plus the first generated step (what a user waits for)
+ * - tg: `tg` steps of `pl` parallel sequences at depth + pp, with per-step latency percentiles
+ * - rss / hwm, average and max CPU frequency, hottest thermal zone before and after each test
+ * Tokens are random (fixed seed) so runs compare across builds.
+ */
+struct bench_config {
+    std::vector<int> pp       = {128, 512};
+    std::vector<int> depth    = {0, 512};
+    std::vector<int> n_batch  = {512};
+    std::vector<int> threads  = {0};
+    std::vector<int> kv       = {KV_F16};
+    std::vector<int> pl       = {1};
+    int  tg         = 32;
+    int  reps       = 3;
+    bool flash_attn = false;
+};
+
+struct bench_sample {
+    double rss_mb      = 0;
+    double hwm_mb      = 0;
+    double cpu_mhz_avg = 0;
+    double cpu_mhz_max = 0;
+    double temp_c      = 0; // hottest zone, 0 = unreadable
+};
+
+static std::atomic<bool> g_bench_cancel{false};
+
+static long proc_status_kb(const char * key) {
+    FILE * f = fopen("/proc/self/status", "r");
+    if (!f) return 0;
+    char line[256];
+    long v = 0;
+    const size_t n = strlen(key);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, n) == 0) {
+            v = strtol(line + n, nullptr, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return v;
+}
+
+static bench_sample bench_sample_now() {
+    bench_sample s;
+    s.rss_mb = proc_status_kb("VmRSS:") / 1024.0;
+    s.hwm_mb = proc_status_kb("VmHWM:") / 1024.0;
+
+    const int n_cpus = get_cpu_topology().n_cpus;
+    int n = 0;
+    for (int i = 0; i < n_cpus; ++i) {
+        const long khz = read_sysfs_long("/sys/devices/system/cpu/cpu" + std::to_string(i) + "/cpufreq/scaling_cur_freq");
+        if (khz <= 0) continue;
+        s.cpu_mhz_avg += khz / 1000.0;
+        s.cpu_mhz_max  = std::max(s.cpu_mhz_max, khz / 1000.0);
+        ++n;
+    }
+    if (n > 0) s.cpu_mhz_avg /= n;
+
+    // Zones are numbered densely on the devices we target; millidegrees (some report degrees).
+    for (int z = 0; z < 64; ++z) {
+        const std::string base = "/sys/class/thermal/thermal_zone" + std::to_string(z);
+        if (access(base.c_str(), F_OK) != 0) break;
+        const long t = read_sysfs_long(base + "/temp");
+        const double c = t > 1000 ? t / 1000.0 : (double) t;
+        if (c > 0 && c < 150) s.temp_c = std::max(s.temp_c, c);
+    }
+    return s;
+}
+
+static json bench_sample_json(const bench_sample & s) {
+    return json{
+            {"rss_mb", s.rss_mb}, {"hwm_mb", s.hwm_mb},
+            {"cpu_mhz_avg", s.cpu_mhz_avg}, {"cpu_mhz_max", s.cpu_mhz_max},
+            {"temp_c", s.temp_c},
+    };
+}
+
+static double percentile(std::vector<double> v, double q) {
+    if (v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    const size_t i = std::min(v.size() - 1, (size_t) std::llround(q * (double) (v.size() - 1)));
+    return v[i];
+}
+
+static double mean_of(const std::vector<double> & v) {
+    if (v.empty()) return 0.0;
+    double sum = 0;
+    for (double x : v) sum += x;
+    return sum / (double) v.size();
+}
+
+static double stdev_of(const std::vector<double> & v) {
+    if (v.size() < 2) return 0.0;
+    const double m = mean_of(v);
+    double ss = 0;
+    for (double x : v) ss += (x - m) * (x - m);
+    return std::sqrt(ss / (double) (v.size() - 1));
+}
+
+static bench_config bench_config_from_json(const std::string & text) {
+    bench_config c;
+    if (text.empty()) return c;
+    const json j = json::parse(text);
+    auto ints = [&](const char * key, std::vector<int> & dst) {
+        if (j.contains(key) && j[key].is_array() && !j[key].empty()) dst = j[key].get<std::vector<int>>();
+    };
+    ints("pp", c.pp);
+    ints("depth", c.depth);
+    ints("n_batch", c.n_batch);
+    ints("threads", c.threads);
+    ints("kv", c.kv);
+    ints("pl", c.pl);
+    c.tg         = std::max(1, json_value(j, "tg", c.tg));
+    c.reps       = std::max(1, json_value(j, "reps", c.reps));
+    c.flash_attn = json_value(j, "flash_attn", c.flash_attn);
+    return c;
+}
+
+// Adds `n` tokens of sequence `seq` at [pos0, pos0 + n) in n_batch chunks; logits on the last.
+static bool bench_decode(llama_context * ctx, llama_batch * batch, const std::vector<llama_token> & toks,
+                         int pos0, int n_batch) {
+    for (int done = 0; done < (int) toks.size(); ) {
+        const int take = std::min(n_batch, (int) toks.size() - done);
+        common_batch_clear(*batch);
+        for (int i = 0; i < take; ++i) {
+            common_batch_add(*batch, toks[done + i], pos0 + done + i, {0}, done + i + 1 == (int) toks.size());
+        }
+        if (llama_decode(ctx, *batch) != 0) return false;
+        done += take;
+    }
+    return true;
+}
+
+/**
+ * One test point: fresh context shaped for it, `reps` repetitions. Returns the JSON row, or
+ * a row with "error" when the context or a decode fails.
+ */
+static json bench_run_one(llama_model * model, llama_batch * batch, const bench_config & cfg,
+                          int pp, int depth, int n_batch, int threads, int kv, int pl) {
+    json row = {
+            {"pp", pp}, {"depth", depth}, {"tg", cfg.tg}, {"n_batch", n_batch},
+            {"threads", threads}, {"kv", kv}, {"pl", pl}, {"flash_attn", cfg.flash_attn},
+    };
+
+    const int batch_cap = get_batch_capacity(batch);
+    const int seq_cap   = get_batch_seq_capacity(batch);
+    if (pl > seq_cap || pl > batch_cap) {
+        row["error"] = "batch too small for pl";
+        return row;
+    }
+
+    const thread_layout lay = pick_thread_layout(threads);
+    row["decode_threads"]  = lay.decode;
+    row["prefill_threads"] = lay.prefill;
+
+    const int n_ctx = depth + pp + cfg.tg + 8;
+    const int n_chunk = std::max(1, std::min(n_batch, batch_cap));
+    llama_context_params p = chat_ctx_params(model, lay, n_ctx, n_chunk, 0, cfg.flash_attn, kv);
+    p.n_seq_max = (uint32_t) std::max(1, pl);
+    if ((int) p.n_ctx < n_ctx) {
+        row["error"] = "exceeds training context";
+        return row;
+    }
+
+    llama_context * ctx = llama_new_context_with_model(model, p);
+    if (!ctx) {
+        row["error"] = "context creation failed";
+        return row;
+    }
+    // Private pools: the point's thread count is what is measured, and replacing the shared
+    // pools would leave the next chat context without the ones the live contexts use.
+    auto pools = new_threadpools(lay);
+    if (pools) llama_attach_threadpool(ctx, pools->decode, pools->batch);
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<llama_token> pick(0, llama_n_vocab(model) - 1);
+    auto random_tokens = [&](int n) {
+        std::vector<llama_token> t(n);
+        for (auto & x : t) x = pick(rng);
+        return t;
+    };
+    const std::vector<llama_token> ctx_tokens    = random_tokens(depth);
+    const std::vector<llama_token> prompt_tokens = random_tokens(pp);
+
+    const bench_sample before = bench_sample_now();
+    std::vector<double> pp_tps, tg_tps, ttft_ms, step_ms;
+    bool ok = true;
+
+    for (int r = 0; r < cfg.reps && ok && !g_bench_cancel.load(); ++r) {
+        llama_kv_cache_clear(ctx);
+        ok = bench_decode(ctx, batch, ctx_tokens, 0, n_chunk);
+        llama_synchronize(ctx);
+        if (!ok) break;
+
+        const int64_t t0 = ggml_time_us();
+        ok = bench_decode(ctx, batch, prompt_tokens, depth, n_chunk);
+        llama_synchronize(ctx);
+        const int64_t t1 = ggml_time_us();
+        if (!ok) break;
+        for (int j = 1; j < pl; ++j) llama_kv_cache_seq_cp(ctx, 0, j, -1, -1);
+
+        const int pos0 = depth + pp;
+        int64_t t_first = 0;
+        const int64_t t_tg0 = ggml_time_us();
+        for (int i = 0; i < cfg.tg && ok; ++i) {
+            common_batch_clear(*batch);
+            for (int j = 0; j < pl; ++j) common_batch_add(*batch, pick(rng), pos0 + i, {j}, true);
+            const int64_t ts = ggml_time_us();
+            ok = llama_decode(ctx, *batch) == 0;
+            llama_synchronize(ctx);
+            const int64_t te = ggml_time_us();
+            step_ms.push_back((te - ts) / 1000.0);
+            if (i == 0) t_first = te;
+        }
+        const int64_t t_tg1 = ggml_time_us();
+        if (!ok) break;
+
+        pp_tps.push_back(pp * 1e6 / (double) std::max<int64_t>(1, t1 - t0));
+        tg_tps.push_back((double) pl * cfg.tg * 1e6 / (double) std::max<int64_t>(1, t_tg1 - t_tg0));
+        ttft_ms.push_back((t_first - t0) / 1000.0);
+    }
+    const bench_sample after = bench_sample_now();
+
+    llama_free(ctx);
+    pools.reset();
+
+    if (!ok) row["error"] = "decode failed";
+    if (g_bench_cancel.load()) row["cancelled"] = true;
+    row["reps_done"]      = (int) pp_tps.size();
+    row["pp_tps"]         = mean_of(pp_tps);
+    row["pp_tps_sd"]      = stdev_of(pp_tps);
+    row["tg_tps"]         = mean_of(tg_tps);
+    row["tg_tps_sd"]      = stdev_of(tg_tps);
+    row["ttft_ms"]        = mean_of(ttft_ms);
+    row["tg_step_ms_p50"] = percentile(step_ms, 0.50);
+    row["tg_step_ms_p90"] = percentile(step_ms, 0.90);
+    row["tg_step_ms_p99"] = percentile(step_ms, 0.99);
+    row["before"]         = bench_sample_json(before);
+    row["after"]          = bench_sample_json(after);
+    return row;
+}
+
+/**
+ * Runs the sweep described by `configJson` (keys of bench_config; missing keys keep the
+ * defaults, "" runs the default sweep) and returns the report as JSON:
+ * {"model": {...}, "system": "...", "config": {...}, "start": {...}, "results": [rows...]}.
+ * `batch` must hold max(n_batch, pl) tokens and pl sequences. bench_cancel() stops it
+ * between repetitions; the rows done so far are still returned.
+ */
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_bench_1suite(JNIEnv * env, jobject, jlong model_pointer, jlong batch_pointer,
+                                                 jstring jconfig) {
+    auto model = reinterpret_cast<llama_model *>(model_pointer);
+    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+    if (!model || !batch) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "bench_suite(): model/batch is null");
+        return nullptr;
+    }
+
+    bench_config cfg;
+    try {
+        cfg = bench_config_from_json(jstring_to_string(env, jconfig));
+    } catch (const std::exception & e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), ("bench_suite(): bad config: " + std::string(e.what())).c_str());
+        return nullptr;
+    }
+    g_bench_cancel.store(false);
+
+    char desc[128];
+    llama_model_desc(model, desc, sizeof(desc));
+
+    json report;
+    report["model"] = {
+            {"desc", desc},
+            {"size_bytes", (int64_t) llama_model_size(model)},
+            {"n_params", (int64_t) llama_model_n_params(model)},
+            {"n_ctx_train", llama_n_ctx_train(model)},
+    };
+    report["system"] = llama_print_system_info();
+    report["config"] = {
+            {"pp", cfg.pp}, {"depth", cfg.depth}, {"n_batch", cfg.n_batch}, {"threads", cfg.threads},
+            {"kv", cfg.kv}, {"pl", cfg.pl}, {"tg", cfg.tg}, {"reps", cfg.reps}, {"flash_attn", cfg.flash_attn},
+    };
+    report["start"] = bench_sample_json(bench_sample_now());
+
+    json rows = json::array();
+    const int64_t t0 = ggml_time_us();
+    for (int kv : cfg.kv)
+    for (int threads : cfg.threads)
+    for (int n_batch : cfg.n_batch)
+    for (int pl : cfg.pl)
+    for (int depth : cfg.depth)
+    for (int pp : cfg.pp) {
+        if (g_bench_cancel.load()) break;
+        json row = bench_run_one(model, batch, cfg, pp, depth, n_batch, threads, kv, pl);
+        LOGi("bench_suite: %s", row.dump().c_str());
+        rows.push_back(std::move(row));
+    }
+    report["results"]    = std::move(rows);
+    report["elapsed_ms"] = (ggml_time_us() - t0) / 1000.0;
+
+    return env->NewStringUTF(report.dump().c_str());
+}
+
+/**
+ * Prefill cost of a real prompt (e.g. a RAG context block) on a throwaway context sized to
+ * it: tokenizes `text` once, then decodes it `reps` times from an empty cache. Returns
+ * {n_tokens, tokenize_ms, prefill_ms mean, prefill_ms best}, or null if a decode failed or
+ * the prompt doesn't fit the training context.
+ */
+extern "C"
+JNIEXPORT jdoubleArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_bench_1prefill_1text(JNIEnv * env, jobject, jlong model_pointer, jlong batch_pointer,
+                                                         jstring jtext, jint threads, jint reps) {
+    auto model = reinterpret_cast<llama_model *>(model_pointer);
+    auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+    if (!model || !batch) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "bench_prefill_text(): model/batch is null");
+        return nullptr;
+    }
+    const std::string text = jstring_to_string(env, jtext);
+
+    const int64_t t_tok0 = ggml_time_us();
+    const std::vector<llama_token> tokens = common_tokenize(model, text, true); // as tokenize_prompt(): no special-token parsing
+    const double tokenize_ms = (ggml_time_us() - t_tok0) / 1000.0;
+    if (tokens.empty() || (int) tokens.size() + 8 > llama_n_ctx_train(model)) return nullptr;
+
+    const thread_layout lay = pick_thread_layout(threads);
+    const int n_chunk = std::max(1, get_batch_capacity(batch));
+    llama_context_params p = chat_ctx_params(model, lay, (int) tokens.size() + 8, n_chunk, 0, false, 0);
+    llama_context * ctx = llama_new_context_with_model(model, p);
+    if (!ctx) return nullptr;
+    auto pools = new_threadpools(lay); // private, as in bench_run_one()
+    if (pools) llama_attach_threadpool(ctx, pools->decode, pools->batch);
+
+    std::vector<double> ms;
+    bool ok = true;
+    for (int r = 0; r < std::max(1, (int) reps) && ok && !g_bench_cancel.load(); ++r) {
+        llama_kv_cache_clear(ctx);
+        const int64_t t0 = ggml_time_us();
+        ok = bench_decode(ctx, batch, tokens, 0, n_chunk);
+        llama_synchronize(ctx);
+        ms.push_back((ggml_time_us() - t0) / 1000.0);
+    }
+    llama_free(ctx);
+    pools.reset();
+    if (!ok || ms.empty()) return nullptr;
+
+    const jdouble out[4] = {
+            (jdouble) tokens.size(), tokenize_ms, mean_of(ms), *std::min_element(ms.begin(), ms.end()),
+    };
+    LOGi("bench_prefill_text: %zu tokens, tokenize %.2f ms, prefill %.1f ms (best %.1f)",
+         tokens.size(), out[1], out[2], out[3]);
+    jdoubleArray arr = env->NewDoubleArray(4);
+    env->SetDoubleArrayRegion(arr, 0, 4, out);
+    return arr;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_bench_1cancel(JNIEnv *, jobject) {
+    g_bench_cancel.store(true);
+}
+
+// ---------------- Session files (resume a conversation without prefill) ----------------
+
+/**
+ * Writes sequence 0's KV cells plus the prompt-cache token mirror to `path` (via a temp
+ * file, so a crash never leaves a torn session). Logits aren't saved: completion_init()
+ * always re-decodes at least one token. Returns false if there is nothing to save.
+ */
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1save(JNIEnv * env, jobject, jlong context_pointer, jstring jpath) {
+    auto ctx = reinterpret_cast<llama_context *>(context_pointer);
+    if (!ctx) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "session_save(): context is null");
+        return JNI_FALSE;
+    }
+
+    prompt_cache_state * pc = get_prompt_cache(ctx);
+    if (!pc || pc->tokens.empty()) return JNI_FALSE;
+
+    const std::string path = jstring_to_string(env, jpath);
+    const std::string tmp  = path + ".tmp";
+
+    const int64_t t0 = ggml_time_us();
+    const size_t n_bytes = llama_state_seq_save_file(ctx, tmp.c_str(), 0, pc->tokens.data(), pc->tokens.size());
+    if (n_bytes == 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOGe("session_save(): failed to write %s", path.c_str());
+        unlink(tmp.c_str());
+        return JNI_FALSE;
+    }
+
+    LOGi("session_save: tokens=%zu bytes=%zu in %.1f ms", pc->tokens.size(), n_bytes, (ggml_time_us() - t0) / 1000.0);
+    return JNI_TRUE;
+}
+
+/**
+ * Loads a session_save() file into sequence 0 and makes its tokens the prompt-cache
+ * mirror, so the next completion_init() reuses them as a cached prefix. Returns the
+ * restored token count; 0 (with an empty cache) if the file is missing or doesn't match
+ * this model/context.
+ */
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1load(JNIEnv * env, jobject, jlong context_pointer, jstring jpath) {
+    auto ctx = reinterpret_cast<llama_context *>(context_pointer);
+    if (!ctx) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "session_load(): context is null");
+        return 0;
+    }
+
+    prompt_cache_state * pc = get_prompt_cache(ctx);
+    const std::string path = jstring_to_string(env, jpath);
+    if (!pc || access(path.c_str(), R_OK) != 0) return 0;
+
+    if (spec_state * sp = get_spec(ctx)) {
+        // The draft cache re-syncs from the restored mirror on its first round.
+        llama_kv_cache_clear(sp->draft_ctx);
+        sp->draft_tokens.clear();
+        sp->queue.clear();
+        sp->has_last = false;
+    }
+
+    const int64_t t0 = ggml_time_us();
+    llama_kv_cache_clear(ctx);
+
+    std::vector<llama_token> tokens(llama_n_ctx(ctx));
+    size_t n_tokens = 0;
+    if (llama_state_seq_load_file(ctx, path.c_str(), 0, tokens.data(), tokens.size(), &n_tokens) == 0 || n_tokens == 0) {
+        LOGe("session_load(): %s does not match this context, ignoring", path.c_str());
+        llama_kv_cache_clear(ctx);
+        pc->tokens.clear();
+        return 0;
+    }
+
+    tokens.resize(n_tokens);
+    pc->tokens   = std::move(tokens);
+    pc->n_reused = 0;
+
+    LOGi("session_load: tokens=%zu in %.1f ms", n_tokens, (ggml_time_us() - t0) / 1000.0);
+    return (jint) n_tokens;
+}
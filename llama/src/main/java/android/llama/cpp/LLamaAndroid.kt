@@ -1,39 +1,91 @@
 package android.llama.cpp
 
+import android.content.ComponentCallbacks2
 import android.util.Log
 import androidx.compose.runtime.getValue
 import androidx.compose.runtime.mutableStateOf
+import kotlinx.coroutines.CompletableDeferred
 import kotlinx.coroutines.CoroutineDispatcher
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.NonCancellable
 import kotlinx.coroutines.asCoroutineDispatcher
+import kotlinx.coroutines.async
+import kotlinx.coroutines.channels.Channel
+import kotlinx.coroutines.channels.ProducerScope
+import kotlinx.coroutines.coroutineScope
+import kotlinx.coroutines.delay
+import kotlinx.coroutines.ensureActive
 import kotlinx.coroutines.flow.Flow
+import kotlinx.coroutines.flow.buffer
+import kotlinx.coroutines.flow.channelFlow
 import kotlinx.coroutines.flow.flow
 import kotlinx.coroutines.flow.flowOn
+import kotlinx.coroutines.isActive
 import kotlinx.coroutines.withContext
 import kotlinx.coroutines.withTimeout
+import org.json.JSONArray
+import org.json.JSONObject
+import java.io.File
+import java.nio.ByteBuffer
+import java.security.MessageDigest
 import java.util.concurrent.Executors
 import kotlin.concurrent.thread
+import kotlin.coroutines.EmptyCoroutineContext
 import kotlin.time.Duration.Companion.seconds
 
 /**
  * Production notes:
  * - Chat (LLM) model + embedding model are managed independently.
  * - Everything runs on a dedicated single-thread runLoop that owns llama.cpp native state.
+ *   Chat and embedding decodes never overlap: they share one set of worker pools, which is
+ *   only safe one context at a time. Search and index natives touch no llama state and run
+ *   off runLoop.
  * - Fully offline.
  *
  * IMPORTANT RAG NOTE:
- * - If n_ctx=1024 and you set n_len too high (e.g., 768), llama.cpp will trim the prompt heavily
- *   (max_prompt ~ 248 tokens), which effectively drops your document context.
- * - Keep n_len ~ 128..256 for RAG to work with n_ctx=1024.
+ * - Prompts longer than the context keep the pinned system prefix plus the newest tokens; the
+ *   oldest turns in between are dropped. Once full, generation shifts the context natively
+ *   (pinned prefix kept, oldest half of the rest discarded) instead of stopping.
+ * - Keep n_len ~ 128..256 for RAG anyway: a shift can push document context out of a long reply.
  */
 class LLamaAndroid {
     private val tag: String? = this::class.simpleName
 
     @Volatile private var stopGeneration: Boolean = false
 
+    // Chat context while send() is generating, so stopTextGeneration() can cancel natively.
+    @Volatile private var activeContext: Long = 0L
+
+    // Loaded chat context (0 when none), for the any-thread metrics calls.
+    @Volatile private var chatContext: Long = 0L
+
+    // Thread count of the chat context, reused for the parallel-sequence contexts.
+    @Volatile private var chatThreads: Int = 0
+
+    // completion_run() hands each piece over here when the piece ring is unavailable (runLoop only).
+    private val pieceBuffer: ByteBuffer = ByteBuffer.allocateDirect(4096)
+
     private val threadLocalState: ThreadLocal<State> = ThreadLocal.withInitial { State.Idle }
 
     @Volatile private var embeddingState: EmbState = EmbState.Idle
 
+    // Last loadEmbeddingModel() arguments: an embedding model evicted for memory is reloaded
+    // from these on its next use.
+    @Volatile private var embeddingSpec: EmbSpec? = null
+    @Volatile private var embeddingLastUsedMs: Long = 0L
+
+    // Pooling-NONE context on the resident embedding model for [embedLateChunkedInto], created
+    // on first use and freed with the model (runLoop only).
+    @Volatile private var embeddingLateContext: Long = 0L
+    // Its KV, counted with the embedding model in [residency].
+    @Volatile private var embeddingLateBytes: Long = 0L
+
+    // Resident footprint estimates (weights + KV), see [residency].
+    @Volatile private var chatBytes: Long = 0L
+    // KV of the open generateParallel() contexts.
+    @Volatile private var parallelBytes: Long = 0L
+    @Volatile private var memoryBudgetBytes: Long = 0L
+
     private val _isSending = mutableStateOf(false)
     private val isSending: Boolean by _isSending
 
@@ -53,19 +105,29 @@ class LLamaAndroid {
 
     fun stopTextGeneration() {
         stopGeneration = true
+        activeContext.takeIf { it != 0L }?.let { completion_cancel(it) }
         _isSending.value = false
         _endedByLimitState.value = false
         _isMarked.value = false
     }
 
+    // Completed once runLoop's thread has loaded the library, for natives that run elsewhere.
+    private val nativeReady = CompletableDeferred<Unit>()
+
     private val runLoop: CoroutineDispatcher = Executors.newSingleThreadExecutor {
         thread(start = false, name = "Llm-RunLoop") {
             Log.d(tag, "Dedicated thread for native code: ${Thread.currentThread().name}")
 
-            System.loadLibrary("llama-android")
+            try {
+                System.loadLibrary("llama-android")
 
-            log_to_android()
-            backend_init()
+                log_to_android()
+                backend_init()
+            } catch (t: Throwable) {
+                nativeReady.completeExceptionally(t)
+                throw t
+            }
+            nativeReady.complete(Unit)
 
             Log.d(tag, system_info())
             it.run()
@@ -80,13 +142,50 @@ class LLamaAndroid {
     // With n_ctx=1024, nlen=256 leaves ~768 tokens for prompt/context.
     @Volatile private var nlenDefault: Int = 256
 
-    // Must match native n_ctx (=1024) unless you also change native new_context() to accept n_ctx.
-    private val context_size: Int = 1024
+    // n_ctx of the loaded chat context (native default 1024; see ContextConfig).
+    @Volatile private var context_size: Int = 1024
 
     // llama_batch allocation capacity.
     // This is allocation capacity; completion_init() still trims prompt to fit n_ctx.
     private val chat_batch_tokens: Int = 1024
 
+    // Sequences per embedding batch. Must match native EMB_N_SEQ_MAX.
+    private val emb_batch_seqs: Int = 16
+
+    // Reuse the KV cache for the prompt prefix shared with the previous turn (system prompt, history).
+    @Volatile private var promptCacheEnabled: Boolean = true
+
+    // Prompt tokens served from the KV cache by the last send(); 0 when nothing matched.
+    @Volatile private var lastReusedTokens: Int = 0
+
+    fun getLastReusedTokens(): Int = lastReusedTokens
+
+    /**
+     * Hot-path metrics of the chat context as JSON (see get_metrics in llama-android.cpp):
+     * tokenize / prefill chunk / sample / decode histograms, reused and generated token
+     * counts, UTF-8 stalls and KV occupancy. Any thread, also while a reply is generating;
+     * null before the first completion.
+     */
+    fun metrics(): String? = chatContext.takeIf { it != 0L }?.let { get_metrics(it) }
+
+    /** Starts a fresh metrics window. Any thread. */
+    fun resetMetrics() {
+        chatContext.takeIf { it != 0L }?.let { reset_metrics(it) }
+    }
+
+    suspend fun setPromptCacheEnabled(enabled: Boolean) {
+        promptCacheEnabled = enabled
+        withContext(runLoop) {
+            when (val state = threadLocalState.get()) {
+                is State.Loaded -> {
+                    set_prompt_cache(state.context, enabled)
+                    if (!enabled) kv_cache_clear(state.context)
+                }
+                else -> {}
+            }
+        }
+    }
+
     fun setDefaultMaxNewTokens(n: Int) {
         // Keep sane bounds; too high breaks RAG by trimming prompt.
         nlenDefault = n.coerceIn(64, 512)
@@ -95,30 +194,133 @@ class LLamaAndroid {
 
     // ---------------- Native bindings (chat) ----------------
     private external fun log_to_android()
-    private external fun load_model(filename: String): Long
+    private fun interface LoadProgressCallback {
+        // 0..1 while weights load (runLoop); false cancels the load.
+        fun onProgress(progress: Float): Boolean
+    }
+
+    private external fun load_model(
+        filename: String,
+        useMmap: Boolean,
+        useMlock: Boolean,
+        nGpuLayers: Int,
+        callback: LoadProgressCallback?
+    ): Long
     private external fun free_model(model: Long)
-    private external fun new_context(model: Long, userThreads: Int): Long
+    private external fun model_size(model: Long): Long
+    private external fun new_context(
+        model: Long,
+        userThreads: Int,
+        nCtx: Int,
+        nBatch: Int,
+        nUbatch: Int,
+        flashAttn: Boolean,
+        kvType: Int,
+        nSeqMax: Int
+    ): Long
+    private external fun context_limits(context: Long): IntArray?
+    private external fun warmup(context: Long, batch: Long): Long
+    private external fun prefetch_file(path: String): Long
+    private external fun context_sizing(model: Long, flashAttn: Boolean, kvType: Int): LongArray?
+    private external fun prefill_probe(
+        model: Long,
+        batch: Long,
+        userThreads: Int,
+        nUbatch: Int,
+        nTokens: Int,
+        flashAttn: Boolean,
+        kvType: Int
+    ): Double
     private external fun free_context(context: Long)
     private external fun backend_init()
     private external fun backend_free()
     private external fun new_batch(nTokens: Int, embd: Int, nSeqMax: Int): Long
     private external fun free_batch(batch: Long)
     private external fun new_sampler(top_p: Float, top_k: Int, temp: Float): Long
+    // Throws IllegalArgumentException when the grammar or schema can't be used.
+    private external fun new_sampler_config(
+        model: Long,
+        topP: Float,
+        topK: Int,
+        temp: Float,
+        minP: Float,
+        penaltyLastN: Int,
+        penaltyRepeat: Float,
+        penaltyFreq: Float,
+        penaltyPresent: Float,
+        seed: Int,
+        grammar: String?,
+        jsonSchema: String?
+    ): Long
     private external fun free_sampler(sampler: Long)
 
     private external fun system_info(): String
+    private external fun bench_suite(model: Long, batch: Long, configJson: String): String?
+    private external fun bench_prefill_text(model: Long, batch: Long, text: String, threads: Int, reps: Int): DoubleArray?
+    private external fun bench_cancel()
 
     private external fun completion_init(
         context: Long,
         batch: Long,
         text: String,
+        pinned: String?,
         nLen: Int
     ): Int
 
-    private external fun oaicompat_completion_param_parse(
-        allmessages: Array<Map<String, String>>,
-        model: Long
-    ): String
+    private external fun completion_init_chat(
+        context: Long,
+        batch: Long,
+        roles: Array<String>,
+        contents: Array<String>,
+        nPinnedMsgs: Int,
+        nLen: Int
+    ): Int
+    private external fun completion_init_tokens(context: Long, batch: Long, tokens: IntArray, nPinned: Int, nLen: Int): Int
+    private external fun chat_apply_template(model: Long, roles: Array<String>, contents: Array<String>, addAss: Boolean): String
+    private external fun chat_tokenize(context: Long, roles: Array<String>, contents: Array<String>): IntArray?
+
+    // Parallel sequences (runLoop only); seq_start takes ownership of the sampler.
+    private external fun seq_start(context: Long, batch: Long, sampler: Long, text: String, nLen: Int, stops: Array<String>): Long
+    private external fun seq_step(context: Long, batch: Long): Int
+    private external fun seq_read(handle: Long): String?
+    private external fun seq_state(handle: Long): IntArray?
+    private external fun seq_release(handle: Long)
+
+    private fun interface PieceCallback {
+        // Called from native with the UTF-8 byte count in pieceBuffer; false stops generation.
+        fun onPiece(length: Int): Boolean
+    }
+
+    private external fun completion_run(
+        context: Long,
+        batch: Long,
+        sampler: Long,
+        nPast: Int,
+        nLen: Int,
+        stopStrings: Array<String>,
+        pieceBuffer: ByteBuffer,
+        callback: PieceCallback
+    ): IntArray?
+
+    private external fun completion_cancel(context: Long)
+    private external fun get_metrics(context: Long): String?
+    private external fun reset_metrics(context: Long)
+
+    private external fun ring_new(capacityBytes: Int): Long
+    private external fun ring_free(ring: Long)
+    private external fun ring_view(ring: Long): ByteBuffer?
+    private external fun ring_reset(ring: Long)
+    private external fun ring_sync(ring: Long, consumed: Long): Long
+
+    private external fun completion_run_ring(
+        context: Long,
+        batch: Long,
+        sampler: Long,
+        nPast: Int,
+        nLen: Int,
+        stopStrings: Array<String>,
+        ring: Long
+    ): IntArray?
 
     private external fun completion_loop(
         context: Long,
@@ -129,42 +331,198 @@ class LLamaAndroid {
     ): String?
 
     private external fun kv_cache_clear(context: Long)
+    private external fun set_prompt_cache(context: Long, enabled: Boolean)
+    private external fun prompt_cache_reused(context: Long): Int
+    private external fun session_save(context: Long, path: String): Boolean
+    private external fun session_load(context: Long, path: String): Int
+    private external fun spec_attach(context: Long, draftContext: Long, draftBatch: Long, nDraft: Int): Boolean
+    private external fun spec_detach(context: Long)
+    private external fun spec_stats(context: Long): LongArray?
     private external fun get_eot_str(model: Long): String
 
     // ---------------- Native bindings (embeddings) ----------------
-    private external fun new_embedding_context(model: Long, userThreads: Int, nCtx: Int, poolingType: Int): Long
+    private external fun new_embedding_context(model: Long, userThreads: Int, nCtx: Int, nBatch: Int, poolingType: Int): Long
     private external fun embedding_for_text(context: Long, batch: Long, text: String): FloatArray
+    private external fun embeddings_for_texts(context: Long, batch: Long, texts: Array<String>): FloatArray
+    private external fun embeddings_into_buffer(
+        context: Long,
+        batch: Long,
+        texts: Array<String>,
+        out: ByteBuffer,
+        offsetBytes: Int,
+        normalize: Boolean
+    ): Int
+    private external fun embeddings_late_chunked(
+        context: Long,
+        batch: Long,
+        segments: Array<String>,
+        spans: IntArray,
+        out: ByteBuffer,
+        offsetBytes: Int,
+        normalize: Boolean
+    ): Int
+    private external fun embedding_dim(context: Long): Int
+    private external fun token_counts(context: Long, texts: Array<String>): IntArray?
+    private external fun token_cache_stats(model: Long): LongArray?
+
+    // ---------------- Native bindings (vector search) ----------------
+    private external fun vector_search_topk(
+        query: FloatArray,
+        vectors: ByteBuffer,
+        count: Int,
+        dim: Int,
+        k: Int,
+        outIndex: IntArray,
+        outScore: FloatArray
+    ): Int
+    private external fun emb_store_open(path: String, dim: Int, rescorePath: String?): Long
+    private external fun emb_store_count(store: Long): Int
+    private external fun emb_store_search(
+        store: Long,
+        query: FloatArray,
+        k: Int,
+        outIndex: IntArray,
+        outScore: FloatArray
+    ): Int
+    private external fun emb_store_close(store: Long)
+    private external fun emb_quantize(
+        src: ByteBuffer,
+        count: Int,
+        dim: Int,
+        dtype: Int,
+        normalized: Boolean,
+        dst: ByteBuffer
+    ): Int
+
+    // ---------------- Native bindings (IVF index) ----------------
+    private external fun ivf_load(path: String): Int
+    private external fun ivf_trained_rows(): Int
+    private external fun ivf_train(stores: LongArray, nlist: Int, iters: Int, path: String): Int
+    private external fun ivf_assign(store: Long, listsPath: String): Boolean
+    private external fun ivf_attach(store: Long, listsPath: String): Boolean
+    private external fun ivf_search(
+        stores: LongArray,
+        query: FloatArray,
+        k: Int,
+        nprobe: Int,
+        outStore: IntArray,
+        outIndex: IntArray,
+        outScore: FloatArray
+    ): Int
+
+    // ---------------- Native bindings (lexical index) ----------------
+    private external fun lex_build(texts: Array<String>, path: String): Boolean
+    private external fun lex_attach(store: Long, path: String): Boolean
+    private external fun hybrid_search(
+        stores: LongArray,
+        query: FloatArray,
+        text: String,
+        k: Int,
+        nprobe: Int,
+        prefilter: Boolean,
+        outStore: IntArray,
+        outIndex: IntArray,
+        outScore: FloatArray,
+        outLex: FloatArray
+    ): Int
 
     // ---------------- Chat API ----------------
 
-    suspend fun load(pathToModel: String, userThreads: Int, topK: Int, topP: Float, temp: Float) {
+    /**
+     * [draftModelPath]: optional small GGUF with the same vocabulary; when set, generation
+     * drafts up to [nDraft] tokens per step with it and verifies them in one decode on the
+     * main model (same output, fewer main-model decodes). A draft that fails to load or
+     * doesn't match the vocab is skipped with a log line.
+     */
+    suspend fun load(
+        pathToModel: String,
+        userThreads: Int,
+        topK: Int,
+        topP: Float,
+        temp: Float,
+        draftModelPath: String? = null,
+        nDraft: Int = 4,
+        contextConfig: ContextConfig = ContextConfig(),
+        loadOptions: LoadOptions = LoadOptions(),
+        onProgress: ((Float) -> Unit)? = null
+    ) {
         withContext(runLoop) {
             when (threadLocalState.get()) {
                 is State.Idle -> {
-                    val model = load_model(pathToModel)
-                    if (model == 0L) throw IllegalStateException("load_model() failed")
+                    // The chat model is pinned: make room for it by evicting the embedding model.
+                    val incoming = File(pathToModel).length() + (draftModelPath?.let { File(it).length() } ?: 0L)
+                    evictFor(incoming)
+
+                    val tLoad = System.nanoTime()
+                    updateLoadTimings { LoadTimings() }
+
+                    // Cancelling the calling coroutine aborts the load between tensors.
+                    val model = load_model(
+                        pathToModel, loadOptions.useMmap, loadOptions.useMlock, loadOptions.gpuLayers
+                    ) { progress ->
+                        onProgress?.invoke(progress)
+                        isActive
+                    }
+                    if (model == 0L) {
+                        ensureActive()
+                        throw IllegalStateException("load_model() failed")
+                    }
+                    val loadMs = (System.nanoTime() - tLoad) / 1_000_000
+                    if (loadOptions.useMmap && loadOptions.prefetch) startPrefetch(pathToModel)
 
                     val cores = Runtime.getRuntime().availableProcessors().coerceAtLeast(2)
                     val threads = userThreads.coerceIn(2, minOf(8, cores))
 
-                    val context = new_context(model, threads)
-                    if (context == 0L) throw IllegalStateException("new_context() failed")
-
-                    val batch = new_batch(chat_batch_tokens, 0, 1)
+                    val batchTokens = maxOf(chat_batch_tokens, contextConfig.nBatch)
+                    val batch = new_batch(batchTokens, 0, 1)
                     if (batch == 0L) throw IllegalStateException("new_batch() failed")
 
+                    val cfg = if (contextConfig.autoTune) {
+                        autoTune(model, batch, threads, File(pathToModel), contextConfig)
+                    } else {
+                        contextConfig
+                    }
+
+                    val context = new_context(model, threads, cfg.nCtx, cfg.nBatch, cfg.nUbatch, cfg.flashAttn, cfg.kvType, 1)
+                    if (context == 0L) throw IllegalStateException("new_context() failed")
+                    context_limits(context)?.let { context_size = it[0] }
+
                     val sampler = new_sampler(top_k = topK, top_p = topP, temp = temp)
                     if (sampler == 0L) throw IllegalStateException("new_sampler() failed")
 
                     val modelEotStr = get_eot_str(model)
                     if (modelEotStr.isBlank()) throw IllegalStateException("get_eot_str() failed")
 
+                    set_prompt_cache(context, promptCacheEnabled)
+
+                    val draft = draftModelPath?.let { loadDraft(it, threads, context, nDraft, loadOptions) }
+
+                    val warmupMs = if (loadOptions.warmUp) {
+                        val us = warmup(context, batch)
+                        draft?.let { warmup(it.context, it.batch) }
+                        if (us >= 0) us / 1000 else -1L
+                    } else -1L
+                    updateLoadTimings { it.copy(loadMs = loadMs, warmupMs = warmupMs) }
+                    Log.i(tag, "load timings: $lastLoadTimings")
+
                     Log.i(
                         tag,
-                        "Loaded chat model=$pathToModel threads=$threads batchTokens=$chat_batch_tokens " +
-                                "context_size=$context_size nlenDefault=$nlenDefault"
+                        "Loaded chat model=$pathToModel threads=$threads batchTokens=$batchTokens " +
+                                "context_size=$context_size config=$cfg nlenDefault=$nlenDefault draft=${draft != null}"
                     )
-                    threadLocalState.set(State.Loaded(model, context, batch, sampler, modelEotStr))
+                    threadLocalState.set(
+                        State.Loaded(model, context, batch, sampler, modelEotStr, draft, modelKey(pathToModel))
+                    )
+                    chatContext = context
+                    chatThreads = threads
+                    // Each model from its own shape: the draft runs an f16 cache without flash attention.
+                    val kvPerToken = context_sizing(model, cfg.flashAttn, cfg.kvType)?.get(0) ?: 0L
+                    val draftKvPerToken = draft?.let { context_sizing(it.model, false, ContextConfig.KV_F16)?.get(0) } ?: 0L
+                    chatBytes = model_size(model) + kvPerToken * context_size +
+                            (draft?.let { model_size(it.model) + draftKvPerToken * context_size } ?: 0L)
+                    Log.i(tag, "residency after chat load: ${residency()}")
+                    // Includes the thread layout picked for this context (cores, counts, pinning).
+                    Log.i(tag, "system_info: ${system_info()}")
                 }
 
                 else -> throw IllegalStateException("Chat model already loaded")
@@ -172,22 +530,242 @@ class LLamaAndroid {
         }
     }
 
+    /**
+     * Chat context shape; 0 keeps the native default (n_ctx 1024, n_batch 512, n_ubatch = n_batch).
+     * A Q8_0 / Q4_0 KV cache roughly halves / quarters its memory; V is only quantized together
+     * with flash attention. autoTune fills the zero fields from free RAM and a prefill probe.
+     */
+    data class ContextConfig(
+        val nCtx: Int = 0,
+        val nBatch: Int = 0,
+        val nUbatch: Int = 0,
+        val flashAttn: Boolean = false,
+        val kvType: Int = KV_F16,
+        val autoTune: Boolean = false
+    ) {
+        companion object {
+            // Native kv_cache_type.
+            const val KV_F16 = 0
+            const val KV_Q8_0 = 1
+            const val KV_Q4_0 = 2
+        }
+    }
+
+    // Best probed n_ubatch per model file (runLoop only); the probe costs a few prefills.
+    private val probedUbatch = HashMap<String, Int>()
+
+    // runLoop only.
+    private fun autoTune(model: Long, batch: Long, threads: Int, modelFile: File, base: ContextConfig): ContextConfig {
+        val sizing = context_sizing(model, base.flashAttn, base.kvType)
+        val kvPerToken = sizing?.get(0) ?: 0L
+        val trainCtx = sizing?.get(1)?.toInt() ?: 0
+
+        val nCtx = if (base.nCtx > 0) base.nCtx else {
+            // Weights are mmapped but end up resident too; give the KV cache half of what's left.
+            val budget = (availableRamBytes() - modelFile.length()).coerceAtLeast(0L) / 2
+            var n = AUTOTUNE_MAX_CTX
+            while (trainCtx in 1 until n) n /= 2
+            while (n > AUTOTUNE_MIN_CTX && n * kvPerToken > budget) n /= 2
+            n
+        }
+
+        val nUbatch = if (base.nUbatch > 0) base.nUbatch else {
+            val key = "${modelFile.path}|${modelFile.length()}|$threads|${base.flashAttn}|${base.kvType}"
+            probedUbatch.getOrPut(key) {
+                AUTOTUNE_UBATCH_CANDIDATES
+                    .filter { it <= nCtx }
+                    .maxByOrNull { prefill_probe(model, batch, threads, it, AUTOTUNE_PROBE_TOKENS, base.flashAttn, base.kvType) }
+                    ?: 0
+            }
+        }
+
+        val nBatch = if (base.nBatch > 0) base.nBatch else maxOf(CHAT_N_BATCH, nUbatch)
+        Log.i(tag, "autoTune: kvBytesPerToken=$kvPerToken trainCtx=$trainCtx -> nCtx=$nCtx nBatch=$nBatch nUbatch=$nUbatch")
+        return base.copy(nCtx = nCtx, nBatch = nBatch, nUbatch = nUbatch)
+    }
+
+    private fun availableRamBytes(): Long = meminfoBytes("MemAvailable:")
+
+    private fun meminfoBytes(key: String): Long = runCatching {
+        File("/proc/meminfo").useLines { lines ->
+            lines.first { it.startsWith(key) }
+                .split(Regex("\\s+"))[1].toLong() * 1024
+        }
+    }.getOrDefault(0L)
+
+    /**
+     * Weight loading. mmap (default) makes a reload of a recently used model mostly page-cache
+     * hits; mlock keeps the weights resident. gpuLayers only has an effect in a GPU build
+     * (LLAMA_ANDROID_GPU=vulkan|opencl); 0 keeps everything on the CPU.
+     */
+    data class LoadOptions(
+        val useMmap: Boolean = true,
+        val useMlock: Boolean = false,
+        val gpuLayers: Int = 0,
+        // Throwaway decode after new_context so the first prompt skips page faults / buffer setup.
+        val warmUp: Boolean = true,
+        // Background readahead of the whole weight file (mmap only).
+        val prefetch: Boolean = true
+    )
+
+    /** Last chat model load; -1 = skipped, failed or (prefetch) still running. */
+    data class LoadTimings(val loadMs: Long = -1, val warmupMs: Long = -1, val prefetchMs: Long = -1)
+
+    @Volatile private var lastLoadTimings = LoadTimings()
+
+    fun getLoadTimings(): LoadTimings = lastLoadTimings
+
+    // runLoop and the prefetch thread both fill in fields.
+    private fun updateLoadTimings(update: (LoadTimings) -> LoadTimings) {
+        synchronized(this) { lastLoadTimings = update(lastLoadTimings) }
+    }
+
+    // Reading the file warms the same page cache llama.cpp's mapping uses; off the runLoop.
+    private fun startPrefetch(path: String) {
+        thread(name = "Llm-Prefetch", isDaemon = true, priority = Thread.MIN_PRIORITY) {
+            val us = prefetch_file(path)
+            updateLoadTimings { it.copy(prefetchMs = if (us >= 0) us / 1000 else -1L) }
+            Log.i(tag, "prefetch done: $lastLoadTimings")
+        }
+    }
+
+    /** llama.cpp build features plus the decode/prefill thread layout of the last chat context. */
+    suspend fun systemInfo(): String = withContext(runLoop) { system_info() }
+
+    // runLoop only. Returns null (plain decoding) on any failure.
+    private fun loadDraft(path: String, threads: Int, mainContext: Long, nDraft: Int, options: LoadOptions): State.Draft? {
+        val model = load_model(path, options.useMmap, options.useMlock, options.gpuLayers, null)
+        if (model == 0L) {
+            Log.w(tag, "draft load_model() failed: $path")
+            return null
+        }
+        // Same positions as the main context; default batch and an f16 cache for the small model.
+        val context = new_context(model, threads, context_size, 0, 0, false, ContextConfig.KV_F16, 1)
+        val batch = if (context != 0L) new_batch(chat_batch_tokens, 0, 1) else 0L
+        if (context == 0L || batch == 0L || !spec_attach(mainContext, context, batch, nDraft.coerceIn(1, 16))) {
+            Log.w(tag, "draft model unusable for speculative decoding: $path")
+            if (batch != 0L) free_batch(batch)
+            if (context != 0L) free_context(context)
+            free_model(model)
+            return null
+        }
+        return State.Draft(model, context, batch)
+    }
+
+    /** Draft acceptance since the model was loaded. */
+    data class SpeculativeStats(val rounds: Long, val drafted: Long, val accepted: Long) {
+        val acceptanceRate: Float get() = if (drafted > 0) accepted.toFloat() / drafted else 0f
+
+        // Tokens produced per main-model decode (1.0 == no gain).
+        val tokensPerDecode: Float get() = if (rounds > 0) (rounds + accepted).toFloat() / rounds else 1f
+    }
+
+    /** Null when no draft model is attached. */
+    suspend fun getSpeculativeStats(): SpeculativeStats? = withContext(runLoop) {
+        when (val state = threadLocalState.get()) {
+            is State.Loaded -> spec_stats(state.context)?.let { SpeculativeStats(it[0], it[1], it[2]) }
+            else -> null
+        }
+    }
+
     suspend fun getTemplate(messages: List<Map<String, String>>): String {
         return withContext(runLoop) {
             when (val state = threadLocalState.get()) {
-                is State.Loaded -> oaicompat_completion_param_parse(messages.toTypedArray(), state.model)
+                is State.Loaded -> chat_apply_template(state.model, messages.roles(), messages.contents(), true)
                 else -> ""
             }
         }
     }
 
+    /**
+     * Token IDs of the templated conversation (before native trimming). Cheap to call right
+     * before [sendChat] with the same messages: the second tokenization is skipped.
+     */
+    suspend fun chatTokens(messages: List<Map<String, String>>): IntArray = withContext(runLoop) {
+        when (val state = threadLocalState.get()) {
+            is State.Loaded -> chat_tokenize(state.context, messages.roles(), messages.contents()) ?: IntArray(0)
+            else -> IntArray(0)
+        }
+    }
+
+    private fun List<Map<String, String>>.roles(): Array<String> = Array(size) { this[it]["role"].orEmpty() }
+    private fun List<Map<String, String>>.contents(): Array<String> = Array(size) { this[it]["content"].orEmpty() }
+
+    /**
+     * Per-request sampling for [send], [sendChat] and [sendTokens]; without one the chat
+     * sampler built at [load] is used. [temp] <= 0 is greedy. [grammar] (GBNF, "root" rule)
+     * or else [jsonSchema] constrains the output, so structured replies parse on the first
+     * try. Penalties apply over the last [penaltyLastN] tokens; [seed] < 0 is random.
+     */
+    data class Sampling(
+        val topP: Float = 0.9f,
+        val topK: Int = 40,
+        val temp: Float = 0.4f,
+        val minP: Float = 0f,
+        val penaltyLastN: Int = 0,
+        val repeatPenalty: Float = 1f,
+        val frequencyPenalty: Float = 0f,
+        val presencePenalty: Float = 0f,
+        val seed: Int = 1234,
+        val grammar: String? = null,
+        val jsonSchema: String? = null
+    )
+
+    // runLoop only. Caller frees.
+    private fun newSampler(model: Long, s: Sampling): Long {
+        val sampler = new_sampler_config(
+            model, s.topP, s.topK, s.temp, s.minP,
+            s.penaltyLastN, s.repeatPenalty, s.frequencyPenalty, s.presencePenalty,
+            s.seed, s.grammar, s.jsonSchema
+        )
+        if (sampler == 0L) throw IllegalStateException("new_sampler_config() failed")
+        return sampler
+    }
+
     /**
      * Send a fully formatted prompt (already templated).
      *
      * maxNewTokens:
      * - If null, uses nlenDefault (recommended 128..256 for RAG with n_ctx=1024).
+     *
+     * pinnedPrefix:
+     * - Templated text the prompt starts with (usually the system turn); its tokens survive prompt
+     *   trimming and context shifts.
+     *
+     * sampling:
+     * - See [Sampling]; null keeps the chat sampler.
      */
-    suspend fun send(message: String, maxNewTokens: Int? = null): Flow<String> = flow {
+    suspend fun send(
+        message: String,
+        maxNewTokens: Int? = null,
+        pinnedPrefix: String? = null,
+        sampling: Sampling? = null
+    ): Flow<String> =
+        generate(maxNewTokens, sampling) { state, nLen -> completion_init(state.context, state.batch, message, pinnedPrefix, nLen) }
+
+    /**
+     * [send] for a conversation that is templated and tokenized natively: no prompt string
+     * crosses JNI, and a history that grew by a turn only tokenizes the new turn. With
+     * [pinSystem] a leading system message survives trimming and context shifts.
+     */
+    suspend fun sendChat(
+        messages: List<Map<String, String>>,
+        maxNewTokens: Int? = null,
+        pinSystem: Boolean = true,
+        sampling: Sampling? = null
+    ): Flow<String> {
+        val nPinned = if (pinSystem && messages.firstOrNull()?.get("role") == "system") 1 else 0
+        return generate(maxNewTokens, sampling) { state, nLen ->
+            completion_init_chat(state.context, state.batch, messages.roles(), messages.contents(), nPinned, nLen)
+        }
+    }
+
+    /** [send] from token IDs (e.g. [chatTokens]); the first [nPinned] tokens are pinned. */
+    suspend fun sendTokens(tokens: IntArray, maxNewTokens: Int? = null, nPinned: Int = 0, sampling: Sampling? = null): Flow<String> =
+        generate(maxNewTokens, sampling) { state, nLen -> completion_init_tokens(state.context, state.batch, tokens, nPinned, nLen) }
+
+    // init runs on runLoop and returns the prompt length (0: nothing to generate).
+    private fun generate(maxNewTokens: Int?, sampling: Sampling?, init: (State.Loaded, Int) -> Int): Flow<String> = channelFlow {
         stopGeneration = false
         _isSending.value = true
         _isCompleteEOT.value = true
@@ -195,62 +773,275 @@ class LLamaAndroid {
         _isMarked.value = false
 
         val nlenEffective = (maxNewTokens ?: nlenDefault).coerceIn(64, 512)
+        var requestSampler = 0L
 
         try {
-            when (val state = threadLocalState.get()) {
-                is State.Loaded -> {
-                    val ncur = IntVar(completion_init(state.context, state.batch, message, nlenEffective))
+            val state = withContext(runLoop) { threadLocalState.get() } as? State.Loaded ?: return@channelFlow
+
+            val nPrompt = withContext(runLoop) {
+                activeContext = state.context
+                val n = init(state, nlenEffective)
+                // init clears the native cancel flag; a stopTextGeneration() that landed before
+                // it only set stopGeneration, so latch it into the native flag here.
+                if (stopGeneration) completion_cancel(state.context)
+                lastReusedTokens = prompt_cache_reused(state.context)
+                Log.d(tag, "send: promptTokens=$n reusedFromCache=$lastReusedTokens")
+                if (n > 0) pieceRing()?.let { ring_reset(it.handle) }
+                n
+            }
+            if (nPrompt <= 0) return@channelFlow
 
-                    var endTokenStore = ""
-                    var producedTokens = 0
+            if (sampling != null) requestSampler = withContext(runLoop) { newSampler(state.model, sampling) }
+            val sampler = if (requestSampler != 0L) requestSampler else state.sampler
 
-                    while (!stopGeneration && producedTokens < nlenEffective && ncur.getValue() < context_size) {
-                        val str = completion_loop(state.context, state.batch, state.sampler, nlenEffective, ncur)
-                        producedTokens += 1
+            val stops = if (state.modelEotStr.isBlank()) emptyArray() else arrayOf(state.modelEotStr)
+            val ring = withContext(runLoop) { pieceRing() }
+            val result = if (ring != null) {
+                streamFromRing(ring, state, sampler, nPrompt, nlenEffective, stops)
+            } else {
+                withContext(runLoop) { streamFromCallback(state, sampler, nPrompt, nlenEffective, stops) }
+            }
 
-                        if (str == "```" || str == "``") {
-                            _isMarked.value = !_isMarked.value
-                        }
+            when (result?.get(0)) {
+                GEN_EOG -> _isCompleteEOT.value = true
+                GEN_STOP_STRING -> _isCompleteEOT.value = false
+                // Hit the token or context limit rather than a natural end.
+                GEN_LENGTH, GEN_CONTEXT -> if (!stopGeneration) _endedByLimitState.value = true
+                GEN_ERROR -> Log.e(tag, "send: generation stopped on a decode error")
+                GEN_CANCELLED -> {} // stopTextGeneration() or the collector went away
+                else -> {}
+            }
+            Log.d(tag, "send: reason=${result?.get(0)} produced=${result?.get(1)} nCur=${result?.get(2)}")
 
-                        if (str == null) {
-                            _isCompleteEOT.value = true
-                            break
-                        }
+            withContext(runLoop) {
+                spec_stats(state.context)?.let {
+                    val st = SpeculativeStats(it[0], it[1], it[2])
+                    Log.d(tag, "send: speculative acceptance=${"%.2f".format(st.acceptanceRate)} tokens/decode=${"%.2f".format(st.tokensPerDecode)}")
+                }
 
-                        endTokenStore += str
+                // Keep the KV cache around for the next turn when prefix reuse is on.
+                if (!promptCacheEnabled) kv_cache_clear(state.context)
+            }
+        } finally {
+            if (requestSampler != 0L) withContext(NonCancellable + runLoop) { free_sampler(requestSampler) }
+            activeContext = 0L
+            _isSending.value = false
+        }
+    }.buffer(Channel.UNLIMITED)
 
-                        // stop on EOT
-                        if (endTokenStore.length > state.modelEotStr.length && endTokenStore.contains(state.modelEotStr)) {
-                            _isCompleteEOT.value = false
-                            break
-                        }
+    // ---------------- Parallel sequences ----------------
 
-                        // keep store bounded
-                        if ((endTokenStore.length / 2) > state.modelEotStr.length) {
-                            endTokenStore = endTokenStore.slice((endTokenStore.length / 2) until endTokenStore.length)
-                        }
+    /** A piece of one reply from [generateParallel]; [done] marks that prompt's last piece. */
+    data class SeqPiece(
+        val index: Int,
+        val text: String,
+        val done: Boolean = false,
+        // On the last piece: ended on EOG or a stop string rather than a limit, error or unload.
+        val complete: Boolean = false
+    )
 
-                        emit(str)
-                    }
+    private class ParallelRun(val context: Long, val handles: LongArray, val bytes: Long) {
+        var closed = false
+    }
 
-                    // If we didn't hit EOT and weren't manually stopped, we likely hit a token/context limit.
-                    if (!stopGeneration && _isCompleteEOT.value &&
-                        (producedTokens >= nlenEffective || ncur.getValue() >= context_size - 1)
-                    ) {
-                        _endedByLimitState.value = true
-                    }
+    // runLoop only. Open runs, so unload() can free them before the model goes.
+    private val parallelRuns = HashSet<ParallelRun>()
 
-                    kv_cache_clear(state.context)
+    private fun closeParallel(run: ParallelRun) {
+        if (run.closed) return
+        run.closed = true
+        run.handles.forEach { if (it != 0L) seq_release(it) }
+        free_context(run.context)
+        parallelRuns.remove(run)
+        parallelBytes -= run.bytes
+    }
+
+    /**
+     * Generates a reply to each of [prompts] (templated text, see [getTemplate]) at once:
+     * a separate context over the loaded chat model holds one sequence per prompt, and every
+     * token step is a single batched decode for all of them. The chat context and its prompt
+     * cache are untouched, and each step is its own run-loop task, so [send] can run between
+     * steps (the sequences pause while it generates). Sampling defaults match the chat sampler.
+     */
+    fun generateParallel(
+        prompts: List<String>,
+        maxNewTokens: Int = nlenDefault,
+        topP: Float = 0f,
+        topK: Int = 0,
+        temp: Float = 0f
+    ): Flow<SeqPiece> = flow {
+        if (prompts.isEmpty()) return@flow
+        val nLen = maxNewTokens.coerceAtLeast(1)
+
+        val (state, run) = withContext(runLoop) {
+            val state = threadLocalState.get() as? State.Loaded
+                ?: throw IllegalStateException("generateParallel(): no chat model loaded")
+            // Room for every prompt and reply; n_ctx is still capped by the training context.
+            val counts = token_counts(state.context, prompts.toTypedArray()) ?: IntArray(prompts.size)
+            val nCtx = counts.sumOf { it + nLen + PARALLEL_SEQ_MARGIN }
+            // A KV cache of its own next to the chat one: budgeted like a model load.
+            val bytes = (context_sizing(state.model, false, ContextConfig.KV_F16)?.get(0) ?: 0L) * nCtx
+            evictFor(bytes)
+            if (chatBytes + parallelBytes + bytes > memoryBudget()) {
+                throw IllegalStateException(
+                    "generateParallel(): $bytes bytes of KV for ${prompts.size} sequences exceed the memory budget (${memoryBudget()} bytes)"
+                )
+            }
+            val context = new_context(state.model, chatThreads, nCtx, 0, 0, false, ContextConfig.KV_F16, prompts.size + 1)
+            if (context == 0L) throw IllegalStateException("new_context() failed")
+
+            val run = ParallelRun(context, LongArray(prompts.size), bytes)
+            parallelRuns.add(run)
+            parallelBytes += bytes
+            try {
+                val stops = if (state.modelEotStr.isBlank()) emptyArray() else arrayOf(state.modelEotStr)
+                prompts.forEachIndexed { i, prompt ->
+                    val sampler = new_sampler(top_p = topP, top_k = topK, temp = temp)
+                    if (sampler == 0L) throw IllegalStateException("new_sampler() failed")
+                    run.handles[i] = seq_start(context, state.batch, sampler, prompt, nLen, stops)
+                    if (run.handles[i] == 0L) throw IllegalStateException("seq_start() failed for prompt $i")
                 }
+            } catch (t: Throwable) {
+                closeParallel(run)
+                throw t
+            }
+            state to run
+        }
 
-                else -> {
-                    // Not loaded
+        try {
+            val done = BooleanArray(prompts.size)
+            while (!done.all { it }) {
+                val pieces = withContext(runLoop) {
+                    val alive = !run.closed && threadLocalState.get() === state
+                    if (alive && seq_step(run.context, state.batch) < 0) Log.e(tag, "generateParallel: seq_step() failed")
+                    run.handles.indices.mapNotNull { i ->
+                        if (done[i]) return@mapNotNull null
+                        val text = if (alive) seq_read(run.handles[i]).orEmpty() else ""
+                        val reason = if (alive) seq_state(run.handles[i])?.get(0) ?: GEN_ERROR else GEN_CANCELLED
+                        done[i] = reason != SEQ_RUNNING
+                        if (text.isEmpty() && !done[i]) null
+                        else SeqPiece(i, text, done[i], reason == GEN_EOG || reason == GEN_STOP_STRING)
+                    }
                 }
+                pieces.forEach { emit(it) }
             }
         } finally {
-            _isSending.value = false
+            withContext(NonCancellable + runLoop) { closeParallel(run) }
         }
-    }.flowOn(runLoop)
+    }
+
+    // ---------------- Streaming output ----------------
+
+    private class PieceRing(val handle: Long, val view: ByteBuffer) {
+        val scratch = ByteArray(view.capacity())
+    }
+
+    // runLoop only. Created on first use; null means fall back to per-piece callbacks.
+    private var ring: PieceRing? = null
+
+    private fun pieceRing(): PieceRing? {
+        ring?.let { return it }
+        val handle = ring_new(PIECE_RING_BYTES)
+        if (handle == 0L) return null
+        val view = ring_view(handle)
+        if (view == null) {
+            ring_free(handle)
+            return null
+        }
+        return PieceRing(handle, view).also { ring = it }
+    }
+
+    /**
+     * Decodes on runLoop straight into the piece ring while this coroutine (the collector's
+     * dispatcher) drains whatever has accumulated about once a frame, so a slow UI only
+     * costs ring space, never decode time.
+     */
+    private suspend fun ProducerScope<String>.streamFromRing(
+        ring: PieceRing,
+        state: State.Loaded,
+        sampler: Long,
+        nPrompt: Int,
+        nLen: Int,
+        stops: Array<String>
+    ): IntArray? = coroutineScope {
+        val decode = async(runLoop) {
+            completion_run_ring(state.context, state.batch, sampler, nPrompt, nLen, stops, ring.handle)
+        }
+
+        var tail = 0L
+        // Drains everything published so far; the ring only ever holds whole UTF-8 characters.
+        suspend fun drain() {
+            val head = ring_sync(ring.handle, tail)
+            if (head == tail) return
+            val cap = ring.view.capacity()
+            val len = (head - tail).toInt()
+            val at = (tail and (cap - 1).toLong()).toInt()
+            val first = minOf(len, cap - at)
+            ring.view.clear()
+            ring.view.position(at)
+            ring.view.get(ring.scratch, 0, first)
+            if (first < len) {
+                ring.view.position(0)
+                ring.view.get(ring.scratch, first, len - first)
+            }
+            val text = String(ring.scratch, 0, len, Charsets.UTF_8)
+            tail = head // handed back to the producer on the next sync
+            emitMarked(text)
+        }
+
+        try {
+            while (!decode.isCompleted) {
+                delay(RING_DRAIN_INTERVAL_MS)
+                drain()
+            }
+            drain()
+            decode.await()
+        } finally {
+            // Collector cancelled mid-stream: stop the native loop so the runLoop is released.
+            if (!decode.isCompleted) completion_cancel(state.context)
+        }
+    }
+
+    // runLoop only. Used when the ring couldn't be set up.
+    private fun ProducerScope<String>.streamFromCallback(
+        state: State.Loaded,
+        sampler: Long,
+        nPrompt: Int,
+        nLen: Int,
+        stops: Array<String>
+    ): IntArray? {
+        val scratch = ByteArray(pieceBuffer.capacity())
+        return completion_run(
+            state.context, state.batch, sampler, nPrompt, nLen, stops, pieceBuffer
+        ) { len ->
+            pieceBuffer.clear()
+            pieceBuffer.get(scratch, 0, len)
+            val str = String(scratch, 0, len, Charsets.UTF_8)
+            if (str == "```" || str == "``") {
+                _isMarked.value = !_isMarked.value
+            }
+            trySend(str).isSuccess
+        }
+    }
+
+    /**
+     * Sends a drained batch, split at code fences so each part goes out with the right
+     * isMarked state (the fence itself flips it, as with per-piece delivery).
+     */
+    private suspend fun ProducerScope<String>.emitMarked(text: String) {
+        var from = 0
+        while (from < text.length) {
+            val fence = text.indexOf("```", from)
+            if (fence < 0) {
+                send(text.substring(from))
+                return
+            }
+            if (fence > from) send(text.substring(from, fence))
+            _isMarked.value = !_isMarked.value
+            send("```")
+            from = fence + 3
+        }
+    }
 
     suspend fun myCustomBenchmark(): Flow<String> = flow {
         try {
@@ -263,13 +1054,14 @@ class LLamaAndroid {
                                 state.context,
                                 state.batch,
                                 "Write an article on global warming in 1000 words",
+                                null,
                                 nlenEffective
                             )
                         )
-                        var produced = 0
-                        while (!stopGeneration && produced < nlenEffective) {
+                        // One call may consume several tokens (a split character) or shift the
+                        // context; ncur counts the tokens either way.
+                        while (!stopGeneration && ncur.produced() < nlenEffective) {
                             val str = completion_loop(state.context, state.batch, state.sampler, nlenEffective, ncur)
-                            produced++
                             if (str == null) {
                                 _isCompleteEOT.value = true
                                 break
@@ -287,74 +1079,559 @@ class LLamaAndroid {
         }
     }.flowOn(runLoop)
 
+    /**
+     * Benchmark sweep (every combination of the list fields) on throwaway contexts of the
+     * loaded chat model; see bench_suite in llama-android.cpp for what each row measures.
+     * 0 threads = automatic layout; kv = ContextConfig.KV_*.
+     */
+    data class BenchConfig(
+        val pp: List<Int> = listOf(128, 512),
+        val depth: List<Int> = listOf(0, 512),
+        val nBatch: List<Int> = listOf(512),
+        val threads: List<Int> = listOf(0),
+        val kv: List<Int> = listOf(ContextConfig.KV_F16),
+        val pl: List<Int> = listOf(1),
+        val tg: Int = 32,
+        val reps: Int = 3,
+        val flashAttn: Boolean = false
+    ) {
+        fun toJson(): String = JSONObject().apply {
+            put("pp", JSONArray(pp))
+            put("depth", JSONArray(depth))
+            put("n_batch", JSONArray(nBatch))
+            put("threads", JSONArray(threads))
+            put("kv", JSONArray(kv))
+            put("pl", JSONArray(pl))
+            put("tg", tg)
+            put("reps", reps)
+            put("flash_attn", flashAttn)
+        }.toString()
+    }
+
+    /**
+     * Runs [config] and returns the JSON report (model, system info, config and one row per
+     * test point with t/s, TTFT, step latency percentiles, RSS and CPU frequency / temperature
+     * before and after). Null when no chat model is loaded. Blocks the run loop while it runs;
+     * [cancelBench] stops it after the current repetition.
+     */
+    suspend fun benchSuite(config: BenchConfig = BenchConfig()): String? = withContext(runLoop) {
+        val state = threadLocalState.get() as? State.Loaded ?: return@withContext null
+        val maxPl = config.pl.maxOrNull()?.coerceAtLeast(1) ?: 1
+        val batch = new_batch(maxOf(config.nBatch.maxOrNull() ?: CHAT_N_BATCH, maxPl), 0, maxPl)
+        if (batch == 0L) throw IllegalStateException("new_batch() failed")
+        try {
+            bench_suite(state.model, batch, config.toJson())
+        } finally {
+            free_batch(batch)
+        }
+    }
+
+    /** Prefill cost of one prompt; see [benchPrefill]. */
+    data class PrefillCost(val tokens: Int, val tokenizeMs: Double, val prefillMs: Double, val bestMs: Double)
+
+    /**
+     * Tokenizes [text] with the chat model and decodes it [reps] times on a throwaway context
+     * (the chat KV cache and prompt cache are untouched). Null when no chat model is loaded or
+     * the prompt doesn't fit.
+     */
+    suspend fun benchPrefill(text: String, reps: Int = 3): PrefillCost? = withContext(runLoop) {
+        val state = threadLocalState.get() as? State.Loaded ?: return@withContext null
+        bench_prefill_text(state.model, state.batch, text, 0, reps)?.let {
+            PrefillCost(it[0].toInt(), it[1], it[2], it[3])
+        }
+    }
+
+    /** Any thread. */
+    fun cancelBench() = bench_cancel()
+
     suspend fun unload() {
         withContext(runLoop) {
             when (val state = threadLocalState.get()) {
                 is State.Loaded -> {
+                    state.draft?.let { d ->
+                        spec_detach(state.context)
+                        free_batch(d.batch)
+                        free_context(d.context)
+                        free_model(d.model)
+                    }
+                    chatContext = 0L
+                    parallelRuns.toList().forEach { closeParallel(it) }
                     free_sampler(state.sampler)
                     free_batch(state.batch)
                     free_context(state.context)
                     free_model(state.model)
                     threadLocalState.set(State.Idle)
+                    chatBytes = 0L
                 }
                 else -> {}
             }
         }
     }
 
+    // ---------------- Session files ----------------
+
+    /**
+     * Saves the chat context's KV cache for [conversationId] and the loaded model in [dir], so
+     * [restoreSession] can resume it without re-evaluating the history. Each model keeps its own
+     * file, so switching to another model and back restores both. Needs the prompt cache.
+     */
+    suspend fun saveSession(dir: File, conversationId: String): Boolean = withContext(runLoop) {
+        val state = threadLocalState.get() as? State.Loaded ?: return@withContext false
+        if (!promptCacheEnabled) return@withContext false
+
+        dir.mkdirs()
+        val file = sessionFile(dir, conversationId, state.modelKey)
+        session_save(state.context, file.path)
+    }
+
+    /**
+     * Loads the session saved for [conversationId] with this model; the next send() then reuses
+     * it as a cached prompt prefix. Returns the restored token count (0: nothing usable).
+     */
+    suspend fun restoreSession(dir: File, conversationId: String): Int = withContext(runLoop) {
+        val state = threadLocalState.get() as? State.Loaded ?: return@withContext 0
+        if (!promptCacheEnabled) return@withContext 0
+
+        val file = sessionFile(dir, conversationId, state.modelKey)
+        if (!file.exists()) return@withContext 0
+        session_load(state.context, file.path).also { n ->
+            if (n == 0) file.delete() // stale: other context size or llama.cpp version
+            Log.i(tag, "restoreSession: conversation=$conversationId tokens=$n")
+        }
+    }
+
+    /** Any thread. */
+    fun deleteSessions(dir: File, conversationId: String) {
+        dir.listFiles { f -> f.name.startsWith(sessionPrefix(conversationId)) }?.forEach { it.delete() }
+    }
+
+    /** Any thread: removes the session files of every conversation except [keepConversationId]. */
+    fun pruneSessions(dir: File, keepConversationId: String) {
+        val keep = sessionPrefix(keepConversationId)
+        dir.listFiles { f -> f.name.endsWith(".session") && !f.name.startsWith(keep) }?.forEach { it.delete() }
+    }
+
+    private fun sessionPrefix(conversationId: String): String = sha1Hex(conversationId).take(16) + "_"
+
+    private fun sessionFile(dir: File, conversationId: String, modelKey: String): File =
+        File(dir, sessionPrefix(conversationId) + modelKey + ".session")
+
+    // Identifies the model file and context shape without hashing gigabytes of weights.
+    private fun modelKey(pathToModel: String): String {
+        val f = File(pathToModel)
+        return sha1Hex("${f.name}|${f.length()}|${f.lastModified()}|$context_size").take(16)
+    }
+
     // ---------------- Embeddings API ----------------
 
-    suspend fun loadEmbeddingModel(pathToModel: String, userThreads: Int, nCtx: Int, poolingType: Int) {
+    /**
+     * nBatch: tokens per embedding decode; 0 keeps min(nCtx, 512).
+     * The model stays registered after [trimMemory] or a budget eviction unloads it: the next
+     * embed*() / embeddingDim() loads it again, so callers never see it missing.
+     */
+    suspend fun loadEmbeddingModel(pathToModel: String, userThreads: Int, nCtx: Int, poolingType: Int, nBatch: Int = 0) {
         withContext(runLoop) {
+            embeddingSpec = EmbSpec(pathToModel, userThreads, nCtx, poolingType, nBatch)
             when (embeddingState) {
                 is EmbState.Loaded -> return@withContext
-                EmbState.Idle -> {
-                    val model = load_model(pathToModel)
-                    if (model == 0L) throw IllegalStateException("load_model() failed for embedding model")
+                EmbState.Idle -> loadEmbeddingResident(embeddingSpec!!)
+            }
+        }
+    }
 
-                    val cores = Runtime.getRuntime().availableProcessors().coerceAtLeast(2)
-                    val threads = userThreads.coerceIn(2, minOf(8, cores))
+    // runLoop only.
+    private fun loadEmbeddingResident(spec: EmbSpec): EmbState.Loaded {
+        val model = load_model(spec.path, true, false, 0, null)
+        if (model == 0L) throw IllegalStateException("load_model() failed for embedding model")
+
+        // Checked from the model's shape before the context allocates its KV and compute buffers.
+        val kvPerToken = context_sizing(model, false, ContextConfig.KV_F16)?.get(0) ?: 0L
+        val bytes = model_size(model) + kvPerToken * spec.nCtx
+        if (chatBytes + parallelBytes + bytes > memoryBudget()) {
+            // The chat model is pinned, so there is nothing to evict for it: refuse, don't overcommit.
+            free_model(model)
+            throw IllegalStateException(
+                "embedding model needs $bytes bytes next to ${chatBytes + parallelBytes} for chat, over the memory budget (${memoryBudget()} bytes)"
+            )
+        }
 
-                    val context = new_embedding_context(model, threads, nCtx, poolingType)
-                    if (context == 0L) {
-                        free_model(model)
-                        throw IllegalStateException("new_embedding_context() failed")
-                    }
+        val threads = embeddingThreads(spec)
+        val context = new_embedding_context(model, threads, spec.nCtx, spec.nBatch, spec.poolingType)
+        if (context == 0L) {
+            free_model(model)
+            throw IllegalStateException("new_embedding_context() failed")
+        }
 
-                    val batch = new_batch(nCtx, 0, 1)
-                    if (batch == 0L) {
-                        free_context(context)
-                        free_model(model)
-                        throw IllegalStateException("new_batch() failed for embedding model")
-                    }
+        val batch = new_batch(maxOf(spec.nCtx, spec.nBatch), 0, emb_batch_seqs)
+        if (batch == 0L) {
+            free_context(context)
+            free_model(model)
+            throw IllegalStateException("new_batch() failed for embedding model")
+        }
 
-                    Log.i(tag, "Loaded embedding model=$pathToModel threads=$threads nCtx=$nCtx pooling=$poolingType")
-                    embeddingState = EmbState.Loaded(model = model, context = context, batch = batch)
-                }
+        val loaded = EmbState.Loaded(model = model, context = context, batch = batch, bytes = bytes)
+        embeddingState = loaded
+        embeddingLastUsedMs = System.currentTimeMillis()
+        Log.i(
+            tag,
+            "Loaded embedding model=${spec.path} threads=$threads nCtx=${spec.nCtx} pooling=${spec.poolingType} " +
+                    "residency=${residency()}"
+        )
+        return loaded
+    }
+
+    private fun embeddingThreads(spec: EmbSpec): Int {
+        val cores = Runtime.getRuntime().availableProcessors().coerceAtLeast(2)
+        return spec.userThreads.coerceIn(2, minOf(8, cores))
+    }
+
+    // runLoop only: the resident embedding model, reloading it if it was evicted.
+    private fun residentEmbedding(): EmbState.Loaded {
+        val s = when (val st = embeddingState) {
+            is EmbState.Loaded -> st
+            EmbState.Idle -> {
+                val spec = embeddingSpec
+                    ?: throw IllegalStateException("Embedding model not loaded. Call loadEmbeddingModel() first.")
+                Log.i(tag, "reloading evicted embedding model")
+                loadEmbeddingResident(spec)
             }
         }
+        embeddingLastUsedMs = System.currentTimeMillis()
+        return s
     }
 
     suspend fun embed(text: String): FloatArray {
         return withContext(runLoop) {
-            when (val s = embeddingState) {
-                is EmbState.Loaded -> embedding_for_text(s.context, s.batch, text)
-                EmbState.Idle -> throw IllegalStateException("Embedding model not loaded. Call loadEmbeddingModel() first.")
+            val s = residentEmbedding()
+            embedding_for_text(s.context, s.batch, text)
+        }
+    }
+
+    /**
+     * Embeds many texts with as few decodes as possible (several sequences per batch).
+     * Returns one flat array of texts.size * n_embd floats, row i belongs to texts[i].
+     */
+    suspend fun embedBatch(texts: List<String>): FloatArray {
+        if (texts.isEmpty()) return FloatArray(0)
+        return withContext(runLoop) {
+            val s = residentEmbedding()
+            embeddings_for_texts(s.context, s.batch, texts.toTypedArray())
+        }
+    }
+
+    /**
+     * Zero-copy variant of [embedBatch]: rows are written (float32, little-endian) straight into
+     * the direct buffer [out] starting at [offsetBytes]. Returns bytes written.
+     */
+    suspend fun embedBatchInto(texts: List<String>, out: ByteBuffer, offsetBytes: Int, normalize: Boolean): Int {
+        require(out.isDirect) { "embedBatchInto() needs a direct ByteBuffer" }
+        if (texts.isEmpty()) return 0
+        return withContext(runLoop) {
+            val s = residentEmbedding()
+            embeddings_into_buffer(s.context, s.batch, texts.toTypedArray(), out, offsetBytes, normalize)
+        }
+    }
+
+    /**
+     * Late chunking, written like [embedBatchInto]: [segments] are decoded once as a single
+     * window with per-token embeddings, and row i is the mean over the tokens of segments
+     * [spans][2i] until [spans][2i + 1]. Text shared by overlapping chunks goes in as its own
+     * segment, referenced by both chunks. Returns bytes written, or 0 when the window is longer
+     * than one decode or the second context doesn't fit the memory budget (embed those chunks
+     * with [embedBatchInto] instead).
+     */
+    suspend fun embedLateChunkedInto(
+        segments: List<String>,
+        spans: IntArray,
+        out: ByteBuffer,
+        offsetBytes: Int,
+        normalize: Boolean
+    ): Int {
+        require(out.isDirect) { "embedLateChunkedInto() needs a direct ByteBuffer" }
+        if (spans.isEmpty()) return 0
+        return withContext(runLoop) {
+            val s = residentEmbedding()
+            val context = lateChunkContext(s)
+            if (context == 0L) return@withContext 0
+            embeddings_late_chunked(context, s.batch, segments.toTypedArray(), spans, out, offsetBytes, normalize)
+        }
+    }
+
+    // runLoop only: the model's own context when it already skips pooling, else a second
+    // context with the same shape and LLAMA_POOLING_TYPE_NONE; 0 when that one is over budget.
+    private fun lateChunkContext(s: EmbState.Loaded): Long {
+        val spec = embeddingSpec ?: throw IllegalStateException("Embedding model not loaded. Call loadEmbeddingModel() first.")
+        if (spec.poolingType == POOLING_TYPE_NONE) return s.context
+        if (embeddingLateContext == 0L) {
+            val bytes = (context_sizing(s.model, false, ContextConfig.KV_F16)?.get(0) ?: 0L) * spec.nCtx
+            if (chatBytes + parallelBytes + s.bytes + bytes > memoryBudget()) {
+                Log.d(tag, "late chunking: $bytes bytes for a second context exceed the memory budget, embedding per chunk")
+                return 0L
             }
+            embeddingLateContext = new_embedding_context(s.model, embeddingThreads(spec), spec.nCtx, spec.nBatch, POOLING_TYPE_NONE)
+            if (embeddingLateContext == 0L) throw IllegalStateException("new_embedding_context() failed for late chunking")
+            embeddingLateBytes = bytes
+        }
+        return embeddingLateContext
+    }
+
+    /** Tokens per text for the embedding model; cached natively for the embed call that follows. */
+    suspend fun embeddingTokenCounts(texts: List<String>): IntArray {
+        if (texts.isEmpty()) return IntArray(0)
+        return withContext(runLoop) {
+            token_counts(residentEmbedding().context, texts.toTypedArray()) ?: IntArray(texts.size)
         }
     }
 
+    /**
+     * Native tokenizer cache of a model: content-keyed token spans (system prompt, pinned prefix,
+     * chunks) plus chat prompts tokenized incrementally from the previous turn's tokens.
+     */
+    data class TokenCacheStats(val entries: Long, val tokens: Long, val hits: Long, val misses: Long, val incremental: Long)
+
+    suspend fun tokenCacheStats(embedding: Boolean = false): TokenCacheStats? = withContext(runLoop) {
+        val model = if (embedding) {
+            (embeddingState as? EmbState.Loaded)?.model
+        } else {
+            (threadLocalState.get() as? State.Loaded)?.model
+        } ?: return@withContext null
+        token_cache_stats(model)?.let { TokenCacheStats(it[0], it[1], it[2], it[3], it[4]) }
+    }
+
+    suspend fun embeddingDim(): Int {
+        return withContext(runLoop) { embedding_dim(residentEmbedding().context) }
+    }
+
+    /** Unloads and forgets the embedding model (no transparent reload afterwards). */
     suspend fun unloadEmbeddingModel() {
         withContext(runLoop) {
-            when (val s = embeddingState) {
-                is EmbState.Loaded -> {
-                    free_batch(s.batch)
-                    free_context(s.context)
-                    free_model(s.model)
-                    embeddingState = EmbState.Idle
+            embeddingSpec = null
+            releaseEmbedding()
+        }
+    }
+
+    // runLoop only.
+    private fun releaseEmbedding() {
+        when (val s = embeddingState) {
+            is EmbState.Loaded -> {
+                if (embeddingLateContext != 0L) {
+                    free_context(embeddingLateContext)
+                    embeddingLateContext = 0L
+                    embeddingLateBytes = 0L
                 }
-                EmbState.Idle -> {}
+                free_batch(s.batch)
+                free_context(s.context)
+                free_model(s.model)
+                embeddingState = EmbState.Idle
             }
+            EmbState.Idle -> {}
+        }
+    }
+
+    // ---------------- Residency ----------------
+
+    /**
+     * Bytes the resident models may use together (weights + KV), 0 = [DEFAULT_BUDGET_RAM_FRACTION]
+     * of total RAM. Loading the chat model evicts the embedding model when both would exceed it.
+     */
+    fun setMemoryBudget(bytes: Long) {
+        memoryBudgetBytes = bytes.coerceAtLeast(0L)
+    }
+
+    data class Residency(
+        val chatBytes: Long,
+        val parallelBytes: Long,
+        val embeddingBytes: Long,
+        val budgetBytes: Long,
+        val embeddingResident: Boolean
+    )
+
+    fun residency(): Residency {
+        val emb = embeddingState as? EmbState.Loaded
+        return Residency(chatBytes, parallelBytes, emb?.let { it.bytes + embeddingLateBytes } ?: 0L, memoryBudget(), emb != null)
+    }
+
+    /**
+     * Forward of ComponentCallbacks2.onTrimMemory(). Drops the embedding model (least recently
+     * used of the two; reloaded on demand) when it has been idle for [EMBED_IDLE_EVICT_MS], or
+     * at once under critical pressure. The chat model is never evicted here.
+     */
+    suspend fun trimMemory(level: Int) {
+        if (level < ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW) return
+        withContext(runLoop) {
+            if (embeddingState !is EmbState.Loaded) return@withContext
+            val idleMs = System.currentTimeMillis() - embeddingLastUsedMs
+            val critical = level == ComponentCallbacks2.TRIM_MEMORY_RUNNING_CRITICAL ||
+                    level >= ComponentCallbacks2.TRIM_MEMORY_COMPLETE
+            if (critical || idleMs >= EMBED_IDLE_EVICT_MS) {
+                Log.i(tag, "trimMemory($level): evicting embedding model idle=${idleMs}ms")
+                releaseEmbedding()
+            }
+        }
+    }
+
+    // runLoop only: evicts non-pinned models until [incomingBytes] fits next to what stays.
+    private fun evictFor(incomingBytes: Long) {
+        val emb = embeddingState as? EmbState.Loaded ?: return
+        if (chatBytes + parallelBytes + emb.bytes + embeddingLateBytes + incomingBytes > memoryBudget()) {
+            Log.i(tag, "evicting embedding model for $incomingBytes bytes (budget ${memoryBudget()})")
+            releaseEmbedding()
+        }
+    }
+
+    private fun memoryBudget(): Long {
+        memoryBudgetBytes.takeIf { it > 0 }?.let { return it }
+        val total = meminfoBytes("MemTotal:").takeIf { it > 0 } ?: return Long.MAX_VALUE
+        return (total * DEFAULT_BUDGET_RAM_FRACTION).toLong()
+    }
+
+    // ---------------- Vector search API ----------------
+
+    // Search and index natives never touch llama state, so they only wait for the library to
+    // be loaded (the first runLoop task starts the thread that loads it), never for runLoop
+    // itself: retrieval doesn't queue behind a reply being generated.
+    private suspend fun <T> offRunLoop(block: () -> T): T {
+        if (!nativeReady.isCompleted) runLoop.dispatch(EmptyCoroutineContext, Runnable { })
+        nativeReady.await()
+        return withContext(Dispatchers.Default) { block() }
+    }
+
+    /** One search result: row index inside the scanned buffer and its dot-product score. */
+    data class VectorHit(val index: Int, val score: Float)
+
+    /**
+     * Exact top-k dot-product scan over [count] packed float32 rows in a direct buffer, in one JNI call.
+     * Results are best-first.
+     */
+    suspend fun searchTopK(query: FloatArray, vectors: ByteBuffer, count: Int, k: Int): List<VectorHit> {
+        require(vectors.isDirect) { "searchTopK() needs a direct ByteBuffer" }
+        if (count <= 0 || k <= 0 || query.isEmpty()) return emptyList()
+        return offRunLoop {
+            val idx = IntArray(k)
+            val score = FloatArray(k)
+            val n = vector_search_topk(query, vectors, count, query.size, k, idx, score)
+            List(n) { VectorHit(idx[it], score[it]) }
+        }
+    }
+
+    /**
+     * mmap()s an embeddings file natively (headered f32/f16/i8, or legacy raw float32 rows);
+     * returns a store handle or 0 if the file is missing or doesn't match [dim].
+     * [rescorePath], if given, is a float32 copy used to re-rank quantized candidates.
+     * Release it with [closeEmbeddingStore].
+     */
+    suspend fun openEmbeddingStore(path: String, dim: Int, rescorePath: String? = null): Long =
+        offRunLoop { emb_store_open(path, dim, rescorePath) }
+
+    /** Row count of an open store (0 for an unknown handle). */
+    suspend fun embeddingStoreCount(store: Long): Int =
+        offRunLoop { emb_store_count(store) }
+
+    /** Same scan as [searchTopK], but straight over the mapped file. */
+    suspend fun searchEmbeddingStore(store: Long, query: FloatArray, k: Int): List<VectorHit> {
+        if (store == 0L || k <= 0 || query.isEmpty()) return emptyList()
+        return offRunLoop {
+            val idx = IntArray(k)
+            val score = FloatArray(k)
+            val n = emb_store_search(store, query, k, idx, score)
+            List(n.coerceAtLeast(0)) { VectorHit(idx[it], score[it]) }
+        }
+    }
+
+    /**
+     * Encodes [count] float32 rows of [src] into a full embeddings file image in [dst]
+     * (header + rows, [dtype] as in EmbeddingFormat). Both buffers must be direct.
+     * Returns the bytes written.
+     */
+    suspend fun quantizeEmbeddings(
+        src: ByteBuffer,
+        count: Int,
+        dim: Int,
+        dtype: Int,
+        normalized: Boolean,
+        dst: ByteBuffer
+    ): Int = offRunLoop { emb_quantize(src, count, dim, dtype, normalized, dst) }
+
+    /**
+     * Safe from any thread and for stale handles; an in-flight search keeps the mapping alive
+     * until it returns.
+     */
+    fun closeEmbeddingStore(store: Long) {
+        if (store != 0L) emb_store_close(store)
+    }
+
+    // ---------------- IVF index API ----------------
+
+    /** One corpus-wide hit: position of the store in the searched array, row, score. */
+    data class StoreHit(val store: Int, val index: Int, val score: Float)
+
+    /** Loads centroids from [path] and makes them current; returns their generation, 0 if none. */
+    suspend fun loadAnnIndex(path: String): Int = offRunLoop { ivf_load(path) }
+
+    /** Row count the current centroids were trained on (0 when there is no index). */
+    suspend fun annTrainedRows(): Int = offRunLoop { ivf_trained_rows() }
+
+    /** k-means over all rows of [stores]; writes and installs the centroids. Returns the generation or 0. */
+    suspend fun trainAnnIndex(stores: LongArray, nlist: Int, iters: Int, path: String): Int =
+        offRunLoop { ivf_train(stores, nlist, iters, path) }
+
+    /** Buckets [store] against the current centroids and writes its lists file. */
+    suspend fun assignAnnLists(store: Long, listsPath: String): Boolean =
+        offRunLoop { ivf_assign(store, listsPath) }
+
+    /** Attaches an existing lists file; false when missing or from an older generation. */
+    suspend fun attachAnnLists(store: Long, listsPath: String): Boolean =
+        offRunLoop { ivf_attach(store, listsPath) }
+
+    /**
+     * Global top-k over [stores] in one JNI call. [nprobe] trades recall for latency
+     * (lists scanned per query); small corpora and unassigned stores are scanned exactly.
+     */
+    suspend fun searchStores(stores: LongArray, query: FloatArray, k: Int, nprobe: Int): List<StoreHit> {
+        if (stores.isEmpty() || k <= 0 || query.isEmpty()) return emptyList()
+        return offRunLoop {
+            val st = IntArray(k)
+            val idx = IntArray(k)
+            val score = FloatArray(k)
+            val n = ivf_search(stores, query, k, nprobe, st, idx, score)
+            List(n) { StoreHit(st[it], idx[it], score[it]) }
+        }
+    }
+
+    // ---------------- Lexical index API ----------------
+
+    /** A [searchHybrid] hit: [score] is the vector score, [lexScore] BM25 (0 when no query term matched). */
+    data class HybridHit(val store: Int, val index: Int, val score: Float, val lexScore: Float)
+
+    /** Writes the BM25 postings file for one doc's chunk texts (row order = embeddings.bin). */
+    suspend fun buildLexicalIndex(texts: List<String>, path: String): Boolean =
+        offRunLoop { lex_build(texts.toTypedArray(), path) }
+
+    /** Attaches a doc's postings file to its open store; false when missing or stale. */
+    suspend fun attachLexicalIndex(store: Long, path: String): Boolean =
+        offRunLoop { lex_attach(store, path) }
+
+    /**
+     * [searchStores] fused with BM25 over [text] by reciprocal rank, in one JNI call. Stores
+     * without a lexical index take part on the vector side only. [prefilter] scores only
+     * lexical matches against [query] when there are at least [k] of them.
+     */
+    suspend fun searchHybrid(
+        stores: LongArray,
+        query: FloatArray,
+        text: String,
+        k: Int,
+        nprobe: Int,
+        prefilter: Boolean = false
+    ): List<HybridHit> {
+        if (stores.isEmpty() || k <= 0 || query.isEmpty()) return emptyList()
+        return offRunLoop {
+            val st = IntArray(k)
+            val idx = IntArray(k)
+            val score = FloatArray(k)
+            val lex = FloatArray(k)
+            val n = hybrid_search(stores, query, text, k, nprobe, prefilter, st, idx, score, lex)
+            List(n) { HybridHit(st[it], idx[it], score[it], lex[it]) }
         }
     }
 
@@ -366,17 +1643,57 @@ class LLamaAndroid {
     }
 
     companion object {
+        // completion_run() stop reasons (native gen_stop_reason).
+        private const val GEN_ERROR = -1
+        private const val GEN_EOG = 0
+        private const val GEN_STOP_STRING = 1
+        private const val GEN_LENGTH = 2
+        private const val GEN_CONTEXT = 3
+        private const val GEN_CANCELLED = 4
+        // seq_state() while the sequence is still generating.
+        private const val SEQ_RUNNING = -2
+        // KV cells per parallel sequence beyond prompt + reply (native CTX_SHIFT_MARGIN).
+        private const val PARALLEL_SEQ_MARGIN = 8
+
+        // Far more than one reply (512 tokens) so decode never waits on the consumer.
+        private const val PIECE_RING_BYTES = 64 * 1024
+        // About one frame: batches redraws instead of one recomposition per token.
+        private const val RING_DRAIN_INTERVAL_MS = 16L
+
+        // Auto-tune bounds: n_ctx is a power of two in [MIN, MAX], capped by the training context.
+        private const val AUTOTUNE_MIN_CTX = 512
+        private const val AUTOTUNE_MAX_CTX = 8192
+        private val AUTOTUNE_UBATCH_CANDIDATES = listOf(64, 128, 256, 512)
+        // At least the largest candidate, so every candidate runs at its full ubatch size.
+        private val AUTOTUNE_PROBE_TOKENS = AUTOTUNE_UBATCH_CANDIDATES.max()
+        private const val CHAT_N_BATCH = 512 // native CHAT_N_BATCH_DEFAULT
+
+        // Default model budget: leaves the rest for the app, system and page cache (a 6 GB phone
+        // gets ~2.7 GB for chat + embedding weights and KV).
+        private const val DEFAULT_BUDGET_RAM_FRACTION = 0.45
+        private const val EMBED_IDLE_EVICT_MS = 30_000L
+        // llama_pooling_type: per-token embeddings, no pooled vector (native LLAMA_POOLING_TYPE_NONE).
+        private const val POOLING_TYPE_NONE = 0
+
+        private fun sha1Hex(s: String): String =
+            MessageDigest.getInstance("SHA-1").digest(s.toByteArray()).joinToString("") { "%02x".format(it) }
+
         /**
          * JNI expects:
          * - getValue():I
          * - inc():V
+         * - shift(I)V
          *
          * IMPORTANT: No Kotlin property called "value" (it auto-generates getValue()).
          */
         private class IntVar(initial: Int) {
             @Volatile private var v: Int = initial
+            @Volatile private var n: Int = 0
             fun getValue(): Int = v
-            fun inc() { synchronized(this) { v += 1 } }
+            fun inc() { synchronized(this) { v += 1; n += 1 } }
+            // A context shift moved the positions back by [by]; tokens produced are unchanged.
+            fun shift(by: Int) { synchronized(this) { v -= by } }
+            fun produced(): Int = n
         }
 
         private sealed interface State {
@@ -386,15 +1703,28 @@ class LLamaAndroid {
                 val context: Long,
                 val batch: Long,
                 val sampler: Long,
-                val modelEotStr: String
+                val modelEotStr: String,
+                val draft: Draft? = null,
+                val modelKey: String = ""
             ) : State
+
+            // Speculative decoding: small model sharing the main vocab, own context/batch.
+            data class Draft(val model: Long, val context: Long, val batch: Long)
         }
 
         private sealed interface EmbState {
             data object Idle : EmbState
-            data class Loaded(val model: Long, val context: Long, val batch: Long) : EmbState
+            data class Loaded(val model: Long, val context: Long, val batch: Long, val bytes: Long = 0L) : EmbState
         }
 
+        private data class EmbSpec(
+            val path: String,
+            val userThreads: Int,
+            val nCtx: Int,
+            val poolingType: Int,
+            val nBatch: Int
+        )
+
         private val _instance: LLamaAndroid = LLamaAndroid()
         fun instance(): LLamaAndroid = _instance
     }